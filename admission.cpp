@@ -0,0 +1,95 @@
+#include "admission.hpp"
+
+#include <algorithm>
+
+void TokenBucket::refill(clock::time_point now) {
+  if (now > last_) {
+    const double elapsed = std::chrono::duration<double>(now - last_).count();
+    tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+    last_ = now;
+  }
+}
+
+bool TokenBucket::take(clock::time_point now) {
+  if (rate_ <= 0) {
+    return true;
+  }
+  refill(now);
+  if (tokens_ < 1) {
+    return false;
+  }
+  tokens_ -= 1;
+  return true;
+}
+
+TokenBucket::clock::duration TokenBucket::wait(clock::time_point now) {
+  if (rate_ <= 0) {
+    return clock::duration::zero();
+  }
+  refill(now);
+  if (tokens_ >= 1) {
+    return clock::duration::zero();
+  }
+  return std::chrono::ceil<clock::duration>(
+      std::chrono::duration<double>((1 - tokens_) / rate_));
+}
+
+AdmissionControl::Slot::~Slot() {
+  if (ctl_) {
+    ctl_->release(*this);
+  }
+}
+
+std::optional<AdmissionControl::Slot> AdmissionControl::try_reserve() {
+  const std::size_t max = max_connections_.load(std::memory_order_relaxed);
+  if (max == 0) {
+    in_flight_.fetch_add(1, std::memory_order_relaxed);
+    return Slot(*this);
+  }
+  std::size_t n = in_flight_.load(std::memory_order_relaxed);
+  do {
+    if (n >= max) {
+      return std::nullopt;
+    }
+  } while (!in_flight_.compare_exchange_weak(n, n + 1,
+                                             std::memory_order_relaxed));
+  return Slot(*this);
+}
+
+bool AdmissionControl::admit(Slot &slot, const IpKey &ip) {
+  const std::size_t max = max_per_ip_.load(std::memory_order_relaxed);
+  if (max == 0 || slot.counted_ip_) {
+    return true;
+  }
+  Shard &s = shard(ip);
+  std::lock_guard lock(s.mu);
+  std::size_t &open = s.open[ip];
+  if (open >= max) {
+    return false;
+  }
+  ++open;
+  slot.ip_ = ip;
+  slot.counted_ip_ = true;
+  return true;
+}
+
+void AdmissionControl::release(Slot &slot) {
+  if (slot.counted_ip_) {
+    Shard &s = shard(slot.ip_);
+    std::lock_guard lock(s.mu);
+    if (const auto it = s.open.find(slot.ip_); it != s.open.end() &&
+                                               --it->second == 0) {
+      s.open.erase(it);
+    }
+  }
+  in_flight_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+std::size_t AdmissionControl::tracked() const {
+  std::size_t n = 0;
+  for (const auto &s : shards_) {
+    std::lock_guard lock(s.mu);
+    n += s.open.size();
+  }
+  return n;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "ban.hpp"
+
+// A token bucket: tokens accrue at `rate` per second up to `burst`, and each
+// take() spends one. Not thread-safe; give each thread its own bucket (with
+// its share of the rate) or lock around it.
+class TokenBucket {
+public:
+  using clock = std::chrono::steady_clock;
+
+  // rate <= 0 means unlimited: take() always succeeds.
+  TokenBucket(double rate, double burst, clock::time_point now)
+      : rate_(rate), burst_(burst), tokens_(burst), last_(now) {}
+
+  // Spend a token if one is available at `now`.
+  bool take(clock::time_point now);
+
+  // How long from `now` until take() can next succeed (zero if it can now).
+  clock::duration wait(clock::time_point now);
+
+private:
+  void refill(clock::time_point now);
+
+  double rate_;
+  double burst_;
+  double tokens_;
+  clock::time_point last_;
+};
+
+// Caps on connections in flight, shared by every listener thread.
+//
+// The global cap is a single atomic count. A listener reserves a slot with
+// try_reserve() *before* accepting, and stops calling accept() while none is
+// free, so excess connections wait in the kernel's listen backlog instead of
+// being accepted and dropped; the daemon never holds more than
+// max_connections sockets for clients however hard it is flooded.
+//
+// The per-address cap needs the address, so it is applied once a connection
+// is accepted: admit() counts the connection against its address, in a small
+// sharded map holding only addresses with connections open, and refuses it
+// if that address already has max_per_ip open. Both counts are given back
+// when the returned Slot is destroyed.
+//
+// The caps can be changed with set_limits() while connections are open.
+// Lowering one below what is already in flight closes nothing; it only
+// holds off new connections until enough have finished.
+class AdmissionControl {
+public:
+  struct Config {
+    std::size_t max_connections = 512; // in flight overall; 0 = unlimited
+    std::size_t max_per_ip = 8;        // in flight per address; 0 = unlimited
+  };
+
+  // Holds one reserved connection, and its address's count if admitted.
+  class Slot {
+  public:
+    Slot(Slot &&other) noexcept
+        : ctl_(other.ctl_), ip_(other.ip_), counted_ip_(other.counted_ip_) {
+      other.ctl_ = nullptr;
+    }
+    Slot &operator=(Slot &&) = delete;
+    ~Slot();
+
+  private:
+    friend class AdmissionControl;
+    explicit Slot(AdmissionControl &ctl) : ctl_(&ctl) {}
+    AdmissionControl *ctl_;
+    IpKey ip_;
+    bool counted_ip_ = false;
+  };
+
+  static constexpr std::size_t kShards = 16;
+
+  explicit AdmissionControl(Config cfg) : shards_(kShards) { set_limits(cfg); }
+
+  // Reserve a connection slot, or nullopt if max_connections are in flight.
+  std::optional<Slot> try_reserve();
+
+  // Count a reserved connection against ip. Returns false (and leaves the
+  // slot as it was) if ip already has max_per_ip connections in flight.
+  // Addresses that are not tracked for bans should not be passed here: behind
+  // NAT or a trusted proxy they stand for many clients.
+  bool admit(Slot &slot, const IpKey &ip);
+
+  std::size_t in_flight() const {
+    return in_flight_.load(std::memory_order_relaxed);
+  }
+  // Addresses with at least one admitted connection in flight.
+  std::size_t tracked() const;
+
+  // Safe to call from any thread, at any time.
+  void set_limits(Config cfg) {
+    max_connections_.store(cfg.max_connections, std::memory_order_relaxed);
+    max_per_ip_.store(cfg.max_per_ip, std::memory_order_relaxed);
+  }
+  Config config() const {
+    return {max_connections_.load(std::memory_order_relaxed),
+            max_per_ip_.load(std::memory_order_relaxed)};
+  }
+
+private:
+  struct Hash {
+    std::size_t operator()(const IpKey &ip) const { return ip.hash(); }
+  };
+  // Padded to a cache line so neighbouring shards' locks do not false-share.
+  struct alignas(64) Shard {
+    mutable std::mutex mu;
+    std::unordered_map<IpKey, std::size_t, Hash> open;
+  };
+
+  Shard &shard(const IpKey &ip) { return shards_[ip.hash() % kShards]; }
+  void release(Slot &slot);
+
+  std::atomic<std::size_t> max_connections_{0};
+  std::atomic<std::size_t> max_per_ip_{0};
+  std::atomic<std::size_t> in_flight_{0};
+  std::vector<Shard> shards_;
+};
@@ -1,7 +1,19 @@
 #include "ban.hpp"
+#include "blocklist.hpp"
+#include "hash.hpp"
 
+#include <algorithm>
+#include <bit>
+#include <charconv>
 #include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <random>
 #include <string>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
 
 bool is_bannable_address(const boost::asio::ip::address &addr) {
   if (addr.is_loopback() || addr.is_unspecified() || addr.is_multicast()) {
@@ -29,8 +41,8 @@ bool is_bannable_address(const boost::asio::ip::address &addr) {
   return true;
 }
 
-std::unordered_set<std::string> parse_ip_allowlist(std::string_view csv) {
-  std::unordered_set<std::string> out;
+IpAllowlist parse_ip_allowlist(std::string_view csv) {
+  IpAllowlist out;
   std::size_t start = 0;
   while (start <= csv.size()) {
     const std::size_t comma = csv.find(',', start);
@@ -50,56 +62,1191 @@ std::unordered_set<std::string> parse_ip_allowlist(std::string_view csv) {
   return out;
 }
 
-namespace {
-// Count timestamps that fall within (now - window, now]. The deque is kept in
-// ascending order, so the in-window entries are always a suffix.
-int count_in_window(const std::deque<BanTracker::clock::time_point> &ts,
-                    BanTracker::clock::time_point now,
-                    BanTracker::clock::duration window) {
-  const auto cutoff = now - window;
+AddressText::AddressText(const boost::asio::ip::address &addr) {
+  // As address::to_string() has it, without the std::string.
+  if (addr.is_v4()) {
+    const auto bytes = addr.to_v4().to_bytes();
+    ::inet_ntop(AF_INET, bytes.data(), text_, sizeof text_);
+  } else {
+    const auto v6 = addr.to_v6();
+    const auto bytes = v6.to_bytes();
+    ::inet_ntop(AF_INET6, bytes.data(), text_, sizeof text_);
+    if (const unsigned long scope = v6.scope_id()) {
+      std::size_t n = std::strlen(text_);
+      text_[n++] = '%';
+      char name[IF_NAMESIZE];
+      if ((v6.is_link_local() || v6.is_multicast_link_local()) &&
+          ::if_indextoname(static_cast<unsigned>(scope), name)) {
+        std::strcpy(text_ + n, name);
+      } else {
+        *std::to_chars(text_ + n, text_ + sizeof text_ - 1, scope).ptr = '\0';
+      }
+    }
+  }
+  size_ = static_cast<std::uint8_t>(std::strlen(text_));
+}
+
+IpKey::IpKey(const boost::asio::ip::address_v4 &addr)
+    : bytes(boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, addr)
+                .to_bytes()) {}
+
+IpKey::IpKey(const boost::asio::ip::address &addr)
+    : IpKey(addr.is_v4() ? IpKey(addr.to_v4()) : IpKey(addr.to_v6())) {}
+
+boost::asio::ip::address IpKey::address() const {
+  const boost::asio::ip::address_v6 v6(bytes);
+  if (v6.is_v4_mapped()) {
+    return boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, v6);
+  }
+  return v6;
+}
+
+std::uint64_t IpKey::hash() const {
+  std::uint64_t lo, hi;
+  std::memcpy(&lo, bytes.data(), 8);
+  std::memcpy(&hi, bytes.data() + 8, 8);
+  // Mix both halves, then the murmur3 finaliser so that every output bit
+  // depends on every address bit (IPv4 keys only differ in the top half).
+  std::uint64_t h = lo * 0x9E3779B97F4A7C15ull ^ hi;
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDull;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+std::string BlockedNet::to_string() const {
+  const bool v4 = is_v4();
+  const int len = v4 ? prefix_len - 96 : prefix_len;
+  return addr.to_string() + "/" + std::to_string(len);
+}
+
+BanTracker::BanTracker(Config cfg) : cfg_(cfg) {
+  cfg_.threshold = std::clamp(cfg_.threshold, 0, kMaxThreshold);
+  ring_ = static_cast<std::size_t>(cfg_.threshold) + 1;
+  window_secs_ = std::max<Stamp>(
+      1, static_cast<Stamp>(
+             std::chrono::ceil<std::chrono::seconds>(cfg_.window).count()));
+  // Two buckets short of a full turn, so that a row filed a whole window
+  // ahead never lands in the bucket being drained.
+  tick_ = std::max<Stamp>(1, (window_secs_ + kWheelBuckets - 3) /
+                                 (kWheelBuckets - 2));
+  wheel_.assign(kWheelBuckets, kNil);
+  if (!is_bounded()) {
+    return;
+  }
+  // Promote no later than the offense that would block.
+  cfg_.promote_after = std::clamp(cfg_.promote_after, 1, cfg_.threshold + 1);
+  rehash(std::bit_ceil((cfg_.max_tracked * 4 + 2) / 3));
+  cfg_.sketch_width = std::bit_floor(cfg_.sketch_width);
+  if (cfg_.sketch_width > 0 && cfg_.promote_after > 1) {
+    for (auto &gen : sketch_) {
+      gen.assign(kSketchRows * cfg_.sketch_width, 0);
+    }
+    // Seeded per process, so that nobody can pick addresses that share a
+    // victim's counters.
+    sketch_seed_ = (std::uint64_t{std::random_device{}()} << 32) ^
+                   std::random_device{}();
+  }
+}
+
+BanTracker::Config BanTracker::bounded(Config base, std::size_t bytes,
+                                      std::size_t tables) {
+  Config cfg = base;
+  const std::size_t ring =
+      static_cast<std::size_t>(std::clamp(base.threshold, 0, kMaxThreshold)) +
+      1;
+  cfg.sketch_width = std::bit_floor(bytes / 4 / (2 * kSketchRows));
+  const std::size_t fixed = 2 * kSketchRows * cfg.sketch_width +
+                            tables * kWheelBuckets * sizeof(std::uint32_t);
+  const std::size_t table_bytes = bytes > fixed ? bytes - fixed : 0;
+  const std::size_t capacity = std::max<std::size_t>(
+      4 * tables,
+      std::bit_floor(table_bytes / (sizeof(Slot) + ring * sizeof(Stamp))));
+  cfg.max_tracked = capacity * 3 / 4;
+  return cfg;
+}
+
+std::size_t BanTracker::memory_bytes() const {
+  return slots_.capacity() * sizeof(Slot) + times_.capacity() * sizeof(Stamp) +
+         wheel_.capacity() * sizeof(std::uint32_t) + sketch_[0].capacity() +
+         sketch_[1].capacity();
+}
+
+// Live offenses are never before the epoch; restore() drops any such time
+// rather than have it clamped here.
+BanTracker::Stamp BanTracker::to_stamp(clock::time_point t) {
+  const auto secs =
+      std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch())
+          .count();
+  return static_cast<Stamp>(
+      std::clamp<std::int64_t>(secs, 0, std::numeric_limits<Stamp>::max()));
+}
+
+// Count ring entries within (now - window, now]. Rings are kept in ascending
+// order from head, so the in-window entries are always a suffix.
+int BanTracker::count_in_window(std::size_t i, clock::time_point now) const {
+  const Slot &slot = slots_[i];
+  const Stamp *ts = ring(i);
+  const auto cutoff = now - cfg_.window;
   int count = 0;
-  for (auto it = ts.rbegin(); it != ts.rend() && *it > cutoff; ++it) {
+  for (std::size_t n = slot.size; n > 0; --n) {
+    if (from_stamp(ts[(slot.head + n - 1) % ring_]) <= cutoff) {
+      break;
+    }
     ++count;
   }
   return count;
 }
-} // namespace
 
-bool BanTracker::is_blocked(const std::string &ip, clock::time_point now) const {
-  auto it = offenders_.find(ip);
-  if (it == offenders_.end()) {
+std::size_t BanTracker::find(const IpKey &ip) const {
+  if (size_ == 0) {
+    return npos;
+  }
+  for (std::size_t i = ip.hash() & mask_;; i = (i + 1) & mask_) {
+    if (slots_[i].size == 0) {
+      return npos;
+    }
+    if (slots_[i].key == ip) {
+      return i;
+    }
+  }
+}
+
+std::size_t BanTracker::insert(const IpKey &ip) {
+  // Keep the load factor at or below 3/4 so probe sequences stay short.
+  if ((size_ + 1) * 4 > slots_.size() * 3) {
+    rehash(std::max<std::size_t>(16, slots_.size() * 2));
+  }
+  std::size_t i = ip.hash() & mask_;
+  while (slots_[i].size != 0) {
+    i = (i + 1) & mask_;
+  }
+  slots_[i].key = ip;
+  slots_[i].head = 0;
+  ++size_;
+  return i;
+}
+
+void BanTracker::move_row(std::size_t from, std::size_t to) {
+  Slot &slot = slots_[to];
+  slot = slots_[from];
+  std::copy_n(ring(from), ring_, ring(to));
+  // Point its bucket neighbours at the new index.
+  if (slot.prev != kNil) {
+    slots_[slot.prev].next = static_cast<std::uint32_t>(to);
+  } else {
+    wheel_[slot.bucket] = static_cast<std::uint32_t>(to);
+  }
+  if (slot.next != kNil) {
+    slots_[slot.next].prev = static_cast<std::uint32_t>(to);
+  }
+}
+
+// File row i under the bucket in which its newest offense leaves the window.
+void BanTracker::link(std::size_t i) {
+  Slot &slot = slots_[i];
+  const std::uint64_t newest = ring(i)[(slot.head + slot.size - 1) % ring_];
+  if (!wheel_started_) {
+    cursor_ = newest / tick_;
+    wheel_started_ = true;
+  }
+  // Normally already in range; the clamp only matters when time has moved
+  // on a long way without an expire(), and then the row is just looked at
+  // early and filed again.
+  const std::uint64_t number = std::clamp<std::uint64_t>(
+      (newest + window_secs_) / tick_, cursor_ + 1, cursor_ + kWheelBuckets - 1);
+  slot.bucket = static_cast<std::uint16_t>(number % kWheelBuckets);
+  slot.prev = kNil;
+  slot.next = wheel_[slot.bucket];
+  if (slot.next != kNil) {
+    slots_[slot.next].prev = static_cast<std::uint32_t>(i);
+  }
+  wheel_[slot.bucket] = static_cast<std::uint32_t>(i);
+}
+
+void BanTracker::unlink(std::size_t i) {
+  const Slot &slot = slots_[i];
+  if (slot.prev != kNil) {
+    slots_[slot.prev].next = slot.next;
+  } else {
+    wheel_[slot.bucket] = slot.next;
+  }
+  if (slot.next != kNil) {
+    slots_[slot.next].prev = slot.prev;
+  }
+}
+
+void BanTracker::erase(std::size_t i) {
+  unlink(i);
+  // Backward-shift deletion: pull later members of the probe run back into
+  // the hole, so lookups never need tombstones.
+  for (std::size_t j = (i + 1) & mask_; slots_[j].size != 0;
+       j = (j + 1) & mask_) {
+    const std::size_t home = slots_[j].key.hash() & mask_;
+    // Move j into the hole unless its home lies cyclically in (i, j].
+    if (((j - home) & mask_) >= ((j - i) & mask_)) {
+      move_row(j, i);
+      i = j;
+    }
+  }
+  slots_[i].size = 0;
+  --size_;
+}
+
+void BanTracker::rehash(std::size_t capacity) {
+  std::vector<Slot> old_slots(capacity);
+  std::vector<Stamp> old_times(capacity * ring_);
+  old_slots.swap(slots_);
+  old_times.swap(times_);
+  mask_ = capacity - 1;
+  size_ = 0;
+  for (std::size_t i = 0; i < old_slots.size(); ++i) {
+    if (old_slots[i].size == 0) {
+      continue;
+    }
+    const std::size_t j = insert(old_slots[i].key);
+    slots_[j] = old_slots[i];
+    std::copy_n(&old_times[i * ring_], ring_, ring(j));
+  }
+  // Every row has moved, so rebuild the bucket lists in place.
+  std::fill(wheel_.begin(), wheel_.end(), kNil);
+  for (std::size_t i = 0; i < slots_.size(); ++i) {
+    Slot &slot = slots_[i];
+    if (slot.size == 0) {
+      continue;
+    }
+    slot.prev = kNil;
+    slot.next = wheel_[slot.bucket];
+    if (slot.next != kNil) {
+      slots_[slot.next].prev = static_cast<std::uint32_t>(i);
+    }
+    wheel_[slot.bucket] = static_cast<std::uint32_t>(i);
+  }
+}
+
+bool BanTracker::is_blocked(const IpKey &ip, clock::time_point now) const {
+  const std::size_t i = find(ip);
+  if (i == npos) {
     return false;
   }
-  return count_in_window(it->second, now, cfg_.window) > cfg_.threshold;
+  return count_in_window(i, now) > cfg_.threshold;
+}
+
+std::optional<BanTracker::clock::time_point>
+BanTracker::blocked_until(const IpKey &ip, clock::time_point now) const {
+  const std::size_t i = find(ip);
+  if (i == npos || count_in_window(i, now) <= cfg_.threshold) {
+    return std::nullopt;
+  }
+  // Blocked means the ring is full and in-window; the block lapses when its
+  // oldest entry ages out.
+  return from_stamp(ring(i)[slots_[i].head]) + cfg_.window;
 }
 
-BanTracker::OffenseResult
-BanTracker::record_offense(const std::string &ip, clock::time_point now) {
-  auto &ts = offenders_[ip];
+void BanTracker::for_each(const BanStateVisitor &visit) const {
+  std::vector<clock::time_point> times(ring_);
+  for (std::size_t i = 0; i < slots_.size(); ++i) {
+    const Slot &slot = slots_[i];
+    if (slot.size == 0) {
+      continue;
+    }
+    for (std::size_t k = 0; k < slot.size; ++k) {
+      times[k] = from_stamp(ring(i)[(slot.head + k) % ring_]);
+    }
+    visit(BlockedNet{slot.key, 128},
+          std::span<const clock::time_point>(times.data(), slot.size));
+  }
+}
+
+BanTracker::OffenseResult BanTracker::record_offense(const IpKey &ip,
+                                                     clock::time_point now) {
+  std::size_t i = find(ip);
+  bool fresh = false;
+  if (i == npos) {
+    std::size_t prior = 0;
+    if (is_bounded()) {
+      if (!sketch_[0].empty()) {
+        const int seen = sketch_offense(ip, now);
+        if (seen < cfg_.promote_after) {
+          return {seen, false};
+        }
+        // The sketch can overcount (other addresses share its counters),
+        // so the row starts from promote_after - 1 earlier offenses at most.
+        prior = static_cast<std::size_t>(cfg_.promote_after - 1);
+      }
+      if (size_ >= cfg_.max_tracked) {
+        evict_near(ip, now);
+      }
+    }
+    i = insert(ip);
+    std::fill_n(ring(i), prior, to_stamp(now));
+    slots_[i].size = static_cast<std::uint8_t>(prior);
+    fresh = true;
+  }
+  Slot &slot = slots_[i];
+  Stamp *ts = ring(i);
   const auto cutoff = now - cfg_.window;
 
   // Drop this IP's timestamps that have aged out of the window.
-  while (!ts.empty() && ts.front() <= cutoff) {
-    ts.pop_front();
+  while (slot.size > 0 && from_stamp(ts[slot.head]) <= cutoff) {
+    slot.head = static_cast<std::uint8_t>((slot.head + 1) % ring_);
+    --slot.size;
   }
 
-  ts.push_back(now);
+  // Append, overwriting the oldest entry once the ring is full: anything
+  // older than the newest threshold + 1 offenses cannot change the verdict.
+  if (slot.size == ring_) {
+    ts[slot.head] = to_stamp(now);
+    slot.head = static_cast<std::uint8_t>((slot.head + 1) % ring_);
+  } else {
+    ts[(slot.head + slot.size) % ring_] = to_stamp(now);
+    ++slot.size;
+  }
+  // An existing row stays in its bucket: when that comes due, expire()
+  // finds the newer offense and files it again.
+  if (fresh) {
+    link(i);
+  }
 
-  const int count = static_cast<int>(ts.size());
+  const int count = slot.size;
   return {count, count > cfg_.threshold};
 }
 
+void BanTracker::restore(const IpKey &ip,
+                         std::span<const clock::time_point> times,
+                         clock::time_point now) {
+  if (const std::size_t old = find(ip); old != npos) {
+    erase(old);
+  }
+  // Only the newest ring_ in-window entries can matter. Times before the
+  // clock's epoch (offenses from before a reboot) have no stamp; rather than
+  // pin them to the epoch, which would stretch their block by the downtime,
+  // they are dropped.
+  const auto cutoff = now - cfg_.window;
+  std::size_t first = times.size();
+  while (first > 0 && times.size() - first < ring_ &&
+         times[first - 1] > cutoff && times[first - 1] >= clock::time_point{}) {
+    --first;
+  }
+  if (first == times.size()) {
+    return;
+  }
+  if (is_bounded() && size_ >= cfg_.max_tracked) {
+    evict_near(ip, now);
+  }
+  if (!wheel_started_) {
+    cursor_ = to_stamp(now) / tick_;
+    wheel_started_ = true;
+  }
+  const std::size_t i = insert(ip);
+  Slot &slot = slots_[i];
+  slot.size = static_cast<std::uint8_t>(times.size() - first);
+  for (std::size_t k = 0; k < slot.size; ++k) {
+    ring(i)[k] = to_stamp(times[first + k]);
+  }
+  link(i);
+}
+
+// Count an offense from an address without a row, and estimate how many it
+// has made recently: at least every one in the current window, and none
+// older than two windows.
+int BanTracker::sketch_offense(const IpKey &ip, clock::time_point now) {
+  if (now - generation_start_ >= cfg_.window) {
+    const bool stale = now - generation_start_ >= 2 * cfg_.window;
+    current_ ^= 1;
+    std::fill(sketch_[current_].begin(), sketch_[current_].end(), 0);
+    if (stale) {
+      std::fill(sketch_[current_ ^ 1].begin(), sketch_[current_ ^ 1].end(), 0);
+    }
+    generation_start_ = now;
+  }
+  std::uint8_t *cur = sketch_[current_].data();
+  const std::uint8_t *prev = sketch_[current_ ^ 1].data();
+  const std::uint64_t h = ip.hash();
+  std::size_t cells[kSketchRows];
+  std::uint8_t least = 255;
+  for (std::size_t row = 0; row < kSketchRows; ++row) {
+    cells[row] = row * cfg_.sketch_width +
+                 (mix64(h ^ (sketch_seed_ + row)) & (cfg_.sketch_width - 1));
+    least = std::min(least, cur[cells[row]]);
+  }
+  // Conservative update: only the counters at the minimum can be this
+  // address's own count, so only they go up.
+  int estimate = 2 * 255;
+  for (const std::size_t c : cells) {
+    if (cur[c] == least && least < 255) {
+      ++cur[c];
+    }
+    estimate = std::min(estimate, cur[c] + prev[c]);
+  }
+  return estimate;
+}
+
+// Make room for ip's row: of the first few rows from its home slot on, erase
+// the one whose newest offense is oldest, passing over blocked rows unless
+// there is nothing else.
+void BanTracker::evict_near(const IpKey &ip, clock::time_point now) {
+  constexpr std::size_t kCandidates = 8;
+  std::size_t victim = npos;
+  bool victim_blocked = false;
+  Stamp victim_last = 0;
+  std::size_t seen = 0;
+  for (std::size_t i = ip.hash() & mask_;
+       seen < std::min(kCandidates, size_); i = (i + 1) & mask_) {
+    const Slot &slot = slots_[i];
+    if (slot.size == 0) {
+      continue;
+    }
+    ++seen;
+    const bool blocked = count_in_window(i, now) > cfg_.threshold;
+    const Stamp last = ring(i)[(slot.head + slot.size - 1) % ring_];
+    if (victim == npos || (victim_blocked && !blocked) ||
+        (blocked == victim_blocked && last < victim_last)) {
+      victim = i;
+      victim_blocked = blocked;
+      victim_last = last;
+    }
+  }
+  erase(victim);
+}
+
 void BanTracker::sweep(clock::time_point now) {
   const auto cutoff = now - cfg_.window;
-  for (auto it = offenders_.begin(); it != offenders_.end();) {
-    auto &ts = it->second;
-    while (!ts.empty() && ts.front() <= cutoff) {
-      ts.pop_front();
+  for (std::size_t i = 0; i < slots_.size();) {
+    const Slot &slot = slots_[i];
+    if (slot.size != 0 &&
+        from_stamp(ring(i)[(slot.head + slot.size - 1) % ring_]) <= cutoff) {
+      // Every offense is older than the window. erase() may shift a later
+      // row into i, so look at i again.
+      erase(i);
+      continue;
+    }
+    ++i;
+  }
+}
+
+std::size_t BanTracker::expire(clock::time_point now, std::size_t budget) {
+  if (!wheel_started_) {
+    return 0;
+  }
+  const std::uint64_t end = to_stamp(now) / tick_; // first bucket not yet due
+  if (end - std::min(end, cursor_) > kWheelBuckets) {
+    // Idle for more than a turn: one more turn visits every bucket.
+    cursor_ = end - kWheelBuckets;
+  }
+  const auto cutoff = now - cfg_.window;
+  std::size_t looked = 0;
+  std::size_t erased = 0;
+  for (; cursor_ < end; ++cursor_) {
+    const std::uint32_t &first = wheel_[cursor_ % kWheelBuckets];
+    while (first != kNil) {
+      if (looked == budget) {
+        return erased;
+      }
+      ++looked;
+      const std::size_t i = first;
+      const Slot &slot = slots_[i];
+      if (from_stamp(ring(i)[(slot.head + slot.size - 1) % ring_]) <= cutoff) {
+        erase(i);
+        ++erased;
+      } else {
+        unlink(i);
+        link(i);
+      }
     }
-    if (ts.empty()) {
-      it = offenders_.erase(it);
+  }
+  return erased;
+}
+
+namespace {
+
+// Bit i (0 = most significant) of a key.
+int bit_at(const IpKey &key, int i) {
+  return (key.bytes[i / 8] >> (7 - i % 8)) & 1;
+}
+
+IpKey masked(const IpKey &key, int len) {
+  IpKey out = key;
+  for (int i = 0; i < 16; ++i) {
+    const int keep = std::clamp(len - i * 8, 0, 8);
+    out.bytes[i] &= static_cast<std::uint8_t>(0xFF00u >> keep);
+  }
+  return out;
+}
+
+// Length of the common leading bits of a and b, capped at max.
+int common_length(const IpKey &a, const IpKey &b, int max) {
+  int n = 0;
+  for (int i = 0; i < 16 && n < max; ++i) {
+    const std::uint8_t diff = a.bytes[i] ^ b.bytes[i];
+    if (diff != 0) {
+      n += std::countl_zero(diff);
+      break;
+    }
+    n += 8;
+  }
+  return std::min(n, max);
+}
+
+} // namespace
+
+SubnetTracker::SubnetTracker(Config cfg) : cfg_(cfg) {
+  cfg_.threshold = std::clamp(cfg_.threshold, 0, BanTracker::kMaxThreshold);
+  cfg_.v4_prefix = std::clamp(cfg_.v4_prefix, 0, 32);
+  cfg_.v6_prefix = std::clamp(cfg_.v6_prefix, 0, 128);
+  ring_ = static_cast<std::size_t>(cfg_.threshold) + 1;
+  reserve();
+}
+
+SubnetTracker::Config SubnetTracker::bounded(Config base, std::size_t bytes) {
+  const std::size_t ring =
+      static_cast<std::size_t>(
+          std::clamp(base.threshold, 0, BanTracker::kMaxThreshold)) +
+      1;
+  base.max_nodes = std::max<std::size_t>(
+      2, bytes / (sizeof(Node) + ring * sizeof(clock::time_point)));
+  return base;
+}
+
+void SubnetTracker::reserve() {
+  // A bounded trie is allocated once, at its full size.
+  if (cfg_.max_nodes > 0 && enabled()) {
+    nodes_.reserve(cfg_.max_nodes);
+    times_.reserve(cfg_.max_nodes * ring_);
+  }
+}
+
+std::size_t SubnetTracker::memory_bytes() const {
+  return nodes_.capacity() * sizeof(Node) +
+         times_.capacity() * sizeof(clock::time_point);
+}
+
+int SubnetTracker::prefix_length(const IpKey &ip) const {
+  return ip.address().is_v4() ? 96 + cfg_.v4_prefix : cfg_.v6_prefix;
+}
+
+std::int32_t SubnetTracker::new_node(const IpKey &prefix, int len,
+                                     bool terminal) {
+  Node node;
+  node.prefix = masked(prefix, len);
+  node.len = static_cast<std::uint8_t>(len);
+  node.terminal = terminal;
+  nodes_.push_back(node);
+  times_.resize(nodes_.size() * ring_);
+  if (terminal) {
+    ++entries_;
+  }
+  return static_cast<std::int32_t>(nodes_.size() - 1);
+}
+
+std::int32_t SubnetTracker::insert(const IpKey &prefix, int len) {
+  std::int32_t parent = kNone;
+  int dir = 0;
+  std::int32_t n = root_;
+  auto relink = [&](std::int32_t to) {
+    if (parent == kNone) {
+      root_ = to;
+    } else {
+      nodes_[parent].child[dir] = to;
+    }
+  };
+
+  while (n != kNone) {
+    const int node_len = nodes_[n].len;
+    const int common =
+        common_length(prefix, nodes_[n].prefix, std::min(len, node_len));
+    if (common < node_len) {
+      // The new prefix diverges from (or ends inside) this node's prefix:
+      // split the edge.
+      const int node_bit = bit_at(nodes_[n].prefix, common);
+      if (common == len) {
+        const std::int32_t added = new_node(prefix, len, true);
+        nodes_[added].child[node_bit] = n;
+        relink(added);
+        return added;
+      }
+      const std::int32_t branch = new_node(prefix, common, false);
+      const std::int32_t added = new_node(prefix, len, true);
+      nodes_[branch].child[node_bit] = n;
+      nodes_[branch].child[node_bit ^ 1] = added;
+      relink(branch);
+      return added;
+    }
+    if (node_len == len) {
+      if (!nodes_[n].terminal) {
+        nodes_[n].terminal = true;
+        ++entries_;
+      }
+      return n;
+    }
+    parent = n;
+    dir = bit_at(prefix, node_len);
+    n = nodes_[n].child[dir];
+  }
+
+  const std::int32_t added = new_node(prefix, len, true);
+  relink(added);
+  return added;
+}
+
+std::int32_t SubnetTracker::find(const IpKey &ip, int len) const {
+  for (std::int32_t n = root_; n != kNone;) {
+    const Node &node = nodes_[n];
+    if (node.len > len || common_length(ip, node.prefix, node.len) < node.len) {
+      return kNone;
+    }
+    if (node.len == len) {
+      return node.terminal ? n : kNone;
+    }
+    n = node.child[bit_at(ip, node.len)];
+  }
+  return kNone;
+}
+
+int SubnetTracker::count_in_window(const Node &node, std::int32_t n,
+                                   clock::time_point now) const {
+  const clock::time_point *ts = ring(n);
+  const auto cutoff = now - cfg_.window;
+  int count = 0;
+  for (std::size_t k = node.size; k > 0; --k) {
+    if (ts[(node.head + k - 1) % ring_] <= cutoff) {
+      break;
+    }
+    ++count;
+  }
+  return count;
+}
+
+bool SubnetTracker::is_blocked(const IpKey &ip, clock::time_point now) const {
+  for (std::int32_t n = root_; n != kNone;) {
+    const Node &node = nodes_[n];
+    if (common_length(ip, node.prefix, node.len) < node.len) {
+      return false;
+    }
+    if (node.terminal && count_in_window(node, n, now) > cfg_.threshold) {
+      return true;
+    }
+    if (node.len == 128) {
+      return false;
+    }
+    n = node.child[bit_at(ip, node.len)];
+  }
+  return false;
+}
+
+std::optional<SubnetTracker::Block>
+SubnetTracker::blocking_prefix(const IpKey &ip, clock::time_point now) const {
+  for (std::int32_t n = root_; n != kNone;) {
+    const Node &node = nodes_[n];
+    if (common_length(ip, node.prefix, node.len) < node.len) {
+      break;
+    }
+    if (node.terminal && count_in_window(node, n, now) > cfg_.threshold) {
+      return Block{BlockedNet{node.prefix, node.len},
+                   ring(n)[node.head] + cfg_.window};
+    }
+    if (node.len == 128) {
+      break;
+    }
+    n = node.child[bit_at(ip, node.len)];
+  }
+  return std::nullopt;
+}
+
+SubnetTracker::Result SubnetTracker::record_source(const IpKey &ip,
+                                                   clock::time_point now) {
+  if (!enabled() || !is_bannable_address(ip.address())) {
+    return {0, false};
+  }
+  const int len = prefix_length(ip);
+  // A new prefix adds at most two nodes: itself and a branch point.
+  if (cfg_.max_nodes > 0 && nodes_.size() + 2 > cfg_.max_nodes &&
+      find(ip, len) == kNone) {
+    return {0, false};
+  }
+  const std::int32_t n = insert(ip, len);
+  Node &node = nodes_[n];
+  clock::time_point *ts = ring(n);
+  const auto cutoff = now - cfg_.window;
+
+  while (node.size > 0 && ts[node.head] <= cutoff) {
+    node.head = static_cast<std::uint8_t>((node.head + 1) % ring_);
+    --node.size;
+  }
+  if (node.size == ring_) {
+    ts[node.head] = now;
+    node.head = static_cast<std::uint8_t>((node.head + 1) % ring_);
+  } else {
+    ts[(node.head + node.size) % ring_] = now;
+    ++node.size;
+  }
+  const int sources = node.size;
+  return {sources, sources > cfg_.threshold};
+}
+
+void SubnetTracker::for_each(const BanStateVisitor &visit) const {
+  std::vector<clock::time_point> times(ring_);
+  for (std::size_t i = 0; i < nodes_.size(); ++i) {
+    const Node &node = nodes_[i];
+    if (!node.terminal || node.size == 0) {
+      continue;
+    }
+    const clock::time_point *ts = ring(static_cast<std::int32_t>(i));
+    for (std::size_t k = 0; k < node.size; ++k) {
+      times[k] = ts[(node.head + k) % ring_];
+    }
+    visit(BlockedNet{node.prefix, node.len},
+          std::span<const clock::time_point>(times.data(), node.size));
+  }
+}
+
+void SubnetTracker::sweep(clock::time_point now) {
+  std::vector<Node> old_nodes;
+  std::vector<clock::time_point> old_times;
+  old_nodes.swap(nodes_);
+  old_times.swap(times_);
+  root_ = kNone;
+  entries_ = 0;
+  reserve();
+
+  for (std::size_t i = 0; i < old_nodes.size(); ++i) {
+    const Node &old = old_nodes[i];
+    if (!old.terminal) {
+      continue;
+    }
+    // Copy out the in-window suffix of the old ring.
+    const clock::time_point *ts = &old_times[i * ring_];
+    const auto cutoff = now - cfg_.window;
+    std::size_t keep = 0;
+    while (keep < old.size && ts[(old.head + old.size - 1 - keep) % ring_] > cutoff) {
+      ++keep;
+    }
+    if (keep == 0) {
+      continue;
+    }
+    const std::int32_t n = insert(old.prefix, old.len);
+    Node &node = nodes_[n];
+    node.head = 0;
+    node.size = static_cast<std::uint8_t>(keep);
+    for (std::size_t k = 0; k < keep; ++k) {
+      ring(n)[k] = ts[(old.head + old.size - keep + k) % ring_];
+    }
+  }
+}
+
+SharedBanTracker::SharedBanTracker(BanTracker::Config cfg,
+                                   SubnetTracker::Config subnet,
+                                   std::size_t shards)
+    : shards_(std::bit_ceil(std::max<std::size_t>(shards, 1))),
+      mask_(shards_.size() - 1), cfg_(cfg), subnet_cfg_(subnet),
+      subnets_(subnet), subnet_prefixes_(pack_prefixes()) {
+  for (auto &shard : shards_) {
+    shard.bans = BanTracker(shard_config(cfg));
+  }
+}
+
+void BlockFilter::add(std::uint64_t hash, clock::time_point now,
+                      clock::duration lifetime) {
+  if (empty_) {
+    started_ = now;
+    empty_ = false;
+  } else if (now - started_ >= lifetime) {
+    // Everything in the other generation was added more than a lifetime
+    // ago.
+    current_ ^= 1;
+    for (auto &word : bits_[current_]) {
+      word.store(0, std::memory_order_relaxed);
+    }
+    started_ = now;
+  }
+  auto &bits = bits_[current_];
+  for (int k = 0; k < 2; ++k) {
+    const std::size_t bit = hash >> (k * 12) & (kBits - 1);
+    bits[bit / 64].fetch_or(std::uint64_t{1} << bit % 64,
+                            std::memory_order_release);
+  }
+}
+
+bool BlockFilter::may_contain(std::uint64_t hash) const {
+  const std::size_t a = hash & (kBits - 1);
+  const std::size_t b = hash >> 12 & (kBits - 1);
+  for (const auto &bits : bits_) {
+    if (bits[a / 64].load(std::memory_order_acquire) >> a % 64 & 1 &&
+        bits[b / 64].load(std::memory_order_acquire) >> b % 64 & 1) {
+      return true;
+    }
+  }
+  return false;
+}
+
+BanTracker::Config
+SharedBanTracker::shard_config(BanTracker::Config cfg) const {
+  // A bounded table's budget is split evenly between the shards.
+  if (cfg.max_tracked > 0) {
+    cfg.max_tracked = std::max<std::size_t>(1, cfg.max_tracked / shards_.size());
+    cfg.sketch_width /= shards_.size();
+  }
+  return cfg;
+}
+
+void SharedBanTracker::reconfigure(BanTracker::Config cfg,
+                                   SubnetTracker::Config subnet,
+                                   BanTracker::clock::time_point now) {
+  std::lock_guard reconfiguring(reconfigure_mu_);
+  std::vector<std::pair<BlockedNet, BanTracker::clock::time_point>> blocked;
+  if (cfg != cfg_) {
+    cfg_ = cfg;
+    for (auto &shard : shards_) {
+      BanTracker next(shard_config(cfg));
+      std::unique_lock lock(shard.mu);
+      shard.bans.for_each([&](const BlockedNet &net,
+                              std::span<const BanTracker::clock::time_point>
+                                  times) {
+        next.restore(net.addr, times, now);
+        if (const auto until = next.blocked_until(net.addr, now)) {
+          shard.blocked.add(net.addr.hash(), now, cfg.window);
+          if (sink_) {
+            blocked.emplace_back(net, *until);
+          }
+        }
+      });
+      shard.bans = std::move(next);
+    }
+  }
+  if (subnet != subnet_cfg_) {
+    subnet_cfg_ = subnet;
+    SubnetTracker next(subnet);
+    std::unique_lock lock(subnet_mu_);
+    if (next.enabled()) {
+      const auto cutoff = now - subnet.window;
+      subnets_.for_each([&](const BlockedNet &net,
+                            std::span<const BanTracker::clock::time_point>
+                                times) {
+        for (const auto t : times) {
+          if (t > cutoff) {
+            next.record_source(net.addr, t);
+          }
+        }
+        if (const auto block = next.blocking_prefix(net.addr, now)) {
+          blocked_prefixes_.add(block->net.addr.hash(), now, subnet.window);
+          if (sink_) {
+            blocked.emplace_back(block->net, block->until);
+          }
+        }
+      });
+    }
+    subnets_ = std::move(next);
+    subnet_prefixes_.store(pack_prefixes(), std::memory_order_release);
+  }
+  for (const auto &[net, until] : blocked) {
+    export_ban(net, until, now);
+  }
+}
+
+SharedBanTracker::BoundedConfig
+SharedBanTracker::bounded(BanTracker::Config cfg, SubnetTracker::Config subnet,
+                          std::size_t bytes, std::size_t shards,
+                          bool exporting) {
+  shards = std::bit_ceil(std::max<std::size_t>(shards, 1));
+  // A block filter per shard and one for prefixes.
+  const std::size_t filters = (shards + 1) * BlockFilter::memory_bytes();
+  bytes = bytes > filters ? bytes - filters : 0;
+  // An eighth of the rest for the prefix trie, a sixteenth for exported
+  // blocks, the rest for the tables.
+  const std::size_t trie_bytes = bytes / 8;
+  const std::size_t export_bytes = exporting ? bytes / 16 : 0;
+  return {BanTracker::bounded(cfg, bytes - trie_bytes - export_bytes, shards),
+          SubnetTracker::bounded(subnet, trie_bytes),
+          exporting ? export_bytes / kExportBytes : kUnlimitedExports};
+}
+
+std::size_t SharedBanTracker::memory_bytes() const {
+  std::size_t n = BlockFilter::memory_bytes();
+  for (const auto &shard : shards_) {
+    std::shared_lock lock(shard.mu);
+    n += shard.bans.memory_bytes() + BlockFilter::memory_bytes();
+  }
+  {
+    std::lock_guard lock(export_mu_);
+    n += (max_exported_ == kUnlimitedExports ? exported_.size()
+                                               : max_exported_) *
+         kExportBytes;
+  }
+  std::shared_lock lock(subnet_mu_);
+  return n + subnets_.memory_bytes();
+}
+
+std::size_t SharedBanTracker::shard_index(std::uint64_t hash) const {
+  // Take the shard from the high bits of the hash: each shard's table probes
+  // from the low bits, so reusing those would cluster every shard's rows.
+  return hash >> 48 & mask_;
+}
+
+std::uint64_t SharedBanTracker::prefix_hash(const IpKey &ip,
+                                            std::uint16_t prefixes) {
+  const int len = ip.address().is_v4() ? prefixes >> 8 : prefixes & 0xff;
+  return masked(ip, len).hash();
+}
+
+std::uint16_t SharedBanTracker::pack_prefixes() const {
+  if (!subnets_.enabled()) {
+    return 0;
+  }
+  const auto &cfg = subnets_.config();
+  return static_cast<std::uint16_t>((96 + cfg.v4_prefix) << 8 | cfg.v6_prefix);
+}
+
+bool SharedBanTracker::is_blocked(const IpKey &ip,
+                                  BanTracker::clock::time_point now) const {
+  const std::uint64_t hash = ip.hash();
+  const Shard &shard = shards_[shard_index(hash)];
+  if (shard.blocked.may_contain(hash)) {
+    std::shared_lock lock(shard.mu);
+    if (shard.bans.is_blocked(ip, now)) {
+      return true;
+    }
+  }
+  const std::uint16_t prefixes =
+      subnet_prefixes_.load(std::memory_order_acquire);
+  if (!prefixes || !blocked_prefixes_.may_contain(prefix_hash(ip, prefixes))) {
+    return false;
+  }
+  std::shared_lock lock(subnet_mu_);
+  return subnets_.is_blocked(ip, now);
+}
+
+SharedBanTracker::OffenseResult
+SharedBanTracker::record_offense(const IpKey &ip,
+                                 BanTracker::clock::time_point now) {
+  OffenseResult res;
+  std::optional<BanTracker::clock::time_point> until;
+  {
+    const std::uint64_t hash = ip.hash();
+    Shard &shard = shards_[shard_index(hash)];
+    std::unique_lock lock(shard.mu);
+    static_cast<BanTracker::OffenseResult &>(res) =
+        shard.bans.record_offense(ip, now);
+    if (res.blocked) {
+      shard.blocked.add(hash, now, shard.bans.config().window);
+      if (sink_) {
+        until = shard.bans.blocked_until(ip, now);
+      }
+    }
+  }
+  if (until) {
+    export_ban(BlockedNet{ip, 128}, *until, now);
+  }
+  // Only an address's first offense in its window makes it a new distinct
+  // source for its prefix.
+  if (res.count == 1 && subnet_prefixes_.load(std::memory_order_relaxed)) {
+    std::optional<SubnetTracker::Block> block;
+    {
+      std::unique_lock lock(subnet_mu_);
+      res.prefix_blocked = subnets_.record_source(ip, now).blocked;
+      if (res.prefix_blocked) {
+        blocked_prefixes_.add(prefix_hash(ip, pack_prefixes()), now,
+                              subnets_.config().window);
+        if (sink_) {
+          block = subnets_.blocking_prefix(ip, now);
+        }
+      }
+    }
+    if (block) {
+      export_ban(block->net, block->until, now);
+    }
+  }
+  return res;
+}
+
+void SharedBanTracker::sweep(BanTracker::clock::time_point now) {
+  for (auto &shard : shards_) {
+    std::unique_lock lock(shard.mu);
+    shard.bans.sweep(now);
+  }
+  sweep_prefixes(now);
+}
+
+std::size_t SharedBanTracker::expire(BanTracker::clock::time_point now,
+                                     std::size_t budget) {
+  std::size_t erased = 0;
+  for (auto &shard : shards_) {
+    std::unique_lock lock(shard.mu);
+    erased += shard.bans.expire(now, budget);
+  }
+  return erased;
+}
+
+void SharedBanTracker::sweep_prefixes(BanTracker::clock::time_point now) {
+  {
+    std::unique_lock lock(subnet_mu_);
+    subnets_.sweep(now);
+  }
+  if (sink_) {
+    std::lock_guard lock(export_mu_);
+    withdraw_lapsed(now);
+  }
+}
+
+void SharedBanTracker::withdraw_lapsed(BanTracker::clock::time_point now) {
+  for (auto it = exported_.begin(); it != exported_.end();) {
+    if (it->second <= now) {
+      sink_->unban(it->first);
+      it = exported_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  lapsed_checked_ = now;
+}
+
+void SharedBanTracker::set_allowlist(const IpAllowlist &allowlist) {
+  std::vector<IpKey> keys;
+  for (const auto &entry : allowlist) {
+    boost::system::error_code ec;
+    const auto addr = boost::asio::ip::make_address(entry, ec);
+    if (!ec) {
+      keys.emplace_back(addr);
+    }
+  }
+  std::lock_guard lock(export_mu_);
+  allowlist_ = std::move(keys);
+  for (auto it = exported_.begin(); it != exported_.end();) {
+    if (covers_allowlisted(it->first)) {
+      sink_->unban(it->first);
+      it = exported_.erase(it);
     } else {
       ++it;
     }
   }
 }
+
+bool SharedBanTracker::covers_allowlisted(const BlockedNet &net) const {
+  return std::any_of(allowlist_.begin(), allowlist_.end(),
+                     [&](const IpKey &addr) {
+                       return common_length(addr, net.addr, net.prefix_len) ==
+                              net.prefix_len;
+                     });
+}
+
+void SharedBanTracker::export_ban(const BlockedNet &net,
+                                  BanTracker::clock::time_point until,
+                                  BanTracker::clock::time_point now) {
+  std::lock_guard lock(export_mu_);
+  if (covers_allowlisted(net)) {
+    return;
+  }
+  // Exported blocks never overlap: nft refuses an interval that overlaps one
+  // already in the set. A net inside an exported prefix is left to the
+  // prefix, and a prefix replaces the nets it covers (any of them that
+  // outlast it are still checked in-process). Nothing sorts between
+  // a prefix and the nets it covers, so the one that could cover net is the
+  // entry just before it.
+  auto covers = [](const BlockedNet &outer, const BlockedNet &inner) {
+    return outer.prefix_len < inner.prefix_len &&
+           common_length(outer.addr, inner.addr, outer.prefix_len) ==
+               outer.prefix_len;
+  };
+  auto next = exported_.lower_bound(net);
+  if (next != exported_.begin() && covers(std::prev(next)->first, net)) {
+    return;
+  }
+  if (next != exported_.end() && next->first == net) {
+    ++next;
+  }
+  while (next != exported_.end() && covers(net, next->first)) {
+    sink_->unban(next->first);
+    next = exported_.erase(next);
+  }
+  if (exported_.size() >= max_exported_ && !exported_.contains(net)) {
+    // Full: make room from blocks that have lapsed since the last sweep,
+    // looking at most once a second.
+    if (now - lapsed_checked_ >= std::chrono::seconds(1)) {
+      withdraw_lapsed(now);
+    }
+    if (exported_.size() >= max_exported_) {
+      dropped_exports_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+  auto [it, inserted] = exported_.try_emplace(net, until);
+  if (!inserted) {
+    // Already exported; a racing offense can only extend the block.
+    if (until <= it->second) {
+      return;
+    }
+    it->second = until;
+  }
+  sink_->ban(net, std::chrono::ceil<std::chrono::seconds>(until - now));
+}
+
+std::size_t SharedBanTracker::tracked() const {
+  std::size_t n = 0;
+  for (const auto &shard : shards_) {
+    std::shared_lock lock(shard.mu);
+    n += shard.bans.tracked();
+  }
+  return n;
+}
+
+std::size_t SharedBanTracker::tracked_prefixes() const {
+  std::shared_lock lock(subnet_mu_);
+  return subnets_.tracked();
+}
+
+void SharedBanTracker::for_each(const BanStateVisitor &visit) const {
+  for (const auto &shard : shards_) {
+    std::shared_lock lock(shard.mu);
+    shard.bans.for_each(visit);
+  }
+  std::shared_lock lock(subnet_mu_);
+  subnets_.for_each(visit);
+}
+
+void SharedBanTracker::restore(
+    const BlockedNet &net, std::span<const BanTracker::clock::time_point> times,
+    BanTracker::clock::time_point now) {
+  if (net.prefix_len == 128) {
+    // Straight into the shard's table, as reconfigure() rebuilds it:
+    // replaying through record_offense() would count each address as a new
+    // source for its prefix a second time, and in a bounded table would
+    // only feed the sketch until the address was promoted.
+    std::optional<BanTracker::clock::time_point> until;
+    {
+      const std::uint64_t hash = net.addr.hash();
+      Shard &shard = shards_[shard_index(hash)];
+      std::unique_lock lock(shard.mu);
+      shard.bans.restore(net.addr, times, now);
+      until = shard.bans.blocked_until(net.addr, now);
+      if (until) {
+        shard.blocked.add(hash, now, shard.bans.config().window);
+      }
+    }
+    if (until && sink_) {
+      export_ban(net, *until, now);
+    }
+    return;
+  }
+  if (!subnet_prefixes_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  std::optional<SubnetTracker::Block> block;
+  {
+    std::unique_lock lock(subnet_mu_);
+    const auto cutoff = now - subnets_.config().window;
+    for (const auto t : times) {
+      if (t > cutoff) {
+        subnets_.record_source(net.addr, t);
+      }
+    }
+    block = subnets_.blocking_prefix(net.addr, now);
+    if (block) {
+      blocked_prefixes_.add(block->net.addr.hash(), now,
+                            subnets_.config().window);
+    }
+  }
+  if (block && sink_) {
+    export_ban(block->net, block->until, now);
+  }
+}
@@ -1,13 +1,92 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <boost/asio/ip/address.hpp>
 #include <chrono>
 #include <cstddef>
-#include <deque>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
 #include <string>
 #include <string_view>
-#include <unordered_map>
 #include <unordered_set>
+#include <vector>
+
+// IpKey is a client address packed into 16 bytes -- IPv6 as-is, IPv4 as its
+// v4-mapped form (::ffff:a.b.c.d) -- so the ban table can key on it directly
+// instead of on a heap-allocated to_string() rendering.
+struct IpKey {
+  std::array<std::uint8_t, 16> bytes{};
+
+  IpKey() = default;
+  // Implicit on purpose: any address converts straight to its key.
+  IpKey(const boost::asio::ip::address &addr);
+  IpKey(const boost::asio::ip::address_v4 &addr);
+  IpKey(const boost::asio::ip::address_v6 &addr) : bytes(addr.to_bytes()) {}
+
+  boost::asio::ip::address address() const;
+  std::string to_string() const { return address().to_string(); }
+  std::uint64_t hash() const;
+
+  bool operator==(const IpKey &) const = default;
+  auto operator<=>(const IpKey &) const = default;
+};
+
+// A client address as boost::asio::ip::address::to_string() writes it, or
+// "unknown", held inline: every connection logs its client's address, and
+// an IPv6 one is too long for std::string to hold without allocating.
+class AddressText {
+public:
+  AddressText() = default;
+  explicit AddressText(const boost::asio::ip::address &addr);
+
+  std::string_view view() const { return {text_, size_}; }
+
+private:
+  // An IPv6 address, '%' and a scope id, by name or number.
+  char text_[72] = "unknown";
+  std::uint8_t size_ = 7;
+};
+
+// Hashes std::string and std::string_view alike, so that an IpAllowlist can
+// be searched with an AddressText's view.
+struct StringViewHash {
+  using is_transparent = void;
+  std::size_t operator()(std::string_view s) const {
+    return std::hash<std::string_view>{}(s);
+  }
+};
+
+// Allowlisted addresses, as written in the configuration.
+using IpAllowlist =
+    std::unordered_set<std::string, StringViewHash, std::equal_to<>>;
+
+// A blocked network: an address and a prefix length in the 128-bit IpKey
+// space (128 for a single address, 96 + n for an IPv4 /n).
+struct BlockedNet {
+  IpKey addr;
+  int prefix_len = 128;
+
+  // CIDR notation in the address's own family, e.g. "203.0.113.0/24".
+  std::string to_string() const;
+  bool is_v4() const { return addr.address().is_v4(); }
+
+  auto operator<=>(const BlockedNet &) const = default;
+};
+
+class BanSink;
+
+// Callback for walking ban state: a tracked address (as a /128) or prefix,
+// with the offense or source times it remembers, oldest first.
+using BanStateVisitor = std::function<void(
+    const BlockedNet &net,
+    std::span<const std::chrono::steady_clock::time_point> times)>;
 
 // BanTracker records the timestamps of "offenses" -- requests that are
 // obviously not finger queries -- per client IP, over a rolling time window.
@@ -16,10 +95,30 @@
 // window are pruned, so a blocked IP automatically frees itself once its old
 // offenses age out.
 //
-// All state is in-memory: the daemon runs a single io_context thread, so every
-// call happens on the same thread and no locking is required. Time is passed
-// in as a steady_clock time_point rather than read internally, so the logic is
-// deterministic and unit-testable.
+// Deciding "more than threshold in the window" only ever needs the newest
+// threshold + 1 offenses, so that is all that is kept: each IP owns a
+// fixed-capacity ring of threshold + 1 timestamps, stored inline in a flat
+// open-addressing table (linear probing, backward-shift deletion). Timestamps
+// are whole seconds on the steady clock in 32 bits, which is ample for a
+// window measured in hours. Tracking an IP therefore costs one table row and
+// no per-IP heap allocation, which keeps a large distributed scan to tens of
+// bytes per source address.
+//
+// Rows also expire incrementally. Every row is linked, through indices kept
+// in the row itself, into one bucket of a timing wheel: the bucket for the
+// moment its newest offense leaves the window, at 1/1022 of the window per
+// bucket (at least a second). expire() only visits the buckets whose time has
+// passed. A row that has offended again since it was filed is moved on to its
+// new bucket, and the rest are erased. No bucket is ever more than a window
+// ahead, so one wheel without overflow levels is enough. This keeps the
+// periodic cost proportional to what is due rather than to the table size,
+// and a budget caps how much one call does.
+//
+// All state is in-memory and BanTracker itself does no locking; when the
+// daemon runs more than one io_context thread it goes through
+// SharedBanTracker below instead. Time is passed in as a steady_clock
+// time_point rather than read internally, so the logic is deterministic and
+// unit-testable.
 class BanTracker {
 public:
   using clock = std::chrono::steady_clock;
@@ -27,39 +126,478 @@ public:
   struct Config {
     int threshold = 3;                              // block when offenses exceed this
     clock::duration window = std::chrono::hours(24); // rolling window length
+
+    // Bounded mode, off while max_tracked is 0. The table is allocated once
+    // for max_tracked rows and never grows: when it is full, a new row
+    // evicts the least recently offending of a few rows near its slot
+    // (preferring ones that are not blocked). Addresses only get a row once
+    // a count-min sketch of sketch_width counters per row says they have
+    // offended promote_after times in the window; offenses before that are
+    // only counted in the sketch.
+    std::size_t max_tracked = 0;
+    std::size_t sketch_width = 0; // rounded down to a power of two
+    int promote_after = 2;
+
+    bool operator==(const Config &) const = default;
   };
 
   struct OffenseResult {
-    int count;    // offenses within the window, including this one
+    int count;    // offenses within the window, including this one; saturates
+                  // at threshold + 1, the most the ring remembers
     bool blocked; // true if the IP is now blocked (count > threshold)
   };
 
-  BanTracker() = default;
-  explicit BanTracker(Config cfg) : cfg_(cfg) {}
+  // Largest supported threshold (the ring index is a single byte).
+  static constexpr int kMaxThreshold = 254;
+
+  BanTracker() : BanTracker(Config{}) {}
+  explicit BanTracker(Config cfg);
+
+  // base in bounded mode, sized so that the table and sketch together take
+  // at most `bytes`: a quarter for the sketch, the rest for the table. The
+  // result may be split between `tables` tables, each with a wheel of its
+  // own, as SharedBanTracker does with its shards.
+  static Config bounded(Config base, std::size_t bytes,
+                        std::size_t tables = 1);
 
   // True if ip currently has more than `threshold` offenses inside the rolling
   // window. Does not mutate state.
-  bool is_blocked(const std::string &ip, clock::time_point now) const;
+  bool is_blocked(const IpKey &ip, clock::time_point now) const;
+
+  // When ip's current block lapses on its own (its oldest remembered offense
+  // leaves the window), or nullopt if it is not blocked.
+  std::optional<clock::time_point> blocked_until(const IpKey &ip,
+                                                 clock::time_point now) const;
 
   // Record one offense from ip at `now`. Prunes that IP's expired timestamps,
   // appends this one, and reports the in-window count and whether it is now
   // blocked.
-  OffenseResult record_offense(const std::string &ip, clock::time_point now);
+  OffenseResult record_offense(const IpKey &ip, clock::time_point now);
+
+  // Give ip a row remembering `times` (oldest first; those outside the
+  // window are skipped), replacing any it had. Unlike record_offense() this
+  // bypasses the sketch, so a table can be rebuilt from another's for_each().
+  void restore(const IpKey &ip, std::span<const clock::time_point> times,
+               clock::time_point now);
 
   // Drop timestamps older than the window across all IPs, removing any IP left
-  // with no offenses. Safe to call periodically to keep the map bounded.
+  // with no offenses. Safe to call periodically to keep the table bounded.
   void sweep(clock::time_point now);
 
+  // Erase the rows due on the expiry wheel by `now`, looking at no more than
+  // `budget` rows; whatever is left over is picked up by the next call.
+  // Returns how many rows were erased.
+  std::size_t expire(clock::time_point now,
+                     std::size_t budget = std::numeric_limits<std::size_t>::max());
+
   // Number of tracked IPs (for introspection and tests).
-  std::size_t tracked() const { return offenders_.size(); }
+  std::size_t tracked() const { return size_; }
+
+  // Bytes held by the table and sketch.
+  std::size_t memory_bytes() const;
+
+  // Visit every tracked IP with its remembered offenses.
+  void for_each(const BanStateVisitor &visit) const;
 
   const Config &config() const { return cfg_; }
 
 private:
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+  static constexpr std::uint32_t kNil = std::numeric_limits<std::uint32_t>::max();
+  static constexpr std::size_t kWheelBuckets = 1024;
+
+  // Seconds since the steady clock's epoch.
+  using Stamp = std::uint32_t;
+  static Stamp to_stamp(clock::time_point t);
+  static clock::time_point from_stamp(Stamp s) {
+    return clock::time_point(std::chrono::seconds(s));
+  }
+
+  // One table row. Its ring of `ring_` timestamps lives at
+  // times_[index * ring_]; `head` is the oldest entry and `size` how many are
+  // in use (0 marks an empty row). `bucket` is its expiry wheel bucket and
+  // prev/next its neighbours in that bucket's list.
+  struct Slot {
+    IpKey key;
+    std::uint8_t head = 0;
+    std::uint8_t size = 0;
+    std::uint16_t bucket = 0;
+    std::uint32_t prev = kNil;
+    std::uint32_t next = kNil;
+  };
+
+  Stamp *ring(std::size_t i) { return &times_[i * ring_]; }
+  const Stamp *ring(std::size_t i) const { return &times_[i * ring_]; }
+  int count_in_window(std::size_t i, clock::time_point now) const;
+  std::size_t find(const IpKey &ip) const;
+  std::size_t insert(const IpKey &ip);
+  void erase(std::size_t i);
+  void move_row(std::size_t from, std::size_t to);
+  void rehash(std::size_t capacity);
+  void link(std::size_t i);
+  void unlink(std::size_t i);
+  int sketch_offense(const IpKey &ip, clock::time_point now);
+  void evict_near(const IpKey &ip, clock::time_point now);
+
+  bool is_bounded() const { return cfg_.max_tracked > 0; }
+
   Config cfg_{};
-  // Per-IP offense timestamps, kept in ascending order (steady_clock is
-  // monotonic, so appends are always newest-last).
-  std::unordered_map<std::string, std::deque<clock::time_point>> offenders_;
+  std::size_t ring_;     // timestamps remembered per IP: threshold + 1
+  std::size_t size_ = 0; // occupied rows
+  std::size_t mask_ = 0; // slots_.size() - 1 (always a power of two)
+  std::vector<Slot> slots_;
+  std::vector<Stamp> times_;
+
+  // Expiry wheel: the first row of each bucket's list. Bucket numbers count
+  // ticks of `tick_` seconds since the clock's epoch, and a row sits in
+  // bucket number % kWheelBuckets. cursor_ is the next bucket number to
+  // drain; everything filed is within kWheelBuckets - 1 buckets after it.
+  std::vector<std::uint32_t> wheel_;
+  Stamp window_secs_; // window, rounded up to whole seconds
+  Stamp tick_;        // seconds per bucket
+  std::uint64_t cursor_ = 0;
+  bool wheel_started_ = false;
+
+  // Bounded mode's sketch: kSketchRows rows of saturating byte counters, in
+  // two generations of one window each, so an estimate covers between one
+  // and two windows of offenses.
+  static constexpr std::size_t kSketchRows = 4;
+  std::vector<std::uint8_t> sketch_[2];
+  int current_ = 0;
+  clock::time_point generation_start_{};
+  std::uint64_t sketch_seed_ = 0;
+};
+
+// SubnetTracker escalates bans from single addresses to whole prefixes.
+// Scanners that rotate through a /24 (or an IPv6 /64) never trip the per-IP
+// threshold for long, so this counts *distinct* offending sources per prefix:
+// the caller reports each address the first time it offends within the
+// window, and once more than `threshold` distinct sources from one prefix
+// have been reported inside the rolling window, every address in that prefix
+// is blocked until those reports age out.
+//
+// Prefixes live in a path-compressed binary radix (Patricia) trie over the
+// 128-bit IpKey space, IPv4 sitting under ::ffff:0:0/96. Nodes are held in a
+// flat vector and linked by index, so is_blocked() is a walk of at most one
+// node per prefix bit with no allocation. Entries are never unlinked
+// individually: sweep() rebuilds the trie from the prefixes that are still
+// live.
+//
+// In bounded mode the trie has a fixed node budget, allocated up front: a
+// source whose prefix is not tracked yet, and would not fit, is not counted
+// until sweep() makes room. Without it every distinct source of a wide scan
+// (each IPv6 address its own /64) would add a prefix for a whole window.
+//
+// Only globally routable addresses (is_bannable_address()) are ever counted,
+// so private and CGNAT ranges can never be blocked wholesale. Allowlisted
+// addresses are exempted by the caller, which never consults the tracker for
+// them even when their prefix is blocked. Like BanTracker this class does no
+// locking of its own.
+class SubnetTracker {
+public:
+  using clock = BanTracker::clock;
+
+  struct Config {
+    // Block a prefix when more distinct sources than this offend within the
+    // window. 0 disables subnet escalation.
+    int threshold = 8;
+    clock::duration window = std::chrono::hours(24);
+    int v4_prefix = 24; // prefix lengths that sources are grouped by
+    int v6_prefix = 64;
+    // Bounded mode, off while 0: the trie never holds more nodes than this.
+    std::size_t max_nodes = 0;
+
+    bool operator==(const Config &) const = default;
+  };
+
+  struct Result {
+    int sources;  // distinct sources in the prefix's window, saturating at
+                  // threshold + 1
+    bool blocked; // true if the prefix is now blocked
+  };
+
+  SubnetTracker() : SubnetTracker(Config{}) {}
+  explicit SubnetTracker(Config cfg);
+
+  // base in bounded mode, with as many nodes as fit in `bytes`.
+  static Config bounded(Config base, std::size_t bytes);
+
+  bool enabled() const { return cfg_.threshold > 0; }
+
+  // True if ip falls in a prefix that is currently blocked.
+  bool is_blocked(const IpKey &ip, clock::time_point now) const;
+
+  // The blocked prefix containing ip, if any, and when that block lapses.
+  struct Block {
+    BlockedNet net;
+    clock::time_point until;
+  };
+  std::optional<Block> blocking_prefix(const IpKey &ip,
+                                       clock::time_point now) const;
+
+  // Report ip as a new distinct offending source at `now`.
+  Result record_source(const IpKey &ip, clock::time_point now);
+
+  // Drop prefixes with no sources left in the window and compact the trie.
+  void sweep(clock::time_point now);
+
+  // Number of prefixes with sources in the trie.
+  std::size_t tracked() const { return entries_; }
+
+  // Bytes held by the trie.
+  std::size_t memory_bytes() const;
+
+  // Visit every tracked prefix with its remembered source times.
+  void for_each(const BanStateVisitor &visit) const;
+
+  // Prefix length (in the 128-bit key space) that ip is grouped under.
+  int prefix_length(const IpKey &ip) const;
+
+  const Config &config() const { return cfg_; }
+
+private:
+  static constexpr std::int32_t kNone = -1;
+
+  struct Node {
+    IpKey prefix;          // bits past `len` are zero
+    std::uint8_t len = 0;  // prefix length in bits, 0-128
+    bool terminal = false; // a tracked prefix, not just a branch point
+    std::uint8_t head = 0; // ring of source times, as in BanTracker
+    std::uint8_t size = 0;
+    std::int32_t child[2] = {kNone, kNone};
+  };
+
+  std::int32_t new_node(const IpKey &prefix, int len, bool terminal);
+  std::int32_t insert(const IpKey &prefix, int len);
+  // The tracked prefix of exactly len bits containing ip, or kNone.
+  std::int32_t find(const IpKey &ip, int len) const;
+  void reserve();
+  clock::time_point *ring(std::int32_t n) { return &times_[n * ring_]; }
+  const clock::time_point *ring(std::int32_t n) const {
+    return &times_[n * ring_];
+  }
+  int count_in_window(const Node &node, std::int32_t n,
+                      clock::time_point now) const;
+
+  Config cfg_;
+  std::size_t ring_;
+  std::size_t entries_ = 0;
+  std::int32_t root_ = kNone;
+  std::vector<Node> nodes_;
+  std::vector<clock::time_point> times_;
+};
+
+// BlockFilter is a Bloom filter of recently blocked keys that can be read
+// without a lock. SharedBanTracker keeps one per shard, and one for blocked
+// prefixes, so that a block check only locks anything when the filter says
+// the key may be blocked: for almost every client it never contends with a
+// writer at all.
+//
+// Bits are only ever set by one writer at a time (the caller's lock), and
+// are never cleared individually. Instead there are two generations, each
+// collecting the adds of one `lifetime`: when an add finds the current one
+// older than that, the previous generation is cleared and becomes current.
+// A block lasts at most `lifetime` past the add that reported it, so by
+// then every key left in the cleared generation has lapsed (or was added
+// again since). A key that is no longer blocked may still test positive;
+// the caller then takes the lock and asks the table.
+class BlockFilter {
+public:
+  using clock = BanTracker::clock;
+
+  static constexpr std::size_t kBits = 4096; // per generation
+
+  // Record that the key hashing to `hash` is blocked as of `now`. Callers
+  // must serialise adds.
+  void add(std::uint64_t hash, clock::time_point now,
+           clock::duration lifetime);
+
+  // False only if the key has not been added within the last lifetime.
+  bool may_contain(std::uint64_t hash) const;
+
+  static constexpr std::size_t memory_bytes() {
+    return 2 * kBits / 8;
+  }
+
+private:
+  static constexpr std::size_t kWords = kBits / 64;
+
+  std::array<std::atomic<std::uint64_t>, kWords> bits_[2];
+  // Touched by add() alone.
+  int current_ = 0;
+  clock::time_point started_{};
+  bool empty_ = true;
+};
+
+// SharedBanTracker is the thread-safe face of BanTracker used by the daemon:
+// with FINGER_THREADS > 1 every io_context thread checks and records offenses
+// against the same table, so a scanner spread across several acceptors still
+// hits one threshold.
+//
+// The table is split into independent BanTracker shards selected by a hash of
+// the address, each behind its own reader/writer lock. sweep() and expire()
+// lock one shard at a time, so they never stall the whole table at once.
+//
+// A SubnetTracker, behind its own reader/writer lock, sits alongside the
+// shards: an address's first offense in its window is reported to it as a new
+// source, and is_blocked() also refuses addresses whose prefix is blocked.
+//
+// is_blocked() -- run on every accepted connection -- first asks the shard's
+// BlockFilter, and the prefix filter, which it reads without locking. Only
+// an address that one of them says may be blocked costs a shared lock, so a
+// client that is not blocked never waits on a writer, even one that holds a
+// shard for an expiry tick.
+//
+// With a BanSink attached, every address or prefix that becomes blocked is
+// pushed to it along with how long the block will last, and sweep_prefixes()
+// reports the ones whose block has lapsed. This lets a firewall drop banned
+// clients before they ever reach the daemon; the in-process checks stay in
+// place for when it does not. A block that covers an allowlisted address is
+// never pushed: the firewall cannot tell the trusted front-end from the rest
+// of its prefix, so that prefix is only refused in-process, where the
+// allowlist is checked first.
+class SharedBanTracker {
+public:
+  static constexpr std::size_t kDefaultShards = 16;
+  static constexpr std::size_t kUnlimitedExports =
+      std::numeric_limits<std::size_t>::max();
+  // What an exported block costs: its node in the record here, and another
+  // in a sink that keeps the current list (FileBanSink).
+  static constexpr std::size_t kExportBytes = 128;
+
+  struct OffenseResult : BanTracker::OffenseResult {
+    bool prefix_blocked = false; // the address's whole prefix is now blocked
+  };
+
+  SharedBanTracker() : SharedBanTracker(BanTracker::Config{}) {}
+  // shards is rounded up to a power of two.
+  explicit SharedBanTracker(BanTracker::Config cfg,
+                            std::size_t shards = kDefaultShards)
+      : SharedBanTracker(cfg, SubnetTracker::Config{}, shards) {}
+  SharedBanTracker(BanTracker::Config cfg, SubnetTracker::Config subnet,
+                   std::size_t shards = kDefaultShards);
+
+  bool is_blocked(const IpKey &ip, BanTracker::clock::time_point now) const;
+  OffenseResult record_offense(const IpKey &ip,
+                               BanTracker::clock::time_point now);
+  // The configs for a tracker of `shards` shards that holds at most `bytes`
+  // in all: cfg in bounded mode for the shards' tables, subnet with a
+  // bounded trie and, if `exporting`, room for the blocks handed to a sink
+  // (pass max_exported to set_sink()). The shards' wheels and the block
+  // filters come out of the budget first.
+  struct BoundedConfig {
+    BanTracker::Config bans;
+    SubnetTracker::Config subnets;
+    std::size_t max_exported = kUnlimitedExports;
+  };
+  static BoundedConfig bounded(BanTracker::Config cfg,
+                               SubnetTracker::Config subnet,
+                               std::size_t bytes,
+                               std::size_t shards = kDefaultShards,
+                               bool exporting = false);
+
+  // Everything: every shard's whole table, then sweep_prefixes().
+  void sweep(BanTracker::clock::time_point now);
+  // Each shard's due expiry buckets, with a budget of rows per shard.
+  // Returns how many rows were erased.
+  std::size_t expire(BanTracker::clock::time_point now,
+                     std::size_t budget = std::numeric_limits<std::size_t>::max());
+  // The prefix trie, and the sink's lapsed blocks.
+  void sweep_prefixes(BanTracker::clock::time_point now);
+  std::size_t tracked() const;
+  std::size_t tracked_prefixes() const;
+  // Bytes held by the shards' tables and sketches, the prefix trie, the
+  // block filters and the record of exported blocks (all of its room, if
+  // that is limited).
+  std::size_t memory_bytes() const;
+
+  // Switch to new ban and subnet parameters, keeping what is tracked: each
+  // table that changed is rebuilt from the old one, one shard at a time,
+  // with every remembered offense still inside the new window. Addresses
+  // that are only counted in a bounded table's sketch are forgotten.
+  // Anything now blocked is exported to the sink; blocks already exported
+  // keep their firewall timeouts. Safe to call while other threads check
+  // and record offenses; concurrent reconfigure() calls are serialised.
+  void reconfigure(BanTracker::Config cfg, SubnetTracker::Config subnet,
+                   BanTracker::clock::time_point now);
+
+  // Visit every tracked address, then every tracked prefix. Each shard is
+  // read-locked while it is walked.
+  void for_each(const BanStateVisitor &visit) const;
+
+  // Replay state captured by for_each(): offense times for a /128, source
+  // times for a prefix. Anything left blocked is exported to the sink.
+  void restore(const BlockedNet &net,
+               std::span<const BanTracker::clock::time_point> times,
+               BanTracker::clock::time_point now);
+
+  // Mirror ban transitions to sink (not owned; nullptr detaches), with at
+  // most max_exported blocks in it at a time. Blocks beyond that are only
+  // enforced in-process, and counted in dropped_exports(). Set it before
+  // serving.
+  void set_sink(BanSink *sink,
+                std::size_t max_exported = kUnlimitedExports) {
+    sink_ = sink;
+    max_exported_ = max_exported;
+  }
+  std::uint64_t dropped_exports() const {
+    return dropped_exports_.load(std::memory_order_relaxed);
+  }
+
+  // Addresses (as parse_ip_allowlist() gives them) whose blocks must stay
+  // out of the sink. Blocks already exported that cover one of them are
+  // withdrawn. Entries that are not addresses are ignored.
+  void set_allowlist(const IpAllowlist &allowlist);
+
+  std::size_t shard_count() const { return shards_.size(); }
+
+private:
+  // Padded to a cache line so neighbouring shards' locks do not false-share.
+  struct alignas(64) Shard {
+    mutable std::shared_mutex mu;
+    BanTracker bans;
+    BlockFilter blocked; // added to under mu, read without it
+  };
+
+  std::size_t shard_index(std::uint64_t hash) const;
+  // Hash of ip's prefix at the lengths packed in `prefixes` (see
+  // subnet_prefixes_).
+  static std::uint64_t prefix_hash(const IpKey &ip, std::uint16_t prefixes);
+  std::uint16_t pack_prefixes() const;
+  // cfg for one shard: a bounded table's budget is split between them.
+  BanTracker::Config shard_config(BanTracker::Config cfg) const;
+
+  void export_ban(const BlockedNet &net, BanTracker::clock::time_point until,
+                  BanTracker::clock::time_point now);
+
+  std::vector<Shard> shards_;
+  std::size_t mask_;
+  // Held by reconfigure() throughout; guards the two configs below.
+  std::mutex reconfigure_mu_;
+  BanTracker::Config cfg_;           // as given, before splitting
+  SubnetTracker::Config subnet_cfg_; // as given
+  mutable std::shared_mutex subnet_mu_;
+  SubnetTracker subnets_;
+  BlockFilter blocked_prefixes_; // added to under subnet_mu_
+  // The prefix lengths subnets_ groups IPv4 and IPv6 sources by, as
+  // (96 + v4 length) << 8 | v6 length, or 0 while subnet escalation is off.
+  // Readable without subnet_mu_; reconfigure() updates it while holding
+  // that lock exclusively.
+  std::atomic<std::uint16_t> subnet_prefixes_;
+
+  // Whether net covers an allowlisted address. Needs export_mu_.
+  bool covers_allowlisted(const BlockedNet &net) const;
+  // Withdraw the exported blocks that have lapsed by now. Needs export_mu_.
+  void withdraw_lapsed(BanTracker::clock::time_point now);
+
+  BanSink *sink_ = nullptr;
+  std::size_t max_exported_ = kUnlimitedExports;
+  std::atomic<std::uint64_t> dropped_exports_{0};
+  mutable std::mutex export_mu_;
+  // Blocks handed to the sink, and when each lapses.
+  std::map<BlockedNet, BanTracker::clock::time_point> exported_;
+  BanTracker::clock::time_point lapsed_checked_{};
+  std::vector<IpKey> allowlist_;
 };
 
 // Whether a client address is meaningful to track and ban. Only globally
@@ -87,4 +625,4 @@ bool is_bannable_address(const boost::asio::ip::address &addr);
 // it, a burst from any single client of the proxy is attributed to the proxy's
 // IP and bans the proxy for everyone; per-client abuse protection for that path
 // lives in the proxy instead.
-std::unordered_set<std::string> parse_ip_allowlist(std::string_view csv);
+IpAllowlist parse_ip_allowlist(std::string_view csv);
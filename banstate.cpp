@@ -0,0 +1,238 @@
+#include "banstate.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+constexpr char kMagic[8] = {'F', 'N', 'G', 'R', 'B', 'A', 'N', 'S'};
+constexpr std::uint32_t kVersion = 1;
+
+struct Header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t entries;
+  std::int64_t saved_at;
+};
+static_assert(sizeof(Header) == 24);
+
+struct EntryHeader {
+  std::uint8_t addr[16];
+  std::uint8_t prefix_len;
+  std::uint8_t count;
+  std::uint16_t reserved;
+};
+static_assert(sizeof(EntryHeader) == 20);
+
+using Age = std::uint32_t;
+
+std::system_error errno_error(const std::string &what,
+                              const std::filesystem::path &path) {
+  return std::system_error(errno, std::generic_category(),
+                           what + " " + path.string());
+}
+
+template <typename T> void append(std::vector<char> &out, const T &v) {
+  const char *p = reinterpret_cast<const char *>(&v);
+  out.insert(out.end(), p, p + sizeof v);
+}
+
+// Closes the descriptor and unmaps the file on scope exit.
+struct Mapping {
+  int fd = -1;
+  const char *data = nullptr;
+  std::size_t size = 0;
+
+  ~Mapping() {
+    if (data) {
+      ::munmap(const_cast<char *>(data), size);
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+};
+
+} // namespace
+
+std::vector<char>
+encode_ban_state(const SharedBanTracker &bans,
+                 std::chrono::steady_clock::time_point now,
+                 std::chrono::system_clock::time_point wall_now) {
+  std::vector<char> buf(sizeof(Header));
+  std::uint32_t entries = 0;
+  bans.for_each([&](const BlockedNet &net,
+                    std::span<const std::chrono::steady_clock::time_point>
+                        times) {
+    EntryHeader e{};
+    std::memcpy(e.addr, net.addr.bytes.data(), sizeof e.addr);
+    e.prefix_len = static_cast<std::uint8_t>(net.prefix_len);
+    e.count = static_cast<std::uint8_t>(
+        std::min<std::size_t>(times.size(), 255));
+    append(buf, e);
+    // Keep the newest times if a ring is ever longer than a count byte.
+    for (const auto t : times.last(e.count)) {
+      const auto age =
+          std::chrono::duration_cast<std::chrono::seconds>(now - t).count();
+      append(buf, static_cast<Age>(std::clamp<std::int64_t>(
+                      age, 0, std::numeric_limits<Age>::max())));
+    }
+    ++entries;
+  });
+
+  Header h{};
+  std::memcpy(h.magic, kMagic, sizeof h.magic);
+  h.version = kVersion;
+  h.entries = entries;
+  h.saved_at = std::chrono::duration_cast<std::chrono::seconds>(
+                   wall_now.time_since_epoch())
+                   .count();
+  std::memcpy(buf.data(), &h, sizeof h);
+  return buf;
+}
+
+std::size_t save_ban_state(const SharedBanTracker &bans,
+                           const std::filesystem::path &path,
+                           std::chrono::steady_clock::time_point now,
+                           std::chrono::system_clock::time_point wall_now) {
+  const std::vector<char> buf = encode_ban_state(bans, now, wall_now);
+  Header h;
+  std::memcpy(&h, buf.data(), sizeof h);
+
+  std::filesystem::path tmp = path;
+  tmp += ".tmp";
+  const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0600);
+  if (fd < 0) {
+    throw errno_error("cannot create", tmp);
+  }
+  for (std::size_t off = 0; off < buf.size();) {
+    const ssize_t n = ::write(fd, buf.data() + off, buf.size() - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      const auto err = errno_error("cannot write", tmp);
+      ::close(fd);
+      ::unlink(tmp.c_str());
+      throw err;
+    }
+    off += static_cast<std::size_t>(n);
+  }
+  // Make the data durable before the rename makes it the snapshot.
+  if (::fsync(fd) < 0 || ::close(fd) < 0) {
+    const auto err = errno_error("cannot write", tmp);
+    ::unlink(tmp.c_str());
+    throw err;
+  }
+  if (::rename(tmp.c_str(), path.c_str()) < 0) {
+    const auto err = errno_error("cannot replace", path);
+    ::unlink(tmp.c_str());
+    throw err;
+  }
+  return h.entries;
+}
+
+std::size_t load_ban_state(SharedBanTracker &bans,
+                           const std::filesystem::path &path,
+                           std::chrono::steady_clock::time_point now,
+                           std::chrono::system_clock::time_point wall_now) {
+  Mapping map;
+  map.fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (map.fd < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    throw errno_error("cannot open", path);
+  }
+  struct stat st;
+  if (::fstat(map.fd, &st) < 0) {
+    throw errno_error("cannot stat", path);
+  }
+  map.size = static_cast<std::size_t>(st.st_size);
+  if (map.size < sizeof(Header)) {
+    throw std::runtime_error(path.string() + ": not a ban state snapshot");
+  }
+  void *p = ::mmap(nullptr, map.size, PROT_READ, MAP_PRIVATE, map.fd, 0);
+  if (p == MAP_FAILED) {
+    throw errno_error("cannot map", path);
+  }
+  map.data = static_cast<const char *>(p);
+  try {
+    return decode_ban_state(bans, {map.data, map.size}, now, wall_now);
+  } catch (const std::runtime_error &e) {
+    throw std::runtime_error(path.string() + ": " + e.what());
+  }
+}
+
+std::size_t decode_ban_state(SharedBanTracker &bans,
+                             std::span<const char> data,
+                             std::chrono::steady_clock::time_point now,
+                             std::chrono::system_clock::time_point wall_now) {
+  Header h;
+  if (data.size() < sizeof h) {
+    throw std::runtime_error("not a ban state snapshot");
+  }
+  std::memcpy(&h, data.data(), sizeof h);
+  if (std::memcmp(h.magic, kMagic, sizeof kMagic) != 0 ||
+      h.version != kVersion) {
+    throw std::runtime_error("not a ban state snapshot");
+  }
+
+  // Ages are relative to the snapshot; the time since then (the downtime)
+  // is added on. A wall clock that went backwards counts as no downtime.
+  const auto downtime = std::max<std::chrono::seconds>(
+      std::chrono::seconds(0),
+      std::chrono::duration_cast<std::chrono::seconds>(
+          wall_now.time_since_epoch()) -
+          std::chrono::seconds(h.saved_at));
+
+  // Validate the whole snapshot before touching the trackers, so a
+  // truncated one restores nothing rather than half its entries.
+  std::size_t off = sizeof(Header);
+  for (std::uint32_t i = 0; i < h.entries; ++i) {
+    if (data.size() - off < sizeof(EntryHeader)) {
+      throw std::runtime_error("truncated");
+    }
+    EntryHeader e;
+    std::memcpy(&e, data.data() + off, sizeof e);
+    off += sizeof e;
+    if (data.size() - off < e.count * sizeof(Age) || e.prefix_len > 128) {
+      throw std::runtime_error("truncated");
+    }
+    off += e.count * sizeof(Age);
+  }
+
+  std::vector<std::chrono::steady_clock::time_point> times;
+  off = sizeof(Header);
+  for (std::uint32_t i = 0; i < h.entries; ++i) {
+    EntryHeader e;
+    std::memcpy(&e, data.data() + off, sizeof e);
+    off += sizeof e;
+    BlockedNet net;
+    std::memcpy(net.addr.bytes.data(), e.addr, sizeof e.addr);
+    net.prefix_len = e.prefix_len;
+    times.resize(e.count);
+    for (std::size_t k = 0; k < e.count; ++k) {
+      Age age;
+      std::memcpy(&age, data.data() + off, sizeof age);
+      off += sizeof age;
+      times[k] = now - downtime - std::chrono::seconds(age);
+    }
+    bans.restore(net, times, now);
+  }
+  // Drop whatever aged out of the window while the daemon was down.
+  bans.sweep(now);
+  return h.entries;
+}
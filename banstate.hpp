@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+#include "ban.hpp"
+
+// Ban state snapshots, so a restart does not hand every known scanner a fresh
+// budget of failures.
+//
+// A snapshot is a flat file in host byte order, laid out so it can be mapped
+// and walked in place:
+//
+//   header   magic "FNGRBANS", u32 version, u32 entry count,
+//            i64 wall-clock time of the snapshot (Unix seconds)
+//   entries  u8[16] address (IpKey bytes), u8 prefix length (128 for a single
+//            address), u8 n, u16 reserved, then n u32 ages -- seconds before
+//            the snapshot time, oldest first
+//
+// Only what the trackers still remember is written (sweep first to drop
+// anything outside the window), so a snapshot holds at most threshold + 1
+// times per entry and loading it costs time proportional to the number of
+// live entries. The steady clock does not survive a restart, so times are
+// stored as ages against the wall clock and mapped back onto the new steady
+// clock on load; time spent down counts against the window.
+
+// Write bans' state to path, atomically (a sibling temp file renamed over it).
+// Returns the number of entries written; throws std::system_error on I/O
+// failure.
+std::size_t save_ban_state(const SharedBanTracker &bans,
+                           const std::filesystem::path &path,
+                           std::chrono::steady_clock::time_point now,
+                           std::chrono::system_clock::time_point wall_now);
+
+// Restore a snapshot written by save_ban_state() into bans, which should not
+// be serving yet. Returns the number of entries read; a missing file is not
+// an error and reads nothing. Throws std::runtime_error for a file that is
+// not a snapshot or is truncated, and std::system_error if it cannot be read.
+std::size_t load_ban_state(SharedBanTracker &bans,
+                           const std::filesystem::path &path,
+                           std::chrono::steady_clock::time_point now,
+                           std::chrono::system_clock::time_point wall_now);
+
+// The same snapshot in memory, e.g. to hand the table to the daemon replacing
+// this one (see handoff.hpp).
+std::vector<char>
+encode_ban_state(const SharedBanTracker &bans,
+                 std::chrono::steady_clock::time_point now,
+                 std::chrono::system_clock::time_point wall_now);
+
+// Restore a snapshot from encode_ban_state(). Returns the number of entries
+// read; throws std::runtime_error if data is not a whole snapshot.
+std::size_t decode_ban_state(SharedBanTracker &bans,
+                             std::span<const char> data,
+                             std::chrono::steady_clock::time_point now,
+                             std::chrono::system_clock::time_point wall_now);
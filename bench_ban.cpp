@@ -0,0 +1,323 @@
+// Microbenchmarks for the ban table.
+//
+// memory: heap bytes per tracked IP during a wide scan (one or several
+// offenses from each of many distinct addresses), comparing BanTracker's flat
+// table against the original layout -- an unordered_map from to_string()
+// addresses to a std::deque of timestamps.
+//
+// bounded: total heap bytes and rows held by a table in bounded mode
+// (BanTracker::bounded(), here with a 1 MiB budget) as the number of distinct
+// one-shot sources grows, and whether 100 scanners bursting among them are
+// still caught.
+//
+// expiry: the longest time the ban table is held up by expiring rows, with
+// offenses spread evenly over the last day or all made in one minute: one
+// full sweep() as the daemon used to run every 10 minutes, against expire()
+// ticks once a second over the same 10 minutes, with the daemon's budget of
+// 4096 rows per tick (kept up until the backlog is gone) and without one.
+// Reports the worst single tick both ways, and how many budgeted ticks ran
+// and their total time.
+//
+// contention: a mix of is_blocked() checks (one per accepted connection) and
+// record_offense() writes (one per failed lookup) from several threads at
+// once, comparing the sharded SharedBanTracker against a plain BanTracker
+// behind a single mutex.
+//
+// Run with `meson test -C builddir --benchmark` or directly as
+// builddir/bench_ban [ops-per-thread].
+
+#include "ban.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Count live heap bytes so the memory section can report what each layout
+// really costs, allocator bookkeeping aside.
+namespace {
+std::atomic<std::size_t> g_live_bytes{0};
+}
+
+void *operator new(std::size_t n) {
+  // Stash the size in front of the block so delete can subtract it.
+  void *p = std::malloc(n + 16);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  *static_cast<std::size_t *>(p) = n;
+  g_live_bytes += n;
+  return static_cast<char *>(p) + 16;
+}
+
+void operator delete(void *p) noexcept {
+  if (p) {
+    char *base = static_cast<char *>(p) - 16;
+    g_live_bytes -= *reinterpret_cast<std::size_t *>(base);
+    std::free(base);
+  }
+}
+
+void operator delete(void *p, std::size_t) noexcept { operator delete(p); }
+
+namespace {
+
+using clock_type = BanTracker::clock;
+
+// The pre-flat-table layout, kept here only as the memory baseline.
+class StringDequeTracker {
+public:
+  void record_offense(const std::string &ip, clock_type::time_point now) {
+    offenders_[ip].push_back(now);
+  }
+
+private:
+  std::unordered_map<std::string, std::deque<clock_type::time_point>> offenders_;
+};
+
+class MutexBanTracker {
+public:
+  bool is_blocked(const IpKey &ip, clock_type::time_point now) {
+    std::lock_guard lock(mu_);
+    return bans_.is_blocked(ip, now);
+  }
+  BanTracker::OffenseResult record_offense(const IpKey &ip,
+                                           clock_type::time_point now) {
+    std::lock_guard lock(mu_);
+    return bans_.record_offense(ip, now);
+  }
+
+private:
+  std::mutex mu_;
+  BanTracker bans_;
+};
+
+std::vector<IpKey> make_ips(std::size_t n) {
+  std::vector<IpKey> ips;
+  ips.reserve(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    ips.push_back(
+        boost::asio::ip::address_v4(0xCB000000u + static_cast<std::uint32_t>(i)));
+  }
+  return ips;
+}
+
+// The flat table doubles at 3/4 load, so bytes per IP swing by 2x depending
+// on where the source count lands; report both ends of that range.
+void bench_memory(std::size_t n) {
+  const auto ips = make_ips(n);
+  std::vector<std::string> names;
+  names.reserve(n);
+  for (const auto &ip : ips) {
+    names.push_back(ip.to_string());
+  }
+  const auto now = clock_type::now();
+
+  for (int offenses : {1, 4}) {
+    std::size_t before = g_live_bytes;
+    double legacy;
+    {
+      StringDequeTracker t;
+      for (int k = 0; k < offenses; ++k) {
+        for (const auto &name : names) {
+          // Pay for the to_string() key as the daemon used to, per lookup.
+          t.record_offense(std::string(name), now);
+        }
+      }
+      legacy = static_cast<double>(g_live_bytes - before) / n;
+    }
+    before = g_live_bytes;
+    double flat;
+    {
+      BanTracker t;
+      for (int k = 0; k < offenses; ++k) {
+        for (const auto &ip : ips) {
+          t.record_offense(ip, now);
+        }
+      }
+      flat = static_cast<double>(g_live_bytes - before) / n;
+    }
+    std::printf("%10zu %10d %18.1f %18.1f %7.1fx\n", n, offenses, legacy,
+                flat, legacy / flat);
+  }
+}
+
+void bench_bounded(std::size_t n) {
+  const std::size_t before = g_live_bytes;
+  std::size_t caught = 0;
+  std::size_t rows;
+  std::size_t bytes;
+  {
+    BanTracker t(BanTracker::bounded({}, 1 << 20));
+    const auto now = clock_type::now();
+    for (std::size_t i = 0; i < n; ++i) {
+      t.record_offense(boost::asio::ip::address_v4(
+                           0x0B000000u + static_cast<std::uint32_t>(i)),
+                       now);
+      // Scanners try a few names in a row: each repeat offender makes a
+      // burst of four offenses at some point in the run.
+      if (i % (n / 100) == 0) {
+        const auto scanner = boost::asio::ip::address_v4(
+            0xCB007100u + static_cast<std::uint32_t>(i / (n / 100)));
+        for (int k = 0; k < 4; ++k) {
+          t.record_offense(scanner, now);
+        }
+      }
+    }
+    for (std::uint32_t k = 0; k < 100; ++k) {
+      caught += t.is_blocked(boost::asio::ip::address_v4(0xCB007100u + k), now);
+    }
+    rows = t.tracked();
+    bytes = g_live_bytes - before;
+  }
+  std::printf("%10zu %14zu %10zu %12zu/100\n", n, bytes, rows, caught);
+}
+
+double elapsed_ms(clock_type::time_point start) {
+  return std::chrono::duration<double, std::milli>(clock_type::now() - start)
+      .count();
+}
+
+void bench_expiry(std::size_t n, clock_type::duration spread) {
+  // Offenses arrive in time order, with expire() run once a simulated
+  // second as the daemon would, so the wheel is where it would be in use.
+  const auto t0 = clock_type::now();
+  const auto step = spread / n;
+  BanTracker filled;
+  auto second = t0;
+  for (std::size_t i = 0; i < n; ++i) {
+    const auto t = t0 + step * i;
+    filled.record_offense(boost::asio::ip::address_v4(
+                              0xCB000000u + static_cast<std::uint32_t>(i)),
+                          t);
+    if (t - second >= std::chrono::seconds(1)) {
+      filled.expire(t);
+      second = t;
+    }
+  }
+  const auto day = t0 + std::chrono::hours(24);
+
+  double sweep_ms;
+  {
+    BanTracker t = filled;
+    const auto start = clock_type::now();
+    t.sweep(day + std::chrono::minutes(10));
+    sweep_ms = elapsed_ms(start);
+  }
+  double worst[2] = {0, 0};
+  double total[2] = {0, 0};
+  int ticks = 0;
+  for (int budgeted = 0; budgeted < 2; ++budgeted) {
+    const std::size_t budget =
+        budgeted ? 4096 : std::numeric_limits<std::size_t>::max();
+    BanTracker t = filled;
+    std::size_t erased = 0;
+    int s = 1;
+    for (; s <= 600 || erased == budget; ++s) {
+      const auto start = clock_type::now();
+      erased = t.expire(day + std::chrono::seconds(s), budget);
+      const double ms = elapsed_ms(start);
+      worst[budgeted] = std::max(worst[budgeted], ms);
+      total[budgeted] += ms;
+    }
+    ticks = s - 1;
+  }
+  std::printf("%10zu %6s %10.3f %12.3f %12.3f %7d %12.3f\n", n,
+              spread >= std::chrono::hours(1) ? "day" : "minute", sweep_ms,
+              worst[0], worst[1], ticks, total[1]);
+}
+
+// Millions of operations per second across all threads. One operation in
+// `write_every` is a record_offense(); the rest are is_blocked() checks.
+template <typename Tracker>
+double run(Tracker &bans, const std::vector<IpKey> &ips, int threads,
+           std::size_t ops, std::size_t write_every) {
+  const auto now = clock_type::now();
+  std::vector<std::thread> workers;
+  const auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      // Cheap per-thread LCG so threads walk the address pool differently.
+      std::uint64_t x = 0x9E3779B97F4A7C15ull * (t + 1);
+      std::size_t blocked = 0;
+      for (std::size_t i = 0; i < ops; ++i) {
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+        const IpKey &ip = ips[(x >> 33) % ips.size()];
+        if (i % write_every == 0) {
+          bans.record_offense(ip, now);
+        } else {
+          blocked += bans.is_blocked(ip, now);
+        }
+      }
+      // Keep the reads from being optimised away.
+      if (blocked == static_cast<std::size_t>(-1)) {
+        std::puts("");
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return static_cast<double>(ops) * threads / elapsed.count() / 1e6;
+}
+
+void bench_contention(std::size_t ops) {
+  const std::size_t write_every = 16;
+  const auto ips = make_ips(1 << 16);
+  const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+
+  std::printf("ban table contention: %zu ops/thread, 1 write per %zu ops, "
+              "%zu addresses, %u cores\n",
+              ops, write_every, ips.size(), cores);
+  std::printf("%8s %16s %16s %8s\n", "threads", "mutex Mops/s", "sharded Mops/s",
+              "speedup");
+  for (int threads = 1; threads <= static_cast<int>(std::max(8u, cores));
+       threads *= 2) {
+    MutexBanTracker single;
+    SharedBanTracker sharded;
+    const double a = run(single, ips, threads, ops, write_every);
+    const double b = run(sharded, ips, threads, ops, write_every);
+    std::printf("%8d %16.2f %16.2f %7.2fx\n", threads, a, b, b / a);
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const std::size_t ops = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 400000;
+  std::printf("ban table memory per distinct IPv4 source\n");
+  std::printf("%10s %10s %18s %18s %8s\n", "sources", "offenses",
+              "string+deque B/IP", "flat table B/IP", "ratio");
+  bench_memory(100000);
+  bench_memory(190000);
+  std::printf("\nbounded ban table (1 MiB budget), one-shot sources\n");
+  std::printf("%10s %14s %10s %16s\n", "sources", "heap bytes", "rows",
+              "scanners caught");
+  for (std::size_t n : {10000, 100000, 1000000, 4000000}) {
+    bench_bounded(n);
+  }
+  std::printf("\nban table expiry: full sweep() against 1s expire() ticks "
+              "(ms)\n");
+  std::printf("%10s %6s %10s %12s %12s %7s %12s\n", "rows", "over",
+              "sweep()", "worst tick", "budgeted", "ticks", "ticks total");
+  for (std::size_t n : {100000, 1000000, 4000000}) {
+    for (const clock_type::duration spread :
+         {clock_type::duration(std::chrono::hours(24)),
+          clock_type::duration(std::chrono::minutes(1))}) {
+      bench_expiry(n, spread);
+    }
+  }
+  std::printf("\n");
+  bench_contention(ops);
+}
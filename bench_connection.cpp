@@ -0,0 +1,188 @@
+// Heap allocations per request in connection handling.
+//
+// Serves finger requests over loopback with echo(), accepting them as the
+// daemon's listener does, on one io_context thread, and counts what that
+// thread allocates per request once warmed up: operator new calls, and how
+// many of them the thread's own free lists could not serve, with its block
+// cache off (all of them) and on (see blockcache.hpp). Requests are a plan
+// (a cache hit), a name with no plan (a cached miss) and a directory
+// traversal attempt, each sent by several client threads at once so that
+// connections overlap.
+//
+// Run with `meson test -C builddir --benchmark` or directly as
+// builddir/bench_connection [requests].
+
+#include "blockcache.hpp"
+#include "cache.hpp"
+#include "connection.hpp"
+#include "handler.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "ratelimit.hpp"
+#include "reader.hpp"
+#include "reaper.hpp"
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+namespace {
+
+constexpr int kClients = 8;
+
+// Accept and serve connections on the io_context, as listener() in main.cpp
+// does for an untracked (loopback) client.
+boost::asio::awaitable<void> accept_loop(tcp::acceptor &acceptor, Server &srv,
+                                         IdleReaper &reaper) {
+  for (;;) {
+    auto slot = srv.admission.try_reserve();
+    tcp::socket socket =
+        co_await acceptor.async_accept(boost::asio::deferred);
+    const auto accepted = std::chrono::steady_clock::now();
+    auto settings = srv.settings.get();
+    const auto address = socket.remote_endpoint().address();
+    boost::asio::co_spawn(
+        acceptor.get_executor(),
+        echo(std::move(socket), IpKey(address), AddressText(address), false,
+             accepted, std::move(*slot), settings, srv, reaper, nullptr),
+        boost::asio::detached);
+  }
+}
+
+// One finger request, answered and closed.
+void request(const tcp::endpoint &server, const std::string &line) {
+  boost::asio::io_context io;
+  tcp::socket socket(io);
+  socket.connect(server);
+  boost::asio::write(socket, boost::asio::buffer(line));
+  std::string reply;
+  boost::system::error_code ec;
+  boost::asio::read(socket, boost::asio::dynamic_buffer(reply), ec);
+}
+
+// requests of line, from kClients threads at once.
+void send_all(const tcp::endpoint &server, const std::string &line,
+              int requests) {
+  std::vector<std::thread> clients;
+  for (int c = 0; c < kClients; ++c) {
+    clients.emplace_back([&, c] {
+      for (int i = c; i < requests; i += kClients) {
+        request(server, line);
+      }
+    });
+  }
+  for (auto &t : clients) {
+    t.join();
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const int requests = argc > 1 ? std::atoi(argv[1]) : 4000;
+
+  const auto dir = std::filesystem::temp_directory_path() /
+                   ("finger_bench_connection_" + std::to_string(::getpid()));
+  std::filesystem::create_directories(dir);
+  std::ofstream(dir / "pete") << "Just another hacker.\n";
+
+  Settings defaults;
+  defaults.plan_dir = dir;
+  LiveSettings live(defaults);
+  const int devnull = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+  Logger log(devnull);
+  LogRateLimit drop_limit(20);
+  Metrics metrics;
+  SharedBanTracker bans;
+  AdmissionControl admission(defaults.admission);
+  LookupLimiter lookups(defaults.lookups);
+  RealFilesystemWrapper real_fs;
+  CachingFilesystemWrapper plans(real_fs, dir);
+  PlanReader reader(plans, real_fs, metrics.file_read_latency, 1);
+  Server srv{bans,    live,      plans,   log,    drop_limit,
+             metrics, admission, lookups, &reader};
+
+  boost::asio::io_context ctx(1);
+  auto work = boost::asio::make_work_guard(ctx);
+  IdleReaper reaper(defaults.request_timeout);
+  tcp::acceptor acceptor(ctx, tcp::endpoint(tcp::v4(), 0));
+  acceptor.listen(1024);
+  const tcp::endpoint server(boost::asio::ip::address_v4::loopback(),
+                             acceptor.local_endpoint().port());
+  boost::asio::co_spawn(ctx, accept_loop(acceptor, srv, reaper),
+                        boost::asio::detached);
+  std::thread serving([&ctx] { ctx.run(); });
+
+  // Run f on the serving thread and wait for it.
+  const auto on_server = [&ctx](auto f) {
+    std::packaged_task<decltype(f())()> task(std::move(f));
+    auto result = task.get_future();
+    boost::asio::post(ctx, [&task] { task(); });
+    return result.get();
+  };
+
+  struct Row {
+    const char *name;
+    std::string line;
+  };
+  const Row rows[] = {{"plan", "pete\r\n"},
+                      {"no plan", "nobody\r\n"},
+                      {"traversal", "../etc/passwd\r\n"}};
+
+  std::printf("connection allocations on the serving thread, per request "
+              "(%d requests, %d clients)\n",
+              requests, kClients);
+  std::printf("  %-12s %12s %14s %14s %12s\n", "request", "operator new",
+              "heap (off)", "heap (on)", "us/request");
+  for (const Row &row : rows) {
+    double per_request[2] = {};
+    double us = 0;
+    for (const bool cached : {false, true}) {
+      on_server([cached] {
+        cached ? ThreadBlockCache::enable() : ThreadBlockCache::disable();
+      });
+      send_all(server, row.line, requests / 4); // warm up
+      const auto before = on_server([] { return ThreadBlockCache::stats(); });
+      const auto start = std::chrono::steady_clock::now();
+      send_all(server, row.line, requests);
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      const auto after = on_server([] { return ThreadBlockCache::stats(); });
+      per_request[cached] =
+          static_cast<double>(after.heap - before.heap) / requests;
+      if (cached) {
+        us = std::chrono::duration<double, std::micro>(elapsed).count() /
+             requests;
+        std::printf("  %-12s %12.2f %14.2f %14.2f %12.1f\n", row.name,
+                    static_cast<double>(after.allocations -
+                                        before.allocations) /
+                        requests,
+                    per_request[0], per_request[1], us);
+      }
+    }
+  }
+
+  on_server([] { ThreadBlockCache::disable(); });
+  work.reset();
+  ctx.stop();
+  serving.join();
+  std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,224 @@
+#include "blockcache.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <sys/mman.h>
+
+namespace {
+
+constexpr std::size_t kGranule = ThreadBlockCache::kGranule;
+constexpr std::size_t kSizes = ThreadBlockCache::kMaxBlock / kGranule;
+constexpr std::size_t kRangeBytes = ThreadBlockCache::kRangeBytes;
+// The range is handed out a chunk at a time, each chunk to one thread and
+// one size.
+constexpr std::size_t kChunk = 64 * 1024;
+constexpr std::size_t kChunks = kRangeBytes / kChunk;
+
+struct FreeBlock {
+  FreeBlock *next;
+};
+
+// For the rare paths. Trivially destructible, like everything here, so that
+// operator new and delete can use it at any point in the program's life,
+// static destructors included.
+class SpinLock {
+public:
+  void lock() {
+    while (flag_.test_and_set(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+  void unlock() { flag_.clear(std::memory_order_release); }
+
+private:
+  std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+};
+
+// The range, reserved by the first enable(). A thread that frees a cached
+// block got it from a thread that had already reserved the range, so it
+// sees it set.
+std::atomic<std::uintptr_t> range{0};
+SpinLock reserving;
+std::atomic<std::size_t> chunks_carved{0};
+// Each chunk's block size in granules, set before its first block is handed
+// out.
+unsigned char chunk_granules[kChunks];
+
+// Blocks freed where they could not be cached.
+struct Shared {
+  SpinLock lock;
+  FreeBlock *free[kSizes];
+};
+Shared shared;
+
+struct Cache {
+  bool enabled;
+  FreeBlock *free[kSizes];
+  std::size_t count[kSizes];
+  // The rest of the chunk being carved for each size.
+  std::uintptr_t next[kSizes];
+  std::uintptr_t end[kSizes];
+  ThreadBlockCache::Stats stats;
+};
+
+thread_local Cache cache;
+
+bool reserve_range() {
+  std::lock_guard lock(reserving);
+  if (range.load(std::memory_order_relaxed)) {
+    return true;
+  }
+  // Address space only: chunks are made accessible as they are carved.
+  void *p = ::mmap(nullptr, kRangeBytes + kChunk, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  const auto at = reinterpret_cast<std::uintptr_t>(p);
+  range.store((at + kChunk - 1) & ~(kChunk - 1), std::memory_order_release);
+  return true;
+}
+
+// The index of p's chunk, or kChunks if p is not from the range.
+std::size_t chunk_of(const void *p) {
+  const std::uintptr_t begin = range.load(std::memory_order_relaxed);
+  const std::uintptr_t offset = reinterpret_cast<std::uintptr_t>(p) - begin;
+  return begin && offset < kRangeBytes ? offset / kChunk : kChunks;
+}
+
+void *carve(std::size_t granules) {
+  const std::size_t size = granules * kGranule;
+  std::uintptr_t &next = cache.next[granules - 1];
+  std::uintptr_t &end = cache.end[granules - 1];
+  if (end - next < size) {
+    const std::size_t chunk =
+        chunks_carved.fetch_add(1, std::memory_order_relaxed);
+    if (chunk >= kChunks) {
+      return nullptr;
+    }
+    const std::uintptr_t base =
+        range.load(std::memory_order_relaxed) + chunk * kChunk;
+    if (::mprotect(reinterpret_cast<void *>(base), kChunk,
+                   PROT_READ | PROT_WRITE) != 0) {
+      return nullptr;
+    }
+    chunk_granules[chunk] = static_cast<unsigned char>(granules);
+    next = base;
+    end = base + kChunk / size * size;
+  }
+  void *block = reinterpret_cast<void *>(next);
+  next += size;
+  return block;
+}
+
+void *take_shared(std::size_t granules) {
+  std::lock_guard lock(shared.lock);
+  FreeBlock *block = shared.free[granules - 1];
+  if (block) {
+    shared.free[granules - 1] = block->next;
+  }
+  return block;
+}
+
+void *allocate(std::size_t size) {
+  ++cache.stats.allocations;
+  if (cache.enabled && size <= ThreadBlockCache::kMaxBlock) {
+    const std::size_t granules =
+        size ? (size + kGranule - 1) / kGranule : 1;
+    if (FreeBlock *block = cache.free[granules - 1]) {
+      cache.free[granules - 1] = block->next;
+      --cache.count[granules - 1];
+      return block;
+    }
+    ++cache.stats.heap;
+    if (void *block = take_shared(granules)) {
+      return block;
+    }
+    if (void *block = carve(granules)) {
+      return block;
+    }
+  } else {
+    ++cache.stats.heap;
+  }
+  void *p;
+  while (!(p = std::malloc(size ? size : 1))) {
+    const std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+  return p;
+}
+
+void release(void *p) noexcept {
+  const std::size_t chunk = chunk_of(p);
+  if (chunk == kChunks) {
+    std::free(p);
+    return;
+  }
+  const std::size_t granules = chunk_granules[chunk];
+  auto *block = static_cast<FreeBlock *>(p);
+  if (cache.enabled && cache.count[granules - 1] * granules * kGranule <
+                           ThreadBlockCache::kMaxCachedBytes) {
+    block->next = cache.free[granules - 1];
+    cache.free[granules - 1] = block;
+    ++cache.count[granules - 1];
+    return;
+  }
+  std::lock_guard lock(shared.lock);
+  block->next = shared.free[granules - 1];
+  shared.free[granules - 1] = block;
+}
+
+} // namespace
+
+void ThreadBlockCache::enable() { cache.enabled = reserve_range(); }
+
+void ThreadBlockCache::disable() {
+  cache.enabled = false;
+  std::lock_guard lock(shared.lock);
+  for (std::size_t i = 0; i < kSizes; ++i) {
+    while (FreeBlock *block = cache.free[i]) {
+      cache.free[i] = block->next;
+      block->next = shared.free[i];
+      shared.free[i] = block;
+    }
+    cache.count[i] = 0;
+  }
+}
+
+ThreadBlockCache::Stats ThreadBlockCache::stats() { return cache.stats; }
+
+bool ThreadBlockCache::owns(const void *p) { return chunk_of(p) != kChunks; }
+
+void *operator new(std::size_t size) { return allocate(size); }
+void *operator new[](std::size_t size) { return allocate(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return allocate(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  try {
+    return allocate(size);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void operator delete(void *p) noexcept { release(p); }
+void operator delete[](void *p) noexcept { release(p); }
+void operator delete(void *p, std::size_t) noexcept { release(p); }
+void operator delete[](void *p, std::size_t) noexcept { release(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { release(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  release(p);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// ThreadBlockCache recycles small heap blocks on the io_context threads, so
+// that serving a connection does not go to malloc() in the steady state.
+//
+// Most of what a connection allocates is short-lived and the same shape
+// every time: its coroutine frame and those of the Asio operations it
+// awaits, and the async operation state. Asio recycles some of these itself,
+// but keeps at most a couple of blocks per thread and purpose, and none
+// over about 1K. Awaitable frames ignore associated allocators, so neither
+// an Asio nor a pmr allocator can reach them. Linking blockcache.cpp
+// therefore replaces the global operator new and delete.
+//
+// Only threads that have called enable() use the cache. There a block of up
+// to kMaxBlock bytes is rounded up to a multiple of kGranule and carved from
+// one address range reserved for the cache, in chunks that each hold blocks
+// of one size. A freed block goes onto the thread's free list for its size,
+// up to kMaxCachedBytes per size, and the next allocation of that size on
+// the same thread takes it back. Everything else, and every allocation on
+// the other threads, goes to malloc() at its own size with nothing added:
+// operator delete tells the two apart by address.
+//
+// Blocks may be freed on any thread. A cached block that the freeing thread
+// cannot keep goes onto a list shared by all threads, which the caches take
+// from before carving more. The range is never returned to the system, so
+// the cache holds on to its peak until the process exits.
+//
+// Only the daemon, its own tests and the allocation benchmark link it in;
+// the other tests use the plain allocator.
+class ThreadBlockCache {
+public:
+  static constexpr std::size_t kGranule = 64;
+  static constexpr std::size_t kMaxBlock = 4096;
+  static constexpr std::size_t kMaxCachedBytes = 64 * 1024;
+  // Address space reserved for cached blocks; only what is carved is backed.
+  static constexpr std::size_t kRangeBytes = std::size_t{1} << 30;
+
+  struct Stats {
+    std::uint64_t allocations = 0; // operator new calls
+    // Of those, the ones the thread's free lists could not serve.
+    std::uint64_t heap = 0;
+  };
+
+  // Start caching on the calling thread. Does nothing if the range cannot
+  // be reserved.
+  static void enable();
+  // Stop, and hand every block cached here to the shared lists. Call before
+  // the thread exits.
+  static void disable();
+
+  // The calling thread's counts, since it started.
+  static Stats stats();
+
+  // True if p came from the cache rather than malloc().
+  static bool owns(const void *p);
+};
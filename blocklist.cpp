@@ -0,0 +1,306 @@
+#include "blocklist.hpp"
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <cerrno>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+extern char **environ;
+
+FileBanSink::FileBanSink(std::filesystem::path path,
+                         std::chrono::milliseconds interval)
+    : path_(std::move(path)), interval_(interval) {
+  // Cleared before the daemon serves anything, so that no ban is left over
+  // from a previous run.
+  if (!write({})) {
+    ++failures_;
+  }
+  worker_ = std::thread([this] { run(); });
+}
+
+FileBanSink::~FileBanSink() {
+  {
+    std::lock_guard lock(mu_);
+    stop_ = true;
+  }
+  work_cv_.notify_one();
+  worker_.join();
+}
+
+void FileBanSink::ban(const BlockedNet &net, std::chrono::seconds) {
+  std::lock_guard lock(mu_);
+  if (nets_.insert(net).second) {
+    changed_locked();
+  }
+}
+
+void FileBanSink::unban(const BlockedNet &net) {
+  std::lock_guard lock(mu_);
+  if (nets_.erase(net) > 0) {
+    changed_locked();
+  }
+}
+
+void FileBanSink::changed_locked() {
+  ++changes_;
+  work_cv_.notify_one();
+}
+
+void FileBanSink::flush() {
+  std::unique_lock lock(mu_);
+  const std::uint64_t target = changes_;
+  hurry_ = true;
+  work_cv_.notify_one();
+  idle_cv_.wait(lock, [&] { return attempted_ >= target; });
+}
+
+std::size_t FileBanSink::size() const {
+  std::lock_guard lock(mu_);
+  return nets_.size();
+}
+
+std::uint64_t FileBanSink::failures() const {
+  std::lock_guard lock(mu_);
+  return failures_;
+}
+
+void FileBanSink::run() {
+  std::unique_lock lock(mu_);
+  auto next = std::chrono::steady_clock::now();
+  for (;;) {
+    work_cv_.wait(lock, [this] { return stop_ || changes_ != written_; });
+    if (stop_ && changes_ == attempted_) {
+      return;
+    }
+    // Let changes gather until an interval has passed since the last write.
+    work_cv_.wait_until(lock, next, [this] { return hurry_ || stop_; });
+    const std::uint64_t changes = changes_;
+    const std::vector<BlockedNet> nets(nets_.begin(), nets_.end());
+    lock.unlock();
+    const bool ok = write(nets);
+    lock.lock();
+    attempted_ = changes;
+    if (ok) {
+      written_ = changes;
+    } else {
+      ++failures_;
+    }
+    hurry_ = false;
+    next = std::chrono::steady_clock::now() + interval_;
+    idle_cv_.notify_all();
+  }
+}
+
+bool FileBanSink::write(const std::vector<BlockedNet> &nets) const {
+  // Write a sibling temp file and rename it over the list, so readers never
+  // see a half-written file.
+  std::filesystem::path tmp = path_;
+  tmp += ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    for (const auto &net : nets) {
+      out << net.to_string() << '\n';
+    }
+    out.close();
+    if (!out) {
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp, path_, ec);
+  return !ec;
+}
+
+CommandBanSink::CommandBanSink(BanCommand ban, UnbanCommand unban,
+                               std::vector<Argv> setup)
+    : ban_cmd_(std::move(ban)), unban_cmd_(std::move(unban)) {
+  for (auto &argv : setup) {
+    queue_.push_back(std::move(argv));
+  }
+  worker_ = std::thread([this] { run(); });
+}
+
+CommandBanSink::~CommandBanSink() {
+  {
+    std::lock_guard lock(mu_);
+    stop_ = true;
+  }
+  work_cv_.notify_one();
+  worker_.join();
+}
+
+void CommandBanSink::ban(const BlockedNet &net, std::chrono::seconds ttl) {
+  enqueue(ban_cmd_(net, ttl));
+}
+
+void CommandBanSink::unban(const BlockedNet &net) { enqueue(unban_cmd_(net)); }
+
+void CommandBanSink::enqueue(Argv argv) {
+  {
+    std::lock_guard lock(mu_);
+    if (queue_.size() >= kMaxQueued) {
+      ++dropped_;
+      return;
+    }
+    queue_.push_back(std::move(argv));
+  }
+  work_cv_.notify_one();
+}
+
+void CommandBanSink::flush() {
+  std::unique_lock lock(mu_);
+  idle_cv_.wait(lock, [this] { return queue_.empty() && !busy_; });
+}
+
+std::uint64_t CommandBanSink::dropped() const {
+  std::lock_guard lock(mu_);
+  return dropped_;
+}
+
+std::uint64_t CommandBanSink::failures() const {
+  std::lock_guard lock(mu_);
+  return failures_;
+}
+
+namespace {
+// Run argv to completion with stdin/stdout on /dev/null (stderr is left
+// alone so the tool's own diagnostics reach the daemon's log). True if it
+// exited with status 0.
+bool run_command(const CommandBanSink::Argv &argv) {
+  if (argv.empty()) {
+    return false;
+  }
+  std::vector<char *> args;
+  for (const auto &a : argv) {
+    args.push_back(const_cast<char *>(a.c_str()));
+  }
+  args.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+  pid_t pid;
+  const int rc =
+      posix_spawnp(&pid, args[0], &actions, nullptr, args.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (rc != 0) {
+    return false;
+  }
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+} // namespace
+
+void CommandBanSink::run() {
+  std::unique_lock lock(mu_);
+  for (;;) {
+    work_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return; // stop_ and nothing left to do
+    }
+    Argv argv = std::move(queue_.front());
+    queue_.pop_front();
+    busy_ = true;
+    lock.unlock();
+    const bool ok = run_command(argv);
+    lock.lock();
+    busy_ = false;
+    if (!ok) {
+      ++failures_;
+    }
+    if (queue_.empty()) {
+      idle_cv_.notify_all();
+    }
+  }
+}
+
+std::unique_ptr<CommandBanSink> make_nft_sink(const std::string &family,
+                                              const std::string &table,
+                                              const std::string &set) {
+  // nftables sets are typed, so IPv6 goes to a sibling set.
+  auto element = [=](const BlockedNet &net, const std::string &extra = "") {
+    return " element " + family + " " + table + " " +
+           (net.is_v4() ? set : set + "6") + " { " + net.to_string() + extra +
+           " }";
+  };
+  // `add element` leaves an existing element's timeout alone, and `delete
+  // element` fails on one the kernel has already expired. Adding the bare
+  // element first makes the delete safe, and one nft run applies the batch
+  // atomically.
+  auto withdraw = [=](const BlockedNet &net) {
+    return "add" + element(net) + "; delete" + element(net);
+  };
+  return std::make_unique<CommandBanSink>(
+      [=](const BlockedNet &net, std::chrono::seconds ttl) {
+        return CommandBanSink::Argv{
+            "nft", withdraw(net) + "; add" +
+                       element(net, " timeout " +
+                                        std::to_string(ttl.count()) + "s")};
+      },
+      [=](const BlockedNet &net) {
+        return CommandBanSink::Argv{"nft", withdraw(net)};
+      },
+      std::vector<CommandBanSink::Argv>{
+          {"nft", "flush", "set", family, table, set},
+          {"nft", "flush", "set", family, table, set + "6"}});
+}
+
+std::unique_ptr<CommandBanSink> make_pf_sink(const std::string &table) {
+  return std::make_unique<CommandBanSink>(
+      [=](const BlockedNet &net, std::chrono::seconds) {
+        return CommandBanSink::Argv{"pfctl", "-q", "-t", table,
+                                    "-T",    "add", net.to_string()};
+      },
+      [=](const BlockedNet &net) {
+        return CommandBanSink::Argv{"pfctl", "-q",     "-t", table,
+                                    "-T",    "delete", net.to_string()};
+      },
+      std::vector<CommandBanSink::Argv>{
+          {"pfctl", "-q", "-t", table, "-T", "flush"}});
+}
+
+std::unique_ptr<BanSink> make_ban_sink(std::string_view spec) {
+  std::vector<std::string> parts;
+  std::size_t start = 0;
+  for (;;) {
+    const std::size_t colon = spec.find(':', start);
+    parts.emplace_back(spec.substr(start, colon - start));
+    if (colon == std::string_view::npos) {
+      break;
+    }
+    start = colon + 1;
+  }
+  auto all_set = [&] {
+    for (const auto &p : parts) {
+      if (p.empty()) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  if (parts[0] == "file" && parts.size() >= 2) {
+    // Paths may contain colons; take everything after "file:".
+    const std::string_view path = spec.substr(5);
+    if (!path.empty()) {
+      return std::make_unique<FileBanSink>(std::filesystem::path(path));
+    }
+  } else if (parts[0] == "nft" && parts.size() == 4 && all_set()) {
+    return make_nft_sink(parts[1], parts[2], parts[3]);
+  } else if (parts[0] == "pf" && parts.size() == 2 && all_set()) {
+    return make_pf_sink(parts[1]);
+  }
+  throw std::invalid_argument("unrecognised ban sink '" + std::string(spec) +
+                              "' (expected file:PATH, nft:FAMILY:TABLE:SET "
+                              "or pf:TABLE)");
+}
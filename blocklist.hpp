@@ -0,0 +1,157 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ban.hpp"
+
+// BanSink receives SharedBanTracker's ban transitions so that something
+// outside the daemon -- normally the host firewall -- can drop banned clients
+// before their connections ever reach userspace. Calls arrive from whichever
+// io_context thread recorded the offense (or ran the sweep), so
+// implementations must be thread-safe and must not block.
+class BanSink {
+public:
+  virtual ~BanSink() = default;
+  // net became blocked and stays blocked for at least ttl.
+  virtual void ban(const BlockedNet &net, std::chrono::seconds ttl) = 0;
+  // net's block has lapsed.
+  virtual void unban(const BlockedNet &net) = 0;
+  // Transitions that did not reach the firewall.
+  virtual std::uint64_t failures() const { return 0; }
+};
+
+// FileBanSink keeps the current blocklist in a text file, one CIDR per line,
+// replaced atomically (write + rename). It is the stand-in used by the
+// tests, and also works as a pf table source:
+//   table <finger_banned> persist file "/var/db/fingerd/banned"
+// reloaded with `pfctl -t finger_banned -T replace -f ...`.
+// ban() and unban() only update the list in memory; a background thread
+// writes it out, at most once per interval, so a flood of bans costs one
+// rewrite per interval rather than one per ban.
+class FileBanSink : public BanSink {
+public:
+  // Starts from an empty list, overwriting anything left at path.
+  explicit FileBanSink(std::filesystem::path path,
+                       std::chrono::milliseconds interval =
+                           std::chrono::seconds(1));
+  // Writes out any change still pending, then stops the writer.
+  ~FileBanSink() override;
+
+  FileBanSink(const FileBanSink &) = delete;
+  FileBanSink &operator=(const FileBanSink &) = delete;
+
+  void ban(const BlockedNet &net, std::chrono::seconds ttl) override;
+  void unban(const BlockedNet &net) override;
+
+  // Block until every change made so far has been written out, or has
+  // failed to be (a failed write is retried an interval later).
+  void flush();
+
+  std::size_t size() const;
+  std::uint64_t failures() const override; // writes that did not land
+
+private:
+  void changed_locked();
+  void run();
+  bool write(const std::vector<BlockedNet> &nets) const;
+
+  const std::filesystem::path path_;
+  const std::chrono::milliseconds interval_;
+  mutable std::mutex mu_;
+  std::condition_variable work_cv_;
+  std::condition_variable idle_cv_;
+  std::set<BlockedNet> nets_;
+  // Changes to nets_ so far, and as of the last write tried and the last
+  // one that landed.
+  std::uint64_t changes_ = 0;
+  std::uint64_t attempted_ = 0;
+  std::uint64_t written_ = 0;
+  bool hurry_ = false; // flush() is waiting
+  bool stop_ = false;
+  std::uint64_t failures_ = 0;
+  std::thread worker_;
+};
+
+// CommandBanSink runs one external command per transition (e.g. `nft add
+// element ...`). Commands are queued and run one at a time on a background
+// thread, so a slow or wedged firewall tool never stalls the daemon; if the
+// queue fills up, further transitions are dropped and counted rather than
+// waited on. The in-process ban checks still cover anything dropped.
+class CommandBanSink : public BanSink {
+public:
+  using Argv = std::vector<std::string>;
+  using BanCommand =
+      std::function<Argv(const BlockedNet &net, std::chrono::seconds ttl)>;
+  using UnbanCommand = std::function<Argv(const BlockedNet &net)>;
+
+  static constexpr std::size_t kMaxQueued = 4096;
+
+  // `setup` commands (e.g. flushing the set left by a previous run) are
+  // queued before anything else.
+  CommandBanSink(BanCommand ban, UnbanCommand unban,
+                 std::vector<Argv> setup = {});
+  // Runs whatever is still queued, then stops the worker.
+  ~CommandBanSink() override;
+
+  CommandBanSink(const CommandBanSink &) = delete;
+  CommandBanSink &operator=(const CommandBanSink &) = delete;
+
+  void ban(const BlockedNet &net, std::chrono::seconds ttl) override;
+  void unban(const BlockedNet &net) override;
+
+  // Block until every queued command has finished.
+  void flush();
+
+  std::uint64_t dropped() const; // transitions lost to a full queue
+  // Commands that could not run or exited non-zero.
+  std::uint64_t failures() const override;
+
+private:
+  void enqueue(Argv argv);
+  void run();
+
+  BanCommand ban_cmd_;
+  UnbanCommand unban_cmd_;
+  mutable std::mutex mu_;
+  std::condition_variable work_cv_;
+  std::condition_variable idle_cv_;
+  std::deque<Argv> queue_;
+  bool busy_ = false;
+  bool stop_ = false;
+  std::uint64_t dropped_ = 0;
+  std::uint64_t failures_ = 0;
+  std::thread worker_;
+};
+
+// nftables: maintain elements of an existing set with per-element timeouts,
+// e.g. `inet filter finger_banned` for IPv4 plus `finger_banned6` for IPv6.
+// Both sets need `flags interval, timeout` so prefixes and expiry work.
+// Each transition is one nft batch that replaces the element, so a repeat
+// ban refreshes its timeout and an unban after it expired is not an error.
+std::unique_ptr<CommandBanSink> make_nft_sink(const std::string &family,
+                                              const std::string &table,
+                                              const std::string &set);
+
+// pf: maintain a persistent table (pf tables have no per-entry expiry, so
+// unbans come from the daemon's sweep).
+std::unique_ptr<CommandBanSink> make_pf_sink(const std::string &table);
+
+// Build the sink named by a FINGER_BAN_SINK value:
+//   file:/path/to/list
+//   nft:FAMILY:TABLE:SET      (e.g. nft:inet:filter:finger_banned)
+//   pf:TABLE                  (e.g. pf:finger_banned)
+// Throws std::invalid_argument for anything else.
+std::unique_ptr<BanSink> make_ban_sink(std::string_view spec);
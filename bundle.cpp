@@ -0,0 +1,463 @@
+#include "bundle.hpp"
+#include "hash.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_set>
+
+namespace {
+
+constexpr char kMagic[8] = {'F', 'N', 'G', 'R', 'P', 'L', 'A', 'N'};
+constexpr std::uint32_t kVersion = 1;
+
+struct Header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t entries;
+  std::uint32_t buckets;
+  std::uint32_t slots;
+  std::uint64_t seed;
+  std::uint64_t size;
+};
+static_assert(sizeof(Header) == 40);
+
+struct Slot {
+  std::uint64_t name_off;
+  std::uint64_t body_off;
+  std::uint32_t name_len;
+  std::uint32_t body_len;
+};
+static_assert(sizeof(Slot) == 24);
+
+// Plans per bucket on average, and slots per plan. A little slack in the
+// table keeps the displacement search for the last buckets short.
+constexpr std::size_t kBucketLoad = 4;
+constexpr double kSlotsPerEntry = 1.25;
+// Displacements tried per bucket before starting over with a new seed.
+constexpr std::uint32_t kMaxDisplacement = 1u << 20;
+
+std::uint64_t hash_name(std::string_view name, std::uint64_t seed) {
+  std::uint64_t h = 0xcbf29ce484222325ull ^ seed; // FNV-1a
+  for (const unsigned char c : name) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return mix64(h);
+}
+
+std::uint32_t bucket_of(std::uint64_t h, std::uint32_t buckets) {
+  return static_cast<std::uint32_t>((h >> 32) % buckets);
+}
+
+std::uint32_t slot_of(std::uint64_t h, std::uint32_t displacement,
+                      std::uint32_t slots) {
+  return static_cast<std::uint32_t>(
+      mix64(h ^ (displacement * 0x9e3779b97f4a7c15ull)) % slots);
+}
+
+std::size_t align8(std::size_t n) { return (n + 7) & ~std::size_t{7}; }
+
+PlanBundle::FileId id_of(const struct stat &st) {
+  return {static_cast<std::uint64_t>(st.st_dev),
+          static_cast<std::uint64_t>(st.st_ino),
+          static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+              st.st_mtim.tv_nsec,
+          static_cast<std::int64_t>(st.st_size)};
+}
+
+std::system_error errno_error(const std::string &what,
+                              const std::filesystem::path &path) {
+  return std::system_error(errno, std::generic_category(),
+                           what + " " + path.string());
+}
+
+// Find a displacement for every bucket such that all names land in distinct
+// slots. Returns false if some bucket cannot be placed with this seed.
+bool place(const std::vector<std::uint64_t> &hashes, std::uint32_t nbuckets,
+           std::uint32_t nslots, std::vector<std::uint32_t> &displacement,
+           std::vector<std::int64_t> &slot_entry) {
+  std::vector<std::vector<std::uint32_t>> buckets(nbuckets);
+  for (std::uint32_t i = 0; i < hashes.size(); ++i) {
+    buckets[bucket_of(hashes[i], nbuckets)].push_back(i);
+  }
+  // Largest buckets first, while the table is emptiest.
+  std::vector<std::uint32_t> order(nbuckets);
+  for (std::uint32_t b = 0; b < nbuckets; ++b) {
+    order[b] = b;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](auto a, auto b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  displacement.assign(nbuckets, 0);
+  slot_entry.assign(nslots, -1);
+  std::vector<std::uint32_t> taken;
+  for (const std::uint32_t b : order) {
+    if (buckets[b].empty()) {
+      break;
+    }
+    bool placed = false;
+    for (std::uint32_t d = 0; d < kMaxDisplacement && !placed; ++d) {
+      taken.clear();
+      placed = true;
+      for (const std::uint32_t i : buckets[b]) {
+        const std::uint32_t s = slot_of(hashes[i], d, nslots);
+        if (slot_entry[s] >= 0 ||
+            std::find(taken.begin(), taken.end(), s) != taken.end()) {
+          placed = false;
+          break;
+        }
+        taken.push_back(s);
+      }
+      if (placed) {
+        displacement[b] = d;
+        for (std::size_t k = 0; k < taken.size(); ++k) {
+          slot_entry[taken[k]] = buckets[b][k];
+        }
+      }
+    }
+    if (!placed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+std::vector<PlanEntry> collect_plans(const std::filesystem::path &dir,
+                                     const IFilesystemWrapper &fs) {
+  std::vector<PlanEntry> plans;
+  for (const auto &de : std::filesystem::directory_iterator(dir)) {
+    std::string name = de.path().filename().string();
+    const bool lower = std::none_of(name.begin(), name.end(), [](char c) {
+      return std::isupper(static_cast<unsigned char>(c));
+    });
+    if (!lower || !de.is_regular_file()) {
+      continue;
+    }
+    std::string body = fs.read_file(de.path());
+    if (!body.empty()) {
+      plans.push_back(PlanEntry{std::move(name), std::move(body)});
+    }
+  }
+  std::sort(plans.begin(), plans.end(),
+            [](const auto &a, const auto &b) { return a.name < b.name; });
+  return plans;
+}
+
+std::size_t write_plan_bundle(const std::vector<PlanEntry> &plans,
+                              const std::filesystem::path &path) {
+  std::unordered_set<std::string_view> names;
+  for (const auto &e : plans) {
+    if (!names.insert(e.name).second) {
+      throw std::invalid_argument("duplicate plan name '" + e.name + "'");
+    }
+    if (e.name.empty() ||
+        e.body.size() > std::numeric_limits<std::uint32_t>::max()) {
+      throw std::invalid_argument("plan name empty or body too large");
+    }
+  }
+
+  const auto n = static_cast<std::uint32_t>(plans.size());
+  const std::uint32_t nbuckets =
+      std::max<std::uint32_t>(1, (n + kBucketLoad - 1) / kBucketLoad);
+  const std::uint32_t nslots = std::max<std::uint32_t>(
+      1, static_cast<std::uint32_t>(n * kSlotsPerEntry));
+  std::uint64_t seed = 0;
+  std::vector<std::uint64_t> hashes(n);
+  std::vector<std::uint32_t> displacement;
+  std::vector<std::int64_t> slot_entry;
+  for (;; ++seed) {
+    for (std::uint32_t i = 0; i < n; ++i) {
+      hashes[i] = hash_name(plans[i].name, seed);
+    }
+    if (place(hashes, nbuckets, nslots, displacement, slot_entry)) {
+      break;
+    }
+    if (seed == 64) {
+      throw std::runtime_error("cannot build a perfect hash for the plans");
+    }
+  }
+
+  const std::size_t slots_off =
+      align8(sizeof(Header) + nbuckets * sizeof(std::uint32_t));
+  const std::size_t data_off = slots_off + nslots * sizeof(Slot);
+  std::vector<char> buf(data_off);
+  std::memcpy(buf.data() + sizeof(Header), displacement.data(),
+              nbuckets * sizeof(std::uint32_t));
+  for (std::uint32_t s = 0; s < nslots; ++s) {
+    Slot slot{};
+    if (slot_entry[s] >= 0) {
+      const PlanEntry &e = plans[static_cast<std::size_t>(slot_entry[s])];
+      slot.name_off = buf.size();
+      slot.name_len = static_cast<std::uint32_t>(e.name.size());
+      buf.insert(buf.end(), e.name.begin(), e.name.end());
+      slot.body_off = buf.size();
+      slot.body_len = static_cast<std::uint32_t>(e.body.size());
+      buf.insert(buf.end(), e.body.begin(), e.body.end());
+    }
+    std::memcpy(buf.data() + slots_off + s * sizeof(Slot), &slot, sizeof slot);
+  }
+
+  Header h{};
+  std::memcpy(h.magic, kMagic, sizeof h.magic);
+  h.version = kVersion;
+  h.entries = n;
+  h.buckets = nbuckets;
+  h.slots = nslots;
+  h.seed = seed;
+  h.size = buf.size();
+  std::memcpy(buf.data(), &h, sizeof h);
+
+  std::filesystem::path tmp = path;
+  tmp += ".tmp";
+  const int fd =
+      ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw errno_error("cannot create", tmp);
+  }
+  for (std::size_t off = 0; off < buf.size();) {
+    const ssize_t w = ::write(fd, buf.data() + off, buf.size() - off);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w < 0) {
+      const auto err = errno_error("cannot write", tmp);
+      ::close(fd);
+      ::unlink(tmp.c_str());
+      throw err;
+    }
+    off += static_cast<std::size_t>(w);
+  }
+  if (::fsync(fd) < 0 || ::close(fd) < 0) {
+    const auto err = errno_error("cannot write", tmp);
+    ::unlink(tmp.c_str());
+    throw err;
+  }
+  // A running daemon has the old bundle mapped; renaming over it leaves
+  // that mapping intact.
+  if (::rename(tmp.c_str(), path.c_str()) < 0) {
+    const auto err = errno_error("cannot replace", path);
+    ::unlink(tmp.c_str());
+    throw err;
+  }
+  return buf.size();
+}
+
+std::shared_ptr<const PlanBundle>
+PlanBundle::open(const std::filesystem::path &path) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw errno_error("cannot open", path);
+  }
+  struct stat st;
+  if (::fstat(fd, &st) < 0) {
+    const auto err = errno_error("cannot stat", path);
+    ::close(fd);
+    throw err;
+  }
+  const auto size = static_cast<std::size_t>(st.st_size);
+  if (size < sizeof(Header)) {
+    ::close(fd);
+    throw std::runtime_error(path.string() + ": not a plan bundle");
+  }
+  void *p = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd); // the mapping keeps the file
+  if (p == MAP_FAILED) {
+    throw errno_error("cannot map", path);
+  }
+  std::shared_ptr<PlanBundle> b(new PlanBundle);
+  b->data_ = static_cast<const char *>(p);
+  b->size_ = size;
+  b->id_ = id_of(st);
+
+  Header h;
+  std::memcpy(&h, b->data_, sizeof h);
+  if (std::memcmp(h.magic, kMagic, sizeof kMagic) != 0 ||
+      h.version != kVersion) {
+    throw std::runtime_error(path.string() + ": not a plan bundle");
+  }
+  const std::size_t slots_off =
+      align8(sizeof(Header) + std::size_t{h.buckets} * sizeof(std::uint32_t));
+  if (h.size != size || h.buckets == 0 || h.slots == 0 ||
+      slots_off + std::size_t{h.slots} * sizeof(Slot) > size) {
+    throw std::runtime_error(path.string() + ": truncated");
+  }
+  // Check every slot up front, so find() never has to.
+  std::uint32_t used = 0;
+  for (std::uint32_t s = 0; s < h.slots; ++s) {
+    Slot slot;
+    std::memcpy(&slot, b->data_ + slots_off + s * sizeof(Slot), sizeof slot);
+    if (slot.name_len == 0) {
+      continue;
+    }
+    ++used;
+    if (slot.name_off > size || slot.name_len > size - slot.name_off ||
+        slot.body_off > size || slot.body_len > size - slot.body_off) {
+      throw std::runtime_error(path.string() + ": truncated");
+    }
+  }
+  if (used != h.entries) {
+    throw std::runtime_error(path.string() + ": corrupt index");
+  }
+  b->entries_ = h.entries;
+  b->buckets_ = h.buckets;
+  b->slots_ = h.slots;
+  b->seed_ = h.seed;
+  b->slots_off_ = slots_off;
+  return b;
+}
+
+PlanBundle::~PlanBundle() {
+  if (data_) {
+    ::munmap(const_cast<char *>(data_), size_);
+  }
+}
+
+std::optional<std::string_view> PlanBundle::find(std::string_view name) const {
+  const std::uint64_t h = hash_name(name, seed_);
+  std::uint32_t d;
+  std::memcpy(&d,
+              data_ + sizeof(Header) + bucket_of(h, buckets_) * sizeof(d),
+              sizeof d);
+  Slot slot;
+  std::memcpy(&slot, data_ + slots_off_ + slot_of(h, d, slots_) * sizeof(Slot),
+              sizeof slot);
+  if (slot.name_len == 0 ||
+      std::string_view(data_ + slot.name_off, slot.name_len) != name) {
+    return std::nullopt;
+  }
+  return std::string_view(data_ + slot.body_off, slot.body_len);
+}
+
+BundleFilesystemWrapper::BundleFilesystemWrapper(
+    const std::filesystem::path &bundle, const std::filesystem::path &dir)
+    // See CachingFilesystemWrapper: strips any trailing separator.
+    : path_(bundle), dir_((dir / "").parent_path()),
+      bundle_(PlanBundle::open(bundle)) {
+#ifdef __linux__
+  // Watch the directory rather than the file: a rename replaces the file,
+  // and a watch on it would follow the old inode.
+  const int fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd >= 0) {
+    std::filesystem::path parent = path_.parent_path();
+    if (parent.empty()) {
+      parent = ".";
+    }
+    if (::inotify_add_watch(fd, parent.c_str(),
+                            IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+      ::close(fd);
+    } else {
+      watch_fd_ = fd;
+    }
+  }
+#endif
+}
+
+BundleFilesystemWrapper::~BundleFilesystemWrapper() {
+  if (watch_fd_ >= 0) {
+    ::close(watch_fd_);
+  }
+}
+
+std::shared_ptr<const PlanBundle> BundleFilesystemWrapper::current() const {
+  std::lock_guard lock(mu_);
+  return bundle_;
+}
+
+std::string
+BundleFilesystemWrapper::key_for(const std::filesystem::path &path) const {
+  if (path.parent_path() != dir_) {
+    return {};
+  }
+  return path.filename().string();
+}
+
+bool BundleFilesystemWrapper::exists(const std::filesystem::path &path) const {
+  const std::string name = key_for(path);
+  return !name.empty() && current()->find(name).has_value();
+}
+
+std::string
+BundleFilesystemWrapper::read_file(const std::filesystem::path &path) const {
+  return std::string(read_plan(path).view());
+}
+
+PlanBody
+BundleFilesystemWrapper::read_plan(const std::filesystem::path &path) const {
+  const std::string name = key_for(path);
+  if (name.empty()) {
+    return {};
+  }
+  auto bundle = current();
+  const auto body = bundle->find(name);
+  if (!body) {
+    return {};
+  }
+  // The body points into the mapping, which lives as long as the bundle.
+  return PlanBody(std::move(bundle), *body);
+}
+
+void BundleFilesystemWrapper::reload() {
+  auto fresh = PlanBundle::open(path_);
+  std::lock_guard lock(mu_);
+  bundle_ = std::move(fresh);
+}
+
+bool BundleFilesystemWrapper::reload_if_changed() {
+  struct stat st;
+  if (::stat(path_.c_str(), &st) < 0) {
+    // Gone for now (e.g. mid-replace); keep serving the current bundle.
+    return false;
+  }
+  if (current()->file_id() == id_of(st)) {
+    return false;
+  }
+  reload();
+  return true;
+}
+
+bool BundleFilesystemWrapper::process_events() {
+  bool changed = false;
+#ifdef __linux__
+  if (watch_fd_ < 0) {
+    return false;
+  }
+  const std::string name = path_.filename().string();
+  alignas(struct inotify_event) char buf[4096];
+  for (;;) {
+    const ssize_t len = ::read(watch_fd_, buf, sizeof buf);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      break;
+    }
+    for (char *p = buf; p < buf + len;) {
+      const auto *ev = reinterpret_cast<const struct inotify_event *>(p);
+      if ((ev->mask & IN_Q_OVERFLOW) || (ev->len > 0 && name == ev->name)) {
+        changed = true;
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+#endif
+  return changed;
+}
+
+std::size_t BundleFilesystemWrapper::size() const { return current()->size(); }
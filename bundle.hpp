@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "handler.hpp"
+
+// Plan bundles: every plan in the users directory packed into one file, built
+// ahead of time by finger_bundle and mapped by the daemon, so a lookup is one
+// hash probe into memory instead of a path resolution, stat and read.
+//
+// A bundle is a flat file in host byte order:
+//
+//   header   magic "FNGRPLAN", u32 version, u32 entry count, u32 bucket
+//            count, u32 slot count, u64 hash seed, u64 file size
+//   buckets  u32 displacement per bucket (padded to 8 bytes)
+//   slots    u64 name offset, u64 body offset, u32 name length, u32 body
+//            length; an empty slot has name length 0
+//   data     names and bodies, referenced by offset from the file start
+//
+// The index is a hash-and-displace perfect hash over lower-cased names: a
+// name's hash picks a bucket, and the bucket's displacement picks its slot,
+// chosen at build time so that no two names share one. Lookups still compare
+// the stored name, so names not in the bundle are misses. Bodies are stored
+// exactly as RealFilesystemWrapper::read_file() returns them (CRLF-terminated)
+// and are written to clients straight from the mapping.
+
+struct PlanEntry {
+  std::string name; // lower-case, as looked up
+  std::string body; // as sent on the wire
+};
+
+// Read every servable plan in dir through fs: regular files with a
+// lower-case name (process() never looks up any other) and a non-empty body.
+// Sorted by name.
+std::vector<PlanEntry> collect_plans(const std::filesystem::path &dir,
+                                     const IFilesystemWrapper &fs);
+
+// Write plans as a bundle to path, atomically (a sibling temp file renamed
+// over it). Returns the file size; throws std::system_error on I/O failure
+// and std::invalid_argument for duplicate names.
+std::size_t write_plan_bundle(const std::vector<PlanEntry> &plans,
+                              const std::filesystem::path &path);
+
+// A mapped, validated bundle. Immutable; shared by every connection writing
+// one of its bodies, and unmapped when the last of them lets go.
+class PlanBundle {
+public:
+  // Throws std::runtime_error for a file that is not a bundle or is
+  // truncated, and std::system_error if it cannot be read.
+  static std::shared_ptr<const PlanBundle>
+  open(const std::filesystem::path &path);
+
+  ~PlanBundle();
+  PlanBundle(const PlanBundle &) = delete;
+  PlanBundle &operator=(const PlanBundle &) = delete;
+
+  // The body stored for name (already lower-case), if any.
+  std::optional<std::string_view> find(std::string_view name) const;
+
+  std::size_t size() const { return entries_; }
+
+  // Identity of the file this was mapped from, to tell when it is replaced.
+  struct FileId {
+    std::uint64_t dev = 0, ino = 0;
+    std::int64_t mtime_ns = 0, size = 0;
+    bool operator==(const FileId &) const = default;
+  };
+  const FileId &file_id() const { return id_; }
+
+private:
+  PlanBundle() = default;
+
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+  std::uint32_t entries_ = 0;
+  std::uint32_t buckets_ = 0;
+  std::uint32_t slots_ = 0;
+  std::uint64_t seed_ = 0;
+  std::size_t slots_off_ = 0;
+  FileId id_;
+};
+
+// Serves plans for one directory (normally kPATH) from a bundle instead of
+// the filesystem. The bundle is authoritative: a name it does not hold is a
+// miss even if a file has appeared since it was built. Paths outside the
+// directory never exist.
+//
+// The mapped bundle can be replaced while serving: reload() maps the file
+// again and swaps it in atomically, and connections still writing bodies
+// from the old one keep it mapped until they finish. Replace the file by
+// renaming a new one over it (finger_bundle does) -- truncating a mapped
+// file in place crashes the daemon. On Linux, watch_fd() is an inotify
+// descriptor on the bundle's directory and process_events() reports when the
+// bundle was renamed into place or rewritten; elsewhere, poll
+// reload_if_changed().
+class BundleFilesystemWrapper : public IFilesystemWrapper {
+public:
+  // Maps bundle; throws like PlanBundle::open().
+  BundleFilesystemWrapper(const std::filesystem::path &bundle,
+                          const std::filesystem::path &dir);
+  ~BundleFilesystemWrapper() override;
+
+  BundleFilesystemWrapper(const BundleFilesystemWrapper &) = delete;
+  BundleFilesystemWrapper &operator=(const BundleFilesystemWrapper &) = delete;
+
+  bool exists(const std::filesystem::path &path) const override;
+  std::string read_file(const std::filesystem::path &path) const override;
+  PlanBody read_plan(const std::filesystem::path &path) const override;
+
+  // Map the bundle file again and swap it in. On failure the current bundle
+  // stays in service and the error is thrown as by PlanBundle::open().
+  void reload();
+  // reload() if the file has been replaced or modified since it was mapped.
+  // Returns whether it did.
+  bool reload_if_changed();
+
+  int watch_fd() const { return watch_fd_; }
+  // Drain pending change notifications without blocking. Returns whether any
+  // concerned the bundle file.
+  bool process_events();
+
+  // Plans in the bundle currently being served.
+  std::size_t size() const;
+
+private:
+  std::shared_ptr<const PlanBundle> current() const;
+  std::string key_for(const std::filesystem::path &path) const;
+
+  std::filesystem::path path_;
+  std::filesystem::path dir_;
+  int watch_fd_ = -1;
+
+  // Only held to copy or swap the pointer.
+  mutable std::mutex mu_;
+  std::shared_ptr<const PlanBundle> bundle_;
+};
@@ -0,0 +1,288 @@
+#include "cache.hpp"
+
+#include <string_view>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <cerrno>
+#include <sys/inotify.h>
+
+namespace {
+constexpr std::uint32_t kWatchMask = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE |
+                                     IN_ATTRIB | IN_DELETE | IN_MOVED_FROM |
+                                     IN_MOVED_TO | IN_DELETE_SELF |
+                                     IN_MOVE_SELF;
+} // namespace
+#endif
+
+CachingFilesystemWrapper::CachingFilesystemWrapper(
+    const IFilesystemWrapper &backing, const std::filesystem::path &dir,
+    Options opts)
+    // Appending an empty component and taking the parent strips any trailing
+    // separator, so "/var/finger/users/" and "/var/finger/users" compare equal
+    // to the parent_path() of the paths process() builds.
+    : backing_(backing), dir_((dir / "").parent_path()), opts_(opts) {
+#ifdef __linux__
+  const int fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd >= 0) {
+    wd_ = ::inotify_add_watch(fd, dir_.c_str(), kWatchMask);
+    if (wd_ < 0) {
+      ::close(fd);
+    } else {
+      watch_fd_ = fd;
+    }
+  }
+#endif
+}
+
+CachingFilesystemWrapper::~CachingFilesystemWrapper() {
+  if (watch_fd_ >= 0) {
+    ::close(watch_fd_);
+  }
+}
+
+std::string
+CachingFilesystemWrapper::key_for(const std::filesystem::path &path) const {
+  if (path.parent_path() != dir_) {
+    return {};
+  }
+  return path.filename().string();
+}
+
+std::optional<const CachingFilesystemWrapper::Entry *>
+CachingFilesystemWrapper::probe(const std::string &name,
+                                clock::time_point now) const {
+  // Without change notifications, entries are only trusted for opts_.ttl.
+  const bool expiring = watch_fd_ < 0;
+
+  if (auto it = plans_.find(name); it != plans_.end()) {
+    if (!expiring || now - it->second.loaded < opts_.ttl) {
+      ++stats_.hits;
+      return &it->second;
+    }
+    plans_.erase(it);
+  } else if (auto neg = negative_.find(name); neg != negative_.end()) {
+    if (!expiring || now - neg->second < opts_.ttl) {
+      ++stats_.negative_hits;
+      return nullptr;
+    }
+    negative_.erase(neg);
+  }
+  return std::nullopt;
+}
+
+void CachingFilesystemWrapper::remember_miss(const std::string &name,
+                                             clock::time_point now) const {
+  if (negative_.size() >= opts_.max_negative) {
+    negative_.clear();
+  }
+  negative_.emplace(name, now);
+}
+
+const CachingFilesystemWrapper::Entry *
+CachingFilesystemWrapper::lookup(const std::string &name,
+                                 const std::filesystem::path &path) const {
+  const auto now = clock::now();
+  if (const auto hit = probe(name, now)) {
+    return *hit;
+  }
+
+  ++stats_.misses;
+  if (!backing_.exists(path)) {
+    remember_miss(name, now);
+    return nullptr;
+  }
+  auto [it, inserted] =
+      plans_.insert_or_assign(name, Entry{backing_.read_plan(path), now});
+  return &it->second;
+}
+
+std::optional<PlanBody>
+CachingFilesystemWrapper::find(const std::filesystem::path &path,
+                               std::uint64_t &generation) const {
+  std::lock_guard lock(mu_);
+  generation = generation_;
+  const std::string name = key_for(path);
+  if (name.empty()) {
+    return std::nullopt;
+  }
+  if (const auto hit = probe(name, clock::now())) {
+    return *hit ? (*hit)->content : PlanBody();
+  }
+  return std::nullopt;
+}
+
+std::optional<PlanBody>
+CachingFilesystemWrapper::find(const std::filesystem::path &dir,
+                               const std::string &name,
+                               std::uint64_t &generation) const {
+  // dir_ has no trailing separator; compare without dir's either.
+  std::string_view asked = dir.native();
+  while (asked.size() > 1 && asked.back() == '/') {
+    asked.remove_suffix(1);
+  }
+  std::lock_guard lock(mu_);
+  generation = generation_;
+  if (asked != dir_.native()) {
+    return std::nullopt;
+  }
+  if (const auto hit = probe(name, clock::now())) {
+    return *hit ? (*hit)->content : PlanBody();
+  }
+  return std::nullopt;
+}
+
+PlanBody CachingFilesystemWrapper::store(const std::filesystem::path &path,
+                                         std::optional<PlanBody> content,
+                                         std::uint64_t generation) const {
+  const bool found = content.has_value();
+  PlanBody body = found ? std::move(*content) : PlanBody();
+  std::lock_guard lock(mu_);
+  const std::string name = key_for(path);
+  if (name.empty()) {
+    return body;
+  }
+  ++stats_.misses;
+  // Something in the directory changed while the file was being read, so
+  // what was read may already be stale; the next lookup reads it again.
+  if (generation != generation_) {
+    return body;
+  }
+  const auto now = clock::now();
+  if (found) {
+    plans_.insert_or_assign(name, Entry{body, now});
+  } else {
+    remember_miss(name, now);
+  }
+  return body;
+}
+
+bool CachingFilesystemWrapper::exists(const std::filesystem::path &path) const {
+  std::unique_lock lock(mu_);
+  const std::string name = key_for(path);
+  if (name.empty()) {
+    lock.unlock();
+    return backing_.exists(path);
+  }
+  return lookup(name, path) != nullptr;
+}
+
+std::string
+CachingFilesystemWrapper::read_file(const std::filesystem::path &path) const {
+  return std::string(read_plan(path).view());
+}
+
+PlanBody
+CachingFilesystemWrapper::read_plan(const std::filesystem::path &path) const {
+  std::unique_lock lock(mu_);
+  const std::string name = key_for(path);
+  if (name.empty()) {
+    lock.unlock();
+    return backing_.read_plan(path);
+  }
+  // process() always calls exists() first, so this is normally a plain map
+  // hit; fall back to a full lookup (without double-counting) otherwise.
+  if (auto it = plans_.find(name); it != plans_.end()) {
+    return it->second.content;
+  }
+  const Entry *entry = lookup(name, path);
+  return entry ? entry->content : PlanBody();
+}
+
+std::size_t CachingFilesystemWrapper::evict(const std::string &name) {
+  ++generation_;
+  const std::size_t n = plans_.erase(name) + negative_.erase(name);
+  stats_.evictions += n;
+  return n;
+}
+
+void CachingFilesystemWrapper::set_dir(const std::filesystem::path &dir) {
+  std::lock_guard lock(mu_);
+  const std::filesystem::path next = (dir / "").parent_path();
+  if (next == dir_) {
+    return;
+  }
+  dir_ = next;
+  clear_locked();
+#ifdef __linux__
+  if (watch_fd_ >= 0) {
+    // Events still queued for the old watch carry its descriptor, and
+    // process_events() skips them.
+    ::inotify_rm_watch(watch_fd_, wd_);
+    wd_ = ::inotify_add_watch(watch_fd_, dir_.c_str(), kWatchMask);
+    if (wd_ < 0) {
+      ::close(watch_fd_);
+      watch_fd_ = -1;
+    }
+  }
+#endif
+}
+
+void CachingFilesystemWrapper::clear() {
+  std::lock_guard lock(mu_);
+  clear_locked();
+}
+
+CachingFilesystemWrapper::Stats CachingFilesystemWrapper::stats() const {
+  std::lock_guard lock(mu_);
+  return stats_;
+}
+
+std::size_t CachingFilesystemWrapper::cached() const {
+  std::lock_guard lock(mu_);
+  return plans_.size() + negative_.size();
+}
+
+void CachingFilesystemWrapper::clear_locked() {
+  ++generation_;
+  stats_.evictions += plans_.size() + negative_.size();
+  plans_.clear();
+  negative_.clear();
+}
+
+std::size_t CachingFilesystemWrapper::process_events() {
+  std::size_t evicted = 0;
+#ifdef __linux__
+  std::lock_guard lock(mu_);
+  if (watch_fd_ < 0) {
+    return 0;
+  }
+  alignas(struct inotify_event) char buf[4096];
+  bool lost = false;
+  while (!lost) {
+    const ssize_t len = ::read(watch_fd_, buf, sizeof buf);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      // EAGAIN: queue drained. Anything else leaves the watch unusable.
+      lost = len < 0 && errno != EAGAIN;
+      break;
+    }
+    for (char *p = buf; p < buf + len;) {
+      const auto *ev = reinterpret_cast<const struct inotify_event *>(p);
+      if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were dropped, so any entry might be stale.
+        evicted += plans_.size() + negative_.size();
+        clear_locked();
+      } else if (ev->wd != wd_) {
+        // From the directory before the last set_dir().
+      } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        lost = true;
+      } else if (ev->len > 0) {
+        evicted += evict(ev->name);
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  if (lost) {
+    // The directory itself went away or the watch broke: stop trusting the
+    // cache and fall back to TTL expiry from here on.
+    ::close(watch_fd_);
+    watch_fd_ = -1;
+    evicted += plans_.size() + negative_.size();
+    clear_locked();
+  }
+#endif
+  return evicted;
+}
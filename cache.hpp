@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "handler.hpp"
+
+// CachingFilesystemWrapper sits in front of another IFilesystemWrapper and
+// keeps plan bodies for one directory (normally kPATH) in memory, so repeat
+// lookups of the same few popular plans never touch the disk. Bodies are
+// stored exactly as the backing wrapper returned them (i.e. already
+// CRLF-terminated) and read_plan() hands out the stored body itself, so a hit
+// is written to the socket without being copied; lookups of names with no plan are cached too,
+// so scanners guessing usernames do not cost an exists() syscall each.
+//
+// Invalidation is driven by inotify on Linux: every create, write, delete or
+// rename in the directory evicts that name, and the next lookup reloads it.
+// The daemon registers watch_fd() with its io_context and calls
+// process_events() when it becomes readable, so the lookup path itself never
+// makes a syscall. Where inotify is unavailable (e.g. FreeBSD) entries instead
+// expire after Options::ttl. Changes to the target of a symlinked plan are not
+// seen by inotify and are only picked up once the link itself changes.
+//
+// Paths outside the cached directory are passed straight through to the
+// backing wrapper, and set_dir() moves the cache to another directory. The
+// cache is shared by every io_context thread, so all access goes through one
+// mutex; it is only held for a map probe on the hit path (a miss through
+// exists() or read_plan() reads the backing file under it; the daemon reads
+// outside it, with find() and store()).
+class CachingFilesystemWrapper : public IFilesystemWrapper {
+public:
+  using clock = std::chrono::steady_clock;
+
+  struct Options {
+    // Cap on remembered misses. Scanners can ask for an unbounded number of
+    // distinct names, so once the cap is hit the negative cache is simply
+    // cleared and refilled.
+    std::size_t max_negative = 4096;
+    // Entry lifetime when change notifications are unavailable.
+    clock::duration ttl = std::chrono::seconds(5);
+  };
+
+  struct Stats {
+    std::uint64_t hits = 0;          // lookups answered with a cached plan
+    std::uint64_t negative_hits = 0; // lookups answered with a cached miss
+    std::uint64_t misses = 0;        // lookups that went to the backing fs
+    std::uint64_t evictions = 0;     // entries dropped by change events
+  };
+
+  CachingFilesystemWrapper(const IFilesystemWrapper &backing,
+                           const std::filesystem::path &dir)
+      : CachingFilesystemWrapper(backing, dir, Options{}) {}
+  CachingFilesystemWrapper(const IFilesystemWrapper &backing,
+                           const std::filesystem::path &dir, Options opts);
+  ~CachingFilesystemWrapper() override;
+
+  CachingFilesystemWrapper(const CachingFilesystemWrapper &) = delete;
+  CachingFilesystemWrapper &operator=(const CachingFilesystemWrapper &) = delete;
+
+  bool exists(const std::filesystem::path &path) const override;
+  std::string read_file(const std::filesystem::path &path) const override;
+  PlanBody read_plan(const std::filesystem::path &path) const override;
+
+  // A lookup split in two, for callers that read plan files themselves
+  // (off the calling thread, see reader.hpp). find() returns the cached body
+  // for path (empty for a cached miss), or nullopt if the file has to be
+  // read; store() then caches what was read, as read_plan() returns it
+  // (nullopt: no such file), and returns the body to serve. generation, set
+  // by find(), lets store() skip caching a read that a change event may have
+  // overtaken.
+  std::optional<PlanBody> find(const std::filesystem::path &path,
+                               std::uint64_t &generation) const;
+  // find(dir / name), for a name from resolve_plan_name(), without building
+  // the path.
+  std::optional<PlanBody> find(const std::filesystem::path &dir,
+                               const std::string &name,
+                               std::uint64_t &generation) const;
+  PlanBody store(const std::filesystem::path &path,
+                 std::optional<PlanBody> content,
+                 std::uint64_t generation) const;
+
+  // inotify descriptor to poll for readability, or -1 when change
+  // notifications are unavailable and the TTL fallback is in use.
+  int watch_fd() const { return watch_fd_; }
+
+  // Drain pending change notifications without blocking, evicting every name
+  // they mention. Returns the number of entries evicted.
+  std::size_t process_events();
+
+  // Cache a different directory instead, forgetting everything. The
+  // inotify watch moves with it; if the new directory cannot be watched the
+  // cache falls back to TTL expiry.
+  void set_dir(const std::filesystem::path &dir);
+
+  // Forget everything (e.g. after losing the directory watch).
+  void clear();
+
+  Stats stats() const;
+  std::size_t cached() const;
+
+private:
+  struct Entry {
+    // Shared with any connection still writing it, so evicting an entry
+    // never invalidates a response in flight.
+    PlanBody content;
+    clock::time_point loaded;
+  };
+
+  // Name of the cached entry for path, or empty if path is not directly
+  // inside the cached directory. Called with mu_ held.
+  std::string key_for(const std::filesystem::path &path) const;
+  // The cached entry for name, dropping it if it has expired: a plan, nullptr
+  // for a cached miss, or nullopt if there is none. Counts the hit.
+  std::optional<const Entry *> probe(const std::string &name,
+                                     clock::time_point now) const;
+  // Remember that name has no plan file.
+  void remember_miss(const std::string &name, clock::time_point now) const;
+  // Look name up, loading it from the backing wrapper on a miss. Returns the
+  // cached plan or nullptr for a (possibly cached) miss.
+  const Entry *lookup(const std::string &name,
+                      const std::filesystem::path &path) const;
+  std::size_t evict(const std::string &name);
+  void clear_locked();
+
+  const IFilesystemWrapper &backing_;
+  std::filesystem::path dir_;
+  Options opts_;
+  std::atomic<int> watch_fd_{-1};
+  int wd_ = -1; // the directory's inotify watch
+
+  mutable std::mutex mu_;
+  mutable std::unordered_map<std::string, Entry> plans_;
+  mutable std::unordered_map<std::string, clock::time_point> negative_;
+  mutable Stats stats_;
+  // Bumped by every change event and clear, for store().
+  std::uint64_t generation_ = 0;
+};
@@ -0,0 +1,176 @@
+#include "config.hpp"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+namespace {
+
+std::string_view trim(std::string_view s) {
+  const std::size_t a = s.find_first_not_of(" \t\r\n");
+  if (a == std::string_view::npos) {
+    return {};
+  }
+  const std::size_t b = s.find_last_not_of(" \t\r\n");
+  return s.substr(a, b - a + 1);
+}
+
+[[noreturn]] void bad(std::string_view key, std::string_view value) {
+  throw std::invalid_argument("bad " + std::string(key) + " '" +
+                              std::string(value) + "'");
+}
+
+std::size_t parse_count(std::string_view key, std::string_view value) {
+  const std::string text(value);
+  char *end = nullptr;
+  errno = 0;
+  const unsigned long long n = std::strtoull(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || text[0] == '-' || errno == ERANGE) {
+    bad(key, value);
+  }
+  return static_cast<std::size_t>(n);
+}
+
+double parse_rate(std::string_view key, std::string_view value) {
+  const std::string text(value);
+  char *end = nullptr;
+  const double r = std::strtod(text.c_str(), &end);
+  if (text.empty() || *end != '\0' || !(r >= 0)) {
+    bad(key, value);
+  }
+  return r;
+}
+
+// "90", "90s", "15m", "24h" or "2d"; at least a second.
+std::chrono::seconds parse_duration(std::string_view key,
+                                    std::string_view value) {
+  static constexpr std::string_view kSuffixes = "smhd";
+  static constexpr long long kUnits[] = {1, 60, 3600, 86400};
+  std::string_view digits = value;
+  long long unit = 1;
+  if (const std::size_t u =
+          value.empty() ? std::string_view::npos : kSuffixes.find(value.back());
+      u != std::string_view::npos) {
+    unit = kUnits[u];
+    digits.remove_suffix(1);
+  }
+  const std::size_t n = parse_count(key, digits);
+  if (n == 0 || n > 365 * 86400 / static_cast<std::size_t>(unit)) {
+    bad(key, value);
+  }
+  return std::chrono::seconds(static_cast<long long>(n) * unit);
+}
+
+} // namespace
+
+void apply_setting(Settings &s, std::string_view key, std::string_view value) {
+  if (key == "ban_threshold") {
+    const std::size_t n = parse_count(key, value);
+    if (n > static_cast<std::size_t>(BanTracker::kMaxThreshold)) {
+      bad(key, value);
+    }
+    s.ban.threshold = static_cast<int>(n);
+  } else if (key == "ban_window") {
+    // Prefixes are counted over the same window as addresses.
+    s.ban.window = parse_duration(key, value);
+    s.subnet.window = s.ban.window;
+  } else if (key == "subnet_threshold") {
+    const std::size_t n = parse_count(key, value);
+    if (n > static_cast<std::size_t>(BanTracker::kMaxThreshold)) {
+      bad(key, value);
+    }
+    s.subnet.threshold = static_cast<int>(n);
+  } else if (key == "ban_allowlist") {
+    s.allowlist = parse_ip_allowlist(value);
+  } else if (key == "plan_dir") {
+    const std::filesystem::path dir(value);
+    if (!dir.is_absolute()) {
+      bad(key, value);
+    }
+    s.plan_dir = dir;
+  } else if (key == "max_connections") {
+    s.admission.max_connections = parse_count(key, value);
+  } else if (key == "max_per_ip") {
+    s.admission.max_per_ip = parse_count(key, value);
+  } else if (key == "accept_rate") {
+    s.accept_rate = parse_rate(key, value);
+  } else if (key == "lookup_rate") {
+    s.lookups.rate = parse_rate(key, value);
+  } else if (key == "lookup_burst") {
+    s.lookups.burst = parse_rate(key, value);
+  } else if (key == "request_timeout") {
+    s.request_timeout = parse_duration(key, value);
+  } else {
+    throw std::invalid_argument("unknown setting '" + std::string(key) + "'");
+  }
+}
+
+Settings settings_from_env() {
+  static constexpr const char *kKeys[] = {
+      "ban_threshold", "ban_window",      "subnet_threshold",
+      "ban_allowlist", "plan_dir",        "max_connections",
+      "max_per_ip",    "accept_rate",     "lookup_rate",
+      "lookup_burst",  "request_timeout"};
+  Settings s;
+  for (const char *key : kKeys) {
+    std::string name = "FINGER_";
+    for (const char *c = key; *c; ++c) {
+      name += static_cast<char>(std::toupper(static_cast<unsigned char>(*c)));
+    }
+    if (const char *env = std::getenv(name.c_str()); env && *env) {
+      try {
+        apply_setting(s, key, env);
+      } catch (const std::invalid_argument &) {
+        throw std::invalid_argument("bad " + name + " '" + env + "'");
+      }
+    }
+  }
+  return s;
+}
+
+Settings parse_settings(std::string_view text, Settings base) {
+  std::size_t line_no = 0;
+  while (!text.empty()) {
+    ++line_no;
+    const std::size_t nl = text.find('\n');
+    std::string_view line = text.substr(0, nl);
+    text.remove_prefix(nl == std::string_view::npos ? text.size() : nl + 1);
+    if (const std::size_t hash = line.find('#');
+        hash != std::string_view::npos) {
+      line = line.substr(0, hash);
+    }
+    line = trim(line);
+    if (line.empty()) {
+      continue;
+    }
+    try {
+      const std::size_t eq = line.find('=');
+      if (eq == std::string_view::npos) {
+        throw std::invalid_argument("expected key = value");
+      }
+      apply_setting(base, trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+    } catch (const std::invalid_argument &e) {
+      throw std::invalid_argument("line " + std::to_string(line_no) + ": " +
+                                  e.what());
+    }
+  }
+  return base;
+}
+
+Settings load_settings(const std::filesystem::path &path, Settings base) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::system_error(errno, std::generic_category(), path.string());
+  }
+  std::ostringstream text;
+  text << in.rdbuf();
+  try {
+    return parse_settings(text.str(), std::move(base));
+  } catch (const std::invalid_argument &e) {
+    throw std::invalid_argument(path.string() + ": " + e.what());
+  }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "admission.hpp"
+#include "ban.hpp"
+#include "handler.hpp"
+#include "ratelimit.hpp"
+
+// The settings that can be changed while the daemon runs.
+//
+// Each one is read at startup from a FINGER_* environment variable. The
+// config file named by FINGER_CONFIG, if there is one, is read over them, and
+// is read again on SIGHUP. The result is swapped in whole, so one connection
+// never sees half of one reload and half of another. Settings that need a
+// restart (the port, thread count, log format, ban sink, ban memory and ban
+// state file) stay environment-only.
+//
+// The file holds "key = value" lines, and '#' starts a comment. A key is its
+// environment variable's name without FINGER_, in lower case:
+//
+//   ban_threshold = 5
+//   ban_window = 12h
+//   ban_allowlist = 203.0.113.10, 2001:db8::10
+struct Settings {
+  BanTracker::Config ban;                   // ban_threshold, ban_window
+  SubnetTracker::Config subnet;             // subnet_threshold
+  IpAllowlist allowlist; // ban_allowlist
+  std::filesystem::path plan_dir = kPATH;   // plan_dir
+  AdmissionControl::Config admission;       // max_connections, max_per_ip
+  double accept_rate = 1000;                // accept_rate, per second
+  LookupLimiter::Config lookups;            // lookup_rate, lookup_burst
+  std::chrono::seconds request_timeout{10}; // request_timeout
+};
+
+// Set key to value in s. Durations take an s, m, h or d suffix (plain
+// numbers are seconds). Throws std::invalid_argument for an unknown key or a
+// bad value.
+void apply_setting(Settings &s, std::string_view key, std::string_view value);
+
+// The defaults, with every FINGER_* variable that is set applied.
+Settings settings_from_env();
+
+// base with the lines of a config file applied. Throws std::invalid_argument
+// naming the line for a bad one, before anything is applied.
+Settings parse_settings(std::string_view text, Settings base);
+
+// parse_settings() on the file at path; also throws std::system_error if it
+// cannot be read.
+Settings load_settings(const std::filesystem::path &path, Settings base);
+
+// The settings in force, shared by every io_context thread. Readers take a
+// snapshot and keep it for as long as they need a consistent view (a
+// connection holds one for its whole life); set() swaps in a new one without
+// disturbing them.
+class LiveSettings {
+public:
+  explicit LiveSettings(Settings s)
+      : current_(std::make_shared<const Settings>(std::move(s))) {}
+
+  std::shared_ptr<const Settings> get() const {
+    std::lock_guard lock(mu_);
+    return current_;
+  }
+
+  void set(Settings s) {
+    auto next = std::make_shared<const Settings>(std::move(s));
+    std::lock_guard lock(mu_);
+    current_.swap(next);
+  }
+
+private:
+  mutable std::mutex mu_;
+  std::shared_ptr<const Settings> current_;
+};
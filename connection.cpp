@@ -0,0 +1,232 @@
+#include "connection.hpp"
+
+#include <boost/asio/as_tuple.hpp>
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/write.hpp>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include "handler.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "ratelimit.hpp"
+#include "reader.hpp"
+#include "reaper.hpp"
+#include "request.hpp"
+#include "uring.hpp"
+
+using boost::asio::awaitable;
+using boost::asio::deferred;
+using boost::asio::ip::tcp;
+
+namespace {
+
+constexpr std::string_view kNoPlan = "No plan found\r\n";
+// Wording suggested by RFC 1288.
+constexpr std::string_view kNoUserList = "Finger online user list denied\r\n";
+constexpr std::string_view kNoForwarding = "Finger forwarding service denied\r\n";
+constexpr std::string_view kThrottled = "Too many requests, try again later\r\n";
+
+} // namespace
+
+awaitable<void> echo(tcp::socket socket, IpKey client, AddressText address,
+                     bool trackable,
+                     std::chrono::steady_clock::time_point accepted,
+                     [[maybe_unused]] AdmissionControl::Slot slot,
+                     std::shared_ptr<const Settings> settings, Server &srv,
+                     IdleReaper &reaper, IoUring *ring) {
+  auto &[bans, live, fs, log, drop_limit, metrics, admission, lookups,
+         plans] = srv;
+  const std::string_view client_addr = address.view();
+  try {
+    auto now = std::chrono::steady_clock::now();
+
+    // An IP that has racked up too many failed lookups (scanners, username
+    // guessers, non-finger junk) is dropped without being read or answered.
+    // Only globally-routable addresses are tracked: behind Docker's bridge
+    // every client is SNAT'd to the gateway, so banning there would block
+    // everyone at once (see is_bannable_address()).
+    // A blocked scanner can open connections far faster than anyone reads
+    // the log, so drop lines are rate-limited.
+    if (trackable && bans.is_blocked(client, now)) {
+      metrics.blocked_drops.inc();
+      if (std::uint64_t suppressed; drop_limit.allow(now, suppressed)) {
+        log.log("finger drop", {{"client", client_addr},
+                                {"reason", "blocked"},
+                                {"suppressed", suppressed}});
+      }
+      co_return;
+    }
+
+    // Read one request line (RFC 1288: it ends in CRLF), however many
+    // segments it arrives in. The reaper closes the socket if the whole line
+    // is not in within the request timeout, so a client that connects and
+    // sends nothing, or trickles bytes, cannot hold the connection open.
+    const auto idle = reaper.add(socket, now);
+    RequestFramer framer;
+    auto status = RequestFramer::Status::need_more;
+    Protocol proto = Protocol::finger;
+    while (status == RequestFramer::Status::need_more) {
+      const auto space = framer.space();
+      auto [read_ec, bytes_read] = co_await socket.async_read_some(
+          boost::asio::buffer(space.data(), space.size()),
+          boost::asio::as_tuple(deferred));
+      if (idle.timed_out()) {
+        metrics.timeouts.inc();
+        const std::int64_t received = framer.buffered().size();
+        if (trackable) {
+          auto res = bans.record_offense(client, now);
+          log.log("finger timeout", {{"client", client_addr},
+                                     {"received", received},
+                                     {"failures", res.count},
+                                     {"blocked", res.blocked},
+                                     {"prefix_blocked", res.prefix_blocked}});
+        } else {
+          log.log("finger timeout", {{"client", client_addr},
+                                     {"received", received},
+                                     {"tracked", false}});
+        }
+        co_return;
+      }
+      if (read_ec) {
+        // Some clients half-close instead of ending the line.
+        if (read_ec == boost::asio::error::eof &&
+            framer.finish() == RequestFramer::Status::complete) {
+          break;
+        }
+        // Client hung up before sending a request: health checks (which
+        // connect and immediately close), port scanners, and reset
+        // connections all land here. This is normal -- don't log it as an
+        // exception.
+        co_return;
+      }
+      status = framer.commit(bytes_read);
+      proto = status == RequestFramer::Status::overlong
+                  ? Protocol::overlong
+                  : classify_protocol(framer.buffered());
+      if (proto != Protocol::finger) {
+        break;
+      }
+    }
+    // HTTP, TLS, SIP and SSH probes, binary garbage and over-long lines are
+    // not finger requests: close them unanswered and count the offense
+    // straight away, without a lookup.
+    if (proto != Protocol::finger) {
+      metrics.rejected[static_cast<std::size_t>(proto)].inc();
+      if (trackable) {
+        auto res = bans.record_offense(client, now);
+        log.log("finger reject", {{"client", client_addr},
+                                  {"protocol", protocol_name(proto)},
+                                  {"failures", res.count},
+                                  {"blocked", res.blocked},
+                                  {"prefix_blocked", res.prefix_blocked}});
+      } else {
+        log.log("finger reject", {{"client", client_addr},
+                                  {"protocol", protocol_name(proto)},
+                                  {"tracked", false}});
+      }
+      co_return;
+    }
+
+    // "/W" only asks for more detail, and a plan is all there is to give.
+    // RFC 1288 lets a server decline to list its users (an empty query, as
+    // sent by `finger @host`) and to forward queries to other hosts. Listing
+    // is an ordinary thing to ask, so it is refused without an offense;
+    // forwarding is only ever relay probing, and counts.
+    const FingerQuery query = parse_query(framer.line());
+    if (!query.host.empty() || query.user.empty()) {
+      metrics.refused.inc();
+      const bool forward = !query.host.empty();
+      if (forward && trackable) {
+        auto res = bans.record_offense(client, now);
+        log.log("finger refused", {{"client", client_addr},
+                                   {"query", "forward"},
+                                   {"host", query.host},
+                                   {"failures", res.count},
+                                   {"blocked", res.blocked},
+                                   {"prefix_blocked", res.prefix_blocked}});
+      } else {
+        log.log("finger refused",
+                {{"client", client_addr},
+                 {"query", forward ? "forward" : "list"}});
+      }
+      co_await async_write(socket,
+                           boost::asio::buffer(forward ? kNoForwarding
+                                                       : kNoUserList),
+                           boost::asio::as_tuple(deferred));
+      metrics.request_latency.record(std::chrono::steady_clock::now() -
+                                     accepted);
+      co_return;
+    }
+    // Lookups are rate limited per address too, so that nobody can hammer
+    // even a real plan. Over the limit the client gets a short refusal
+    // without a lookup. It is not an offense: an eager client is not a
+    // scanner, and BanTracker already sees every failed lookup.
+    if (trackable && !lookups.allow(client, now)) {
+      metrics.throttled.inc();
+      if (std::uint64_t suppressed; drop_limit.allow(now, suppressed)) {
+        log.log("finger throttled", {{"client", client_addr},
+                                     {"suppressed", suppressed}});
+      }
+      co_await async_write(socket, boost::asio::buffer(kThrottled),
+                           boost::asio::as_tuple(deferred));
+      metrics.request_latency.record(std::chrono::steady_clock::now() -
+                                     accepted);
+      co_return;
+    }
+    // A view of the request line, which outlives every use below.
+    const std::string_view username = query.user;
+    log.log("finger request", {{"client", client_addr}, {"user", username}});
+    // The reply body is shared with the plan cache; holding it here keeps it
+    // alive for the write even if the plan is evicted meanwhile. Cache hits
+    // are answered straight away; a miss is read off this thread (see
+    // reader.hpp), through ring if there is one. Plans from a bundle are in
+    // memory, and looked up in place.
+    std::optional<Reply> settled =
+        plans ? plans->try_finger(username, settings->plan_dir)
+              : finger(username, fs, settings->plan_dir);
+    if (!settled) {
+      settled = co_await plans->finger(username, settings->plan_dir, ring);
+    }
+    const Reply &reply = *settled;
+
+    // A "failure" is simply any request that does not resolve to a readable
+    // plan file: an unknown user, rejected input, or non-finger junk. Each
+    // failure is timestamped against the client IP; once an IP exceeds the
+    // threshold within the rolling window, the is_blocked() check above starts
+    // dropping its connections. This also frustrates username guessing.
+    const bool invalid = reply.kind == Reply::Kind::invalid;
+    const bool plan_served = reply.kind == Reply::Kind::plan;
+    (invalid ? metrics.invalid_input
+             : plan_served ? metrics.plan_hits : metrics.misses)
+        .inc();
+    if (!plan_served) {
+      if (trackable) {
+        auto res = bans.record_offense(client, now);
+        log.log("finger miss", {{"client", client_addr},
+                                {"user", username},
+                                {"failures", res.count},
+                                {"blocked", res.blocked},
+                                {"prefix_blocked", res.prefix_blocked}});
+      } else {
+        log.log("finger miss", {{"client", client_addr},
+                                {"user", username},
+                                {"tracked", false}});
+      }
+      // Best-effort reply; ignore write errors (the client may have already
+      // gone away).
+      co_await async_write(socket, boost::asio::buffer(kNoPlan),
+                           boost::asio::as_tuple(deferred));
+      metrics.request_latency.record(std::chrono::steady_clock::now() -
+                                     accepted);
+      co_return;
+    }
+    co_await async_write(socket, boost::asio::buffer(reply.body.view()),
+                         boost::asio::as_tuple(deferred));
+    metrics.request_latency.record(std::chrono::steady_clock::now() - accepted);
+    co_return;
+  } catch (std::exception &e) {
+    log.log("echo exception", {{"error", e.what()}});
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+#include "admission.hpp"
+#include "ban.hpp"
+#include "config.hpp"
+
+class IFilesystemWrapper;
+class IdleReaper;
+class IoUring;
+class LogRateLimit;
+class Logger;
+class LookupLimiter;
+class Metrics;
+class PlanReader;
+
+// Everything a connection needs that is shared across io_context threads.
+// All of it is thread-safe.
+struct Server {
+  SharedBanTracker &bans;
+  const LiveSettings &settings;
+  const IFilesystemWrapper &fs;
+  Logger &log;
+  LogRateLimit &drop_limit;
+  Metrics &metrics;
+  AdmissionControl &admission;
+  LookupLimiter &lookups;
+  // Plan lookups in the users directory, or null when plans come from a
+  // bundle (which is in memory, and looked up in place).
+  PlanReader *plans;
+};
+
+// Serve one connection: read its request line, answer it and close it. slot
+// is its admission slot, held until it returns, settings the configuration
+// it was accepted under, reaper its io_context's request deadlines, and ring
+// its io_context's io_uring (or null). client is tracked for bans only if
+// trackable.
+boost::asio::awaitable<void>
+echo(boost::asio::ip::tcp::socket socket, IpKey client,
+     AddressText client_addr, bool trackable,
+     std::chrono::steady_clock::time_point accepted,
+     AdmissionControl::Slot slot, std::shared_ptr<const Settings> settings,
+     Server &srv, IdleReaper &reaper, IoUring *ring);
@@ -0,0 +1,472 @@
+// finger_bench: load generator for a running finger daemon.
+//
+// Keeps --concurrency connections in flight against --target for --duration
+// seconds. Each request is drawn from a weighted mix of traffic classes:
+//
+//   hit        a lookup of --hit-user, which must have a plan
+//   miss       a lookup of a name with no plan
+//   traversal  a directory-traversal attempt (rejected as InvalidInput)
+//   banned     a miss from a source address that has already been banned
+//
+// Hits, misses and traversals come from the loopback address, which the
+// daemon never tracks, so they can run forever without getting banned. Banned
+// traffic needs globally routable source addresses on this host; put a block
+// from the benchmarking range on the loopback interface first, e.g.
+//
+//   Linux:    ip addr add 198.18.0.0/24 dev lo
+//   FreeBSD:  ifconfig lo0 alias 198.18.0.1/32  (one per address)
+//
+// Before the timed run, each of the --banned-sources addresses starting at
+// --banned-base is banned by sending it --ban-threshold + 1 misses.
+//
+// Results go to stdout as one JSON object (throughput, plus latency
+// percentiles per class from connect to the daemon closing the connection)
+// so they can be collected and compared across builds; a short human summary
+// goes to stderr.
+//
+// Example, against an unprivileged instance:
+//   FINGER_PORT=7979 FINGER_THREADS=auto builddir/finger &
+//   builddir/finger_bench --target 127.0.0.1:7979 --duration 10
+//       --concurrency 2000 --mix hit=70,miss=20,traversal=5,banned=5
+// (one command line)
+
+#include <boost/asio/as_tuple.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using boost::asio::awaitable;
+using boost::asio::co_spawn;
+using boost::asio::deferred;
+using boost::asio::detached;
+using boost::asio::ip::tcp;
+namespace this_coro = boost::asio::this_coro;
+using clock_type = std::chrono::steady_clock;
+
+namespace {
+
+enum Class { kHit, kMiss, kTraversal, kBanned, kClasses };
+constexpr std::array<const char *, kClasses> kClassNames = {
+    "hit", "miss", "traversal", "banned"};
+
+struct Options {
+  tcp::endpoint target{boost::asio::ip::make_address("127.0.0.1"), 79};
+  double duration = 10;
+  int concurrency = 1000;
+  int threads = 1;
+  std::array<int, kClasses> mix = {70, 20, 5, 5};
+  std::string hit_user = "pete";
+  boost::asio::ip::address_v4 banned_base =
+      boost::asio::ip::make_address_v4("198.18.0.1");
+  int banned_sources = 16;
+  int ban_threshold = 3;
+  std::chrono::milliseconds timeout{5000};
+};
+
+// How a request ended.
+enum Outcome {
+  kAnswered, // got a response and then EOF
+  kDropped,  // closed without a response (what a banned client sees)
+  kFailed,   // connect/IO error or timeout
+};
+
+struct Sample {
+  std::uint32_t us;
+  std::uint8_t cls;
+  std::uint8_t outcome;
+};
+
+// One entry per request, per thread; merged after the run.
+struct Results {
+  std::vector<Sample> samples;
+};
+
+[[noreturn]] void usage(const char *why) {
+  std::fprintf(stderr,
+               "finger_bench: %s\n"
+               "usage: finger_bench [--target HOST:PORT] [--duration SECONDS]\n"
+               "         [--concurrency N] [--threads N]\n"
+               "         [--mix hit=W,miss=W,traversal=W,banned=W]\n"
+               "         [--hit-user NAME] [--banned-base ADDR]\n"
+               "         [--banned-sources N] [--ban-threshold N]\n"
+               "         [--timeout-ms N]\n",
+               why);
+  std::exit(2);
+}
+
+tcp::endpoint parse_endpoint(std::string_view s) {
+  const auto colon = s.rfind(':');
+  if (colon == std::string_view::npos) {
+    usage("target must be HOST:PORT");
+  }
+  std::string host(s.substr(0, colon));
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+  boost::system::error_code ec;
+  const auto addr = boost::asio::ip::make_address(host, ec);
+  const long port = std::strtol(std::string(s.substr(colon + 1)).c_str(),
+                                nullptr, 10);
+  if (ec || port <= 0 || port > 65535) {
+    usage("bad target address");
+  }
+  return {addr, static_cast<unsigned short>(port)};
+}
+
+std::array<int, kClasses> parse_mix(std::string_view s) {
+  std::array<int, kClasses> mix{};
+  while (!s.empty()) {
+    const auto comma = s.find(',');
+    const std::string_view item = s.substr(0, comma);
+    s = comma == std::string_view::npos ? "" : s.substr(comma + 1);
+    const auto eq = item.find('=');
+    const std::string_view name = item.substr(0, eq);
+    const auto it = std::find(kClassNames.begin(), kClassNames.end(), name);
+    if (eq == std::string_view::npos || it == kClassNames.end()) {
+      usage("bad --mix entry");
+    }
+    mix[it - kClassNames.begin()] =
+        std::max(0, std::atoi(std::string(item.substr(eq + 1)).c_str()));
+  }
+  if (std::all_of(mix.begin(), mix.end(), [](int w) { return w == 0; })) {
+    usage("--mix needs at least one non-zero weight");
+  }
+  return mix;
+}
+
+Options parse_args(int argc, char **argv) {
+  Options o;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (i + 1 >= argc) {
+      usage("missing option value");
+    }
+    const char *val = argv[++i];
+    if (arg == "--target") {
+      o.target = parse_endpoint(val);
+    } else if (arg == "--duration") {
+      o.duration = std::atof(val);
+    } else if (arg == "--concurrency") {
+      o.concurrency = std::atoi(val);
+    } else if (arg == "--threads") {
+      o.threads = std::atoi(val);
+    } else if (arg == "--mix") {
+      o.mix = parse_mix(val);
+    } else if (arg == "--hit-user") {
+      o.hit_user = val;
+    } else if (arg == "--banned-base") {
+      boost::system::error_code ec;
+      o.banned_base = boost::asio::ip::make_address_v4(val, ec);
+      if (ec) {
+        usage("--banned-base must be an IPv4 address");
+      }
+    } else if (arg == "--banned-sources") {
+      o.banned_sources = std::atoi(val);
+    } else if (arg == "--ban-threshold") {
+      o.ban_threshold = std::atoi(val);
+    } else if (arg == "--timeout-ms") {
+      o.timeout = std::chrono::milliseconds(std::atol(val));
+    } else {
+      usage("unknown option");
+    }
+  }
+  if (o.duration <= 0 || o.concurrency <= 0 || o.threads <= 0 ||
+      o.ban_threshold < 0 || o.timeout.count() <= 0) {
+    usage("durations and counts must be positive");
+  }
+  if (o.mix[kBanned] > 0 && o.banned_sources <= 0) {
+    usage("banned traffic needs --banned-sources > 0");
+  }
+  return o;
+}
+
+boost::asio::ip::address banned_source(const Options &o, std::uint64_t n) {
+  return boost::asio::ip::address_v4(o.banned_base.to_uint() +
+                                     static_cast<std::uint32_t>(
+                                         n % o.banned_sources));
+}
+
+// Connect (from `source`, if set), send one query and read until the daemon
+// closes the connection.
+awaitable<Outcome> one_request(const Options &o,
+                               std::optional<boost::asio::ip::address> source,
+                               std::string query) {
+  auto executor = co_await this_coro::executor;
+  // Shared with the timeout handler, which may still be queued after this
+  // coroutine has finished.
+  struct State {
+    explicit State(boost::asio::any_io_executor ex) : socket(ex) {}
+    tcp::socket socket;
+    bool timed_out = false;
+  };
+  auto st = std::make_shared<State>(executor);
+  boost::asio::steady_timer timer(executor, o.timeout);
+  timer.async_wait([st](boost::system::error_code ec) {
+    if (!ec) {
+      st->timed_out = true;
+      st->socket.close(ec);
+    }
+  });
+
+  boost::system::error_code ec;
+  st->socket.open(o.target.protocol(), ec);
+  if (!ec && source) {
+    st->socket.bind(tcp::endpoint(*source, 0), ec);
+  }
+  if (ec) {
+    co_return kFailed;
+  }
+  auto [connect_ec] = co_await st->socket.async_connect(
+      o.target, boost::asio::as_tuple(deferred));
+  if (connect_ec) {
+    co_return kFailed;
+  }
+  query += "\r\n";
+  // A banned client may be closed on before the write lands; that is still
+  // a drop, so write errors are judged by what the read sees.
+  co_await async_write(st->socket, boost::asio::buffer(query),
+                       boost::asio::as_tuple(deferred));
+  std::size_t received = 0;
+  char buf[4096];
+  for (;;) {
+    auto [read_ec, n] = co_await st->socket.async_read_some(
+        boost::asio::buffer(buf), boost::asio::as_tuple(deferred));
+    received += n;
+    if (read_ec) {
+      timer.cancel();
+      if (st->timed_out) {
+        co_return kFailed;
+      }
+      const bool closed = read_ec == boost::asio::error::eof ||
+                          read_ec == boost::asio::error::connection_reset;
+      if (!closed) {
+        co_return kFailed;
+      }
+      co_return received > 0 ? kAnswered : kDropped;
+    }
+  }
+}
+
+std::string query_for(int cls, std::mt19937_64 &rng) {
+  static const std::array<const char *, 4> kTraversals = {
+      "../../etc/passwd", "..%2f..%2fetc%2fpasswd", "%2e%2e%2fetc", "a/b"};
+  switch (cls) {
+  case kTraversal:
+    return kTraversals[rng() % kTraversals.size()];
+  case kMiss:
+  case kBanned:
+    return "nosuchuser" + std::to_string(rng() % 1000000);
+  default:
+    return {};
+  }
+}
+
+awaitable<void> worker(const Options &o, clock_type::time_point deadline,
+                       std::uint64_t seed, Results &out) {
+  std::mt19937_64 rng(seed);
+  std::discrete_distribution<int> pick(o.mix.begin(), o.mix.end());
+  std::uint64_t n = seed;
+  while (clock_type::now() < deadline) {
+    const int cls = pick(rng);
+    std::optional<boost::asio::ip::address> source;
+    if (cls == kBanned) {
+      source = banned_source(o, n++);
+    }
+    std::string query = cls == kHit ? o.hit_user : query_for(cls, rng);
+    const auto start = clock_type::now();
+    const Outcome outcome = co_await one_request(o, source, std::move(query));
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                        clock_type::now() - start)
+                        .count();
+    out.samples.push_back(Sample{static_cast<std::uint32_t>(us),
+                                 static_cast<std::uint8_t>(cls),
+                                 static_cast<std::uint8_t>(outcome)});
+  }
+}
+
+// Ban every banned-traffic source up front, so the timed run measures the
+// daemon's drop path rather than the ban being earned.
+awaitable<void> prime_ban(const Options &o, boost::asio::ip::address source,
+                          int &failures) {
+  for (int i = 0; i <= o.ban_threshold; ++i) {
+    std::mt19937_64 rng(i);
+    if (co_await one_request(o, source, query_for(kMiss, rng)) == kFailed) {
+      ++failures;
+    }
+  }
+}
+
+void raise_fd_limit() {
+  rlimit rl;
+  if (::getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+struct Summary {
+  std::size_t count = 0;
+  std::array<std::size_t, 3> outcomes{};
+  double mean_us = 0;
+  std::uint32_t p50 = 0, p90 = 0, p99 = 0, p999 = 0, max = 0;
+};
+
+Summary summarize(std::vector<std::uint32_t> us,
+                  const std::array<std::size_t, 3> &outcomes) {
+  Summary s;
+  s.count = us.size();
+  s.outcomes = outcomes;
+  if (us.empty()) {
+    return s;
+  }
+  std::sort(us.begin(), us.end());
+  auto pct = [&](double p) {
+    const auto i = static_cast<std::size_t>(p * (us.size() - 1) + 0.5);
+    return us[std::min(i, us.size() - 1)];
+  };
+  double total = 0;
+  for (const auto v : us) {
+    total += v;
+  }
+  s.mean_us = total / us.size();
+  s.p50 = pct(0.50);
+  s.p90 = pct(0.90);
+  s.p99 = pct(0.99);
+  s.p999 = pct(0.999);
+  s.max = us.back();
+  return s;
+}
+
+void print_summary_json(const char *name, const Summary &s, double seconds,
+                        bool last) {
+  std::printf("    \"%s\": {\"requests\": %zu, \"rps\": %.1f, "
+              "\"answered\": %zu, \"dropped\": %zu, \"failed\": %zu, "
+              "\"latency_us\": {\"mean\": %.1f, \"p50\": %u, \"p90\": %u, "
+              "\"p99\": %u, \"p999\": %u, \"max\": %u}}%s\n",
+              name, s.count, s.count / seconds, s.outcomes[kAnswered],
+              s.outcomes[kDropped], s.outcomes[kFailed], s.mean_us, s.p50,
+              s.p90, s.p99, s.p999, s.max, last ? "" : ",");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const Options o = parse_args(argc, argv);
+  raise_fd_limit();
+
+  if (o.mix[kBanned] > 0) {
+    boost::asio::io_context ctx;
+    int failures = 0;
+    for (int i = 0; i < o.banned_sources; ++i) {
+      co_spawn(ctx, prime_ban(o, banned_source(o, i), failures), detached);
+    }
+    ctx.run();
+    if (failures > 0) {
+      std::fprintf(stderr,
+                   "finger_bench: %d priming requests failed; are the "
+                   "--banned-base addresses configured on loopback?\n",
+                   failures);
+      return 1;
+    }
+  }
+
+  std::vector<Results> results(o.threads);
+  std::vector<std::thread> threads;
+  const auto start = clock_type::now();
+  const auto deadline =
+      start + std::chrono::duration_cast<clock_type::duration>(
+                  std::chrono::duration<double>(o.duration));
+  for (int t = 0; t < o.threads; ++t) {
+    threads.emplace_back([&, t] {
+      boost::asio::io_context ctx(1);
+      const int workers =
+          o.concurrency / o.threads + (t < o.concurrency % o.threads ? 1 : 0);
+      for (int w = 0; w < workers; ++w) {
+        co_spawn(ctx,
+                 worker(o, deadline,
+                        static_cast<std::uint64_t>(t) * o.concurrency + w,
+                        results[t]),
+                 detached);
+      }
+      ctx.run();
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  const double seconds =
+      std::chrono::duration<double>(clock_type::now() - start).count();
+
+  std::array<std::vector<std::uint32_t>, kClasses> by_class;
+  std::array<std::array<std::size_t, 3>, kClasses> outcomes{};
+  std::vector<std::uint32_t> all;
+  std::array<std::size_t, 3> all_outcomes{};
+  for (const auto &r : results) {
+    for (const auto &s : r.samples) {
+      by_class[s.cls].push_back(s.us);
+      ++outcomes[s.cls][s.outcome];
+      all.push_back(s.us);
+      ++all_outcomes[s.outcome];
+    }
+  }
+  const Summary overall = summarize(std::move(all), all_outcomes);
+
+  std::printf("{\n  \"target\": \"%s\",\n  \"duration_s\": %.3f,\n"
+              "  \"concurrency\": %d,\n  \"threads\": %d,\n"
+              "  \"mix\": {\"hit\": %d, \"miss\": %d, \"traversal\": %d, "
+              "\"banned\": %d},\n",
+              (o.target.address().to_string() + ":" +
+               std::to_string(o.target.port()))
+                  .c_str(),
+              seconds, o.concurrency, o.threads, o.mix[kHit], o.mix[kMiss],
+              o.mix[kTraversal], o.mix[kBanned]);
+  std::printf("  \"overall\": {\"requests\": %zu, \"rps\": %.1f, "
+              "\"answered\": %zu, \"dropped\": %zu, \"failed\": %zu, "
+              "\"latency_us\": {\"mean\": %.1f, \"p50\": %u, \"p90\": %u, "
+              "\"p99\": %u, \"p999\": %u, \"max\": %u}},\n",
+              overall.count, overall.count / seconds,
+              overall.outcomes[kAnswered], overall.outcomes[kDropped],
+              overall.outcomes[kFailed], overall.mean_us, overall.p50,
+              overall.p90, overall.p99, overall.p999, overall.max);
+  std::printf("  \"classes\": {\n");
+  std::vector<int> present;
+  for (int c = 0; c < kClasses; ++c) {
+    if (!by_class[c].empty()) {
+      present.push_back(c);
+    }
+  }
+  for (std::size_t i = 0; i < present.size(); ++i) {
+    const int c = present[i];
+    print_summary_json(kClassNames[c],
+                       summarize(std::move(by_class[c]), outcomes[c]), seconds,
+                       i + 1 == present.size());
+  }
+  std::printf("  }\n}\n");
+
+  std::fprintf(stderr,
+               "%zu requests in %.1fs: %.0f req/s, p50 %uus, p99 %uus, "
+               "%zu failed\n",
+               overall.count, seconds, overall.count / seconds, overall.p50,
+               overall.p99, overall.outcomes[kFailed]);
+  return overall.outcomes[kFailed] > 0 ? 1 : 0;
+}
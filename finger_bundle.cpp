@@ -0,0 +1,46 @@
+// finger_bundle: pack the plans in a users directory into a plan bundle for
+// the daemon to serve from (FINGER_PLAN_BUNDLE).
+//
+//   finger_bundle [-d DIR] OUTPUT
+//
+// DIR defaults to /var/finger/users. OUTPUT is replaced atomically, so it is
+// safe to rebuild the bundle a running daemon is serving; it picks the new
+// one up by itself (or on SIGHUP).
+
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <string_view>
+
+#include "bundle.hpp"
+#include "handler.hpp"
+
+int main(int argc, char **argv) {
+  std::filesystem::path dir = kPATH;
+  std::filesystem::path out;
+  for (int i = 1; i < argc; ++i) {
+    const std::string_view arg = argv[i];
+    if (arg == "-d" && i + 1 < argc) {
+      dir = argv[++i];
+    } else if (out.empty() && !arg.starts_with("-")) {
+      out = argv[i];
+    } else {
+      out.clear();
+      break;
+    }
+  }
+  if (out.empty()) {
+    std::fprintf(stderr, "usage: finger_bundle [-d DIR] OUTPUT\n");
+    return 2;
+  }
+  try {
+    RealFilesystemWrapper fs;
+    const auto plans = collect_plans(dir, fs);
+    const std::size_t bytes = write_plan_bundle(plans, out);
+    std::printf("%zu plans, %zu bytes -> %s\n", plans.size(), bytes,
+                out.c_str());
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "finger_bundle: %s\n", e.what());
+    return 1;
+  }
+}
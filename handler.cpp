@@ -1,9 +1,13 @@
 #include "handler.hpp"
+#include "validate.hpp"
 #include <algorithm>
-#include <cctype>
+#include <cerrno>
 #include <filesystem>
 #include <fstream>
 #include <string_view>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 bool RealFilesystemWrapper::exists(const std::filesystem::path &path) const {
   return std::filesystem::exists(path);
@@ -11,29 +15,50 @@ bool RealFilesystemWrapper::exists(const std::filesystem::path &path) const {
 
 std::string
 RealFilesystemWrapper::read_file(const std::filesystem::path &path) const {
-  std::ifstream file(path);
-  if (!file.is_open()) {
+  // O_NONBLOCK only matters for a FIFO, whose open() would otherwise wait
+  // for a writer; it is refused below anyway.
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+  if (fd < 0) {
+    return "";
+  }
+  struct stat st {};
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    ::close(fd);
     return "";
   }
 
+  // Read the whole file (up to the cap) into one buffer sized up front, with
+  // room for the CRLF appended below, instead of rebuilding it line by line.
+  // Keep reading past st_size in case the file grew.
   std::string content;
-  std::string line;
-
-  while (std::getline(file, line)) {
-    content += line + "\n";
+  content.reserve(
+      std::min(static_cast<std::size_t>(st.st_size), max_plan_size_) + 2);
+  char buf[16384];
+  while (content.size() < max_plan_size_) {
+    const ssize_t n = ::read(
+        fd, buf, std::min(sizeof buf, max_plan_size_ - content.size()));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    content.append(buf, static_cast<std::size_t>(n));
   }
+  ::close(fd);
+  return crlf_terminate(std::move(content));
+}
 
+std::string crlf_terminate(std::string content) {
   if (content.empty()) {
-    return "";
+    return content;
   }
 
-  // Return the content with proper line endings
+  // Return the content with proper line endings: only the final newline (if
+  // any) becomes CRLF; interior lines are sent as they are on disk.
   if (content.back() == '\n') {
     content.pop_back(); // Remove the last newline
-    content += "\r\n";
-    return content;
   }
-
   content += "\r\n";
   return content;
 }
@@ -45,52 +70,69 @@ std::string process(const std::string &username) {
 
 std::string process(const std::string &username, const IFilesystemWrapper &fs,
                     const std::filesystem::path &basepath) {
-  try {
-    // Check for directory traversal patterns
-    if (username.find("../") != std::string::npos ||
-        username.find("..\\") != std::string::npos ||
-        username.find("%2e%2e%2f") != std::string::npos ||
-        username.find("%2e%2e%5c") != std::string::npos ||
-        username.find("%2E%2E%2F") != std::string::npos ||
-        username.find("%2E%2E%5C") != std::string::npos ||
-        username.find("..%2f") != std::string::npos ||
-        username.find("..%5c") != std::string::npos ||
-        username.find("..%2F") != std::string::npos ||
-        username.find("..%5C") != std::string::npos) {
-      throw InvalidInput("Directory traversal detected in username");
-    }
+  return std::string(finger(username, fs, basepath).body.view());
+}
 
-    if (username.find("/") != std::string::npos) {
-      throw InvalidInput("Path detected in username");
-    }
-  } catch (InvalidInput &e) {
-    return std::string("InvalidInput: ") + e.what() + std::string("\r\n");
+Reply finger(std::string_view username, const IFilesystemWrapper &fs,
+             const std::filesystem::path &basepath) {
+  std::filesystem::path planPath;
+  if (auto settled = resolve_plan_path(username, basepath, planPath)) {
+    return std::move(*settled);
   }
 
-  // Plan-file lookup is case-insensitive: normalise the requested name to
-  // lower-case so e.g. "Pete" resolves the on-disk "pete" plan. Plan filenames
-  // are always lower-case; the original spelling is still echoed back below
-  // when no plan exists.
-  std::string lookup = username;
-  std::transform(lookup.begin(), lookup.end(), lookup.begin(),
-                 [](unsigned char c) { return std::tolower(c); });
-
-  // Attempt to open the plan file (if any) and return the contents as a string
-  std::filesystem::path planPath = basepath / lookup;
-
   // Check if the plan file exists using the filesystem wrapper
   if (!fs.exists(planPath)) {
     // If no plan file exists, return just the username
-    return username;
+    return {Reply::Kind::miss, PlanBody(std::string(username))};
   }
 
   // Try to read the plan file using the filesystem wrapper
-  std::string content = fs.read_file(planPath);
+  return plan_reply(username, fs.read_plan(planPath));
+}
 
+std::optional<Reply> resolve_plan_path(std::string_view username,
+                                       const std::filesystem::path &basepath,
+                                       std::filesystem::path &plan_path) {
+  std::string lookup;
+  if (auto settled = resolve_plan_name(username, lookup)) {
+    return settled;
+  }
+  plan_path = basepath / lookup;
+  return std::nullopt;
+}
+
+std::optional<Reply> resolve_plan_name(std::string_view username,
+                                       std::string &name) {
+  // One pass over the request: reject traversal attempts and paths, and
+  // build the lookup key. Plan-file lookup is case-insensitive: the key is
+  // the lower-cased name so e.g. "Pete" resolves the on-disk "pete" plan.
+  // Plan filenames are always lower-case; the original spelling is still
+  // echoed back below when no plan exists.
+  // The rejections are literals, so their bodies need no owner.
+  switch (classify_username(username, name)) {
+  case RequestClass::traversal:
+    return Reply{Reply::Kind::invalid,
+                 PlanBody(nullptr, "InvalidInput: Directory traversal "
+                                   "detected in username\r\n")};
+  case RequestClass::path:
+    return Reply{Reply::Kind::invalid,
+                 PlanBody(nullptr,
+                          "InvalidInput: Path detected in username\r\n")};
+  case RequestClass::junk:
+    // Control bytes or longer than any filename: cannot be a plan, so do not
+    // ask the filesystem (which throws on over-long names).
+    return Reply{Reply::Kind::miss, PlanBody(std::string(username))};
+  case RequestClass::valid:
+    break;
+  }
+  return std::nullopt;
+}
+
+Reply plan_reply(std::string_view username, PlanBody content) {
   if (content.empty()) {
     // If file exists but is empty or couldn't be read, return just the username
-    return username;
+    return {Reply::Kind::miss, PlanBody(std::string(username))};
   }
 
-  return content;
+  return {Reply::Kind::plan, std::move(content)};
 }
@@ -1,22 +1,71 @@
 #pragma once
 
+#include <cstddef>
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
+
+// A response body as sent on the wire: a view of immutable bytes plus
+// whatever keeps them alive (a cached string, a mapped plan bundle), so one
+// body can be handed to any number of in-flight connections without copying.
+class PlanBody {
+public:
+  PlanBody() = default;
+  explicit PlanBody(std::string bytes) {
+    auto owned = std::make_shared<const std::string>(std::move(bytes));
+    bytes_ = *owned;
+    owner_ = std::move(owned);
+  }
+  PlanBody(std::shared_ptr<const void> owner, std::string_view bytes)
+      : owner_(std::move(owner)), bytes_(bytes) {}
+
+  std::string_view view() const { return bytes_; }
+  bool empty() const { return bytes_.empty(); }
+
+private:
+  std::shared_ptr<const void> owner_;
+  std::string_view bytes_;
+};
 
 class IFilesystemWrapper {
 public:
   virtual ~IFilesystemWrapper() = default;
   virtual bool exists(const std::filesystem::path &path) const = 0;
   virtual std::string read_file(const std::filesystem::path &path) const = 0;
+  // read_file() as a shareable body. The default wraps read_file(); wrappers
+  // that keep plans in memory override it to hand out their stored copy.
+  virtual PlanBody read_plan(const std::filesystem::path &path) const {
+    return PlanBody(read_file(path));
+  }
 };
 
+// Default cap on the bytes read from one plan file (FINGER_MAX_PLAN_SIZE).
+constexpr std::size_t kMaxPlanSize = 1024 * 1024;
+
+// Plans read from disk. Only regular files are read (a symlink to one is
+// fine): anything else -- a FIFO, a device such as /dev/zero, a directory --
+// reads as empty, i.e. as no plan, and is opened without blocking so that a
+// FIFO with no writer cannot hang the reader. A file longer than
+// max_plan_size is cut off there, so whatever lands in the users directory
+// costs at most that much memory per plan.
 class RealFilesystemWrapper : public IFilesystemWrapper {
 public:
+  explicit RealFilesystemWrapper(std::size_t max_plan_size = kMaxPlanSize)
+      : max_plan_size_(max_plan_size) {}
+
   bool exists(const std::filesystem::path &path) const override;
   std::string read_file(const std::filesystem::path &path) const override;
+
+  std::size_t max_plan_size() const { return max_plan_size_; }
+
+private:
+  std::size_t max_plan_size_;
 };
 
 class InvalidInput : public std::runtime_error {
@@ -26,6 +75,37 @@ public:
 
 const std::filesystem::path kPATH{"/var/finger/users/"};
 
+// Result of one finger lookup. body is what to send: the plan (shared with
+// the plan cache or bundle, if there is one), the requested name for a miss,
+// or the rejection message for invalid input.
+struct Reply {
+  enum class Kind { plan, miss, invalid };
+  Kind kind;
+  PlanBody body;
+};
+
+Reply finger(std::string_view username, const IFilesystemWrapper &fs,
+             const std::filesystem::path &basepath = kPATH);
+
+// finger() in two halves, for callers that read the plan file themselves.
+// The first settles a request without looking at the filesystem where it can
+// (invalid input, a name that cannot have a plan) and otherwise sets
+// plan_path; the second builds the reply from the file's contents as
+// read_plan() returns them (empty when there is no plan).
+std::optional<Reply> resolve_plan_path(std::string_view username,
+                                       const std::filesystem::path &basepath,
+                                       std::filesystem::path &plan_path);
+// resolve_plan_path() without building the path: sets name to the plan
+// file's name in the users directory instead.
+std::optional<Reply> resolve_plan_name(std::string_view username,
+                                       std::string &name);
+Reply plan_reply(std::string_view username, PlanBody content);
+
+// A plan file's bytes as they are sent: the final newline, if any, becomes
+// CRLF (interior lines are left as they are on disk). Empty stays empty.
+std::string crlf_terminate(std::string content);
+
+// finger() with the body copied out.
 std::string process(const std::string &username);
 std::string process(const std::string &username, const IFilesystemWrapper &fs,
                     const std::filesystem::path &basepath = kPATH);
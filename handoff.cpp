@@ -0,0 +1,250 @@
+#include "handoff.hpp"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace {
+
+constexpr char kMagic[8] = {'F', 'N', 'G', 'R', 'U', 'P', 'G', 'R'};
+constexpr std::uint32_t kVersion = 1;
+// Far more than one daemon ever listens on (one per thread, plus metrics).
+constexpr std::uint32_t kMaxSockets = 512;
+// A ban state snapshot is at most a few hundred bytes per tracked row.
+constexpr std::uint64_t kMaxStateBytes = std::uint64_t{1} << 32;
+
+struct Header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t sockets;
+  std::uint64_t state_bytes;
+};
+static_assert(sizeof(Header) == 24);
+
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+#ifdef MSG_CMSG_CLOEXEC
+constexpr int kRecvFlags = MSG_CMSG_CLOEXEC;
+#else
+constexpr int kRecvFlags = 0;
+#endif
+
+std::system_error errno_error(const char *what) {
+  return std::system_error(errno, std::generic_category(), what);
+}
+
+void send_all(int fd, const char *p, std::size_t n) {
+  while (n > 0) {
+    const ssize_t sent = ::send(fd, p, n, kSendFlags);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 0) {
+      throw errno_error("handoff send");
+    }
+    p += sent;
+    n -= static_cast<std::size_t>(sent);
+  }
+}
+
+void recv_all(int fd, char *p, std::size_t n) {
+  while (n > 0) {
+    const ssize_t got = ::recv(fd, p, n, 0);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      throw errno_error("handoff receive");
+    }
+    if (got == 0) {
+      throw std::runtime_error("handoff cut short");
+    }
+    p += got;
+    n -= static_cast<std::size_t>(got);
+  }
+}
+
+// Closes received descriptors unless they are handed on.
+struct Received {
+  std::vector<int> fds;
+
+  ~Received() {
+    for (const int fd : fds) {
+      ::close(fd);
+    }
+  }
+};
+
+} // namespace
+
+int connect_upgrade_socket(const std::filesystem::path &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  const std::string &s = path.native();
+  if (s.empty() || s.size() >= sizeof addr.sun_path) {
+    throw std::system_error(ENAMETOOLONG, std::generic_category(), s);
+  }
+  std::memcpy(addr.sun_path, s.c_str(), s.size() + 1);
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw errno_error("upgrade socket");
+  }
+  int rc;
+  do {
+    rc = ::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr);
+  } while (rc < 0 && errno == EINTR);
+  if (rc < 0) {
+    const int err = errno;
+    ::close(fd);
+    // A socket file left by a daemon that has since exited refuses.
+    if (err == ENOENT || err == ECONNREFUSED) {
+      return -1;
+    }
+    throw std::system_error(err, std::generic_category(), s);
+  }
+  return fd;
+}
+
+void set_handoff_timeouts(int channel) {
+  timeval tv{};
+  tv.tv_sec = kHandoffTimeout.count();
+  if (::setsockopt(channel, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv) < 0 ||
+      ::setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) < 0) {
+    throw errno_error("handoff timeouts");
+  }
+}
+
+void send_handoff(int channel, std::span<const HandedSocket> sockets,
+                  std::span<const char> ban_state) {
+  if (sockets.size() > kMaxSockets) {
+    throw std::invalid_argument("too many sockets to hand off");
+  }
+  Header h{};
+  std::memcpy(h.magic, kMagic, sizeof h.magic);
+  h.version = kVersion;
+  h.sockets = static_cast<std::uint32_t>(sockets.size());
+  h.state_bytes = ban_state.size();
+
+  // The descriptors travel with the header's bytes, so the receiver has them
+  // as soon as it has read the header.
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * sockets.size()));
+  iovec iov{&h, sizeof h};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!sockets.empty()) {
+    msg.msg_control = control.data();
+    msg.msg_controllen = static_cast<socklen_t>(control.size());
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * sockets.size());
+    int *fds = reinterpret_cast<int *>(CMSG_DATA(cmsg));
+    for (std::size_t i = 0; i < sockets.size(); ++i) {
+      std::memcpy(fds + i, &sockets[i].fd, sizeof(int));
+    }
+  }
+  ssize_t sent;
+  do {
+    sent = ::sendmsg(channel, &msg, kSendFlags);
+  } while (sent < 0 && errno == EINTR);
+  if (sent < 0) {
+    throw errno_error("handoff send");
+  }
+  // A stream socket may take the header in pieces; the descriptors went with
+  // the first.
+  send_all(channel, reinterpret_cast<const char *>(&h) + sent,
+           sizeof h - static_cast<std::size_t>(sent));
+
+  std::vector<char> roles;
+  for (const auto &s : sockets) {
+    roles.push_back(static_cast<char>(s.role));
+  }
+  send_all(channel, roles.data(), roles.size());
+  send_all(channel, ban_state.data(), ban_state.size());
+}
+
+Handoff receive_handoff(int channel) {
+  Header h{};
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * kMaxSockets));
+  iovec iov{&h, sizeof h};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = static_cast<socklen_t>(control.size());
+  ssize_t got;
+  do {
+    got = ::recvmsg(channel, &msg, kRecvFlags);
+  } while (got < 0 && errno == EINTR);
+  if (got < 0) {
+    throw errno_error("handoff receive");
+  }
+  if (got == 0) {
+    throw std::runtime_error("handoff cut short");
+  }
+
+  Received received;
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    const std::size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const auto *fds = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+    for (std::size_t i = 0; i < n; ++i) {
+      int fd;
+      std::memcpy(&fd, fds + i, sizeof fd);
+      if (kRecvFlags == 0) {
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+      received.fds.push_back(fd);
+    }
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    throw std::runtime_error("handoff has too many sockets");
+  }
+  recv_all(channel, reinterpret_cast<char *>(&h) + got,
+           sizeof h - static_cast<std::size_t>(got));
+  if (std::memcmp(h.magic, kMagic, sizeof kMagic) != 0 ||
+      h.version != kVersion) {
+    throw std::runtime_error("not a finger handoff");
+  }
+  if (h.sockets != received.fds.size()) {
+    throw std::runtime_error("handoff sockets missing");
+  }
+  if (h.state_bytes > kMaxStateBytes) {
+    throw std::runtime_error("handoff ban state too large");
+  }
+
+  std::vector<char> roles(h.sockets);
+  recv_all(channel, roles.data(), roles.size());
+  Handoff handoff;
+  handoff.ban_state.resize(h.state_bytes);
+  recv_all(channel, handoff.ban_state.data(), handoff.ban_state.size());
+  for (std::size_t i = 0; i < roles.size(); ++i) {
+    const auto role = static_cast<SocketRole>(roles[i]);
+    if (role != SocketRole::finger && role != SocketRole::metrics) {
+      throw std::runtime_error("handoff socket of unknown role");
+    }
+    handoff.sockets.push_back({received.fds[i], role});
+  }
+  received.fds.clear();
+  return handoff;
+}
+
+void confirm_handoff(int channel) {
+  const char ok = 'k';
+  send_all(channel, &ok, 1);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+// Zero-downtime upgrades: the running daemon hands its listening sockets and
+// ban table to a new binary, then drains its connections and exits.
+//
+// The running daemon listens on a unix socket (FINGER_UPGRADE_SOCKET). A new
+// daemon started with the same setting connects to it before binding
+// anything; if nothing answers it starts from scratch. Otherwise the old
+// daemon sends one message down the connection:
+//
+//   header   magic "FNGRUPGR", u32 version, u32 socket count, u64 state size,
+//            with the listening sockets attached (SCM_RIGHTS)
+//   roles    one byte per socket, in the same order
+//   state    a ban state snapshot (banstate.hpp) of that many bytes
+//
+// The new daemon adopts the sockets, restores the bans and, once its own
+// listeners are set up, confirms with a single byte. Only then does the old
+// daemon stop accepting. Both processes hold the same listening sockets
+// throughout, so the port never closes: connections that arrive while
+// neither is calling accept() wait in the kernel's listen backlog.
+//
+// Everything here works on plain blocking descriptors with send and receive
+// timeouts, so a peer that stops reading or writing fails the handoff
+// rather than hanging it. Whichever side fails, the old daemon keeps serving.
+
+// What a listening socket is for.
+enum class SocketRole : std::uint8_t {
+  finger = 'f',
+  metrics = 'm',
+};
+
+struct HandedSocket {
+  int fd; // owned by whoever holds it
+  SocketRole role;
+};
+
+// What a new daemon receives from the one it replaces.
+struct Handoff {
+  std::vector<HandedSocket> sockets;
+  std::vector<char> ban_state;
+};
+
+// Give up on a handoff peer that goes quiet for this long.
+constexpr std::chrono::seconds kHandoffTimeout{10};
+
+// Connect to the upgrade socket at path. Returns the connected descriptor,
+// or -1 if no daemon is listening there (no such socket, or nobody accepting
+// on it). Throws std::system_error for anything else.
+int connect_upgrade_socket(const std::filesystem::path &path);
+
+// Apply kHandoffTimeout to reads and writes on channel.
+void set_handoff_timeouts(int channel);
+
+// Old daemon: send sockets (which stay open here) and a ban state snapshot
+// down channel. Throws std::system_error if the peer goes away or stalls.
+void send_handoff(int channel, std::span<const HandedSocket> sockets,
+                  std::span<const char> ban_state);
+
+// New daemon: read what send_handoff() sent. The sockets are returned open
+// and close-on-exec. Throws std::runtime_error for anything else on the
+// channel, and std::system_error on a read error or timeout.
+Handoff receive_handoff(int channel);
+
+// New daemon: tell the old one that its listeners are being served.
+void confirm_handoff(int channel);
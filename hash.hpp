@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// The splitmix64 finaliser: spreads every input bit over the whole word.
+// Used to derive independent sketch rows, and bucket and slot indexes, from
+// one hash.
+inline std::uint64_t mix64(std::uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
@@ -0,0 +1,318 @@
+#include "log.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+namespace {
+
+// Flush the batch buffer once it reaches this size, even mid-drain.
+constexpr std::size_t kMaxBatchBytes = 64 * 1024;
+
+constexpr char kHex[] = "0123456789abcdef";
+
+// text/logfmt values are bare unless they would be ambiguous.
+bool needs_quotes(std::string_view v) {
+  if (v.empty()) {
+    return true;
+  }
+  for (const unsigned char c : v) {
+    if (c <= ' ' || c == '=' || c == '"' || c == '\\' || c >= 0x7f) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void append_quoted(std::string &out, std::string_view v) {
+  out += '"';
+  for (const unsigned char c : v) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < ' ' || c >= 0x7f) {
+      out += "\\x";
+      out += kHex[c >> 4];
+      out += kHex[c & 0xf];
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
+  out += '"';
+}
+
+void append_kv_value(std::string &out, std::string_view v) {
+  if (needs_quotes(v)) {
+    append_quoted(out, v);
+  } else {
+    out += v;
+  }
+}
+
+// Bytes outside printable ASCII become \u00XX, so the output is valid JSON
+// whatever a client sent.
+void append_json_string(std::string &out, std::string_view v) {
+  out += '"';
+  for (const unsigned char c : v) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < ' ' || c >= 0x7f) {
+      out += "\\u00";
+      out += kHex[c >> 4];
+      out += kHex[c & 0xf];
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
+  out += '"';
+}
+
+// RFC 3339 UTC with milliseconds, e.g. 2024-05-01T12:00:00.000Z.
+void append_time(std::string &out, std::chrono::system_clock::time_point ts) {
+  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      ts.time_since_epoch())
+                      .count();
+  const std::time_t secs = static_cast<std::time_t>(ms / 1000);
+  std::tm tm;
+  ::gmtime_r(&secs, &tm);
+  char buf[32];
+  const int n = std::snprintf(buf, sizeof buf,
+                              "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+                              tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                              tm.tm_hour, tm.tm_min, tm.tm_sec,
+                              static_cast<int>(ms % 1000));
+  out.append(buf, static_cast<std::size_t>(n));
+}
+
+} // namespace
+
+Logger::Logger(int fd, Options opts)
+    : fd_(fd), opts_(opts),
+      mask_(std::bit_ceil(std::max<std::size_t>(opts.capacity, 2)) - 1),
+      cells_(std::make_unique<Cell[]>(mask_ + 1)) {
+  for (std::size_t i = 0; i <= mask_; ++i) {
+    cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+  if (opts_.background) {
+    flusher_ = std::thread([this] { run(); });
+  }
+}
+
+Logger::~Logger() {
+  if (flusher_.joinable()) {
+    {
+      std::lock_guard lock(stop_mu_);
+      stop_ = true;
+    }
+    stop_cv_.notify_one();
+    flusher_.join();
+  }
+  flush();
+}
+
+void Logger::log(const char *event, std::initializer_list<LogField> fields) {
+  // Claim a slot: a cell is free for position `pos` when its sequence equals
+  // pos, and full (the ring has wrapped onto an unread slot) when it is
+  // behind.
+  std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  Cell *cell;
+  for (;;) {
+    cell = &cells_[pos & mask_];
+    const std::size_t seq = cell->seq.load(std::memory_order_acquire);
+    const auto diff =
+        static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      dropped_total_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+
+  Record &rec = cell->rec;
+  rec.ts = std::chrono::system_clock::now();
+  rec.event = event;
+  rec.nfields = 0;
+  rec.bare = 0;
+  std::size_t used = 0;
+  for (const LogField &f : fields) {
+    if (rec.nfields == kMaxFields) {
+      break;
+    }
+    char *dst = rec.values + used;
+    const std::size_t room = kMaxValueBytes - used;
+    std::size_t n;
+    if (f.is_num) {
+      const auto r = std::to_chars(dst, dst + room, f.num);
+      n = r.ec == std::errc() ? static_cast<std::size_t>(r.ptr - dst) : 0;
+    } else {
+      n = std::min(f.str.size(), room);
+      std::memcpy(dst, f.str.data(), n);
+    }
+    used += n;
+    rec.keys[rec.nfields] = f.key;
+    rec.ends[rec.nfields] = static_cast<std::uint16_t>(used);
+    if (f.bare && n > 0) {
+      rec.bare |= static_cast<std::uint8_t>(1u << rec.nfields);
+    }
+    ++rec.nfields;
+  }
+  cell->seq.store(pos + 1, std::memory_order_release);
+}
+
+void Logger::flush() {
+  std::lock_guard lock(drain_mu_);
+  drain_locked();
+}
+
+void Logger::drain_locked() {
+  buf_.clear();
+  for (;;) {
+    Cell &cell = cells_[dequeue_pos_ & mask_];
+    // Empty, or the producer holding the next slot has not finished it yet;
+    // either way the rest waits for the next drain.
+    if (cell.seq.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+      break;
+    }
+    render(cell.rec, buf_);
+    cell.seq.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+    ++dequeue_pos_;
+    if (buf_.size() >= kMaxBatchBytes) {
+      write_all(buf_);
+      buf_.clear();
+    }
+  }
+  if (const std::uint64_t lost = dropped_.exchange(0)) {
+    Record rec{};
+    rec.ts = std::chrono::system_clock::now();
+    rec.event = "log overflow";
+    const auto r = std::to_chars(rec.values, rec.values + kMaxValueBytes, lost);
+    rec.keys[0] = "dropped";
+    rec.ends[0] = static_cast<std::uint16_t>(r.ptr - rec.values);
+    rec.nfields = 1;
+    rec.bare = 1;
+    render(rec, buf_);
+  }
+  write_all(buf_);
+}
+
+void Logger::render(const Record &rec, std::string &out) const {
+  std::size_t start = 0;
+  auto value = [&](std::size_t i) {
+    const std::string_view v(rec.values + start, rec.ends[i] - start);
+    start = rec.ends[i];
+    return v;
+  };
+  switch (opts_.format) {
+  case Format::text:
+    out += rec.event;
+    for (std::size_t i = 0; i < rec.nfields; ++i) {
+      out += ' ';
+      out += rec.keys[i];
+      out += '=';
+      append_kv_value(out, value(i));
+    }
+    break;
+  case Format::logfmt:
+    out += "ts=";
+    append_time(out, rec.ts);
+    out += " msg=";
+    append_kv_value(out, rec.event);
+    for (std::size_t i = 0; i < rec.nfields; ++i) {
+      out += ' ';
+      out += rec.keys[i];
+      out += '=';
+      append_kv_value(out, value(i));
+    }
+    break;
+  case Format::json:
+    out += "{\"ts\":\"";
+    append_time(out, rec.ts);
+    out += "\",\"msg\":";
+    append_json_string(out, rec.event);
+    for (std::size_t i = 0; i < rec.nfields; ++i) {
+      out += ',';
+      append_json_string(out, rec.keys[i]);
+      out += ':';
+      if (rec.bare & (1u << i)) {
+        out += value(i);
+      } else {
+        append_json_string(out, value(i));
+      }
+    }
+    out += '}';
+    break;
+  }
+  out += '\n';
+}
+
+void Logger::write_all(const std::string &buf) const {
+  for (std::size_t off = 0; off < buf.size();) {
+    const ssize_t n = ::write(fd_, buf.data() + off, buf.size() - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return; // nowhere left to report it
+    }
+    off += static_cast<std::size_t>(n);
+  }
+}
+
+void Logger::run() {
+  std::unique_lock lock(stop_mu_);
+  while (!stop_) {
+    stop_cv_.wait_for(lock, opts_.flush_interval);
+    lock.unlock();
+    flush();
+    lock.lock();
+  }
+}
+
+bool LogRateLimit::allow(std::chrono::steady_clock::time_point now,
+                         std::uint64_t &suppressed) {
+  const std::int64_t second =
+      std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch())
+          .count();
+  std::int64_t seen = second_.load(std::memory_order_relaxed);
+  // The first caller into a new second resets the budget. A racing caller
+  // can slip one extra event through; that is fine for a log limit.
+  if (seen < second &&
+      second_.compare_exchange_strong(seen, second, std::memory_order_relaxed)) {
+    used_.store(0, std::memory_order_relaxed);
+  }
+  if (used_.fetch_add(1, std::memory_order_relaxed) < limit_) {
+    suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+  suppressed_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+Logger::Format parse_log_format(std::string_view name) {
+  if (name == "text") {
+    return Logger::Format::text;
+  }
+  if (name == "logfmt") {
+    return Logger::Format::logfmt;
+  }
+  if (name == "json") {
+    return Logger::Format::json;
+  }
+  throw std::invalid_argument("unknown log format '" + std::string(name) +
+                              "' (expected text, logfmt or json)");
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// One key/value pair of a log event. Keys must be string literals (only the
+// pointer is kept); values are copied when the event is logged.
+struct LogField {
+  LogField(const char *k, std::string_view v) : key(k), str(v) {}
+  LogField(const char *k, const char *v) : key(k), str(v) {}
+  LogField(const char *k, const std::string &v) : key(k), str(v) {}
+  LogField(const char *k, bool v)
+      : key(k), str(v ? "true" : "false"), bare(true) {}
+  LogField(const char *k, std::int64_t v)
+      : key(k), num(v), is_num(true), bare(true) {}
+  LogField(const char *k, int v) : LogField(k, std::int64_t{v}) {}
+  LogField(const char *k, std::uint64_t v)
+      : LogField(k, static_cast<std::int64_t>(v)) {}
+
+  const char *key;
+  std::string_view str;
+  std::int64_t num = 0;
+  bool is_num = false;
+  bool bare = false; // a JSON number or boolean rather than a string
+};
+
+// Logger takes log events off the io_context threads. log() only copies the
+// event into a fixed-size slot of a bounded lock-free ring (no allocation, no
+// lock, no syscall); a background thread drains the ring every
+// Options::flush_interval and writes each batch with a single write(). When
+// the ring is full, events are dropped rather than waited on, and the next
+// batch reports how many were lost.
+//
+// Events are an event name plus key/value fields, rendered by the flusher as
+//   text    finger miss client=203.0.113.5 user=root failures=2
+//   logfmt  ts=2024-05-01T12:00:00.000Z msg="finger miss" client=...
+//   json    {"ts":"2024-05-01T12:00:00.000Z","msg":"finger miss","client":...}
+// Control characters and quotes in values (usernames are client-supplied)
+// are escaped in every format.
+class Logger {
+public:
+  enum class Format { text, logfmt, json };
+
+  struct Options {
+    Format format = Format::text;
+    std::size_t capacity = 4096; // slots, rounded up to a power of two
+    std::chrono::milliseconds flush_interval{20};
+    // Without a flusher thread, events are only written by flush() (tests).
+    bool background = true;
+  };
+
+  static constexpr std::size_t kMaxFields = 6;
+  static constexpr std::size_t kMaxValueBytes = 224; // all values combined
+
+  // Writes to fd, which is not closed (normally STDOUT_FILENO).
+  explicit Logger(int fd) : Logger(fd, Options{}) {}
+  Logger(int fd, Options opts);
+  // Writes out anything still queued.
+  ~Logger();
+
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
+  // Queue one event; `event` must be a string literal. Fields past
+  // kMaxFields are ignored and long values are truncated.
+  void log(const char *event, std::initializer_list<LogField> fields = {});
+
+  // Write out everything queued so far.
+  void flush();
+
+  // Events lost to a full ring since the logger was created.
+  std::uint64_t dropped() const { return dropped_total_.load(); }
+
+  Format format() const { return opts_.format; }
+
+private:
+  struct Record {
+    std::chrono::system_clock::time_point ts;
+    const char *event;
+    std::uint8_t nfields;
+    std::uint8_t bare; // bit i set: field i is a JSON literal
+    const char *keys[kMaxFields];
+    std::uint16_t ends[kMaxFields]; // end offset of each value in `values`
+    char values[kMaxValueBytes];
+  };
+
+  // One ring slot; `seq` hands the slot back and forth between producers and
+  // the consumer (Vyukov's bounded queue).
+  struct alignas(64) Cell {
+    std::atomic<std::size_t> seq;
+    Record rec;
+  };
+
+  void drain_locked();
+  void render(const Record &rec, std::string &out) const;
+  void write_all(const std::string &buf) const;
+  void run();
+
+  const int fd_;
+  const Options opts_;
+  std::size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  alignas(64) std::atomic<std::size_t> enqueue_pos_{0};
+  alignas(64) std::size_t dequeue_pos_ = 0; // guarded by drain_mu_
+  std::atomic<std::uint64_t> dropped_{0};   // not yet reported
+  std::atomic<std::uint64_t> dropped_total_{0};
+
+  std::mutex drain_mu_; // one consumer at a time; producers never take it
+  std::string buf_;     // batch being written, guarded by drain_mu_
+
+  std::mutex stop_mu_;
+  std::condition_variable stop_cv_;
+  bool stop_ = false;
+  std::thread flusher_;
+};
+
+// LogRateLimit caps how often a repetitive event is logged: at most
+// `per_second` events are let through in any one-second interval, and the
+// rest are counted so the next one that is logged can say how many were
+// suppressed. Thread-safe and lock-free.
+class LogRateLimit {
+public:
+  explicit LogRateLimit(std::uint32_t per_second) : limit_(per_second) {}
+
+  // True if the caller should log now. `suppressed` is then set to the number
+  // of events skipped since the last one that was allowed.
+  bool allow(std::chrono::steady_clock::time_point now,
+             std::uint64_t &suppressed);
+
+private:
+  const std::uint32_t limit_;
+  std::atomic<std::int64_t> second_{-1};
+  std::atomic<std::uint32_t> used_{0};
+  std::atomic<std::uint64_t> suppressed_{0};
+};
+
+// Parse a FINGER_LOG_FORMAT value ("text", "logfmt" or "json"). Throws
+// std::invalid_argument for anything else.
+Logger::Format parse_log_format(std::string_view name);
@@ -6,148 +6,998 @@
 #include <boost/asio/detached.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/read_until.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/asio/steady_timer.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/asio/write.hpp>
+#include <algorithm>
 #include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
-#include <unordered_set>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include "admission.hpp"
 #include "ban.hpp"
+#include "banstate.hpp"
+#include "blockcache.hpp"
+#include "blocklist.hpp"
+#include "bundle.hpp"
+#include "cache.hpp"
+#include "config.hpp"
+#include "connection.hpp"
+#include "handoff.hpp"
 #include "handler.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "ratelimit.hpp"
+#include "reader.hpp"
+#include "reaper.hpp"
+#include "uring.hpp"
 
 using boost::asio::awaitable;
 using boost::asio::co_spawn;
 using boost::asio::deferred;
 using boost::asio::detached;
 using boost::asio::ip::tcp;
+using local = boost::asio::local::stream_protocol;
 namespace this_coro = boost::asio::this_coro;
 
-awaitable<std::string> dofinger(const std::string &username) {
-  co_return process(username);
+// Open the listening acceptor for one io_context. With more than one thread,
+// every io_context binds its own acceptor with SO_REUSEPORT and the kernel
+// spreads incoming connections across them, so no accept queue is shared
+// between threads. FreeBSD only load-balances with SO_REUSEPORT_LB.
+tcp::acceptor make_acceptor(boost::asio::io_context &io_context,
+                            unsigned short port, bool reuse_port) {
+#if defined(SO_REUSEPORT_LB)
+  using reuse_port_option =
+      boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT_LB>;
+#else
+  using reuse_port_option =
+      boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+  const tcp::endpoint endpoint(tcp::v4(), port);
+  tcp::acceptor acceptor(io_context);
+  acceptor.open(endpoint.protocol());
+  acceptor.set_option(tcp::acceptor::reuse_address(true));
+  if (reuse_port) {
+    acceptor.set_option(reuse_port_option(true));
+  }
+  acceptor.bind(endpoint);
+  acceptor.listen();
+  return acceptor;
 }
 
-awaitable<void> echo(tcp::socket socket, std::string client_addr, bool trackable,
-                     BanTracker &bans) {
-  try {
-    auto now = std::chrono::steady_clock::now();
-
-    // An IP that has racked up too many failed lookups (scanners, username
-    // guessers, non-finger junk) is dropped without being read or answered.
-    // Only globally-routable addresses are tracked: behind Docker's bridge
-    // every client is SNAT'd to the gateway, so banning there would block
-    // everyone at once (see is_bannable_address()).
-    if (trackable && bans.is_blocked(client_addr, now)) {
-      std::printf("finger drop from %s: blocked\n", client_addr.c_str());
-      co_return;
-    }
-
-    char data[1024];
-    auto [read_ec, bytes_read] = co_await socket.async_read_some(
-        boost::asio::buffer(data), boost::asio::as_tuple(deferred));
-    if (read_ec) {
-      // Client hung up before sending a request: health checks (which connect
-      // and immediately close), port scanners, and reset connections all land
-      // here. This is normal -- don't log it as an exception.
-      co_return;
-    }
-    std::string username(data, bytes_read);
-    // Remove trailing \r\n characters
-    while (!username.empty() &&
-           (username.back() == '\r' || username.back() == '\n')) {
-      username.pop_back();
-    }
-    std::printf("finger request from %s for user '%s'\n",
-                client_addr.c_str(), username.c_str());
-    auto response = co_await dofinger(username);
-
-    // A "failure" is simply any request that does not resolve to a readable
-    // plan file: an unknown user, rejected input, or non-finger junk. Each
-    // failure is timestamped against the client IP; once an IP exceeds the
-    // threshold within the rolling window, the is_blocked() check above starts
-    // dropping its connections. This also frustrates username guessing.
-    bool plan_served =
-        response != username && response.rfind("InvalidInput:", 0) != 0;
-    if (!plan_served) {
-      if (trackable) {
-        auto res = bans.record_offense(client_addr, now);
-        std::printf("finger miss from %s for '%s' (%d failures in window)%s\n",
-                    client_addr.c_str(), username.c_str(), res.count,
-                    res.blocked ? " -- now blocked" : "");
-      } else {
-        std::printf("finger miss from %s for '%s' (not tracked)\n",
-                    client_addr.c_str(), username.c_str());
-      }
-      // Best-effort reply; ignore write errors (the client may have already
-      // gone away).
-      co_await async_write(socket,
-                           boost::asio::buffer(std::string("No plan found\r\n")),
-                           boost::asio::as_tuple(deferred));
-      co_return;
-    }
-    co_await async_write(socket, boost::asio::buffer(response),
-                         boost::asio::as_tuple(deferred));
-    co_return;
-  } catch (std::exception &e) {
-    std::printf("echo exception: %s\n", e.what());
+// Address family of a socket handed over by an upgrade.
+int socket_family(int fd) {
+  sockaddr_storage addr{};
+  socklen_t len = sizeof addr;
+  if (::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+    throw std::system_error(errno, std::generic_category(), "getsockname");
   }
+  return addr.ss_family;
+}
+
+// Serve a listening socket handed over by an upgrade.
+tcp::acceptor adopt_acceptor(boost::asio::io_context &io_context, int fd) {
+  return tcp::acceptor(io_context,
+                       socket_family(fd) == AF_INET6 ? tcp::v6() : tcp::v4(),
+                       fd);
 }
 
-awaitable<void> listener(BanTracker &bans,
-                         const std::unordered_set<std::string> &allowlist) {
+// How often a listener with no free connection slot looks again. Slots are
+// given back by connections on every thread, so this polls rather than
+// waiting to be woken.
+constexpr auto kFullRetry = std::chrono::milliseconds(5);
+
+// Accept connections on one io_context, which gets 1/share of the accept
+// rate, until the acceptor is closed. With an io_uring, connections are
+// taken by a multishot accept on it (multishot) instead of one accept() at a
+// time.
+awaitable<void> listener(tcp::acceptor &acceptor, Server &srv,
+                         IdleReaper &reaper, std::size_t share, IoUring *ring,
+                         MultishotAcceptor *multishot) {
   auto executor = co_await this_coro::executor;
-  tcp::acceptor acceptor(executor, {tcp::v4(), 79});
+  const auto protocol = acceptor.local_endpoint().protocol();
+  boost::asio::steady_timer pause(executor);
+  bool full = false;
+  auto settings = srv.settings.get();
+  double rate = -1;
+  TokenBucket accept_rate(0, 0, std::chrono::steady_clock::now());
   for (;;) {
-    tcp::socket socket = co_await acceptor.async_accept(deferred);
+    // Start a fresh bucket whenever a reload changes the rate.
+    if (settings->accept_rate != rate) {
+      rate = settings->accept_rate;
+      const double mine = rate / static_cast<double>(share);
+      accept_rate = TokenBucket(mine, std::max(1.0, mine),
+                                std::chrono::steady_clock::now());
+    }
+    // Backpressure: while this thread's share of the accept rate is spent,
+    // or every connection slot is taken, stop calling accept() and leave new
+    // connections queued in the kernel's listen backlog.
+    if (const auto wait = accept_rate.wait(std::chrono::steady_clock::now());
+        wait > std::chrono::steady_clock::duration::zero()) {
+      srv.metrics.rate_pauses.inc();
+      if (multishot) {
+        multishot->pause();
+      }
+      pause.expires_after(wait);
+      co_await pause.async_wait(deferred);
+      continue;
+    }
+    auto slot = srv.admission.try_reserve();
+    if (!slot) {
+      if (!full) {
+        srv.metrics.capacity_pauses.inc();
+        full = true;
+      }
+      if (multishot) {
+        multishot->pause();
+      }
+      pause.expires_after(kFullRetry);
+      co_await pause.async_wait(deferred);
+      continue;
+    }
+    full = false;
+    tcp::socket socket(executor);
+    boost::system::error_code accept_ec;
+    if (multishot) {
+      if (const int fd = co_await multishot->accept(); fd < 0) {
+        accept_ec.assign(-fd, boost::system::system_category());
+      } else {
+        socket.assign(protocol, fd, accept_ec);
+        if (accept_ec) {
+          ::close(fd);
+        }
+      }
+    } else {
+      std::tie(accept_ec, socket) =
+          co_await acceptor.async_accept(boost::asio::as_tuple(deferred));
+    }
+    if (accept_ec && !acceptor.is_open()) {
+      // Handed over to an upgraded daemon, which accepts from here on.
+      co_return;
+    }
+    if (accept_ec == boost::asio::error::invalid_argument && multishot) {
+      srv.log.log("io_uring accept failed", {{"fallback", "reactor"}});
+      multishot = nullptr;
+      continue;
+    }
+    if (accept_ec) {
+      throw boost::system::system_error(accept_ec);
+    }
+    const auto accepted = std::chrono::steady_clock::now();
+    accept_rate.take(accepted);
+    srv.metrics.accepts.inc();
+    settings = srv.settings.get();
     boost::system::error_code ec;
     auto endpoint = socket.remote_endpoint(ec);
-    std::string client_addr =
-        ec ? std::string("unknown") : endpoint.address().to_string();
+    const AddressText client_addr =
+        ec ? AddressText() : AddressText(endpoint.address());
     // Allowlisted IPs (trusted aggregating front-ends like the finger-web
     // proxy) are never tracked, so their bursts neither block them nor count
     // as offenses.
     bool trackable = !ec && is_bannable_address(endpoint.address()) &&
-                     allowlist.find(client_addr) == allowlist.end();
+                     !settings->allowlist.contains(client_addr.view());
+    const IpKey client(endpoint.address());
+    // The per-address cap only applies where an address is one client; the
+    // socket is closed as it goes out of scope.
+    if (trackable && !srv.admission.admit(*slot, client)) {
+      srv.metrics.per_ip_drops.inc();
+      if (std::uint64_t suppressed; srv.drop_limit.allow(accepted, suppressed)) {
+        srv.log.log("finger drop", {{"client", client_addr.view()},
+                                    {"reason", "per_ip"},
+                                    {"suppressed", suppressed}});
+      }
+      continue;
+    }
     co_spawn(executor,
-             echo(std::move(socket), std::move(client_addr), trackable, bans),
+             echo(std::move(socket), client, client_addr, trackable,
+                  accepted, std::move(*slot), settings, srv, reaper, ring),
              detached);
   }
 }
 
-// Periodically prune offense records that have aged out of the window so the
-// tracker's memory stays bounded even for IPs that never reconnect.
-awaitable<void> sweeper(BanTracker &bans) {
+// Write a ban state snapshot to `state` (if set), logging any failure.
+void save_bans(const SharedBanTracker &bans,
+               const std::filesystem::path &state, Logger &log) {
+  if (state.empty()) {
+    return;
+  }
+  try {
+    save_ban_state(bans, state, std::chrono::steady_clock::now(),
+                   std::chrono::system_clock::now());
+  } catch (const std::exception &e) {
+    log.log("ban state save failed", {{"error", e.what()}});
+  }
+}
+
+// Expire ban table rows as they come due, once a second and with a budget of
+// rows per shard, so that no tick holds a shard lock for long however big the
+// table is. Every 10 minutes also sweep the prefix trie and lapsed firewall
+// blocks, then snapshot what is left.
+awaitable<void> sweeper(SharedBanTracker &bans,
+                        const std::filesystem::path &state, Logger &log,
+                        Metrics &metrics) {
+  constexpr std::size_t kExpireBudget = 4096;
+  constexpr int kTicksPerSweep = 600;
   boost::asio::steady_timer timer(co_await this_coro::executor);
+  for (int tick = 1;; ++tick) {
+    timer.expires_after(std::chrono::seconds(1));
+    co_await timer.async_wait(deferred);
+    auto start = std::chrono::steady_clock::now();
+    bans.expire(start, kExpireBudget);
+    metrics.expire_duration.record(std::chrono::steady_clock::now() - start);
+    if (tick % kTicksPerSweep != 0) {
+      continue;
+    }
+    start = std::chrono::steady_clock::now();
+    bans.sweep_prefixes(start);
+    metrics.sweep_duration.record(std::chrono::steady_clock::now() - start);
+    save_bans(bans, state, log);
+  }
+}
+
+// Evict plan-cache entries as soon as inotify reports a change in the users
+// directory. The cache owns the inotify descriptor; the stream_descriptor only
+// holds a dup() of it so the reactor can wait for readability.
+awaitable<void> plan_cache_watcher(CachingFilesystemWrapper &cache,
+                                   Logger &log) {
+  boost::asio::posix::stream_descriptor watch(co_await this_coro::executor,
+                                              ::dup(cache.watch_fd()));
   for (;;) {
-    timer.expires_after(std::chrono::minutes(10));
+    co_await watch.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                              deferred);
+    cache.process_events();
+    if (cache.watch_fd() < 0) {
+      log.log("plan cache lost watch",
+              {{"dir", kPATH.string()}, {"fallback", "ttl"}});
+      co_return;
+    }
+  }
+}
+
+// Swap in a rebuilt plan bundle: always on SIGHUP (force), otherwise only if
+// the file has changed since it was mapped. A bad bundle is logged and the
+// current one keeps serving.
+void reload_bundle(BundleFilesystemWrapper &bundle, Logger &log, bool force) {
+  try {
+    if (force) {
+      bundle.reload();
+    } else if (!bundle.reload_if_changed()) {
+      return;
+    }
+    log.log("plan bundle reloaded", {{"plans", bundle.size()}});
+  } catch (const std::exception &e) {
+    log.log("plan bundle reload failed", {{"error", e.what()}});
+  }
+}
+
+// Pick up a plan bundle renamed into place: via inotify on the bundle's
+// directory where available, otherwise by checking the file every 5 seconds.
+awaitable<void> plan_bundle_watcher(BundleFilesystemWrapper &bundle,
+                                    Logger &log) {
+  auto executor = co_await this_coro::executor;
+  if (bundle.watch_fd() >= 0) {
+    boost::asio::posix::stream_descriptor watch(executor,
+                                                ::dup(bundle.watch_fd()));
+    for (;;) {
+      co_await watch.async_wait(
+          boost::asio::posix::stream_descriptor::wait_read, deferred);
+      if (bundle.process_events()) {
+        reload_bundle(bundle, log, false);
+      }
+    }
+  }
+  boost::asio::steady_timer timer(executor);
+  for (;;) {
+    timer.expires_after(std::chrono::seconds(5));
     co_await timer.async_wait(deferred);
-    bans.sweep(std::chrono::steady_clock::now());
+    reload_bundle(bundle, log, false);
+  }
+}
+
+// Run reload on every SIGHUP.
+awaitable<void> hangup(std::function<void()> reload) {
+  boost::asio::signal_set hup(co_await this_coro::executor, SIGHUP);
+  for (;;) {
+    co_await hup.async_wait(deferred);
+    reload();
+  }
+}
+
+// Serve Prometheus scrapes on a local TCP port or unix socket. Each scrape
+// is one short HTTP/1.0 exchange; the request headers are capped at 8 KiB.
+template <typename Protocol>
+awaitable<void> metrics_session(typename Protocol::socket socket,
+                                const Metrics &metrics) {
+  std::string request;
+  auto [ec, n] = co_await boost::asio::async_read_until(
+      socket, boost::asio::dynamic_buffer(request, 8192), "\r\n\r\n",
+      boost::asio::as_tuple(deferred));
+  if (ec) {
+    co_return;
   }
+  const std::string response = metrics_http_response(request, metrics);
+  co_await async_write(socket, boost::asio::buffer(response),
+                       boost::asio::as_tuple(deferred));
+}
+
+template <typename Protocol>
+awaitable<void> metrics_server(typename Protocol::acceptor &acceptor,
+                               const Metrics &metrics) {
+  auto executor = co_await this_coro::executor;
+  for (;;) {
+    auto [ec, socket] =
+        co_await acceptor.async_accept(boost::asio::as_tuple(deferred));
+    if (!acceptor.is_open()) {
+      co_return;
+    }
+    if (ec) {
+      continue;
+    }
+    co_spawn(executor, metrics_session<Protocol>(std::move(socket), metrics),
+             detached);
+  }
+}
+
+// The metrics listener handed over by an upgrade (inherited, or -1) if it is
+// still listening on endpoint, otherwise a new one there.
+template <typename Protocol>
+typename Protocol::acceptor
+metrics_acceptor(boost::asio::io_context &io_context,
+                 const typename Protocol::endpoint &endpoint, int inherited) {
+  if (inherited >= 0) {
+    if (socket_family(inherited) == endpoint.protocol().family()) {
+      typename Protocol::acceptor acceptor(io_context, endpoint.protocol(),
+                                           inherited);
+      if (acceptor.local_endpoint() == endpoint) {
+        return acceptor;
+      }
+    } else {
+      ::close(inherited);
+    }
+  }
+  if constexpr (std::is_same_v<Protocol, local>) {
+    ::unlink(endpoint.path().c_str()); // left over from a previous run
+  }
+  return typename Protocol::acceptor(io_context, endpoint);
+}
+
+// How long the new daemon has to confirm an upgrade, restoring the ban table
+// included, and how long the old one then waits for its connections to
+// finish before exiting regardless.
+constexpr auto kUpgradeConfirmTimeout = std::chrono::seconds(60);
+constexpr auto kDrainTimeout = std::chrono::seconds(30);
+
+// Hand this daemon's listening sockets and ban table to a new binary that
+// connects to the upgrade socket (see handoff.hpp), and call handed_off once
+// it confirms that it is serving them. A handoff that fails changes nothing
+// here; this daemon carries on serving and waits for the next attempt.
+// Encoding the table and sending it are done on worker, so that the io
+// thread keeps serving its own connections meanwhile.
+awaitable<void> upgrade_server(local::acceptor &acceptor,
+                               const SharedBanTracker &bans,
+                               std::vector<HandedSocket> sockets, Logger &log,
+                               boost::asio::thread_pool::executor_type worker,
+                               std::function<void()> handed_off) {
+  auto executor = co_await this_coro::executor;
+  for (;;) {
+    auto [ec, accepted] =
+        co_await acceptor.async_accept(boost::asio::as_tuple(deferred));
+    if (!acceptor.is_open()) {
+      co_return;
+    }
+    if (ec) {
+      continue;
+    }
+    // Shared with the deadline below, which may fire after this iteration.
+    auto channel = std::make_shared<local::socket>(std::move(accepted));
+    // Nothing else touches the channel until this is back on executor.
+    co_await boost::asio::post(worker, deferred);
+    std::size_t bytes = 0;
+    std::string error;
+    try {
+      // This blocks the worker while the new daemon reads the table, and no
+      // longer than kHandoffTimeout at a time.
+      set_handoff_timeouts(channel->native_handle());
+      const std::vector<char> state =
+          encode_ban_state(bans, std::chrono::steady_clock::now(),
+                           std::chrono::system_clock::now());
+      send_handoff(channel->native_handle(), sockets, state);
+      bytes = state.size();
+    } catch (const std::exception &e) {
+      error = e.what();
+    }
+    co_await boost::asio::post(executor, deferred);
+    if (!error.empty()) {
+      log.log("upgrade failed", {{"error", error}});
+      continue;
+    }
+    log.log("upgrade sent",
+            {{"sockets", static_cast<std::uint64_t>(sockets.size())},
+             {"bytes", static_cast<std::uint64_t>(bytes)}});
+    boost::asio::steady_timer deadline(executor, kUpgradeConfirmTimeout);
+    deadline.async_wait([channel](boost::system::error_code ec) {
+      if (!ec) {
+        channel->close();
+      }
+    });
+    char ok;
+    auto [read_ec, n] = co_await boost::asio::async_read(
+        *channel, boost::asio::buffer(&ok, 1), boost::asio::as_tuple(deferred));
+    deadline.cancel();
+    if (read_ec || n != 1) {
+      log.log("upgrade failed", {{"error", "not confirmed"}});
+      continue;
+    }
+    log.log("upgrade handed off", {});
+    handed_off();
+    co_return;
+  }
+}
+
+// After an upgrade: stop the io_contexts once no connection is left, or
+// after kDrainTimeout.
+awaitable<void>
+drain(const AdmissionControl &admission,
+      std::vector<std::unique_ptr<boost::asio::io_context>> &contexts,
+      Logger &log) {
+  boost::asio::steady_timer timer(co_await this_coro::executor);
+  const auto until = std::chrono::steady_clock::now() + kDrainTimeout;
+  while (admission.in_flight() > 0 &&
+         std::chrono::steady_clock::now() < until) {
+    timer.expires_after(std::chrono::milliseconds(100));
+    co_await timer.async_wait(deferred);
+  }
+  log.log("upgrade drained",
+          {{"abandoned", static_cast<std::uint64_t>(admission.in_flight())}});
+  for (auto &ctx : contexts) {
+    ctx->stop();
+  }
+}
+
+// A byte count such as "65536", "512K" or "64M".
+std::size_t parse_byte_size(const char *text) {
+  char *end = nullptr;
+  const unsigned long long n = std::strtoull(text, &end, 10);
+  int shift = 0;
+  if (const char c = *end; c == 'K' || c == 'k') {
+    shift = 10;
+  } else if (c == 'M' || c == 'm') {
+    shift = 20;
+  } else if (c == 'G' || c == 'g') {
+    shift = 30;
+  }
+  if (shift) {
+    ++end;
+  }
+  if (end == text || *end != '\0' || n == 0) {
+    throw std::invalid_argument("bad size '" + std::string(text) + "'");
+  }
+  return static_cast<std::size_t>(n) << shift;
+}
+
+// Number of threads for plan file lookups, from FINGER_FILE_THREADS.
+unsigned file_thread_count() {
+  const char *env = std::getenv("FINGER_FILE_THREADS");
+  if (!env || !*env) {
+    return 4;
+  }
+  const unsigned long n = std::strtoul(env, nullptr, 10);
+  return static_cast<unsigned>(std::clamp(n, 1ul, 64ul));
+}
+
+// Number of io_context threads, from FINGER_THREADS. Unset keeps the classic
+// single-threaded daemon; "auto" (or 0) means one per core.
+unsigned thread_count() {
+  const char *env = std::getenv("FINGER_THREADS");
+  if (!env || !*env) {
+    return 1;
+  }
+  const unsigned long n =
+      std::string_view(env) == "auto" ? 0 : std::strtoul(env, nullptr, 10);
+  if (n == 0) {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+  return static_cast<unsigned>(std::min(n, 256ul));
 }
 
 int main() {
   // Line-buffer stdout so docker logs / tail -f see entries in real time.
   std::setvbuf(stdout, nullptr, _IOLBF, 0);
   try {
-    boost::asio::io_context io_context(1);
-    BanTracker bans;
+    // Everything after startup goes through the logger, which writes to
+    // stdout in batches from its own thread (FINGER_LOG_FORMAT picks text,
+    // logfmt or json). Declared first so it outlives every io_context.
+    Logger::Options log_opts;
+    if (const char *env = std::getenv("FINGER_LOG_FORMAT"); env && *env) {
+      log_opts.format = parse_log_format(env);
+    }
+    Logger log(STDOUT_FILENO, log_opts);
+    // At most this many "finger drop" lines per second.
+    LogRateLimit drop_limit(20);
+    Metrics metrics;
+
+    // Everything that can be tuned without a restart (see config.hpp): from
+    // the environment, then the FINGER_CONFIG file if set, which SIGHUP
+    // reads again.
+    const Settings env_settings = settings_from_env();
+    std::filesystem::path config_path;
+    if (const char *env = std::getenv("FINGER_CONFIG"); env && *env) {
+      config_path = env;
+    }
+    const Settings startup = config_path.empty()
+                                 ? env_settings
+                                 : load_settings(config_path, env_settings);
+    LiveSettings live(startup);
+    if (!config_path.empty()) {
+      log.log("config", {{"path", config_path.string()}});
+    }
+
+    // One single-threaded io_context per thread: each connection lives
+    // entirely on the thread that accepted it, and only the ban table and
+    // plan cache are shared (both lock internally).
+    const unsigned nthreads = thread_count();
+    // Admission control: at most max_connections connections in flight,
+    // max_per_ip from any one client address, and new connections accepted
+    // at no more than accept_rate per second (0 lifts any of them).
+    // Each io_context's request deadlines, and the admission slots its
+    // connections hold. Connections give both back when their coroutine
+    // frames are destroyed, so these outlive the contexts.
+    AdmissionControl admission(startup.admission);
+    std::vector<std::unique_ptr<IdleReaper>> reapers;
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    for (unsigned i = 0; i < nthreads; ++i) {
+      contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+    }
+    boost::asio::io_context &io_context = *contexts.front();
+    // FINGER_IO_URING=1 gives each io_context an io_uring (see uring.hpp) for
+    // plan file reads and multishot accept, where the kernel allows it.
+    std::vector<std::unique_ptr<IoUring>> rings;
+    if (const char *env = std::getenv("FINGER_IO_URING");
+        env && std::string_view(env) == "1") {
+      for (auto &ctx : contexts) {
+        auto ring = IoUring::open(*ctx);
+        if (!ring) {
+          rings.clear();
+          log.log("io_uring unavailable", {{"fallback", "reactor"}});
+          break;
+        }
+        co_spawn(*ctx, ring->run(), detached);
+        rings.push_back(std::move(ring));
+      }
+      if (!rings.empty()) {
+        log.log("io_uring",
+                {{"rings", static_cast<std::uint64_t>(rings.size())}});
+      }
+    }
+    // Listening sockets, kept here so that an upgrade can close them. Each
+    // belongs to one io_context, as does its multishot accept (if any).
+    std::vector<std::unique_ptr<tcp::acceptor>> acceptors;
+    std::vector<std::unique_ptr<MultishotAcceptor>> multishot;
+    std::optional<tcp::acceptor> metrics_tcp;
+    std::optional<local::acceptor> metrics_local;
+    std::optional<local::acceptor> upgrade_acceptor;
+
+    // Optionally push bans into the host firewall (FINGER_BAN_SINK), so
+    // banned clients are dropped before they reach accept(). Declared ahead
+    // of the tracker so it outlives it.
+    std::unique_ptr<BanSink> sink;
+    if (const char *env = std::getenv("FINGER_BAN_SINK"); env && *env) {
+      try {
+        sink = make_ban_sink(env);
+        log.log("ban sink", {{"spec", env}});
+      } catch (const std::invalid_argument &e) {
+        log.log("ban sink disabled", {{"error", e.what()}});
+      }
+    }
+    // FINGER_BAN_MEMORY (bytes, or with a K/M/G suffix) caps the ban table
+    // and prefix trie: one-off offenders are then only counted in a sketch,
+    // and both are allocated once at that size. Subnet escalation blocks a
+    // whole /24 (IPv4) or /64 (IPv6) once more than subnet_threshold
+    // distinct addresses in it have offended within the window.
+    std::size_t ban_bytes = 0;
+    if (const char *env = std::getenv("FINGER_BAN_MEMORY"); env && *env) {
+      ban_bytes = parse_byte_size(env);
+    }
+    const bool exporting = sink != nullptr;
+    const auto ban_config = [ban_bytes, exporting](const Settings &s) {
+      return ban_bytes ? SharedBanTracker::bounded(
+                             s.ban, s.subnet, ban_bytes,
+                             SharedBanTracker::kDefaultShards, exporting)
+                       : SharedBanTracker::BoundedConfig{s.ban, s.subnet};
+    };
+    if (ban_bytes) {
+      const auto bounded = ban_config(startup);
+      log.log("ban table bounded",
+              {{"bytes", static_cast<std::uint64_t>(ban_bytes)},
+               {"max_tracked",
+                static_cast<std::uint64_t>(bounded.bans.max_tracked)},
+               {"max_prefix_nodes",
+                static_cast<std::uint64_t>(bounded.subnets.max_nodes)},
+               {"max_exported",
+                static_cast<std::uint64_t>(
+                    exporting ? bounded.max_exported : 0)}});
+    }
+    const auto initial = ban_config(startup);
+    SharedBanTracker bans(initial.bans, initial.subnets);
+    bans.set_sink(sink.get(), initial.max_exported);
+    bans.set_allowlist(startup.allowlist);
 
-    const char *allow_env = std::getenv("FINGER_BAN_ALLOWLIST");
-    const std::unordered_set<std::string> allowlist =
-        parse_ip_allowlist(allow_env ? allow_env : "");
-    for (const auto &ip : allowlist) {
-      std::printf("ban allowlist: %s (never tracked or blocked)\n", ip.c_str());
+    // FINGER_UPGRADE_SOCKET: if a daemon is already running with the same
+    // setting, take over its listening sockets and ban table (see
+    // handoff.hpp). Either way, listen there for the next upgrade.
+    std::filesystem::path upgrade_path;
+    int upgrade_channel = -1;
+    Handoff handoff;
+    if (const char *env = std::getenv("FINGER_UPGRADE_SOCKET"); env && *env) {
+      upgrade_path = env;
+      upgrade_channel = connect_upgrade_socket(upgrade_path);
+    }
+    if (upgrade_channel >= 0) {
+      set_handoff_timeouts(upgrade_channel);
+      handoff = receive_handoff(upgrade_channel);
+      const std::size_t n =
+          decode_ban_state(bans, handoff.ban_state,
+                           std::chrono::steady_clock::now(),
+                           std::chrono::system_clock::now());
+      log.log("upgrade received",
+              {{"sockets", static_cast<std::uint64_t>(handoff.sockets.size())},
+               {"entries", static_cast<std::uint64_t>(n)}});
+      handoff.ban_state = {};
+    }
+
+    // Warm-start from the last snapshot (FINGER_BAN_STATE), so a restart
+    // does not reset every scanner's budget. An upgrade has already brought
+    // the live table over.
+    std::filesystem::path ban_state;
+    if (const char *env = std::getenv("FINGER_BAN_STATE"); env && *env) {
+      ban_state = env;
+    }
+    if (!ban_state.empty() && upgrade_channel < 0) {
+      try {
+        const std::size_t n =
+            load_ban_state(bans, ban_state, std::chrono::steady_clock::now(),
+                           std::chrono::system_clock::now());
+        log.log("ban state restored",
+                {{"path", ban_state.string()}, {"entries", n}});
+      } catch (const std::exception &e) {
+        log.log("ban state not restored", {{"error", e.what()}});
+      }
+    }
+    // Per-address lookup rate: lookup_rate per second (default 1), in
+    // bursts of up to lookup_burst (default 20). A rate of 0 turns it off.
+    LookupLimiter lookups(startup.lookups);
+    // FINGER_MAX_PLAN_SIZE (bytes, or with a K/M/G suffix; default 1M) caps
+    // what is read of one plan file; longer plans are cut off there. Only
+    // regular files are read, so a FIFO or a link to a device is no plan.
+    std::size_t max_plan_size = kMaxPlanSize;
+    if (const char *env = std::getenv("FINGER_MAX_PLAN_SIZE"); env && *env) {
+      max_plan_size = parse_byte_size(env);
+    }
+    RealFilesystemWrapper real_fs(max_plan_size);
+    TimedFilesystemWrapper timed_fs(real_fs, metrics.file_read_latency);
+    CachingFilesystemWrapper plans(timed_fs, startup.plan_dir);
+    // Plan cache misses are looked up on FINGER_FILE_THREADS threads of
+    // their own (default 4), or through the io_uring.
+    PlanReader reader(plans, timed_fs, metrics.file_read_latency,
+                      file_thread_count(), max_plan_size);
+    // FINGER_PLAN_BUNDLE serves plans from a bundle built by finger_bundle
+    // instead of reading the users directory; it is reloaded when replaced
+    // and on SIGHUP.
+    std::unique_ptr<BundleFilesystemWrapper> bundle;
+    if (const char *env = std::getenv("FINGER_PLAN_BUNDLE"); env && *env) {
+      bundle = std::make_unique<BundleFilesystemWrapper>(env, startup.plan_dir);
+      log.log("plan bundle", {{"path", env}, {"plans", bundle->size()}});
+    }
+    const IFilesystemWrapper &serving_fs =
+        bundle ? static_cast<const IFilesystemWrapper &>(*bundle) : plans;
+
+    for (const auto &ip : startup.allowlist) {
+      log.log("ban allowlist", {{"client", ip}});
     }
 
     boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
-    signals.async_wait([&](auto, auto) { io_context.stop(); });
+    signals.async_wait([&](auto, auto) {
+      for (auto &ctx : contexts) {
+        ctx->stop();
+      }
+    });
 
-    co_spawn(io_context, listener(bans, allowlist), detached);
-    co_spawn(io_context, sweeper(bans), detached);
+    // FINGER_PORT moves the listener off port 79, e.g. to run an
+    // unprivileged instance for finger_bench. After an upgrade the port is
+    // whatever the handed-over sockets listen on.
+    unsigned short port = 79;
+    if (const char *env = std::getenv("FINGER_PORT"); env && *env) {
+      const unsigned long p = std::strtoul(env, nullptr, 10);
+      if (p == 0 || p > 65535) {
+        throw std::invalid_argument("bad FINGER_PORT '" + std::string(env) +
+                                    "'");
+      }
+      port = static_cast<unsigned short>(p);
+    }
+    // A client has request_timeout (default 10s) from accept to send its
+    // whole request; after that the connection is closed and counted as an
+    // offense.
+    Server server{bans,    live,      serving_fs, log,
+                  drop_limit, metrics, admission, lookups,
+                  bundle ? nullptr : &reader};
+    for (auto &ctx : contexts) {
+      auto &reaper = *reapers.emplace_back(
+          std::make_unique<IdleReaper>(startup.request_timeout));
+      co_spawn(*ctx, reaper.run(std::chrono::seconds(1)), detached);
+    }
+    // One listener per io_context, or per handed-over socket if there are
+    // more of those. Handed-over sockets are dealt out across the contexts;
+    // with more contexts than sockets, some share one (each accepts from it
+    // on its own thread).
+    std::vector<int> inherited;
+    int inherited_metrics = -1;
+    for (const auto &h : handoff.sockets) {
+      if (h.role == SocketRole::finger) {
+        inherited.push_back(h.fd);
+      } else if (inherited_metrics < 0) {
+        inherited_metrics = h.fd;
+      } else {
+        ::close(h.fd);
+      }
+    }
+    const std::size_t nlisteners = std::max(contexts.size(), inherited.size());
+    for (std::size_t i = 0; i < nlisteners; ++i) {
+      auto &ctx = *contexts[i % contexts.size()];
+      if (inherited.empty()) {
+        acceptors.push_back(std::make_unique<tcp::acceptor>(
+            make_acceptor(ctx, port, nthreads > 1)));
+      } else {
+        const int fd = i < inherited.size()
+                           ? inherited[i]
+                           : ::dup(inherited[i % inherited.size()]);
+        acceptors.push_back(
+            std::make_unique<tcp::acceptor>(adopt_acceptor(ctx, fd)));
+      }
+      IoUring *ring =
+          rings.empty() ? nullptr : rings[i % contexts.size()].get();
+      multishot.push_back(ring ? std::make_unique<MultishotAcceptor>(
+                                     *ring, acceptors.back()->native_handle())
+                               : nullptr);
+      // Each listener gets an equal share of the accept rate.
+      co_spawn(ctx,
+               listener(*acceptors.back(), server,
+                        *reapers[i % contexts.size()], nlisteners, ring,
+                        multishot.back().get()),
+               detached);
+    }
+    co_spawn(io_context, sweeper(bans, ban_state, log, metrics), detached);
 
+    // Metrics for Prometheus on FINGER_METRICS_ADDR, e.g. 127.0.0.1:9179 or
+    // unix:/var/run/fingerd/metrics.sock. Off unless set.
+    metrics.add_gauge("finger_tracked_ips", "Client IPs in the ban table.",
+                      [&bans] { return static_cast<double>(bans.tracked()); });
+    metrics.add_gauge(
+        "finger_connections_in_flight", "Client connections being served.",
+        [&admission] { return static_cast<double>(admission.in_flight()); });
+    metrics.add_gauge(
+        "finger_ban_table_bytes", "Memory held by the ban table.",
+        [&bans] { return static_cast<double>(bans.memory_bytes()); });
+    metrics.add_gauge(
+        "finger_tracked_prefixes", "Prefixes tracked for subnet escalation.",
+        [&bans] { return static_cast<double>(bans.tracked_prefixes()); });
+    metrics.add_gauge("finger_plan_cache_hit_ratio",
+                      "Share of plan lookups answered from the cache.",
+                      [&plans] {
+                        const auto st = plans.stats();
+                        const double hits = st.hits + st.negative_hits;
+                        const double total = hits + st.misses;
+                        return total > 0 ? hits / total : 0.0;
+                      });
+    metrics.add_gauge(
+        "finger_plan_reads_coalesced",
+        "Plan lookups that shared a read already in flight.",
+        [&reader] { return static_cast<double>(reader.coalesced()); });
+    metrics.add_gauge(
+        "finger_log_dropped", "Log lines lost to a full log queue.",
+        [&log] { return static_cast<double>(log.dropped()); });
+    if (sink) {
+      metrics.add_gauge(
+          "finger_ban_sink_failures",
+          "Ban transitions that did not reach the firewall.",
+          [&sink] { return static_cast<double>(sink->failures()); });
+      metrics.add_gauge(
+          "finger_ban_exports_dropped",
+          "Blocks kept out of the firewall because its share of "
+          "FINGER_BAN_MEMORY was full.",
+          [&bans] { return static_cast<double>(bans.dropped_exports()); });
+    }
+    if (bundle) {
+      metrics.add_gauge(
+          "finger_plan_bundle_plans", "Plans in the plan bundle being served.",
+          [&bundle] { return static_cast<double>(bundle->size()); });
+    }
+    if (const char *env = std::getenv("FINGER_METRICS_ADDR"); env && *env) {
+      const MetricsEndpoint where = parse_metrics_address(env);
+      if (const auto *ep = std::get_if<tcp::endpoint>(&where)) {
+        metrics_tcp.emplace(
+            metrics_acceptor<tcp>(io_context, *ep, inherited_metrics));
+        co_spawn(io_context, metrics_server<tcp>(*metrics_tcp, metrics),
+                 detached);
+      } else {
+        metrics_local.emplace(metrics_acceptor<local>(
+            io_context, std::get<local::endpoint>(where), inherited_metrics));
+        co_spawn(io_context, metrics_server<local>(*metrics_local, metrics),
+                 detached);
+      }
+      inherited_metrics = -1;
+      log.log("metrics", {{"listen", env}});
+    }
+    if (inherited_metrics >= 0) {
+      ::close(inherited_metrics);
+    }
+    // Apply a reloaded config file. Connections already accepted keep the
+    // settings they started with; the ban table is only rebuilt if its
+    // parameters changed. A bad file is logged and changes nothing.
+    const auto reload_config = [&] {
+      Settings next;
+      try {
+        next = load_settings(config_path, env_settings);
+      } catch (const std::exception &e) {
+        log.log("config reload failed", {{"error", e.what()}});
+        return;
+      }
+      const auto current = live.get();
+      if (bundle && next.plan_dir != current->plan_dir) {
+        // The bundle's names are mapped under the directory it was opened
+        // with.
+        log.log("config plan_dir ignored", {{"reason", "plan bundle"}});
+        next.plan_dir = current->plan_dir;
+      }
+      const auto configs = ban_config(next);
+      bans.reconfigure(configs.bans, configs.subnets,
+                       std::chrono::steady_clock::now());
+      bans.set_allowlist(next.allowlist);
+      admission.set_limits(next.admission);
+      lookups.set_rate(next.lookups.rate, next.lookups.burst);
+      plans.set_dir(next.plan_dir);
+      // Each reaper belongs to its io_context's thread.
+      for (std::size_t i = 0; i < contexts.size(); ++i) {
+        boost::asio::post(*contexts[i],
+                          [&reaper = *reapers[i], t = next.request_timeout] {
+                            reaper.set_timeout(t);
+                          });
+      }
+      log.log("config reloaded",
+              {{"path", config_path.string()},
+               {"allowlist",
+                static_cast<std::uint64_t>(next.allowlist.size())}});
+      live.set(std::move(next));
+    };
+    if (!config_path.empty() || bundle) {
+      co_spawn(io_context, hangup([&] {
+                 if (!config_path.empty()) {
+                   reload_config();
+                 }
+                 if (bundle) {
+                   reload_bundle(*bundle, log, true);
+                 }
+               }),
+               detached);
+    }
+    if (bundle) {
+      co_spawn(io_context, plan_bundle_watcher(*bundle, log), detached);
+    } else if (plans.watch_fd() >= 0) {
+      co_spawn(io_context, plan_cache_watcher(plans, log), detached);
+    } else {
+      log.log("plan cache no change notifications", {{"fallback", "ttl"}});
+    }
+    if (nthreads > 1) {
+      log.log("serving", {{"threads", static_cast<std::int64_t>(nthreads)}});
+    }
+
+    // Everything is listening: let the daemon being replaced stop accepting,
+    // and take its place on the upgrade socket.
+    if (upgrade_channel >= 0) {
+      try {
+        confirm_handoff(upgrade_channel);
+      } catch (const std::exception &e) {
+        // It gave up waiting; both daemons now serve the same sockets.
+        log.log("upgrade not confirmed", {{"error", e.what()}});
+      }
+      ::close(upgrade_channel);
+    }
+    bool handed_off = false;
+    // Runs the blocking part of a handoff. Declared after bans, so that it
+    // is joined before the table it reads goes away.
+    std::optional<boost::asio::thread_pool> handoff_worker;
+    if (!upgrade_path.empty()) {
+      handoff_worker.emplace(1);
+      ::unlink(upgrade_path.c_str());
+      upgrade_acceptor.emplace(io_context, local::endpoint(upgrade_path));
+      // Whoever connects gets the port, so only the daemon's own user may.
+      std::filesystem::permissions(upgrade_path,
+                                   std::filesystem::perms::owner_read |
+                                       std::filesystem::perms::owner_write);
+      std::vector<HandedSocket> sockets;
+      for (const auto &a : acceptors) {
+        sockets.push_back({a->native_handle(), SocketRole::finger});
+      }
+      if (metrics_tcp) {
+        sockets.push_back({metrics_tcp->native_handle(), SocketRole::metrics});
+      } else if (metrics_local) {
+        sockets.push_back(
+            {metrics_local->native_handle(), SocketRole::metrics});
+      }
+      co_spawn(io_context,
+               upgrade_server(*upgrade_acceptor, bans, std::move(sockets), log,
+                              handoff_worker->get_executor(), [&] {
+                                // Stop accepting everywhere, then wait for
+                                // the connections in flight.
+                                handed_off = true;
+                                upgrade_acceptor->close();
+                                for (std::size_t i = 0; i < acceptors.size();
+                                     ++i) {
+                                  boost::asio::post(
+                                      acceptors[i]->get_executor(),
+                                      [&a = acceptors[i], &m = multishot[i]] {
+                                        if (m) {
+                                          m->stop();
+                                        }
+                                        a->close();
+                                      });
+                                }
+                                if (metrics_tcp) {
+                                  metrics_tcp->close();
+                                }
+                                if (metrics_local) {
+                                  metrics_local->close();
+                                }
+                                co_spawn(io_context,
+                                         drain(admission, contexts, log),
+                                         detached);
+                              }),
+               detached);
+    }
+
+    // Each io_context thread recycles the small blocks its connections
+    // allocate (coroutine frames, operation state) instead of returning
+    // them to malloc() (see blockcache.hpp).
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < nthreads; ++i) {
+      threads.emplace_back([&ctx = *contexts[i], &log] {
+        ThreadBlockCache::enable();
+        try {
+          ctx.run();
+        } catch (std::exception &e) {
+          log.log("fatal exception", {{"error", e.what()}});
+        }
+        ThreadBlockCache::disable();
+      });
+    }
+    ThreadBlockCache::enable();
     io_context.run();
+    ThreadBlockCache::disable();
+    for (auto &t : threads) {
+      t.join();
+    }
+    // Stopped by SIGINT/SIGTERM: keep the current bans for the next start.
+    // After an upgrade the new daemon has them, and snapshots them itself.
+    if (!handed_off) {
+      bans.sweep(std::chrono::steady_clock::now());
+      save_bans(bans, ban_state, log);
+    }
   } catch (std::exception &e) {
     std::printf("fatal exception: %s\n", e.what());
   }
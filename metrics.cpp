@@ -0,0 +1,200 @@
+#include "metrics.hpp"
+
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+#include <boost/asio/ip/address.hpp>
+
+void LatencyHistogram::record(std::chrono::nanoseconds d) {
+  const auto ns = d.count() > 0 ? static_cast<std::uint64_t>(d.count()) : 0;
+  const std::uint64_t us = (ns + 999) / 1000;
+  // Smallest i with us <= 2^i.
+  const std::size_t i =
+      us <= 1 ? 0 : static_cast<std::size_t>(std::bit_width(us - 1));
+  buckets_[i < kBuckets ? i : kBuckets].fetch_add(1, std::memory_order_relaxed);
+  sum_us_.fetch_add(us, std::memory_order_relaxed);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+  // Not an atomic snapshot across buckets, which Prometheus tolerates; the
+  // count is derived from the buckets so the two always agree.
+  Snapshot s;
+  for (std::size_t i = 0; i <= kBuckets; ++i) {
+    s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    s.count += s.buckets[i];
+  }
+  s.sum_us = sum_us_.load(std::memory_order_relaxed);
+  return s;
+}
+
+void Metrics::add_gauge(std::string name, std::string help,
+                        std::function<double()> read) {
+  gauges_.push_back(Gauge{std::move(name), std::move(help), std::move(read)});
+}
+
+namespace {
+
+void header(std::string &out, const char *name, const char *help,
+            const char *type) {
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+void counter(std::string &out, const char *name, const char *help,
+             const Counter &c) {
+  header(out, name, help, "counter");
+  out += name;
+  out += ' ';
+  out += std::to_string(c.value());
+  out += '\n';
+}
+
+std::string format_double(double v) {
+  char buf[32];
+  std::snprintf(buf, sizeof buf, "%.9g", v);
+  return buf;
+}
+
+void histogram(std::string &out, const char *name, const char *help,
+               const LatencyHistogram &h) {
+  header(out, name, help, "histogram");
+  const auto s = h.snapshot();
+  std::uint64_t cumulative = 0;
+  for (std::size_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+    cumulative += s.buckets[i];
+    out += name;
+    out += "_bucket{le=\"";
+    out += format_double(LatencyHistogram::bound_us(i) / 1e6);
+    out += "\"} ";
+    out += std::to_string(cumulative);
+    out += '\n';
+  }
+  out += name;
+  out += "_bucket{le=\"+Inf\"} ";
+  out += std::to_string(s.count);
+  out += '\n';
+  out += name;
+  out += "_sum ";
+  out += format_double(s.sum_us / 1e6);
+  out += '\n';
+  out += name;
+  out += "_count ";
+  out += std::to_string(s.count);
+  out += '\n';
+}
+
+} // namespace
+
+std::string Metrics::render() const {
+  std::string out;
+  counter(out, "finger_accepts_total", "Connections accepted.", accepts);
+  counter(out, "finger_plan_hits_total", "Requests answered with a plan.",
+          plan_hits);
+  counter(out, "finger_misses_total", "Requests for a name with no plan.",
+          misses);
+  counter(out, "finger_invalid_input_total",
+          "Requests rejected by input validation.", invalid_input);
+  counter(out, "finger_blocked_drops_total",
+          "Connections dropped because the client is banned.", blocked_drops);
+  counter(out, "finger_timeouts_total",
+          "Connections closed for not sending a request in time.", timeouts);
+  counter(out, "finger_refused_total",
+          "User listings and forwarding requests turned down.", refused);
+  counter(out, "finger_throttled_total",
+          "Lookups refused for exceeding the per-address lookup rate.",
+          throttled);
+  counter(out, "finger_per_ip_drops_total",
+          "Connections closed because their address had too many open.",
+          per_ip_drops);
+  counter(out, "finger_accept_capacity_pauses_total",
+          "Times accepting paused because every connection slot was in use.",
+          capacity_pauses);
+  counter(out, "finger_accept_rate_pauses_total",
+          "Times accepting paused for the accept rate limit.", rate_pauses);
+  header(out, "finger_rejected_total",
+         "Connections closed unanswered because the request was another "
+         "protocol.",
+         "counter");
+  for (std::size_t p = 1; p < kProtocolCount; ++p) {
+    out += "finger_rejected_total{protocol=\"";
+    out += protocol_name(static_cast<Protocol>(p));
+    out += "\"} ";
+    out += std::to_string(rejected[p].value());
+    out += '\n';
+  }
+  histogram(out, "finger_request_duration_seconds",
+            "Time from accept to the response being written.",
+            request_latency);
+  histogram(out, "finger_file_read_duration_seconds",
+            "Time to read a plan file from disk.", file_read_latency);
+  histogram(out, "finger_ban_sweep_duration_seconds",
+            "Time taken by each sweep of banned prefixes and firewall blocks.",
+            sweep_duration);
+  histogram(out, "finger_ban_expire_duration_seconds",
+            "Time taken by each tick of ban table expiry.", expire_duration);
+  for (const auto &g : gauges_) {
+    header(out, g.name.c_str(), g.help.c_str(), "gauge");
+    out += g.name;
+    out += ' ';
+    out += format_double(g.read());
+    out += '\n';
+  }
+  return out;
+}
+
+std::string
+TimedFilesystemWrapper::read_file(const std::filesystem::path &path) const {
+  const auto start = std::chrono::steady_clock::now();
+  std::string content = backing_.read_file(path);
+  reads_.record(std::chrono::steady_clock::now() - start);
+  return content;
+}
+
+MetricsEndpoint parse_metrics_address(std::string_view spec) {
+  if (spec.starts_with("unix:")) {
+    const std::string_view path = spec.substr(5);
+    if (!path.empty()) {
+      return boost::asio::local::stream_protocol::endpoint(std::string(path));
+    }
+  } else if (const auto colon = spec.rfind(':');
+             colon != std::string_view::npos && colon + 1 < spec.size()) {
+    std::string_view host = spec.substr(0, colon);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+      host = host.substr(1, host.size() - 2);
+    }
+    const std::string port_str(spec.substr(colon + 1));
+    char *end = nullptr;
+    const unsigned long port = std::strtoul(port_str.c_str(), &end, 10);
+    boost::system::error_code ec;
+    const auto addr = boost::asio::ip::make_address(std::string(host), ec);
+    if (!ec && *end == '\0' && port > 0 && port <= 65535) {
+      return boost::asio::ip::tcp::endpoint(
+          addr, static_cast<unsigned short>(port));
+    }
+  }
+  throw std::invalid_argument("bad metrics address '" + std::string(spec) +
+                              "' (expected HOST:PORT or unix:PATH)");
+}
+
+std::string metrics_http_response(std::string_view request,
+                                  const Metrics &metrics) {
+  const std::string_view line = request.substr(0, request.find("\r\n"));
+  const bool ok = line.starts_with("GET /metrics ") || line.starts_with("GET / ");
+  const std::string body = ok ? metrics.render() : "not found\n";
+  std::string out = ok ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n";
+  out += ok ? "Content-Type: text/plain; version=0.0.4\r\n"
+            : "Content-Type: text/plain\r\n";
+  out += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  out += "Connection: close\r\n\r\n";
+  out += body;
+  return out;
+}
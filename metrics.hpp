@@ -0,0 +1,127 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include "handler.hpp"
+#include "validate.hpp"
+
+// A monotonically increasing count. inc() is a single relaxed atomic add;
+// each counter has its own cache line so threads bumping different counters
+// do not contend.
+class alignas(64) Counter {
+public:
+  void inc(std::uint64_t n = 1) { v_.fetch_add(n, std::memory_order_relaxed); }
+  std::uint64_t value() const { return v_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<std::uint64_t> v_{0};
+};
+
+// Latency histogram with fixed power-of-two buckets: bucket i counts
+// durations up to 2^i microseconds (1us .. ~8.4s), plus an overflow bucket.
+// record() is two relaxed atomic adds -- no lock, no allocation.
+class LatencyHistogram {
+public:
+  static constexpr std::size_t kBuckets = 24;
+
+  struct Snapshot {
+    std::array<std::uint64_t, kBuckets + 1> buckets{}; // not cumulative
+    std::uint64_t count = 0;
+    std::uint64_t sum_us = 0;
+  };
+
+  void record(std::chrono::nanoseconds d);
+  Snapshot snapshot() const;
+
+  // Upper bound of bucket i, in microseconds.
+  static std::uint64_t bound_us(std::size_t i) { return std::uint64_t{1} << i; }
+
+private:
+  std::array<std::atomic<std::uint64_t>, kBuckets + 1> buckets_{};
+  std::atomic<std::uint64_t> sum_us_{0};
+};
+
+// The daemon's metrics, rendered in the Prometheus text exposition format.
+// Counters and histograms are updated directly by the request path; gauges
+// are callbacks read at scrape time (for state that already lives elsewhere,
+// like the number of tracked IPs). Register gauges before serving.
+class Metrics {
+public:
+  Counter accepts;        // connections accepted
+  Counter plan_hits;      // requests answered with a plan
+  Counter misses;         // requests for a name with no plan
+  Counter invalid_input;  // requests rejected by input validation
+  Counter blocked_drops;  // connections dropped because the client is banned
+  Counter timeouts;       // connections closed before sending a whole request
+  Counter refused;        // user listings and forwarding requests turned down
+  Counter throttled;      // lookups refused for the per-address lookup rate
+  Counter per_ip_drops;   // connections closed: too many open from one address
+  Counter capacity_pauses; // accept() paused: every connection slot in use
+  Counter rate_pauses;     // accept() paused: accept rate limit reached
+  // Connections closed unanswered because their first bytes were another
+  // protocol's (indexed by Protocol; the finger slot stays at zero).
+  std::array<Counter, kProtocolCount> rejected;
+  LatencyHistogram request_latency; // accept to response written
+  LatencyHistogram file_read_latency; // plan file reads that hit the disk
+  LatencyHistogram sweep_duration;    // prefix and blocklist sweeps
+  LatencyHistogram expire_duration;   // ban table expiry ticks
+
+  void add_gauge(std::string name, std::string help,
+                 std::function<double()> read);
+
+  std::string render() const;
+
+private:
+  struct Gauge {
+    std::string name;
+    std::string help;
+    std::function<double()> read;
+  };
+  std::vector<Gauge> gauges_;
+};
+
+// Passes everything through to another IFilesystemWrapper, timing each
+// read_file() into a histogram. Sits under the plan cache so that only reads
+// that actually touch the disk are measured.
+class TimedFilesystemWrapper : public IFilesystemWrapper {
+public:
+  TimedFilesystemWrapper(const IFilesystemWrapper &backing,
+                         LatencyHistogram &reads)
+      : backing_(backing), reads_(reads) {}
+
+  bool exists(const std::filesystem::path &path) const override {
+    return backing_.exists(path);
+  }
+  std::string read_file(const std::filesystem::path &path) const override;
+
+private:
+  const IFilesystemWrapper &backing_;
+  LatencyHistogram &reads_;
+};
+
+// Where to serve metrics, from FINGER_METRICS_ADDR: "HOST:PORT" (an IP
+// literal; IPv6 in brackets, e.g. "[::1]:9179") or "unix:/path/to/socket".
+// Throws std::invalid_argument for anything else.
+using MetricsEndpoint =
+    std::variant<boost::asio::ip::tcp::endpoint,
+                 boost::asio::local::stream_protocol::endpoint>;
+MetricsEndpoint parse_metrics_address(std::string_view spec);
+
+// Build the HTTP response for one scrape request (the request line and
+// headers, already read). GET /metrics (or /) gets the metrics; anything else
+// a 404.
+std::string metrics_http_response(std::string_view request,
+                                  const Metrics &metrics);
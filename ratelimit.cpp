@@ -0,0 +1,71 @@
+#include "ratelimit.hpp"
+#include "hash.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <random>
+
+LookupLimiter::LookupLimiter(Config cfg)
+    : LookupLimiter(cfg, (std::uint64_t{std::random_device{}()} << 32) ^
+                             std::random_device{}()) {}
+
+LookupLimiter::LookupLimiter(Config cfg, std::uint64_t seed)
+    : cfg_(cfg), seed_(seed) {
+  cfg_.width = std::bit_ceil(std::max<std::size_t>(cfg_.width, 1));
+  cfg_.depth = std::max<std::size_t>(cfg_.depth, 1);
+  cfg_.burst = std::max(cfg_.burst, 1.0);
+  mask_ = cfg_.width - 1;
+  set_rate(cfg_.rate, cfg_.burst);
+  // Allocated even while disabled, so that set_rate() can turn it on.
+  cells_size_ = cfg_.width * cfg_.depth;
+  cells_ = std::make_unique<Cell[]>(cells_size_);
+  for (std::size_t i = 0; i < cells_size_; ++i) {
+    cells_[i].store(std::numeric_limits<std::int64_t>::min(),
+                    std::memory_order_relaxed);
+  }
+}
+
+std::size_t LookupLimiter::cell(std::uint64_t hash, std::size_t row) const {
+  return row * cfg_.width + (mix64(hash ^ (seed_ + row)) & mask_);
+}
+
+void LookupLimiter::set_rate(double rate, double burst) {
+  const std::int64_t interval =
+      rate > 0 ? static_cast<std::int64_t>(1e9 / rate) : 0;
+  // Set the tolerance first: a reader that sees the new interval with the
+  // old tolerance only errs for one lookup.
+  tolerance_.store(static_cast<std::int64_t>((std::max(burst, 1.0) - 1) *
+                                             static_cast<double>(interval)),
+                   std::memory_order_relaxed);
+  interval_.store(interval, std::memory_order_relaxed);
+}
+
+bool LookupLimiter::allow(const IpKey &ip, clock::time_point now) {
+  const std::int64_t interval = interval_.load(std::memory_order_relaxed);
+  if (interval <= 0) {
+    return true;
+  }
+  const std::int64_t tolerance = tolerance_.load(std::memory_order_relaxed);
+  const std::int64_t t =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          now.time_since_epoch())
+          .count();
+  const std::uint64_t hash = ip.hash();
+  std::int64_t tat = std::numeric_limits<std::int64_t>::max();
+  for (std::size_t row = 0; row < cfg_.depth; ++row) {
+    tat = std::min(tat, cells_[cell(hash, row)].load(std::memory_order_relaxed));
+  }
+  if (tat > t + tolerance) {
+    return false;
+  }
+  const std::int64_t next = std::max(tat, t) + interval;
+  for (std::size_t row = 0; row < cfg_.depth; ++row) {
+    Cell &c = cells_[cell(hash, row)];
+    std::int64_t cur = c.load(std::memory_order_relaxed);
+    while (cur < next &&
+           !c.compare_exchange_weak(cur, next, std::memory_order_relaxed)) {
+    }
+  }
+  return true;
+}
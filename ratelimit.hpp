@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "ban.hpp"
+
+// Per-address rate limit for lookups, in fixed memory.
+//
+// BanTracker only counts failures, so on its own nothing stops a client
+// fingering a real plan thousands of times a second. LookupLimiter gives
+// every address a token bucket -- `rate` lookups per second, up to `burst`
+// at once -- without keeping any per-address state: the buckets live in a
+// count-min sketch of `depth` rows of `width` cells, and an address uses one
+// cell per row, chosen by a hash seeded at startup so that nobody can aim
+// for a neighbour's cells.
+//
+// Each cell holds a bucket in GCRA form, as the time at which it would next
+// be full ("theoretical arrival time"). A lookup is allowed if the emptiest
+// of the address's cells (the earliest TAT) has a token, and then charges
+// every one of its cells up to that bucket's new level (the sketch's
+// conservative update). Addresses that share a cell can only drain it
+// faster, so a collision can make the limit stricter but never looser; an
+// occasional client is only throttled if every one of its cells is shared
+// with a heavy hitter. Memory is depth * width * 8 bytes, however many
+// addresses show up.
+//
+// Cells are relaxed atomics, so allow() takes no lock from any thread. A
+// race between two threads can let one extra lookup through, never more.
+// The rate and burst can be changed in place with set_rate(): cells hold
+// times rather than token counts, so they stay meaningful under the new
+// rate.
+class LookupLimiter {
+public:
+  using clock = std::chrono::steady_clock;
+
+  struct Config {
+    double rate = 1;    // lookups per second, sustained; 0 disables
+    double burst = 20;  // lookups allowed back to back
+    std::size_t width = 4096; // cells per row (rounded up to a power of two)
+    std::size_t depth = 4;    // rows
+  };
+
+  explicit LookupLimiter(Config cfg);
+  // With a fixed hash seed, for tests.
+  LookupLimiter(Config cfg, std::uint64_t seed);
+
+  bool enabled() const {
+    return interval_.load(std::memory_order_relaxed) > 0;
+  }
+
+  // Charge one lookup to ip at `now`; false if it is over its rate.
+  bool allow(const IpKey &ip, clock::time_point now);
+
+  // Change the rate and burst (a rate of 0 disables the limit). Safe to call
+  // while other threads are in allow().
+  void set_rate(double rate, double burst);
+
+  std::size_t memory_bytes() const { return cells_size_ * sizeof(Cell); }
+  // As constructed: set_rate() does not change it.
+  const Config &config() const { return cfg_; }
+
+private:
+  using Cell = std::atomic<std::int64_t>; // TAT, steady clock nanoseconds
+
+  std::size_t cell(std::uint64_t hash, std::size_t row) const;
+
+  Config cfg_;
+  std::uint64_t seed_;
+  std::size_t mask_;
+  std::atomic<std::int64_t> interval_{0};  // nanoseconds per token
+  std::atomic<std::int64_t> tolerance_{0}; // how far ahead of now a TAT may run
+  std::size_t cells_size_;
+  std::unique_ptr<Cell[]> cells_;
+};
@@ -0,0 +1,169 @@
+#include "reader.hpp"
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/post.hpp>
+#include <algorithm>
+#include <chrono>
+
+#include "metrics.hpp"
+#include "uring.hpp"
+
+struct PlanReader::Waiter {
+  virtual ~Waiter() = default;
+  virtual void complete(std::exception_ptr error, PlanBody body) = 0;
+};
+
+// Resumes one waiting lookup on its own executor.
+template <typename Handler> struct PlanReader::HandlerWaiter : Waiter {
+  explicit HandlerWaiter(Handler h) : handler(std::move(h)) {}
+
+  void complete(std::exception_ptr error, PlanBody body) override {
+    auto ex = boost::asio::get_associated_executor(handler);
+    boost::asio::post(ex, [h = std::move(handler), error,
+                           body = std::move(body)]() mutable {
+      std::move(h)(error, std::move(body));
+    });
+  }
+
+  Handler handler;
+};
+
+PlanReader::PlanReader(CachingFilesystemWrapper &cache,
+                       const IFilesystemWrapper &backing,
+                       LatencyHistogram &reads, std::size_t threads,
+                       std::size_t max_plan_size)
+    : cache_(cache), backing_(backing), read_latency_(reads),
+      max_plan_size_(max_plan_size), pool_(std::max<std::size_t>(threads, 1)) {}
+
+PlanReader::~PlanReader() {
+  pool_.stop();
+  pool_.join();
+}
+
+boost::asio::awaitable<Reply>
+PlanReader::finger(std::string_view username,
+                   const std::filesystem::path &plan_dir, IoUring *ring) {
+  std::string name;
+  std::uint64_t generation;
+  if (auto settled = settle(username, plan_dir, name, generation)) {
+    co_return std::move(*settled);
+  }
+  co_return plan_reply(username,
+                       co_await load(plan_dir / name, generation, ring));
+}
+
+std::optional<Reply>
+PlanReader::try_finger(std::string_view username,
+                       const std::filesystem::path &plan_dir) const {
+  std::string name;
+  std::uint64_t generation;
+  return settle(username, plan_dir, name, generation);
+}
+
+std::optional<Reply> PlanReader::settle(std::string_view username,
+                                        const std::filesystem::path &plan_dir,
+                                        std::string &name,
+                                        std::uint64_t &generation) const {
+  if (auto settled = resolve_plan_name(username, name)) {
+    return settled;
+  }
+  if (auto cached = cache_.find(plan_dir, name, generation)) {
+    return plan_reply(username, std::move(*cached));
+  }
+  return std::nullopt;
+}
+
+boost::asio::awaitable<PlanBody>
+PlanReader::load(std::filesystem::path path, std::uint64_t generation,
+                 IoUring *ring) {
+  co_return co_await boost::asio::async_initiate<
+      decltype(boost::asio::deferred), void(std::exception_ptr, PlanBody)>(
+      [&](auto handler) {
+        bool first;
+        {
+          std::lock_guard lock(mu_);
+          auto [it, inserted] = pending_.try_emplace(path.native());
+          it->second.push_back(
+              std::make_unique<HandlerWaiter<decltype(handler)>>(
+                  std::move(handler)));
+          first = inserted;
+          ++(first ? reads_ : coalesced_);
+        }
+        if (first) {
+          start(path, generation, ring);
+        }
+      },
+      boost::asio::deferred);
+}
+
+void PlanReader::start(const std::filesystem::path &path,
+                       std::uint64_t generation, IoUring *ring) {
+  if (ring) {
+    boost::asio::co_spawn(ring->get_executor(),
+                          read_through(*ring, path, generation),
+                          boost::asio::detached);
+    return;
+  }
+  boost::asio::post(pool_, [this, path, generation] {
+    std::exception_ptr error;
+    std::optional<PlanBody> content;
+    try {
+      if (backing_.exists(path)) {
+        content = backing_.read_plan(path);
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+    finish(path, error, std::move(content), generation);
+  });
+}
+
+boost::asio::awaitable<void>
+PlanReader::read_through(IoUring &ring, std::filesystem::path path,
+                         std::uint64_t generation) {
+  std::exception_ptr error;
+  std::optional<PlanBody> content;
+  try {
+    const auto start = std::chrono::steady_clock::now();
+    if (auto bytes = co_await ring.read_file(path, max_plan_size_)) {
+      content = PlanBody(crlf_terminate(std::move(*bytes)));
+    }
+    read_latency_.record(std::chrono::steady_clock::now() - start);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  finish(path, error, std::move(content), generation);
+}
+
+void PlanReader::finish(const std::filesystem::path &path,
+                        std::exception_ptr error,
+                        std::optional<PlanBody> content,
+                        std::uint64_t generation) {
+  // Cached before the lookup leaves pending_, so that nobody finds neither.
+  const PlanBody body =
+      error ? PlanBody() : cache_.store(path, std::move(content), generation);
+  Waiters waiters;
+  {
+    std::lock_guard lock(mu_);
+    auto it = pending_.find(path.native());
+    waiters = std::move(it->second);
+    pending_.erase(it);
+  }
+  for (auto &w : waiters) {
+    w->complete(error, body);
+  }
+}
+
+std::uint64_t PlanReader::reads() const {
+  std::lock_guard lock(mu_);
+  return reads_;
+}
+
+std::uint64_t PlanReader::coalesced() const {
+  std::lock_guard lock(mu_);
+  return coalesced_;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include "cache.hpp"
+#include "handler.hpp"
+
+class IoUring;
+class LatencyHistogram;
+
+// PlanReader answers finger lookups without blocking the io_context thread
+// that asks. Plan cache hits are answered straight away. A miss is looked up
+// on a small pool of threads of its own (or, given the caller's io_uring,
+// read through that), and the caller resumes on its own executor once the
+// result is in, so a slow stat or read on the users directory (an NFS mount,
+// a busy disk) only holds up the connections waiting for that plan.
+//
+// Concurrent misses for the same file share one lookup: whoever asks while
+// it is in flight waits for its result instead of going to the disk again,
+// which keeps a burst of requests for a plan just evicted by an edit down to
+// one read. The pool's threads are fixed; its queue is at most one lookup
+// per distinct name in flight, and so bounded by the connection limit.
+//
+// Shared by every io_context thread; finger() may be called from any of
+// them.
+class PlanReader {
+public:
+  // Misses are looked up in backing (the wrapper behind cache) on threads
+  // pool threads; reads through an io_uring are timed into reads and cut
+  // off at max_plan_size, as RealFilesystemWrapper does.
+  PlanReader(CachingFilesystemWrapper &cache, const IFilesystemWrapper &backing,
+             LatencyHistogram &reads, std::size_t threads,
+             std::size_t max_plan_size = kMaxPlanSize);
+  // Stops the pool. Lookups still queued are dropped, and whoever is waiting
+  // for them is never resumed; only destroy it once the io_contexts have
+  // stopped.
+  ~PlanReader();
+
+  PlanReader(const PlanReader &) = delete;
+  PlanReader &operator=(const PlanReader &) = delete;
+
+  // finger(username, cache, plan_dir), without blocking. username must stay
+  // valid until it completes. ring, if given, must belong to the calling
+  // io_context. Filesystem errors are rethrown here.
+  boost::asio::awaitable<Reply> finger(std::string_view username,
+                                       const std::filesystem::path &plan_dir,
+                                       IoUring *ring = nullptr);
+  // finger(), if it can be answered without reading a file (invalid input,
+  // a cache hit), or nullopt. Never blocks, and saves a coroutine frame on
+  // the common path.
+  std::optional<Reply> try_finger(std::string_view username,
+                                  const std::filesystem::path &plan_dir) const;
+
+  // Lookups that went to the disk, and those that joined one already in
+  // flight instead.
+  std::uint64_t reads() const;
+  std::uint64_t coalesced() const;
+
+private:
+  struct Waiter;
+  template <typename Handler> struct HandlerWaiter;
+  using Waiters = std::vector<std::unique_ptr<Waiter>>;
+
+  // The reply if no file has to be read; otherwise nullopt, with name set
+  // to the plan file's and generation to pass on to the cache's store().
+  std::optional<Reply> settle(std::string_view username,
+                              const std::filesystem::path &plan_dir,
+                              std::string &name,
+                              std::uint64_t &generation) const;
+  // The plan at path for a cache miss, shared with any lookup of it already
+  // in flight.
+  boost::asio::awaitable<PlanBody> load(std::filesystem::path path,
+                                        std::uint64_t generation,
+                                        IoUring *ring);
+  void start(const std::filesystem::path &path, std::uint64_t generation,
+             IoUring *ring);
+  boost::asio::awaitable<void> read_through(IoUring &ring,
+                                            std::filesystem::path path,
+                                            std::uint64_t generation);
+  // Cache the result of a lookup and hand it to everyone waiting for it.
+  void finish(const std::filesystem::path &path, std::exception_ptr error,
+              std::optional<PlanBody> content, std::uint64_t generation);
+
+  CachingFilesystemWrapper &cache_;
+  const IFilesystemWrapper &backing_;
+  LatencyHistogram &read_latency_;
+  const std::size_t max_plan_size_;
+
+  mutable std::mutex mu_;
+  std::unordered_map<std::string, Waiters> pending_; // by path
+  std::uint64_t reads_ = 0;
+  std::uint64_t coalesced_ = 0;
+
+  // Last, so that it stops before the rest goes.
+  boost::asio::thread_pool pool_;
+};
@@ -0,0 +1,56 @@
+#include "reaper.hpp"
+
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
+
+IdleReaper::Registration::~Registration() {
+  if (reaper_) {
+    auto &from = entry_->reaped ? reaper_->reaped_ : reaper_->pending_;
+    reaper_->spare_.splice(reaper_->spare_.end(), from, entry_);
+  }
+}
+
+IdleReaper::Registration
+IdleReaper::add(boost::asio::ip::tcp::socket &socket,
+                std::chrono::steady_clock::time_point now) {
+  if (spare_.empty()) {
+    pending_.push_back({now + timeout_, &socket});
+  } else {
+    spare_.front() = {now + timeout_, &socket};
+    pending_.splice(pending_.end(), spare_, spare_.begin());
+  }
+  return Registration(*this, std::prev(pending_.end()));
+}
+
+std::size_t IdleReaper::reap(std::chrono::steady_clock::time_point now) {
+  std::size_t n = 0;
+  while (!pending_.empty() && pending_.front().deadline <= now) {
+    Entry &e = pending_.front();
+    e.reaped = true;
+    // Closing completes the owner's pending read with operation_aborted and
+    // gives the descriptor back straight away.
+    boost::system::error_code ignored;
+    e.socket->close(ignored);
+    reaped_.splice(reaped_.end(), pending_, pending_.begin());
+    ++n;
+  }
+  return n;
+}
+
+void IdleReaper::set_timeout(std::chrono::steady_clock::duration timeout) {
+  for (Entry &e : pending_) {
+    e.deadline += timeout - timeout_;
+  }
+  timeout_ = timeout;
+}
+
+boost::asio::awaitable<void>
+IdleReaper::run(std::chrono::steady_clock::duration tick) {
+  boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+  for (;;) {
+    timer.expires_after(tick);
+    co_await timer.async_wait(boost::asio::deferred);
+    reap(std::chrono::steady_clock::now());
+  }
+}
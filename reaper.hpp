@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <iterator>
+#include <list>
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+// Deadlines for connections that have not finished sending their request.
+//
+// Every connection gets the same timeout from when it registers, so on one
+// io_context deadlines fall due in registration order and a FIFO list is
+// enough: registering and unregistering are O(1), and a tick only looks at
+// the connections that are actually due. A single reaper coroutine per
+// io_context closes them, rather than a timer (and a coroutine waiting on
+// it) per socket, so a slowloris flood of stalled connections costs one list
+// node each. Not thread-safe; use one reaper per io_context.
+class IdleReaper {
+  struct Entry {
+    std::chrono::steady_clock::time_point deadline;
+    boost::asio::ip::tcp::socket *socket;
+    bool reaped = false;
+  };
+
+public:
+  explicit IdleReaper(std::chrono::steady_clock::duration timeout)
+      : timeout_(timeout) {}
+  IdleReaper(const IdleReaper &) = delete;
+  IdleReaper &operator=(const IdleReaper &) = delete;
+
+  // A connection's place in the queue; unregisters it when destroyed.
+  class Registration {
+  public:
+    Registration(Registration &&other) noexcept
+        : reaper_(other.reaper_), entry_(other.entry_) {
+      other.reaper_ = nullptr;
+    }
+    Registration &operator=(Registration &&) = delete;
+    ~Registration();
+
+    // The deadline passed and the socket was closed.
+    bool timed_out() const { return entry_->reaped; }
+
+  private:
+    friend class IdleReaper;
+    Registration(IdleReaper &reaper, std::list<Entry>::iterator entry)
+        : reaper_(&reaper), entry_(entry) {}
+    IdleReaper *reaper_;
+    std::list<Entry>::iterator entry_;
+  };
+
+  // Close socket unless the registration is dropped within the timeout.
+  Registration add(boost::asio::ip::tcp::socket &socket,
+                   std::chrono::steady_clock::time_point now);
+
+  // Close every registered socket whose deadline is at or before now.
+  // Returns how many were closed.
+  std::size_t reap(std::chrono::steady_clock::time_point now);
+
+  // Reap once per tick until the io_context stops.
+  boost::asio::awaitable<void> run(std::chrono::steady_clock::duration tick);
+
+  // Change the timeout. Connections already waiting have their deadlines
+  // moved by the difference too, which keeps the queue in deadline order.
+  void set_timeout(std::chrono::steady_clock::duration timeout);
+
+  std::chrono::steady_clock::duration timeout() const { return timeout_; }
+  // Connections waiting on their deadline.
+  std::size_t pending() const { return pending_.size(); }
+
+private:
+  std::chrono::steady_clock::duration timeout_;
+  std::list<Entry> pending_; // by deadline
+  std::list<Entry> reaped_;  // closed, waiting for their owner to let go
+  // Nodes of connections gone, reused by add() so that registering does not
+  // allocate once the list has grown to the peak number of connections.
+  std::list<Entry> spare_;
+};
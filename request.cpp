@@ -0,0 +1,67 @@
+#include "request.hpp"
+
+#include <algorithm>
+
+RequestFramer::Status RequestFramer::commit(std::size_t n) {
+  if (status_ != Status::need_more) {
+    return status_;
+  }
+  const std::size_t start = size_;
+  size_ += n;
+  const auto first = buf_.begin() + start;
+  const auto last = buf_.begin() + size_;
+  if (const auto lf = std::find(first, last, '\n'); lf != last) {
+    line_size_ = static_cast<std::size_t>(lf - buf_.begin());
+    if (line_size_ > 0 && buf_[line_size_ - 1] == '\r') {
+      --line_size_;
+    }
+    status_ = Status::complete;
+  } else if (size_ == buf_.size()) {
+    status_ = Status::overlong;
+  }
+  return status_;
+}
+
+RequestFramer::Status RequestFramer::finish() {
+  if (status_ == Status::need_more && size_ > 0) {
+    line_size_ = size_;
+    while (line_size_ > 0 && buf_[line_size_ - 1] == '\r') {
+      --line_size_;
+    }
+    status_ = Status::complete;
+  }
+  return status_;
+}
+
+namespace {
+
+bool blank(char c) { return c == ' ' || c == '\t'; }
+
+std::string_view trim(std::string_view s) {
+  while (!s.empty() && blank(s.front())) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && blank(s.back())) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+} // namespace
+
+FingerQuery parse_query(std::string_view line) {
+  FingerQuery query;
+  std::string_view rest = trim(line);
+  // "/W" on its own or followed by blanks; "/Wpete" is a name with a slash.
+  if (rest.size() >= 2 && rest[0] == '/' && (rest[1] == 'W' || rest[1] == 'w') &&
+      (rest.size() == 2 || blank(rest[2]))) {
+    query.verbose = true;
+    rest = trim(rest.substr(2));
+  }
+  if (const auto at = rest.find('@'); at != std::string_view::npos) {
+    query.host = rest.substr(at + 1);
+    rest = rest.substr(0, at);
+  }
+  query.user = rest;
+  return query;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+#include "validate.hpp"
+
+// RFC 1288 request framing and parsing.
+//
+// A finger query is a single line ending in CRLF:
+//
+//   {Q1} ::= [{W} | {W}{S}{U} | {U}] {C}
+//   {Q2} ::= [{W}{S}] [{U}] {H} {C}
+//
+// where {W} is "/W" (ask for verbose output), {S} one or more spaces, {U} a
+// username, {H} one or more "@host" suffixes (asking this server to forward
+// the query) and {C} the CRLF.
+
+// Collects one request line from however many reads it takes to arrive, in
+// a fixed buffer sized for the longest acceptable request. Bytes are read
+// straight into space() and then commit()ted.
+class RequestFramer {
+public:
+  enum class Status {
+    need_more, // no line ending yet
+    complete,  // line() is the request
+    overlong,  // the buffer filled up without a line ending
+  };
+
+  // The unused part of the buffer, to read into.
+  std::span<char> space() { return std::span(buf_).subspan(size_); }
+
+  // Account for n bytes read into space(), looking for the line ending
+  // among them.
+  Status commit(std::size_t n);
+
+  // The peer closed its side: whatever arrived without a line ending is the
+  // request (some clients half-close instead of sending CRLF). need_more if
+  // nothing arrived at all.
+  Status finish();
+
+  // Everything read so far.
+  std::string_view buffered() const { return {buf_.data(), size_}; }
+
+  // The request line without its CRLF (or bare LF); only valid once
+  // complete.
+  std::string_view line() const { return {buf_.data(), line_size_}; }
+
+private:
+  // Room for kMaxRequestBytes and the CRLF.
+  std::array<char, kMaxRequestBytes + 2> buf_;
+  std::size_t size_ = 0;
+  std::size_t line_size_ = 0;
+  Status status_ = Status::need_more;
+};
+
+// One parsed query. Views point into the request line.
+struct FingerQuery {
+  bool verbose = false;  // "/W" was given
+  std::string_view user; // empty: list the users logged in
+  std::string_view host; // after the first '@'; empty unless forwarding
+};
+
+// Split a request line into its parts. Surrounding blanks are ignored and
+// "/W" is accepted in either case; nothing is validated beyond that.
+FingerQuery parse_query(std::string_view line);
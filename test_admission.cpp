@@ -0,0 +1,131 @@
+#include "admission.hpp"
+#include <boost/asio/ip/address.hpp>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <optional>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+IpKey ip(const char *s) { return boost::asio::ip::make_address(s); }
+
+} // namespace
+
+TEST(TokenBucket, SpendsTheBurstThenRefillsAtTheRate) {
+  const auto t0 = std::chrono::steady_clock::now();
+  TokenBucket bucket(10, 3, t0);
+  EXPECT_TRUE(bucket.take(t0));
+  EXPECT_TRUE(bucket.take(t0));
+  EXPECT_TRUE(bucket.take(t0));
+  EXPECT_FALSE(bucket.take(t0));
+  EXPECT_EQ(bucket.wait(t0), 100ms);
+
+  EXPECT_FALSE(bucket.take(t0 + 50ms));
+  EXPECT_EQ(bucket.wait(t0 + 50ms), 50ms);
+  EXPECT_TRUE(bucket.take(t0 + 100ms));
+  EXPECT_FALSE(bucket.take(t0 + 100ms));
+
+  // Idle time only ever refills up to the burst.
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(bucket.take(t0 + 1h));
+  }
+  EXPECT_FALSE(bucket.take(t0 + 1h));
+}
+
+TEST(TokenBucket, ZeroRateIsUnlimited) {
+  const auto t0 = std::chrono::steady_clock::now();
+  TokenBucket bucket(0, 0, t0);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(bucket.take(t0));
+  }
+  EXPECT_EQ(bucket.wait(t0), 0s);
+}
+
+TEST(AdmissionControl, CapsConnectionsInFlight) {
+  AdmissionControl ctl({.max_connections = 2, .max_per_ip = 0});
+  auto a = ctl.try_reserve();
+  auto b = ctl.try_reserve();
+  ASSERT_TRUE(a && b);
+  EXPECT_FALSE(ctl.try_reserve());
+  EXPECT_EQ(ctl.in_flight(), 2u);
+  a.reset();
+  EXPECT_EQ(ctl.in_flight(), 1u);
+  EXPECT_TRUE(ctl.try_reserve());
+  // The temporary was released again.
+  EXPECT_EQ(ctl.in_flight(), 1u);
+}
+
+TEST(AdmissionControl, CapsConnectionsPerAddress) {
+  AdmissionControl ctl({.max_connections = 0, .max_per_ip = 2});
+  std::vector<AdmissionControl::Slot> open;
+  for (int i = 0; i < 2; ++i) {
+    auto slot = ctl.try_reserve();
+    ASSERT_TRUE(slot);
+    EXPECT_TRUE(ctl.admit(*slot, ip("203.0.113.7")));
+    open.push_back(std::move(*slot));
+  }
+  auto third = ctl.try_reserve();
+  ASSERT_TRUE(third);
+  EXPECT_FALSE(ctl.admit(*third, ip("203.0.113.7")));
+  EXPECT_TRUE(ctl.admit(*third, ip("203.0.113.8")));
+  EXPECT_EQ(ctl.tracked(), 2u);
+
+  open.pop_back();
+  auto again = ctl.try_reserve();
+  ASSERT_TRUE(again);
+  EXPECT_TRUE(ctl.admit(*again, ip("203.0.113.7")));
+  open.clear();
+  again.reset();
+  third.reset();
+  EXPECT_EQ(ctl.tracked(), 0u);
+  EXPECT_EQ(ctl.in_flight(), 0u);
+}
+
+TEST(AdmissionControl, SetLimitsAppliesToTheNextReservation) {
+  AdmissionControl ctl({.max_connections = 1, .max_per_ip = 0});
+  auto a = ctl.try_reserve();
+  ASSERT_TRUE(a);
+  EXPECT_FALSE(ctl.try_reserve());
+
+  ctl.set_limits({.max_connections = 3, .max_per_ip = 1});
+  EXPECT_EQ(ctl.config().max_connections, 3u);
+  auto b = ctl.try_reserve();
+  ASSERT_TRUE(b);
+  EXPECT_TRUE(ctl.admit(*a, ip("203.0.113.7")));
+  EXPECT_FALSE(ctl.admit(*b, ip("203.0.113.7")));
+
+  // Lowering a cap refuses new connections but closes nothing.
+  ctl.set_limits({.max_connections = 1, .max_per_ip = 0});
+  EXPECT_FALSE(ctl.try_reserve());
+  EXPECT_EQ(ctl.in_flight(), 2u);
+  EXPECT_TRUE(ctl.admit(*b, ip("203.0.113.7")));
+}
+
+TEST(AdmissionControl, ConcurrentReservationsNeverExceedTheCap) {
+  AdmissionControl ctl({.max_connections = 8, .max_per_ip = 0});
+  std::atomic<bool> over{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 20000; ++i) {
+        auto slot = ctl.try_reserve();
+        if (ctl.in_flight() > 8) {
+          over = true;
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_FALSE(over);
+  EXPECT_EQ(ctl.in_flight(), 0u);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
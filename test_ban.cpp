@@ -1,6 +1,10 @@
 #include "ban.hpp"
 #include <boost/asio/ip/address.hpp>
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 using namespace std::chrono_literals;
 using clock_t_ = BanTracker::clock;
@@ -9,57 +13,61 @@ using clock_t_ = BanTracker::clock;
 // never underflows and default-constructed time_points are unambiguous.
 static const clock_t_::time_point kBase = clock_t_::time_point{} + 1000h;
 
+static IpKey ip(const std::string &s) {
+  return boost::asio::ip::make_address(s);
+}
+
 TEST(BanTracker, UnknownIpIsNotBlocked) {
   BanTracker bt;
-  EXPECT_FALSE(bt.is_blocked("1.2.3.4", kBase));
+  EXPECT_FALSE(bt.is_blocked(ip("1.2.3.4"), kBase));
 }
 
 TEST(BanTracker, BlocksOnlyAfterMoreThanThreshold) {
   BanTracker bt; // default threshold = 3, so block on the 4th failure
-  EXPECT_FALSE(bt.record_offense("1.2.3.4", kBase).blocked); // 1
-  EXPECT_FALSE(bt.record_offense("1.2.3.4", kBase).blocked); // 2
-  EXPECT_FALSE(bt.record_offense("1.2.3.4", kBase).blocked); // 3
-  EXPECT_FALSE(bt.is_blocked("1.2.3.4", kBase));
-  auto r = bt.record_offense("1.2.3.4", kBase); // 4
+  EXPECT_FALSE(bt.record_offense(ip("1.2.3.4"), kBase).blocked); // 1
+  EXPECT_FALSE(bt.record_offense(ip("1.2.3.4"), kBase).blocked); // 2
+  EXPECT_FALSE(bt.record_offense(ip("1.2.3.4"), kBase).blocked); // 3
+  EXPECT_FALSE(bt.is_blocked(ip("1.2.3.4"), kBase));
+  auto r = bt.record_offense(ip("1.2.3.4"), kBase); // 4
   EXPECT_TRUE(r.blocked);
   EXPECT_EQ(r.count, 4);
-  EXPECT_TRUE(bt.is_blocked("1.2.3.4", kBase));
+  EXPECT_TRUE(bt.is_blocked(ip("1.2.3.4"), kBase));
 }
 
 TEST(BanTracker, TracksEachIpIndependently) {
   BanTracker bt;
   for (int i = 0; i < 4; ++i) {
-    bt.record_offense("1.1.1.1", kBase);
+    bt.record_offense(ip("1.1.1.1"), kBase);
   }
-  EXPECT_TRUE(bt.is_blocked("1.1.1.1", kBase));
-  EXPECT_FALSE(bt.is_blocked("2.2.2.2", kBase));
+  EXPECT_TRUE(bt.is_blocked(ip("1.1.1.1"), kBase));
+  EXPECT_FALSE(bt.is_blocked(ip("2.2.2.2"), kBase));
 }
 
 TEST(BanTracker, OffensesAgeOutOfRollingWindow) {
   BanTracker bt;
   // Four failures spread over a couple of hours -> blocked.
   for (int i = 0; i < 4; ++i) {
-    bt.record_offense("1.2.3.4", kBase + i * 1h);
+    bt.record_offense(ip("1.2.3.4"), kBase + i * 1h);
   }
-  EXPECT_TRUE(bt.is_blocked("1.2.3.4", kBase + 3h));
+  EXPECT_TRUE(bt.is_blocked(ip("1.2.3.4"), kBase + 3h));
 
   // 24h after the first failure, that one drops out of the window: only 3
   // remain, so the IP is no longer blocked.
-  EXPECT_FALSE(bt.is_blocked("1.2.3.4", kBase + 24h + 1min));
+  EXPECT_FALSE(bt.is_blocked(ip("1.2.3.4"), kBase + 24h + 1min));
 }
 
 TEST(BanTracker, WindowBoundaryIsExclusiveAtCutoff) {
   BanTracker bt;
   // Exactly window-old timestamps are pruned (cutoff is inclusive of <=).
-  bt.record_offense("1.2.3.4", kBase);
-  auto r = bt.record_offense("1.2.3.4", kBase + 24h);
+  bt.record_offense(ip("1.2.3.4"), kBase);
+  auto r = bt.record_offense(ip("1.2.3.4"), kBase + 24h);
   EXPECT_EQ(r.count, 1); // the kBase entry was pruned before appending
 }
 
 TEST(BanTracker, SweepRemovesFullyExpiredIp) {
   BanTracker bt;
   for (int i = 0; i < 4; ++i) {
-    bt.record_offense("1.2.3.4", kBase);
+    bt.record_offense(ip("1.2.3.4"), kBase);
   }
   EXPECT_EQ(bt.tracked(), 1u);
   bt.sweep(kBase + 24h + 1min); // all offenses aged out
@@ -69,19 +77,575 @@ TEST(BanTracker, SweepRemovesFullyExpiredIp) {
 TEST(BanTracker, SweepKeepsStillActiveIp) {
   BanTracker bt;
   for (int i = 0; i < 4; ++i) {
-    bt.record_offense("1.2.3.4", kBase);
+    bt.record_offense(ip("1.2.3.4"), kBase);
   }
   bt.sweep(kBase + 1h); // still inside the window
   EXPECT_EQ(bt.tracked(), 1u);
-  EXPECT_TRUE(bt.is_blocked("1.2.3.4", kBase + 1h));
+  EXPECT_TRUE(bt.is_blocked(ip("1.2.3.4"), kBase + 1h));
 }
 
 TEST(BanTracker, RespectsCustomConfig) {
   BanTracker bt(BanTracker::Config{/*threshold=*/1, /*window=*/1h});
-  EXPECT_FALSE(bt.record_offense("9.9.9.9", kBase).blocked); // 1, not > 1
-  EXPECT_TRUE(bt.record_offense("9.9.9.9", kBase).blocked);  // 2 > 1
-  EXPECT_TRUE(bt.is_blocked("9.9.9.9", kBase));
-  EXPECT_FALSE(bt.is_blocked("9.9.9.9", kBase + 1h + 1min)); // window elapsed
+  EXPECT_FALSE(bt.record_offense(ip("9.9.9.9"), kBase).blocked); // 1, not > 1
+  EXPECT_TRUE(bt.record_offense(ip("9.9.9.9"), kBase).blocked);  // 2 > 1
+  EXPECT_TRUE(bt.is_blocked(ip("9.9.9.9"), kBase));
+  EXPECT_FALSE(bt.is_blocked(ip("9.9.9.9"), kBase + 1h + 1min)); // window elapsed
+}
+
+TEST(BanTracker, CountSaturatesAtRingCapacity) {
+  BanTracker bt; // remembers the newest threshold + 1 = 4 offenses
+  BanTracker::OffenseResult r{};
+  for (int i = 0; i < 10; ++i) {
+    r = bt.record_offense(ip("1.2.3.4"), kBase + i * 1min);
+  }
+  EXPECT_EQ(r.count, 4);
+  EXPECT_TRUE(r.blocked);
+  // The oldest remembered offense is the 7th (kBase + 6min): once it ages out
+  // only 3 remain and the IP is released.
+  EXPECT_TRUE(bt.is_blocked(ip("1.2.3.4"), kBase + 24h + 5min));
+  EXPECT_FALSE(bt.is_blocked(ip("1.2.3.4"), kBase + 24h + 6min));
+}
+
+TEST(BanTracker, GrowsAndSweepsLargeTables) {
+  BanTracker bt;
+  // Enough distinct addresses to force several rehashes, with IPv4 and IPv6
+  // mixed so that both key forms share the table.
+  for (int i = 0; i < 5000; ++i) {
+    const auto v4 = boost::asio::ip::address_v4(0xCB000000u + i);
+    bt.record_offense(v4, kBase + (i % 2) * 12h);
+    auto v6 = boost::asio::ip::make_address_v6("2001:db8::").to_bytes();
+    v6[14] = static_cast<unsigned char>(i >> 8);
+    v6[15] = static_cast<unsigned char>(i);
+    bt.record_offense(boost::asio::ip::address_v6(v6), kBase);
+  }
+  EXPECT_EQ(bt.tracked(), 10000u);
+  // Everything recorded at kBase expires; the odd IPv4 rows (kBase + 12h)
+  // survive, and every survivor must still be findable after the
+  // backward-shift deletions.
+  bt.sweep(kBase + 24h);
+  EXPECT_EQ(bt.tracked(), 2500u);
+  for (int i = 1; i < 5000; i += 2) {
+    const auto v4 = boost::asio::ip::address_v4(0xCB000000u + i);
+    EXPECT_EQ(bt.record_offense(v4, kBase + 24h).count, 2);
+  }
+  EXPECT_EQ(bt.tracked(), 2500u);
+}
+
+TEST(BanTracker, ExpireErasesOnlyRowsThatAreDue) {
+  BanTracker bt;
+  bt.record_offense(ip("1.2.3.4"), kBase);
+  bt.record_offense(ip("5.6.7.8"), kBase);
+  bt.record_offense(ip("9.9.9.9"), kBase + 12h);
+  EXPECT_EQ(bt.expire(kBase + 23h), 0u);
+  // 5.6.7.8 offends again, so when its bucket comes due it is filed again
+  // rather than erased.
+  bt.record_offense(ip("5.6.7.8"), kBase + 23h);
+  EXPECT_EQ(bt.expire(kBase + 24h + 3min), 1u);
+  EXPECT_EQ(bt.tracked(), 2u);
+  EXPECT_EQ(bt.expire(kBase + 36h + 3min), 1u);
+  EXPECT_EQ(bt.tracked(), 1u);
+  EXPECT_EQ(bt.record_offense(ip("5.6.7.8"), kBase + 36h + 3min).count, 2);
+  EXPECT_EQ(bt.expire(kBase + 60h + 6min), 1u);
+  EXPECT_EQ(bt.tracked(), 0u);
+}
+
+TEST(BanTracker, ExpireSpreadsTheWorkOverCalls) {
+  BanTracker bt;
+  for (std::uint32_t i = 0; i < 20000; ++i) {
+    bt.record_offense(boost::asio::ip::address_v4(0xCB000000u + i),
+                      kBase + std::chrono::seconds(i % 600));
+  }
+  EXPECT_EQ(bt.expire(kBase + 12h), 0u);
+  for (std::uint32_t i = 0; i < 5000; ++i) {
+    bt.record_offense(boost::asio::ip::address_v4(0x0B000000u + i),
+                      kBase + 12h);
+  }
+  // Every row looked at is due, so each call erases exactly its budget.
+  int calls = 0;
+  for (std::size_t erased = 0; erased < 20000; ++calls) {
+    const std::size_t n = bt.expire(kBase + 25h, 1000);
+    ASSERT_EQ(n, 1000u);
+    erased += n;
+  }
+  EXPECT_EQ(calls, 20);
+  EXPECT_EQ(bt.expire(kBase + 25h), 0u);
+  EXPECT_EQ(bt.tracked(), 5000u);
+  // The survivors are all still findable after the backward shifts.
+  for (std::uint32_t i = 0; i < 5000; ++i) {
+    EXPECT_EQ(bt.record_offense(boost::asio::ip::address_v4(0x0B000000u + i),
+                                kBase + 25h)
+                  .count,
+              2);
+  }
+}
+
+TEST(BanTracker, ExpireKeepsUpWithSweepThroughGrowthAndEviction) {
+  BanTracker::Config cfg;
+  cfg.window = 1h;
+  // Unbounded, and bounded without a sketch so that it evicts and refills
+  // rows all the time.
+  for (const std::size_t max_tracked : {0, 500}) {
+    cfg.max_tracked = max_tracked;
+    BanTracker wheel(cfg);
+    BanTracker swept(cfg);
+    std::uint64_t x = 12345;
+    auto t = kBase;
+    for (int op = 0; op < 50000; ++op) {
+      x = x * 6364136223846793005ull + 1442695040888963407ull;
+      const auto addr =
+          boost::asio::ip::address_v4(0xCB000000u + (x >> 33) % 3000);
+      t += std::chrono::milliseconds((x >> 20) % 400);
+      const bool blocked = wheel.record_offense(addr, t).blocked;
+      // Evictions depend on what is still in the table, so only the
+      // unbounded tables are bound to agree.
+      if (max_tracked == 0) {
+        ASSERT_EQ(swept.record_offense(addr, t).blocked, blocked);
+      }
+      if (op % 500 == 0) {
+        wheel.expire(t);
+        swept.sweep(t);
+        // Rows may outlive the window by up to a bucket (4s here), no more.
+        BanTracker check = wheel;
+        check.sweep(t - 10s);
+        ASSERT_EQ(check.tracked(), wheel.tracked());
+      }
+    }
+    wheel.expire(t + 1h + 10s);
+    EXPECT_EQ(wheel.tracked(), 0u);
+  }
+}
+
+TEST(BanTracker, SketchOnlyPromotesRepeatOffenders) {
+  BanTracker::Config cfg;
+  cfg.max_tracked = 1000;
+  cfg.sketch_width = 1 << 14;
+  BanTracker bt(cfg);
+  // A one-off offense is counted, but gets no row.
+  auto r = bt.record_offense(ip("1.2.3.4"), kBase);
+  EXPECT_EQ(r.count, 1);
+  EXPECT_FALSE(r.blocked);
+  EXPECT_EQ(bt.tracked(), 0u);
+  // The second is promoted to an exact row that remembers the first.
+  r = bt.record_offense(ip("1.2.3.4"), kBase + 1min);
+  EXPECT_EQ(r.count, 2);
+  EXPECT_EQ(bt.tracked(), 1u);
+  bt.record_offense(ip("1.2.3.4"), kBase + 2min);
+  r = bt.record_offense(ip("1.2.3.4"), kBase + 3min);
+  EXPECT_EQ(r.count, 4);
+  EXPECT_TRUE(r.blocked);
+  EXPECT_TRUE(bt.is_blocked(ip("1.2.3.4"), kBase + 3min));
+  // Sketch counts age out with the window like the rows do.
+  bt.record_offense(ip("5.6.7.8"), kBase);
+  EXPECT_EQ(bt.record_offense(ip("5.6.7.8"), kBase + 49h).count, 1);
+  EXPECT_EQ(bt.tracked(), 1u);
+}
+
+TEST(BanTracker, BoundedTableHoldsItsMemoryUnderAWideScan) {
+  const std::size_t budget = 256 * 1024;
+  BanTracker bt(BanTracker::bounded({}, budget));
+  const std::size_t start = bt.memory_bytes();
+  EXPECT_LE(start, budget);
+  // A million one-shot sources -- far more than the budget can tell apart --
+  // with 100 persistent scanners among them.
+  for (std::uint32_t i = 0; i < 1000000; ++i) {
+    const auto t = kBase + std::chrono::milliseconds(i);
+    bt.record_offense(boost::asio::ip::address_v4(0x0B000000u + i), t);
+    if (i % 1000 == 0) {
+      for (std::uint32_t k = 0; k < 100; ++k) {
+        bt.record_offense(boost::asio::ip::address_v4(0xCB007100u + k), t);
+      }
+    }
+  }
+  EXPECT_EQ(bt.memory_bytes(), start);
+  for (std::uint32_t k = 0; k < 100; ++k) {
+    EXPECT_TRUE(bt.is_blocked(boost::asio::ip::address_v4(0xCB007100u + k),
+                              kBase + 1000s));
+  }
+}
+
+TEST(BanTracker, FullBoundedTableEvictsUnblockedRowsFirst) {
+  BanTracker::Config cfg;
+  cfg.max_tracked = 12;
+  BanTracker bt(cfg);
+  for (int i = 0; i < 6; ++i) {
+    for (int k = 0; k < 4; ++k) {
+      bt.record_offense(boost::asio::ip::address_v4(0xCB000000u + i), kBase);
+    }
+  }
+  for (std::uint32_t i = 0; i < 4000; ++i) {
+    bt.record_offense(boost::asio::ip::address_v4(0x0B000000u + i),
+                      kBase + 1min);
+    ASSERT_LE(bt.tracked(), 12u);
+  }
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_TRUE(bt.is_blocked(boost::asio::ip::address_v4(0xCB000000u + i),
+                              kBase + 1min));
+  }
+}
+
+TEST(IpKey, RoundTripsBothFamilies) {
+  EXPECT_EQ(ip("1.2.3.4").to_string(), "1.2.3.4");
+  EXPECT_EQ(ip("2001:db8::1").to_string(), "2001:db8::1");
+  EXPECT_EQ(ip("1.2.3.4"), ip("::ffff:1.2.3.4")); // v4-mapped is the same key
+  EXPECT_NE(ip("1.2.3.4"), ip("1.2.3.5"));
+}
+
+TEST(AddressText, MatchesToString) {
+  EXPECT_EQ(AddressText().view(), "unknown");
+  for (const char *text :
+       {"1.2.3.4", "255.255.255.255", "2001:db8::1", "::ffff:1.2.3.4",
+        "2001:db8:1234:5678:9abc:def0:1234:5678", "fe80::1%4294967295",
+        "2001:db8::1%7"}) {
+    const auto addr = boost::asio::ip::make_address(text);
+    EXPECT_EQ(AddressText(addr).view(), addr.to_string()) << text;
+  }
+}
+
+TEST(SharedBanTracker, CountsOffensesFromAllThreads) {
+  SharedBanTracker bt(BanTracker::Config{/*threshold=*/200, /*window=*/24h});
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 50; ++i) {
+        bt.record_offense(ip("1.2.3.4"), kBase);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_FALSE(bt.is_blocked(ip("1.2.3.4"), kBase)); // exactly 200, not > 200
+  EXPECT_TRUE(bt.record_offense(ip("1.2.3.4"), kBase).blocked);
+  EXPECT_EQ(bt.tracked(), 1u);
+}
+
+TEST(SharedBanTracker, ShardsTrackIpsIndependently) {
+  SharedBanTracker bt(BanTracker::Config{}, /*shards=*/5); // rounds up to 8
+  EXPECT_EQ(bt.shard_count(), 8u);
+  for (int i = 0; i < 64; ++i) {
+    bt.record_offense(ip("10.0.0." + std::to_string(i)), kBase);
+  }
+  for (int i = 0; i < 4; ++i) {
+    bt.record_offense(ip("1.1.1.1"), kBase);
+  }
+  EXPECT_EQ(bt.tracked(), 65u);
+  EXPECT_TRUE(bt.is_blocked(ip("1.1.1.1"), kBase));
+  EXPECT_FALSE(bt.is_blocked(ip("10.0.0.1"), kBase));
+  bt.sweep(kBase + 24h + 1min);
+  EXPECT_EQ(bt.tracked(), 0u);
+}
+
+TEST(BlockFilter, ForgetsKeysTwoLifetimesAfterTheyWereAdded) {
+  BlockFilter filter;
+  const std::uint64_t a = ip("1.2.3.4").hash();
+  const std::uint64_t b = ip("5.6.7.8").hash();
+  EXPECT_FALSE(filter.may_contain(a));
+  filter.add(a, kBase, 1h);
+  EXPECT_TRUE(filter.may_contain(a));
+  EXPECT_FALSE(filter.may_contain(b));
+  // b starts a new generation; a is kept alongside it, as its block may
+  // still be running.
+  filter.add(b, kBase + 1h, 1h);
+  EXPECT_TRUE(filter.may_contain(a));
+  EXPECT_TRUE(filter.may_contain(b));
+  // A lifetime later a's generation is cleared for reuse.
+  filter.add(b, kBase + 2h, 1h);
+  EXPECT_FALSE(filter.may_contain(a));
+  EXPECT_TRUE(filter.may_contain(b));
+}
+
+TEST(SharedBanTracker, BlocksAreFoundThroughTheFilters) {
+  SharedBanTracker bt(BanTracker::Config{/*threshold=*/1, /*window=*/1h},
+                      SubnetTracker::Config{/*threshold=*/2, /*window=*/1h});
+  // Blocked, lapsed and blocked again across several filter generations.
+  for (int round = 0; round < 5; ++round) {
+    const auto t = kBase + round * 90min;
+    bt.record_offense(ip("8.8.8.8"), t);
+    EXPECT_FALSE(bt.is_blocked(ip("8.8.8.8"), t));
+    bt.record_offense(ip("8.8.8.8"), t);
+    EXPECT_TRUE(bt.is_blocked(ip("8.8.8.8"), t));
+    EXPECT_FALSE(bt.is_blocked(ip("8.8.8.8"), t + 1h));
+    for (int i = 1; i <= 3; ++i) {
+      bt.record_offense(ip("198.51.100." + std::to_string(round * 3 + i)), t);
+    }
+    EXPECT_TRUE(bt.is_blocked(ip("198.51.100.200"), t));
+    EXPECT_FALSE(bt.is_blocked(ip("198.51.101.200"), t));
+    EXPECT_FALSE(bt.is_blocked(ip("198.51.100.200"), t + 1h));
+  }
+  // Restored and reconfigured blocks are found as well.
+  const auto now = kBase + 6h;
+  SharedBanTracker restored(
+      BanTracker::Config{/*threshold=*/1, /*window=*/1h},
+      SubnetTracker::Config{/*threshold=*/2, /*window=*/1h});
+  bt.for_each([&](const BlockedNet &net,
+                  std::span<const clock_t_::time_point> times) {
+    restored.restore(net, times, now);
+  });
+  EXPECT_TRUE(restored.is_blocked(ip("8.8.8.8"), now));
+  EXPECT_TRUE(restored.is_blocked(ip("198.51.100.200"), now));
+  restored.reconfigure(BanTracker::Config{/*threshold=*/0, /*window=*/1h},
+                       SubnetTracker::Config{/*threshold=*/2, /*window=*/1h,
+                                             /*v4_prefix=*/16},
+                       now);
+  EXPECT_TRUE(restored.is_blocked(ip("198.51.200.1"), now));
+  // The rebuilt tables keep filling the filters.
+  EXPECT_TRUE(restored.record_offense(ip("203.0.113.1"), now).blocked);
+  EXPECT_TRUE(restored.is_blocked(ip("203.0.113.1"), now));
+}
+
+TEST(SubnetTracker, BlocksPrefixAfterEnoughDistinctSources) {
+  SubnetTracker st(SubnetTracker::Config{/*threshold=*/3, /*window=*/24h});
+  for (int i = 1; i <= 3; ++i) {
+    EXPECT_FALSE(st.record_source(ip("203.0.113." + std::to_string(i)), kBase)
+                     .blocked);
+  }
+  EXPECT_FALSE(st.is_blocked(ip("203.0.113.200"), kBase));
+  EXPECT_TRUE(st.record_source(ip("203.0.113.4"), kBase).blocked);
+  // Every address in the /24 is now refused, including ones never seen...
+  EXPECT_TRUE(st.is_blocked(ip("203.0.113.200"), kBase));
+  // ...but not the neighbouring /24.
+  EXPECT_FALSE(st.is_blocked(ip("203.0.112.200"), kBase));
+  EXPECT_FALSE(st.is_blocked(ip("203.0.114.1"), kBase));
+  // Sources age out of the window like individual offenses do.
+  EXPECT_FALSE(st.is_blocked(ip("203.0.113.200"), kBase + 24h));
+}
+
+TEST(SubnetTracker, GroupsIpv6BySlash64) {
+  SubnetTracker st(SubnetTracker::Config{/*threshold=*/1, /*window=*/1h});
+  st.record_source(ip("2001:db8:1:2::a"), kBase);
+  st.record_source(ip("2001:db8:1:2:ffff::b"), kBase);
+  EXPECT_TRUE(st.is_blocked(ip("2001:db8:1:2::1234"), kBase));
+  EXPECT_FALSE(st.is_blocked(ip("2001:db8:1:3::1"), kBase));
+  // An IPv4 address with the same leading bytes lives elsewhere in the trie.
+  EXPECT_FALSE(st.is_blocked(ip("32.1.13.184"), kBase));
+}
+
+TEST(SubnetTracker, NeverCountsNonBannableSources) {
+  SubnetTracker st(SubnetTracker::Config{/*threshold=*/1, /*window=*/1h});
+  for (int i = 1; i < 10; ++i) {
+    st.record_source(ip("192.168.1." + std::to_string(i)), kBase);
+    st.record_source(ip("100.64.0." + std::to_string(i)), kBase);
+  }
+  EXPECT_EQ(st.tracked(), 0u);
+  EXPECT_FALSE(st.is_blocked(ip("192.168.1.1"), kBase));
+}
+
+TEST(SubnetTracker, DisabledWithZeroThreshold) {
+  SubnetTracker st(SubnetTracker::Config{/*threshold=*/0, /*window=*/1h});
+  EXPECT_FALSE(st.enabled());
+  EXPECT_FALSE(st.record_source(ip("8.8.8.8"), kBase).blocked);
+  EXPECT_FALSE(st.is_blocked(ip("8.8.8.8"), kBase));
+}
+
+TEST(SubnetTracker, ManyPrefixesMatchBruteForceAndSurviveSweep) {
+  // Scattered /24s reported at alternating times, so half of them expire in
+  // the sweep. Diverse leading bits exercise edge splits at every depth.
+  SubnetTracker st(SubnetTracker::Config{/*threshold=*/1, /*window=*/24h});
+  std::vector<std::pair<std::uint32_t, bool>> nets; // (prefix, reported late)
+  std::uint32_t x = 12345;
+  for (int i = 0; i < 400; ++i) {
+    x = x * 1103515245u + 12345u;
+    const std::uint32_t net = x & 0xFFFFFF00u;
+    if (!is_bannable_address(boost::asio::ip::address_v4(net | 1))) {
+      continue;
+    }
+    const bool late = i % 2 == 1;
+    nets.emplace_back(net, late);
+    const auto t = kBase + (late ? 12h : 0h);
+    st.record_source(boost::asio::ip::address_v4(net | 1), t);
+    st.record_source(boost::asio::ip::address_v4(net | 2), t);
+  }
+  auto reported = [&](std::uint32_t net) {
+    return std::any_of(nets.begin(), nets.end(),
+                       [&](const auto &n) { return n.first == net; });
+  };
+  for (const auto &[net, late] : nets) {
+    EXPECT_TRUE(st.is_blocked(boost::asio::ip::address_v4(net | 77), kBase + 12h));
+    if (!reported(net ^ 0x100)) {
+      EXPECT_FALSE(st.is_blocked(boost::asio::ip::address_v4((net ^ 0x100) | 77),
+                                 kBase + 12h));
+    }
+  }
+
+  st.sweep(kBase + 24h);
+  std::size_t late_count = 0;
+  for (const auto &[net, late] : nets) {
+    late_count += late;
+    EXPECT_EQ(st.is_blocked(boost::asio::ip::address_v4(net | 77), kBase + 24h),
+              late);
+  }
+  EXPECT_EQ(st.tracked(), late_count);
+}
+
+TEST(SubnetTracker, BoundedTrieStopsAtItsBudgetUntilSwept) {
+  SubnetTracker::Config cfg{/*threshold=*/1, /*window=*/1h};
+  cfg.max_nodes = 8;
+  SubnetTracker st(cfg);
+  const std::size_t bytes = st.memory_bytes();
+  for (int i = 0; i < 100; ++i) {
+    st.record_source(ip("203.0." + std::to_string(i) + ".1"), kBase);
+  }
+  EXPECT_LE(st.tracked(), 4u);
+  EXPECT_EQ(st.memory_bytes(), bytes);
+  // Prefixes already tracked keep counting; new ones are turned away.
+  EXPECT_TRUE(st.record_source(ip("203.0.0.2"), kBase).blocked);
+  EXPECT_EQ(st.record_source(ip("198.51.100.1"), kBase).sources, 0);
+  st.sweep(kBase + 1h);
+  EXPECT_EQ(st.record_source(ip("198.51.100.1"), kBase + 1h).sources, 1);
+  EXPECT_EQ(st.memory_bytes(), bytes);
+}
+
+TEST(SharedBanTracker, BoundedTrackerHoldsItsMemoryUnderAWideIpv6Scan) {
+  const std::size_t budget = 1 << 20;
+  const auto cfg = SharedBanTracker::bounded(
+      BanTracker::Config{}, SubnetTracker::Config{/*threshold=*/2}, budget);
+  SharedBanTracker bt(cfg.bans, cfg.subnets);
+  const std::size_t start = bt.memory_bytes();
+  EXPECT_LE(start, budget);
+  // A prefix seen before the scan fills the trie still escalates after it.
+  bt.record_offense(ip("203.0.113.1"), kBase);
+  // Every source of the scan is in a /64 of its own: several times what the
+  // trie has room for.
+  ASSERT_LT(cfg.subnets.max_nodes, 4000u);
+  auto v6 = boost::asio::ip::make_address_v6("2a01::1").to_bytes();
+  for (std::uint32_t i = 0; i < 4000; ++i) {
+    v6[4] = static_cast<unsigned char>(i >> 24);
+    v6[5] = static_cast<unsigned char>(i >> 16);
+    v6[6] = static_cast<unsigned char>(i >> 8);
+    v6[7] = static_cast<unsigned char>(i);
+    bt.record_offense(boost::asio::ip::address_v6(v6),
+                      kBase + std::chrono::milliseconds(i));
+  }
+  EXPECT_EQ(bt.memory_bytes(), start);
+  // The scan leaves some sketch counters shared, so a few of these may not
+  // count as first offenses; enough of them do.
+  for (int i = 2; i <= 9; ++i) {
+    bt.record_offense(ip("203.0.113." + std::to_string(i)), kBase + 1h);
+  }
+  EXPECT_TRUE(bt.is_blocked(ip("203.0.113.200"), kBase + 1h));
+}
+
+TEST(SharedBanTracker, BoundedBudgetCoversEveryShard) {
+  // The smallest is not far above what sixteen shards need before their
+  // tables: a wheel and a block filter each.
+  for (std::size_t budget : {128u << 10, 300u << 10, 1u << 20, 5u << 20}) {
+    for (std::size_t shards : {1u, 4u, 16u}) {
+      const auto cfg = SharedBanTracker::bounded(
+          BanTracker::Config{}, SubnetTracker::Config{}, budget, shards);
+      SharedBanTracker bt(cfg.bans, cfg.subnets, shards);
+      // Wheels and filters included, and not so much left over that the
+      // tables could have been twice the size.
+      EXPECT_LE(bt.memory_bytes(), budget) << budget << " " << shards;
+      EXPECT_GT(bt.memory_bytes(), budget / 2) << budget << " " << shards;
+    }
+  }
+}
+
+TEST(SharedBanTracker, EscalatesToPrefixOnDistinctFirstOffenses) {
+  SharedBanTracker bt(BanTracker::Config{},
+                      SubnetTracker::Config{/*threshold=*/2, /*window=*/24h});
+  // Repeat offenses from one address do not count as extra sources.
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_FALSE(bt.record_offense(ip("198.51.100.1"), kBase).prefix_blocked);
+  }
+  EXPECT_FALSE(bt.record_offense(ip("198.51.100.2"), kBase).prefix_blocked);
+  EXPECT_FALSE(bt.is_blocked(ip("198.51.100.9"), kBase));
+  EXPECT_TRUE(bt.record_offense(ip("198.51.100.3"), kBase).prefix_blocked);
+  EXPECT_TRUE(bt.is_blocked(ip("198.51.100.9"), kBase));
+  EXPECT_EQ(bt.tracked_prefixes(), 1u);
+  bt.sweep(kBase + 24h);
+  EXPECT_EQ(bt.tracked_prefixes(), 0u);
+  EXPECT_FALSE(bt.is_blocked(ip("198.51.100.9"), kBase + 24h));
+}
+
+TEST(SharedBanTracker, ReconfigureKeepsOffensesInsideTheNewWindow) {
+  SharedBanTracker bt(BanTracker::Config{/*threshold=*/5, /*window=*/24h},
+                      SubnetTracker::Config{/*threshold=*/0});
+  // Three offenses from an hour ago, and three from ten hours ago.
+  for (int i = 0; i < 3; ++i) {
+    bt.record_offense(ip("203.0.113.1"), kBase - 1h);
+    bt.record_offense(ip("203.0.113.2"), kBase - 10h);
+  }
+  EXPECT_FALSE(bt.is_blocked(ip("203.0.113.1"), kBase));
+
+  // Lowering the threshold blocks on the offenses already seen...
+  bt.reconfigure(BanTracker::Config{/*threshold=*/2, /*window=*/24h},
+                 SubnetTracker::Config{/*threshold=*/0}, kBase);
+  EXPECT_TRUE(bt.is_blocked(ip("203.0.113.1"), kBase));
+  EXPECT_TRUE(bt.is_blocked(ip("203.0.113.2"), kBase));
+  EXPECT_EQ(bt.tracked(), 2u);
+
+  // ...and shrinking the window drops the ones now outside it.
+  bt.reconfigure(BanTracker::Config{/*threshold=*/2, /*window=*/2h},
+                 SubnetTracker::Config{/*threshold=*/0}, kBase);
+  EXPECT_TRUE(bt.is_blocked(ip("203.0.113.1"), kBase));
+  EXPECT_FALSE(bt.is_blocked(ip("203.0.113.2"), kBase));
+  EXPECT_EQ(bt.tracked(), 1u);
+  // The new window also governs expiry.
+  EXPECT_FALSE(bt.is_blocked(ip("203.0.113.1"), kBase + 1h));
+  bt.expire(kBase + 2h);
+  EXPECT_EQ(bt.tracked(), 0u);
+}
+
+TEST(SharedBanTracker, ReconfigureRebuildsBoundedTables) {
+  const BanTracker::Config bounded =
+      BanTracker::bounded(BanTracker::Config{/*threshold=*/3}, 1 << 20);
+  SharedBanTracker bt(bounded, SubnetTracker::Config{/*threshold=*/0});
+  for (int i = 0; i < 4; ++i) {
+    bt.record_offense(ip("203.0.113.1"), kBase);
+  }
+  ASSERT_TRUE(bt.is_blocked(ip("203.0.113.1"), kBase));
+  const std::size_t bytes = bt.memory_bytes();
+
+  // The daemon sizes the new table to the same memory budget.
+  bt.reconfigure(
+      BanTracker::bounded(BanTracker::Config{/*threshold=*/1}, 1 << 20),
+      SubnetTracker::Config{/*threshold=*/0}, kBase);
+  EXPECT_TRUE(bt.is_blocked(ip("203.0.113.1"), kBase));
+  EXPECT_LE(bt.memory_bytes(), bytes);
+}
+
+TEST(SharedBanTracker, ReconfigureEscalatesSubnetsOnTheNewThreshold) {
+  SharedBanTracker bt(BanTracker::Config{},
+                      SubnetTracker::Config{/*threshold=*/8, /*window=*/24h});
+  for (int i = 1; i <= 3; ++i) {
+    bt.record_offense(ip("198.51.100." + std::to_string(i)), kBase);
+  }
+  EXPECT_FALSE(bt.is_blocked(ip("198.51.100.9"), kBase));
+  bt.reconfigure(BanTracker::Config{},
+                 SubnetTracker::Config{/*threshold=*/2, /*window=*/24h}, kBase);
+  EXPECT_TRUE(bt.is_blocked(ip("198.51.100.9"), kBase));
+}
+
+TEST(SharedBanTracker, ReconfiguresWhileOtherThreadsServe) {
+  SharedBanTracker bt(BanTracker::Config{},
+                      SubnetTracker::Config{/*threshold=*/2, /*window=*/24h});
+  std::atomic<bool> done = false;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; !done; i = (i + 1) % 250) {
+        const IpKey addr =
+            ip("198.51." + std::to_string(100 + t) + "." + std::to_string(i));
+        bt.record_offense(addr, kBase);
+        bt.is_blocked(addr, kBase);
+      }
+    });
+  }
+  // Subnet escalation switched off and on again under the serving threads.
+  for (int i = 0; i < 50; ++i) {
+    bt.reconfigure(BanTracker::Config{},
+                   SubnetTracker::Config{/*threshold=*/i % 2 ? 2 : 0}, kBase);
+  }
+  done = true;
+  for (auto &t : threads) {
+    t.join();
+  }
+  // Left enabled: fresh sources still escalate.
+  for (int i = 1; i <= 3; ++i) {
+    bt.record_offense(ip("203.0.113." + std::to_string(i)), kBase);
+  }
+  EXPECT_TRUE(bt.is_blocked(ip("203.0.113.9"), kBase));
 }
 
 static bool bannable(const char *ip) {
@@ -0,0 +1,187 @@
+#include "banstate.hpp"
+#include <boost/asio/ip/address.hpp>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+
+using namespace std::chrono_literals;
+using steady = std::chrono::steady_clock;
+using wall = std::chrono::system_clock;
+
+// Fixed points on both clocks; the restarted daemon gets a different steady
+// epoch, as it would after a reboot.
+static const steady::time_point kBase = steady::time_point{} + 1000h;
+static const steady::time_point kRestart = steady::time_point{} + 50h;
+static const wall::time_point kWall = wall::time_point{} + 480000h;
+
+static IpKey ip(const std::string &s) {
+  return boost::asio::ip::make_address(s);
+}
+
+class BanStateTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    dir = std::filesystem::temp_directory_path() /
+          ("finger_banstate_test_" +
+           std::to_string(steady::now().time_since_epoch().count()));
+    std::filesystem::create_directories(dir);
+    path = dir / "bans";
+  }
+  void TearDown() override { std::filesystem::remove_all(dir); }
+
+  std::filesystem::path dir;
+  std::filesystem::path path;
+};
+
+TEST_F(BanStateTest, MissingFileRestoresNothing) {
+  SharedBanTracker bt;
+  EXPECT_EQ(load_ban_state(bt, path, kRestart, kWall), 0u);
+  EXPECT_EQ(bt.tracked(), 0u);
+}
+
+TEST_F(BanStateTest, RoundTripKeepsBlocksAndBudgets) {
+  SharedBanTracker before;
+  for (int i = 0; i < 4; ++i) {
+    before.record_offense(ip("8.8.8.8"), kBase + i * 1h); // blocked
+  }
+  before.record_offense(ip("2001:db8::1"), kBase + 3h); // one strike
+  // Two addresses, plus the /24 and /64 they count towards.
+  EXPECT_EQ(save_ban_state(before, path, kBase + 4h, kWall), 4u);
+
+  // Restarted ten minutes later.
+  SharedBanTracker after;
+  EXPECT_EQ(load_ban_state(after, path, kRestart, kWall + 10min), 4u);
+  EXPECT_EQ(after.tracked(), 2u);
+  EXPECT_EQ(after.tracked_prefixes(), 2u);
+  EXPECT_TRUE(after.is_blocked(ip("8.8.8.8"), kRestart));
+  EXPECT_FALSE(after.is_blocked(ip("2001:db8::1"), kRestart));
+  EXPECT_EQ(after.record_offense(ip("2001:db8::1"), kRestart).count, 2);
+
+  // The first offense was 4h10m old at restart, so the block lapses 19h50m
+  // later -- the same moment it would have without the restart.
+  EXPECT_TRUE(after.is_blocked(ip("8.8.8.8"), kRestart + 19h + 49min));
+  EXPECT_FALSE(after.is_blocked(ip("8.8.8.8"), kRestart + 19h + 50min));
+}
+
+TEST_F(BanStateTest, BoundedTablesRestoreRowsPastTheSketch) {
+  SharedBanTracker before;
+  for (int i = 0; i < 4; ++i) {
+    before.record_offense(ip("8.8.8.8"), kBase + i * 1h); // blocked
+  }
+  before.record_offense(ip("9.9.9.9"), kBase + 3h); // one strike
+  save_ban_state(before, path, kBase + 4h, kWall);
+
+  SharedBanTracker after(
+      BanTracker::bounded(BanTracker::Config{}, 1 << 20),
+      SubnetTracker::Config{/*threshold=*/0});
+  load_ban_state(after, path, kRestart, kWall);
+  // Both keep their rows; neither is left to the sketch.
+  EXPECT_EQ(after.tracked(), 2u);
+  EXPECT_TRUE(after.is_blocked(ip("8.8.8.8"), kRestart));
+  EXPECT_EQ(after.record_offense(ip("9.9.9.9"), kRestart).count, 2);
+}
+
+TEST_F(BanStateTest, DowntimeCountsAgainstTheWindow) {
+  SharedBanTracker before;
+  for (int i = 0; i < 4; ++i) {
+    before.record_offense(ip("8.8.8.8"), kBase);
+  }
+  before.record_offense(ip("1.1.1.1"), kBase + 20h);
+  save_ban_state(before, path, kBase + 20h, kWall);
+
+  // Down for 5 hours: 8.8.8.8's offenses are now 25h old and dropped.
+  SharedBanTracker after;
+  load_ban_state(after, path, kRestart, kWall + 5h);
+  EXPECT_EQ(after.tracked(), 1u);
+  EXPECT_FALSE(after.is_blocked(ip("8.8.8.8"), kRestart));
+}
+
+TEST_F(BanStateTest, OffensesFromBeforeABootAreDropped) {
+  SharedBanTracker before(BanTracker::Config{}, SubnetTracker::Config{0});
+  for (int i = 0; i < 4; ++i) {
+    before.record_offense(ip("8.8.8.8"), kBase + i * 1h);
+  }
+  save_ban_state(before, path, kBase + 4h, kWall);
+
+  // The host rebooted and the daemon started two minutes into its uptime:
+  // the offenses predate this boot's steady clock. They must not be pinned
+  // to the moment it started, which would block 8.8.8.8 for another day.
+  const auto booted = steady::time_point{} + 2min;
+  SharedBanTracker after(BanTracker::Config{}, SubnetTracker::Config{0});
+  load_ban_state(after, path, booted, kWall + 10min);
+  EXPECT_EQ(after.tracked(), 0u);
+  EXPECT_FALSE(after.is_blocked(ip("8.8.8.8"), booted));
+  EXPECT_EQ(after.record_offense(ip("8.8.8.8"), booted).count, 1);
+}
+
+TEST_F(BanStateTest, RestoresBlockedPrefixes) {
+  SharedBanTracker before(BanTracker::Config{},
+                          SubnetTracker::Config{/*threshold=*/2});
+  before.record_offense(ip("198.51.100.1"), kBase);
+  before.record_offense(ip("198.51.100.2"), kBase);
+  before.record_offense(ip("198.51.100.3"), kBase);
+  ASSERT_TRUE(before.is_blocked(ip("198.51.100.200"), kBase));
+  EXPECT_EQ(save_ban_state(before, path, kBase, kWall), 4u);
+
+  SharedBanTracker after(BanTracker::Config{},
+                         SubnetTracker::Config{/*threshold=*/2});
+  load_ban_state(after, path, kRestart, kWall);
+  EXPECT_EQ(after.tracked_prefixes(), 1u);
+  EXPECT_TRUE(after.is_blocked(ip("198.51.100.200"), kRestart));
+  // Restoring the addresses did not count them as sources a second time.
+  SharedBanTracker fresh(BanTracker::Config{},
+                         SubnetTracker::Config{/*threshold=*/3});
+  load_ban_state(fresh, path, kRestart, kWall);
+  EXPECT_FALSE(fresh.is_blocked(ip("198.51.100.200"), kRestart));
+}
+
+TEST_F(BanStateTest, RejectsForeignAndTruncatedFiles) {
+  std::ofstream(path) << "hello, this is not a snapshot at all";
+  SharedBanTracker bt;
+  EXPECT_THROW(load_ban_state(bt, path, kRestart, kWall), std::runtime_error);
+
+  SharedBanTracker before;
+  before.record_offense(ip("8.8.8.8"), kBase);
+  before.record_offense(ip("1.1.1.1"), kBase);
+  save_ban_state(before, path, kBase, kWall);
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 2);
+  EXPECT_THROW(load_ban_state(bt, path, kRestart, kWall), std::runtime_error);
+  EXPECT_EQ(bt.tracked(), 0u);
+}
+
+TEST_F(BanStateTest, SnapshotIsReplacedNotAppended) {
+  SharedBanTracker bt;
+  bt.record_offense(ip("8.8.8.8"), kBase);
+  save_ban_state(bt, path, kBase, kWall);
+  const auto one = std::filesystem::file_size(path);
+  save_ban_state(bt, path, kBase, kWall);
+  EXPECT_EQ(std::filesystem::file_size(path), one);
+  EXPECT_FALSE(std::filesystem::exists(path.string() + ".tmp"));
+}
+
+TEST(BanStateBuffer, RoundTripsInMemory) {
+  SharedBanTracker before;
+  for (int i = 0; i < 4; ++i) {
+    before.record_offense(ip("8.8.8.8"), kBase + i * 1min);
+  }
+  const std::vector<char> buf = encode_ban_state(before, kBase + 5min, kWall);
+
+  // Handed straight to another process on the same host.
+  SharedBanTracker after;
+  EXPECT_EQ(decode_ban_state(after, buf, kRestart, kWall), 2u);
+  EXPECT_TRUE(after.is_blocked(ip("8.8.8.8"), kRestart));
+
+  SharedBanTracker partial;
+  EXPECT_THROW(decode_ban_state(partial, std::span(buf).first(buf.size() - 1),
+                                kRestart, kWall),
+               std::runtime_error);
+  EXPECT_EQ(partial.tracked(), 0u);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,115 @@
+#include "blockcache.hpp"
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Enables the cache for one test, and empties it again afterwards.
+class ThreadBlockCacheTest : public ::testing::Test {
+protected:
+  void SetUp() override { ThreadBlockCache::enable(); }
+  void TearDown() override { ThreadBlockCache::disable(); }
+};
+
+// Stops the compiler from eliding a new/delete pair.
+void *volatile sink;
+
+// Allocate one block of size bytes and free it again; the block's address.
+std::uintptr_t churn(std::size_t size) {
+  auto block = std::make_unique<unsigned char[]>(size);
+  sink = block.get();
+  return reinterpret_cast<std::uintptr_t>(block.get());
+}
+
+} // namespace
+
+TEST_F(ThreadBlockCacheTest, FreedBlocksAreReusedWithoutMalloc) {
+  const std::uintptr_t first = churn(200);
+  const auto before = ThreadBlockCache::stats();
+  // Anything that rounds up to the same size takes the same block back.
+  EXPECT_EQ(churn(200), first);
+  EXPECT_EQ(churn(ThreadBlockCache::kGranule * 4 - 1), first);
+  const auto after = ThreadBlockCache::stats();
+  EXPECT_EQ(after.allocations - before.allocations, 2u);
+  EXPECT_EQ(after.heap, before.heap);
+}
+
+TEST_F(ThreadBlockCacheTest, BlocksKeepTheirAlignment) {
+  for (std::size_t size : {1u, 8u, 63u, 64u, 65u, 1000u, 5000u}) {
+    auto block = std::make_unique<unsigned char[]>(size);
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(block.get()) %
+                  alignof(std::max_align_t),
+              0u)
+        << size;
+  }
+}
+
+TEST_F(ThreadBlockCacheTest, LargeBlocksGoStraightBackToMalloc) {
+  churn(ThreadBlockCache::kMaxBlock + 1);
+  const auto before = ThreadBlockCache::stats();
+  churn(ThreadBlockCache::kMaxBlock + 1);
+  EXPECT_EQ(ThreadBlockCache::stats().heap - before.heap, 1u);
+}
+
+TEST_F(ThreadBlockCacheTest, CachedBytesAreCapped) {
+  constexpr std::size_t kSize = 2048;
+  constexpr std::size_t kKept = ThreadBlockCache::kMaxCachedBytes / kSize;
+  std::vector<std::unique_ptr<unsigned char[]>> blocks;
+  blocks.reserve(2 * kKept);
+  for (std::size_t i = 0; i < 2 * kKept; ++i) {
+    blocks.push_back(std::make_unique<unsigned char[]>(kSize));
+  }
+  blocks.clear();
+  const auto before = ThreadBlockCache::stats();
+  for (std::size_t i = 0; i < 2 * kKept; ++i) {
+    blocks.push_back(std::make_unique<unsigned char[]>(kSize));
+  }
+  EXPECT_EQ(ThreadBlockCache::stats().heap - before.heap, kKept);
+}
+
+TEST_F(ThreadBlockCacheTest, BlocksMayBeFreedOnAnyThread) {
+  // Allocated on a thread with no cache, freed here: back to malloc().
+  std::unique_ptr<std::string> there;
+  std::thread([&there] {
+    there = std::make_unique<std::string>(100, 'y');
+  }).join();
+  EXPECT_EQ(*there, std::string(100, 'y'));
+  EXPECT_FALSE(ThreadBlockCache::owns(there.get()));
+  there.reset();
+
+  // Allocated here, freed on a thread with no cache: kept for whichever
+  // thread with a cache asks next.
+  auto here = std::make_unique<std::string>(100, 'x');
+  EXPECT_TRUE(ThreadBlockCache::owns(here.get()));
+  const auto block = reinterpret_cast<std::uintptr_t>(here.get());
+  std::thread([&here] { here.reset(); }).join();
+  // The thread's own state went the same way, so it may come first.
+  std::vector<std::unique_ptr<std::string>> taken;
+  bool found = false;
+  for (int i = 0; i < 4 && !found; ++i) {
+    taken.push_back(std::make_unique<std::string>());
+    found = reinterpret_cast<std::uintptr_t>(taken.back().get()) == block;
+  }
+  EXPECT_TRUE(found);
+}
+
+TEST(ThreadBlockCacheDisabled, EveryBlockComesFromMalloc) {
+  const auto before = ThreadBlockCache::stats();
+  churn(200);
+  churn(200);
+  const auto after = ThreadBlockCache::stats();
+  EXPECT_EQ(after.allocations - before.allocations, 2u);
+  EXPECT_EQ(after.heap - before.heap, 2u);
+  // At its own size: nothing is rounded up or put in front of it.
+  auto block = std::make_unique<unsigned char[]>(200);
+  EXPECT_FALSE(ThreadBlockCache::owns(block.get()));
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
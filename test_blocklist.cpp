@@ -0,0 +1,320 @@
+#include "blocklist.hpp"
+#include <boost/asio/ip/address.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std::chrono_literals;
+using clock_t_ = BanTracker::clock;
+
+static const clock_t_::time_point kBase = clock_t_::time_point{} + 1000h;
+
+static IpKey ip(const std::string &s) {
+  return boost::asio::ip::make_address(s);
+}
+
+// Records every transition as "ban <cidr> <ttl>" / "unban <cidr>".
+class RecordingSink : public BanSink {
+public:
+  void ban(const BlockedNet &net, std::chrono::seconds ttl) override {
+    events.push_back("ban " + net.to_string() + " " +
+                     std::to_string(ttl.count()));
+  }
+  void unban(const BlockedNet &net) override {
+    events.push_back("unban " + net.to_string());
+  }
+  std::vector<std::string> events;
+};
+
+static std::string slurp(const std::filesystem::path &p) {
+  std::ifstream in(p);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+TEST(BanSinkExport, PrefixesReplaceTheAddressesTheyCover) {
+  RecordingSink sink;
+  SharedBanTracker bt(BanTracker::Config{/*threshold=*/1, /*window=*/1h},
+                      SubnetTracker::Config{/*threshold=*/2, /*window=*/1h});
+  bt.set_sink(&sink);
+  bt.record_offense(ip("198.51.100.1"), kBase);
+  bt.record_offense(ip("198.51.100.1"), kBase);
+  ASSERT_EQ(sink.events, std::vector<std::string>{"ban 198.51.100.1/32 3600"});
+  bt.record_offense(ip("198.51.100.2"), kBase);
+  bt.record_offense(ip("198.51.100.3"), kBase);
+  ASSERT_TRUE(bt.is_blocked(ip("198.51.100.9"), kBase));
+  EXPECT_EQ(sink.events,
+            (std::vector<std::string>{"ban 198.51.100.1/32 3600",
+                                      "unban 198.51.100.1/32",
+                                      "ban 198.51.100.0/24 3600"}));
+  // Addresses inside the exported prefix are left to it.
+  bt.record_offense(ip("198.51.100.2"), kBase + 1min);
+  bt.record_offense(ip("198.51.100.1"), kBase + 1min);
+  EXPECT_EQ(sink.events.size(), 3u);
+  // Addresses outside it are not.
+  bt.record_offense(ip("198.51.101.1"), kBase);
+  bt.record_offense(ip("198.51.101.1"), kBase);
+  EXPECT_EQ(sink.events.back(), "ban 198.51.101.1/32 3600");
+}
+
+TEST(BanSinkExport, BoundedTrackerCapsItsExports) {
+  RecordingSink sink;
+  const std::size_t budget = 256 << 10;
+  const auto cfg = SharedBanTracker::bounded(
+      BanTracker::Config{/*threshold=*/1, /*window=*/1h},
+      SubnetTracker::Config{0}, budget, SharedBanTracker::kDefaultShards,
+      /*exporting=*/true);
+  ASSERT_GT(cfg.max_exported, 0u);
+  ASSERT_LT(cfg.max_exported, 1000u);
+  SharedBanTracker bt(cfg.bans, cfg.subnets);
+  bt.set_sink(&sink, cfg.max_exported);
+  const std::size_t start = bt.memory_bytes();
+  EXPECT_LE(start, budget);
+  // A thousand addresses blocked at once: more than there is room for.
+  for (int i = 0; i < 1000; ++i) {
+    const auto addr = ip("198.51." + std::to_string(100 + i / 250) + "." +
+                         std::to_string(1 + i % 250));
+    bt.record_offense(addr, kBase);
+    bt.record_offense(addr, kBase);
+    EXPECT_TRUE(bt.is_blocked(addr, kBase));
+  }
+  EXPECT_EQ(bt.memory_bytes(), start);
+  EXPECT_EQ(sink.events.size(), cfg.max_exported);
+  // The sketch may block an address on its first offense, so the second
+  // can be dropped again.
+  EXPECT_GE(bt.dropped_exports(), 1000 - cfg.max_exported);
+  // Once the exported blocks lapse, new ones take their place.
+  bt.record_offense(ip("203.0.113.1"), kBase + 1h);
+  bt.record_offense(ip("203.0.113.1"), kBase + 1h);
+  EXPECT_EQ(sink.events.back(), "ban 203.0.113.1/32 3600");
+  EXPECT_EQ(sink.events.size(), 2 * cfg.max_exported + 1);
+}
+
+class BlocklistTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    dir = std::filesystem::temp_directory_path() /
+          ("finger_blocklist_test_" +
+           std::to_string(clock_t_::now().time_since_epoch().count()));
+    std::filesystem::create_directories(dir);
+  }
+  void TearDown() override { std::filesystem::remove_all(dir); }
+
+  std::filesystem::path dir;
+};
+
+TEST(BlockedNet, FormatsInOwnFamily) {
+  EXPECT_EQ((BlockedNet{ip("1.2.3.4"), 128}).to_string(), "1.2.3.4/32");
+  EXPECT_EQ((BlockedNet{ip("203.0.113.0"), 120}).to_string(), "203.0.113.0/24");
+  EXPECT_EQ((BlockedNet{ip("2001:db8::"), 64}).to_string(), "2001:db8::/64");
+}
+
+TEST(BanSinkExport, BanIsPushedOnceWithRemainingLifetime) {
+  RecordingSink sink;
+  SharedBanTracker bt(BanTracker::Config{}, SubnetTracker::Config{0});
+  bt.set_sink(&sink);
+  bt.record_offense(ip("8.8.8.8"), kBase);
+  bt.record_offense(ip("8.8.8.8"), kBase + 1h);
+  bt.record_offense(ip("8.8.8.8"), kBase + 2h);
+  EXPECT_TRUE(sink.events.empty());
+  bt.record_offense(ip("8.8.8.8"), kBase + 3h); // blocked
+  bt.record_offense(ip("8.8.8.8"), kBase + 3h); // in-flight straggler
+  // The block lapses when the kBase offense leaves the window: 21h from now.
+  ASSERT_EQ(sink.events.size(), 2u);
+  EXPECT_EQ(sink.events[0], "ban 8.8.8.8/32 75600");
+  // The straggler pushed the oldest remembered offense to kBase + 1h, so the
+  // block was extended.
+  EXPECT_EQ(sink.events[1], "ban 8.8.8.8/32 79200");
+}
+
+TEST(BanSinkExport, LapsedBansAreWithdrawnBySweep) {
+  RecordingSink sink;
+  SharedBanTracker bt(BanTracker::Config{/*threshold=*/1, /*window=*/1h},
+                      SubnetTracker::Config{0});
+  bt.set_sink(&sink);
+  bt.record_offense(ip("8.8.8.8"), kBase);
+  bt.record_offense(ip("8.8.8.8"), kBase);
+  ASSERT_EQ(sink.events.size(), 1u);
+  bt.sweep(kBase + 30min);
+  EXPECT_EQ(sink.events.size(), 1u);
+  bt.sweep(kBase + 1h);
+  ASSERT_EQ(sink.events.size(), 2u);
+  EXPECT_EQ(sink.events[1], "unban 8.8.8.8/32");
+}
+
+TEST(BanSinkExport, PrefixBlocksAreExportedAsCidr) {
+  RecordingSink sink;
+  SharedBanTracker bt(BanTracker::Config{},
+                      SubnetTracker::Config{/*threshold=*/1, /*window=*/1h});
+  bt.set_sink(&sink);
+  bt.record_offense(ip("198.51.100.1"), kBase);
+  bt.record_offense(ip("198.51.100.2"), kBase);
+  ASSERT_EQ(sink.events.size(), 1u);
+  EXPECT_EQ(sink.events[0], "ban 198.51.100.0/24 3600");
+  bt.sweep(kBase + 1h);
+  EXPECT_EQ(sink.events.back(), "unban 198.51.100.0/24");
+}
+
+TEST(BanSinkExport, PrefixesHoldingAnAllowlistedAddressStayOut) {
+  RecordingSink sink;
+  SharedBanTracker bt(BanTracker::Config{/*threshold=*/1, /*window=*/1h},
+                      SubnetTracker::Config{/*threshold=*/1, /*window=*/1h});
+  bt.set_sink(&sink);
+  bt.set_allowlist({"198.51.100.7", "not an address"});
+  // Two other sources block the /24 the allowlisted proxy sits in.
+  bt.record_offense(ip("198.51.100.1"), kBase);
+  bt.record_offense(ip("198.51.100.2"), kBase);
+  EXPECT_TRUE(bt.is_blocked(ip("198.51.100.9"), kBase));
+  EXPECT_TRUE(sink.events.empty());
+  // Addresses of their own are still exported.
+  bt.record_offense(ip("198.51.100.1"), kBase);
+  ASSERT_EQ(sink.events.size(), 1u);
+  EXPECT_EQ(sink.events[0], "ban 198.51.100.1/32 3600");
+
+  // A block exported before its address was allowlisted is withdrawn.
+  bt.record_offense(ip("203.0.113.1"), kBase);
+  bt.record_offense(ip("203.0.113.2"), kBase);
+  ASSERT_EQ(sink.events.back(), "ban 203.0.113.0/24 3600");
+  bt.set_allowlist({"198.51.100.7", "203.0.113.80"});
+  EXPECT_EQ(sink.events.back(), "unban 203.0.113.0/24");
+  const std::size_t events = sink.events.size();
+  bt.sweep(kBase + 1h);
+  EXPECT_EQ(sink.events.size(), events + 1); // only 198.51.100.1 lapses
+  EXPECT_EQ(sink.events.back(), "unban 198.51.100.1/32");
+}
+
+TEST_F(BlocklistTest, FileSinkKeepsCurrentList) {
+  const auto path = dir / "banned";
+  std::ofstream(path) << "stale\n";
+  FileBanSink sink(path);
+  EXPECT_EQ(slurp(path), "");
+  sink.ban(BlockedNet{ip("8.8.8.8"), 128}, 60s);
+  sink.ban(BlockedNet{ip("2001:db8::"), 64}, 60s);
+  sink.ban(BlockedNet{ip("8.8.8.8"), 128}, 60s); // duplicate
+  EXPECT_EQ(sink.size(), 2u);
+  sink.flush();
+  const std::string two = slurp(path);
+  EXPECT_NE(two.find("8.8.8.8/32\n"), std::string::npos);
+  EXPECT_NE(two.find("2001:db8::/64\n"), std::string::npos);
+  sink.unban(BlockedNet{ip("8.8.8.8"), 128});
+  sink.flush();
+  EXPECT_EQ(slurp(path), "2001:db8::/64\n");
+  EXPECT_EQ(sink.failures(), 0u);
+}
+
+TEST_F(BlocklistTest, FileSinkWritesInTheBackground) {
+  const auto path = dir / "banned";
+  {
+    FileBanSink sink(path, 1h);
+    // The first change is written straight away, the rest wait out the
+    // interval behind it: ban() never waits for the file.
+    sink.ban(BlockedNet{ip("8.8.8.8"), 128}, 60s);
+    sink.flush();
+    EXPECT_EQ(slurp(path), "8.8.8.8/32\n");
+    for (int i = 1; i <= 100; ++i) {
+      sink.ban(BlockedNet{ip("198.51.100." + std::to_string(i)), 128}, 60s);
+    }
+    EXPECT_EQ(slurp(path), "8.8.8.8/32\n");
+  }
+  // Whatever is still pending is written out on the way down.
+  std::ifstream in(path);
+  std::size_t lines = 0;
+  for (std::string line; std::getline(in, line);) {
+    ++lines;
+  }
+  EXPECT_EQ(lines, 101u);
+}
+
+TEST_F(BlocklistTest, FileSinkCountsFailedWrites) {
+  FileBanSink sink(dir / "missing" / "banned");
+  EXPECT_EQ(sink.failures(), 1u); // clearing the list at startup
+  sink.ban(BlockedNet{ip("8.8.8.8"), 128}, 60s);
+  sink.flush();
+  EXPECT_EQ(sink.failures(), 2u);
+}
+
+TEST_F(BlocklistTest, CommandSinkRunsCommandsInOrder) {
+  const auto log = dir / "log";
+  auto append = [log](const std::string &line) {
+    return CommandBanSink::Argv{"/bin/sh", "-c",
+                                "echo \"$1\" >> \"$2\"", "sh", line,
+                                log.string()};
+  };
+  CommandBanSink sink(
+      [&](const BlockedNet &net, std::chrono::seconds ttl) {
+        return append("add " + net.to_string() + " " +
+                      std::to_string(ttl.count()));
+      },
+      [&](const BlockedNet &net) { return append("del " + net.to_string()); },
+      {append("flush")});
+  sink.ban(BlockedNet{ip("8.8.8.8"), 128}, 30s);
+  sink.unban(BlockedNet{ip("8.8.8.8"), 128});
+  sink.flush();
+  EXPECT_EQ(slurp(log), "flush\nadd 8.8.8.8/32 30\ndel 8.8.8.8/32\n");
+  EXPECT_EQ(sink.failures(), 0u);
+}
+
+TEST_F(BlocklistTest, CommandSinkCountsFailures) {
+  CommandBanSink sink(
+      [](const BlockedNet &, std::chrono::seconds) {
+        return CommandBanSink::Argv{"/nonexistent/firewall-tool"};
+      },
+      [](const BlockedNet &) { return CommandBanSink::Argv{"false"}; });
+  sink.ban(BlockedNet{ip("8.8.8.8"), 128}, 30s);
+  sink.unban(BlockedNet{ip("8.8.8.8"), 128});
+  sink.flush();
+  EXPECT_EQ(sink.failures(), 2u);
+}
+
+TEST_F(BlocklistTest, NftSinkReplacesElements) {
+  // A stand-in nft on PATH that logs its arguments, one run per line.
+  const auto log = dir / "log";
+  {
+    std::ofstream script(dir / "nft");
+    script << "#!/bin/sh\necho \"$*\" >> '" << log.string() << "'\n";
+  }
+  std::filesystem::permissions(dir / "nft",
+                               std::filesystem::perms::owner_all);
+  const char *old_path = std::getenv("PATH");
+  const std::string saved = old_path ? old_path : "";
+  ::setenv("PATH", (dir.string() + ":" + saved).c_str(), 1);
+  {
+    auto sink = make_nft_sink("inet", "filter", "banned");
+    sink->ban(BlockedNet{ip("203.0.113.0"), 120}, 60s);
+    sink->unban(BlockedNet{ip("2001:db8::1"), 128});
+    sink->flush();
+    EXPECT_EQ(sink->failures(), 0u);
+  }
+  ::setenv("PATH", saved.c_str(), 1);
+  EXPECT_EQ(slurp(log),
+            "flush set inet filter banned\n"
+            "flush set inet filter banned6\n"
+            "add element inet filter banned { 203.0.113.0/24 }; "
+            "delete element inet filter banned { 203.0.113.0/24 }; "
+            "add element inet filter banned { 203.0.113.0/24 timeout 60s }\n"
+            "add element inet filter banned6 { 2001:db8::1/128 }; "
+            "delete element inet filter banned6 { 2001:db8::1/128 }\n");
+}
+
+TEST_F(BlocklistTest, ParsesSinkSpecs) {
+  EXPECT_NE(dynamic_cast<FileBanSink *>(
+                make_ban_sink("file:" + (dir / "list").string()).get()),
+            nullptr);
+  EXPECT_THROW(make_ban_sink(""), std::invalid_argument);
+  EXPECT_THROW(make_ban_sink("file:"), std::invalid_argument);
+  EXPECT_THROW(make_ban_sink("nft:inet:filter"), std::invalid_argument);
+  EXPECT_THROW(make_ban_sink("pf:"), std::invalid_argument);
+  EXPECT_THROW(make_ban_sink("iptables:x"), std::invalid_argument);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,145 @@
+#include "bundle.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+class PlanBundleTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    dir = std::filesystem::temp_directory_path() /
+          ("finger_bundle_test_" +
+           std::to_string(std::chrono::steady_clock::now()
+                              .time_since_epoch()
+                              .count()));
+    users = dir / "users";
+    std::filesystem::create_directories(users);
+    bundle = dir / "plans.bundle";
+  }
+
+  void TearDown() override { std::filesystem::remove_all(dir); }
+
+  void write(const std::filesystem::path &path, const std::string &content) {
+    std::ofstream(path, std::ios::binary) << content;
+  }
+
+  std::filesystem::path dir;
+  std::filesystem::path users;
+  std::filesystem::path bundle;
+};
+
+TEST_F(PlanBundleTest, EveryPlanIsFoundAndNothingElse) {
+  std::vector<PlanEntry> plans;
+  for (int i = 0; i < 2000; ++i) {
+    plans.push_back({"user" + std::to_string(i),
+                     "plan " + std::to_string(i) + "\r\n"});
+  }
+  write_plan_bundle(plans, bundle);
+
+  const auto b = PlanBundle::open(bundle);
+  EXPECT_EQ(b->size(), plans.size());
+  for (const auto &p : plans) {
+    const auto body = b->find(p.name);
+    ASSERT_TRUE(body) << p.name;
+    EXPECT_EQ(*body, p.body);
+  }
+  EXPECT_FALSE(b->find("user2000"));
+  EXPECT_FALSE(b->find("User1"));
+  EXPECT_FALSE(b->find(""));
+}
+
+TEST_F(PlanBundleTest, EmptyBundleMissesEverything) {
+  write_plan_bundle({}, bundle);
+  const auto b = PlanBundle::open(bundle);
+  EXPECT_EQ(b->size(), 0u);
+  EXPECT_FALSE(b->find("pete"));
+}
+
+TEST_F(PlanBundleTest, CollectsOnlyServablePlans) {
+  write(users / "pete", "Just another hacker.\n");
+  write(users / "alice", "line one\nline two");
+  write(users / "Bob", "never looked up");
+  write(users / "empty", "");
+  std::filesystem::create_directories(users / "subdir");
+
+  RealFilesystemWrapper fs;
+  const auto plans = collect_plans(users, fs);
+  ASSERT_EQ(plans.size(), 2u);
+  EXPECT_EQ(plans[0].name, "alice");
+  EXPECT_EQ(plans[0].body, "line one\nline two\r\n");
+  EXPECT_EQ(plans[1].name, "pete");
+  EXPECT_EQ(plans[1].body, "Just another hacker.\r\n");
+
+  EXPECT_THROW(write_plan_bundle({{"a", "x\r\n"}, {"a", "y\r\n"}}, bundle),
+               std::invalid_argument);
+}
+
+TEST_F(PlanBundleTest, WrapperServesLookupsFromTheMapping) {
+  write(users / "pete", "Just another hacker.\n");
+  RealFilesystemWrapper fs;
+  write_plan_bundle(collect_plans(users, fs), bundle);
+
+  BundleFilesystemWrapper served(bundle, users);
+  EXPECT_EQ(process("Pete", served, users), "Just another hacker.\r\n");
+  EXPECT_EQ(process("nobody", served, users), "nobody");
+  EXPECT_FALSE(served.exists("/elsewhere/pete"));
+
+  // The bundle is authoritative; files added since it was built are misses.
+  write(users / "alice", "hi\n");
+  EXPECT_EQ(process("alice", served, users), "alice");
+
+  // Bodies point into the mapping rather than being copied per request.
+  const Reply a = finger("pete", served, users);
+  const Reply b = finger("pete", served, users);
+  ASSERT_EQ(a.kind, Reply::Kind::plan);
+  EXPECT_EQ(a.body.view().data(), b.body.view().data());
+}
+
+TEST_F(PlanBundleTest, ReplacedBundleIsSwappedInWithoutBreakingOldReplies) {
+  write_plan_bundle({{"pete", "old plan\r\n"}}, bundle);
+  BundleFilesystemWrapper served(bundle, users);
+  const Reply old_reply = finger("pete", served, users);
+  EXPECT_FALSE(served.reload_if_changed());
+
+  write_plan_bundle({{"pete", "new plan\r\n"}, {"alice", "hi\r\n"}}, bundle);
+  if (served.watch_fd() >= 0) {
+    EXPECT_TRUE(served.process_events());
+  }
+  EXPECT_TRUE(served.reload_if_changed());
+  EXPECT_EQ(served.size(), 2u);
+  EXPECT_EQ(process("pete", served, users), "new plan\r\n");
+  EXPECT_EQ(process("alice", served, users), "hi\r\n");
+  // A reply built from the old bundle still has its bytes.
+  EXPECT_EQ(old_reply.body.view(), "old plan\r\n");
+}
+
+TEST_F(PlanBundleTest, BadFilesAreRejectedAndKeepTheCurrentBundle) {
+  EXPECT_THROW(PlanBundle::open(bundle), std::system_error);
+  write(bundle, "not a bundle at all, just some text");
+  EXPECT_THROW(PlanBundle::open(bundle), std::runtime_error);
+
+  write_plan_bundle({{"pete", "plan\r\n"}}, bundle);
+  std::string bytes;
+  {
+    std::ifstream in(bundle, std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  BundleFilesystemWrapper served(bundle, users);
+
+  // Replace (not overwrite in place) with a truncated copy.
+  const auto tmp = dir / "truncated";
+  write(tmp, bytes.substr(0, bytes.size() - 3));
+  std::filesystem::rename(tmp, bundle);
+  EXPECT_THROW(served.reload(), std::runtime_error);
+  EXPECT_EQ(process("pete", served, users), "plan\r\n");
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,254 @@
+#include "cache.hpp"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <optional>
+#include <string>
+#include <thread>
+
+using ::testing::_;
+using ::testing::Return;
+
+class MockFilesystemWrapper : public IFilesystemWrapper {
+public:
+  MOCK_METHOD(bool, exists, (const std::filesystem::path &path),
+              (const, override));
+  MOCK_METHOD(std::string, read_file, (const std::filesystem::path &path),
+              (const, override));
+};
+
+static const std::filesystem::path kBase{"/var/finger/users/"};
+
+TEST(PlanCache, RepeatLookupsHitMemory) {
+  MockFilesystemWrapper fs;
+  EXPECT_CALL(fs, exists(kBase / "pete")).WillOnce(Return(true));
+  EXPECT_CALL(fs, read_file(kBase / "pete"))
+      .WillOnce(Return("Just another hacker.\r\n"));
+
+  CachingFilesystemWrapper cache(fs, kBase);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(process("pete", cache, kBase), "Just another hacker.\r\n");
+  }
+  EXPECT_EQ(cache.stats().misses, 1u);
+  EXPECT_EQ(cache.stats().hits, 2u);
+}
+
+TEST(PlanCache, MissesAreCachedToo) {
+  MockFilesystemWrapper fs;
+  EXPECT_CALL(fs, exists(kBase / "admin")).WillOnce(Return(false));
+  EXPECT_CALL(fs, read_file(_)).Times(0);
+
+  CachingFilesystemWrapper cache(fs, kBase);
+  EXPECT_EQ(process("admin", cache, kBase), "admin");
+  EXPECT_EQ(process("Admin", cache, kBase), "Admin"); // same lookup key
+  EXPECT_EQ(cache.stats().misses, 1u);
+  EXPECT_EQ(cache.stats().negative_hits, 1u);
+}
+
+TEST(PlanCache, NegativeCacheIsBounded) {
+  MockFilesystemWrapper fs;
+  EXPECT_CALL(fs, exists(_)).WillRepeatedly(Return(false));
+
+  CachingFilesystemWrapper::Options opts;
+  opts.max_negative = 4;
+  CachingFilesystemWrapper cache(fs, kBase, opts);
+  for (int i = 0; i < 100; ++i) {
+    process("guess" + std::to_string(i), cache, kBase);
+  }
+  EXPECT_LE(cache.cached(), 4u);
+}
+
+TEST(PlanCache, PathsOutsideDirectoryPassThrough) {
+  MockFilesystemWrapper fs;
+  EXPECT_CALL(fs, exists(std::filesystem::path("/elsewhere/pete")))
+      .Times(2)
+      .WillRepeatedly(Return(false));
+
+  CachingFilesystemWrapper cache(fs, kBase);
+  EXPECT_FALSE(cache.exists("/elsewhere/pete"));
+  EXPECT_FALSE(cache.exists("/elsewhere/pete"));
+  EXPECT_EQ(cache.cached(), 0u);
+}
+
+TEST(PlanCache, HitsShareTheCachedBody) {
+  MockFilesystemWrapper fs;
+  EXPECT_CALL(fs, exists(kBase / "pete")).WillOnce(Return(true));
+  EXPECT_CALL(fs, read_file(kBase / "pete"))
+      .WillOnce(Return("Just another hacker.\r\n"));
+
+  CachingFilesystemWrapper cache(fs, kBase);
+  const Reply first = finger("pete", cache, kBase);
+  const Reply second = finger("Pete", cache, kBase);
+  ASSERT_EQ(first.kind, Reply::Kind::plan);
+  // Same bytes, not a copy per request.
+  EXPECT_EQ(first.body.view().data(), second.body.view().data());
+
+  // A reply still being written outlives its eviction from the cache.
+  cache.clear();
+  EXPECT_EQ(first.body.view(), "Just another hacker.\r\n");
+}
+
+TEST(PlanCache, FindAndStoreSplitALookup) {
+  MockFilesystemWrapper fs;
+  EXPECT_CALL(fs, exists(_)).Times(0);
+  EXPECT_CALL(fs, read_file(_)).Times(0);
+
+  CachingFilesystemWrapper cache(fs, kBase);
+  std::uint64_t generation;
+  EXPECT_EQ(cache.find(kBase / "pete", generation), std::nullopt);
+  EXPECT_EQ(cache
+                .store(kBase / "pete", PlanBody("Just another hacker.\r\n"),
+                       generation)
+                .view(),
+            "Just another hacker.\r\n");
+  EXPECT_EQ(cache.find(kBase / "nobody", generation), std::nullopt);
+  EXPECT_TRUE(cache.store(kBase / "nobody", std::nullopt, generation).empty());
+
+  const auto hit = cache.find(kBase / "pete", generation);
+  ASSERT_TRUE(hit);
+  EXPECT_EQ(hit->view(), "Just another hacker.\r\n");
+  const auto miss = cache.find(kBase / "nobody", generation);
+  ASSERT_TRUE(miss);
+  EXPECT_TRUE(miss->empty());
+  // Both agree with the synchronous lookup.
+  EXPECT_EQ(process("pete", cache, kBase), "Just another hacker.\r\n");
+  EXPECT_EQ(process("nobody", cache, kBase), "nobody");
+  EXPECT_EQ(cache.stats().misses, 2u);
+  EXPECT_EQ(cache.stats().hits, 2u);
+  EXPECT_EQ(cache.stats().negative_hits, 2u);
+}
+
+TEST(PlanCache, FindByNameMatchesFindByPath) {
+  MockFilesystemWrapper fs;
+  CachingFilesystemWrapper cache(fs, kBase);
+  std::uint64_t generation;
+  EXPECT_EQ(cache.find(kBase, "pete", generation), std::nullopt);
+  cache.store(kBase / "pete", PlanBody("Just another hacker.\r\n"),
+              generation);
+
+  // With or without the trailing separator.
+  for (const std::filesystem::path &dir :
+       {kBase, std::filesystem::path("/var/finger/users")}) {
+    const auto hit = cache.find(dir, "pete", generation);
+    ASSERT_TRUE(hit) << dir;
+    EXPECT_EQ(hit->view(), "Just another hacker.\r\n");
+  }
+  EXPECT_EQ(cache.find(kBase, "nobody", generation), std::nullopt);
+  // Another directory is never answered from this one's entries.
+  EXPECT_EQ(cache.find("/var/finger", "pete", generation), std::nullopt);
+  EXPECT_EQ(cache.find("/srv/finger/users/", "pete", generation),
+            std::nullopt);
+}
+
+TEST(PlanCache, StoreSkipsAReadOvertakenByAChange) {
+  MockFilesystemWrapper fs;
+  CachingFilesystemWrapper cache(fs, kBase);
+  std::uint64_t generation;
+  EXPECT_EQ(cache.find(kBase / "pete", generation), std::nullopt);
+  cache.clear(); // as a change event would, while the read is in flight
+  EXPECT_EQ(
+      cache.store(kBase / "pete", PlanBody("stale\r\n"), generation).view(),
+      "stale\r\n");
+  EXPECT_EQ(cache.cached(), 0u);
+}
+
+// Real filesystem: edits to the directory must be visible through the cache.
+class PlanCacheRealFsTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    dir = std::filesystem::temp_directory_path() /
+          ("finger_cache_test_" +
+           std::to_string(std::chrono::steady_clock::now()
+                              .time_since_epoch()
+                              .count()));
+    std::filesystem::create_directories(dir);
+  }
+
+  void TearDown() override { std::filesystem::remove_all(dir); }
+
+  void write(const std::string &name, const std::string &content) {
+    std::ofstream(dir / name) << content;
+  }
+
+  // With inotify, events are queued by the time the writing syscall returns;
+  // without it, wait out the TTL instead.
+  void settle(CachingFilesystemWrapper &cache) {
+    if (cache.watch_fd() >= 0) {
+      cache.process_events();
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    }
+  }
+
+  CachingFilesystemWrapper::Options opts() {
+    CachingFilesystemWrapper::Options o;
+    o.ttl = std::chrono::milliseconds(20);
+    return o;
+  }
+
+  std::filesystem::path dir;
+  RealFilesystemWrapper real_fs;
+};
+
+TEST_F(PlanCacheRealFsTest, ModifiedPlanIsReloaded) {
+  write("pete", "old plan");
+  CachingFilesystemWrapper cache(real_fs, dir, opts());
+  EXPECT_EQ(process("pete", cache, dir), "old plan\r\n");
+
+  write("pete", "new plan");
+  settle(cache);
+  EXPECT_EQ(process("pete", cache, dir), "new plan\r\n");
+}
+
+TEST_F(PlanCacheRealFsTest, CreatedPlanReplacesCachedMiss) {
+  CachingFilesystemWrapper cache(real_fs, dir, opts());
+  EXPECT_EQ(process("alice", cache, dir), "alice");
+
+  write("alice", "hello");
+  settle(cache);
+  EXPECT_EQ(process("alice", cache, dir), "hello\r\n");
+}
+
+TEST_F(PlanCacheRealFsTest, DeletedPlanIsEvicted) {
+  write("bob", "here");
+  CachingFilesystemWrapper cache(real_fs, dir, opts());
+  EXPECT_EQ(process("bob", cache, dir), "here\r\n");
+
+  std::filesystem::remove(dir / "bob");
+  settle(cache);
+  EXPECT_EQ(process("bob", cache, dir), "bob");
+}
+
+TEST_F(PlanCacheRealFsTest, RenamedIntoPlaceIsSeen) {
+  CachingFilesystemWrapper cache(real_fs, dir, opts());
+  EXPECT_EQ(process("carol", cache, dir), "carol");
+
+  write(".carol.tmp", "atomic");
+  std::filesystem::rename(dir / ".carol.tmp", dir / "carol");
+  settle(cache);
+  EXPECT_EQ(process("carol", cache, dir), "atomic\r\n");
+}
+
+TEST_F(PlanCacheRealFsTest, SetDirMovesTheCacheAndItsWatch) {
+  const auto other = dir / "other";
+  std::filesystem::create_directories(other);
+  write("pete", "old dir");
+  std::ofstream(other / "pete") << "new dir";
+  CachingFilesystemWrapper cache(real_fs, dir, opts());
+  EXPECT_EQ(process("pete", cache, dir), "old dir\r\n");
+
+  cache.set_dir(other);
+  EXPECT_EQ(cache.cached(), 0u);
+  EXPECT_EQ(process("pete", cache, other), "new dir\r\n");
+  // Edits in the new directory are still seen.
+  std::ofstream(other / "pete") << "edited";
+  settle(cache);
+  EXPECT_EQ(process("pete", cache, other), "edited\r\n");
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
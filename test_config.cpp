@@ -0,0 +1,164 @@
+#include "config.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+using namespace std::chrono_literals;
+
+TEST(Settings, DefaultsMatchTheComponents) {
+  const Settings s;
+  EXPECT_EQ(s.ban, BanTracker::Config{});
+  EXPECT_EQ(s.subnet, SubnetTracker::Config{});
+  EXPECT_TRUE(s.allowlist.empty());
+  EXPECT_EQ(s.plan_dir, kPATH);
+  EXPECT_EQ(s.request_timeout, 10s);
+}
+
+TEST(Settings, ParsesEveryKey) {
+  const Settings s = parse_settings(R"(
+# Tighter bans for the weekend.
+ban_threshold = 5
+ban_window = 12h   # also the subnet window
+subnet_threshold = 4
+ban_allowlist = 203.0.113.10, 2001:db8::10
+plan_dir = /srv/finger/plans
+max_connections = 2000
+max_per_ip = 4
+accept_rate = 250.5
+lookup_rate = 0.5
+lookup_burst = 8
+request_timeout = 2m
+)",
+                                    Settings{});
+  EXPECT_EQ(s.ban.threshold, 5);
+  EXPECT_EQ(s.ban.window, 12h);
+  EXPECT_EQ(s.subnet.window, 12h);
+  EXPECT_EQ(s.subnet.threshold, 4);
+  EXPECT_EQ(s.allowlist.size(), 2u);
+  EXPECT_TRUE(s.allowlist.contains("2001:db8::10"));
+  EXPECT_EQ(s.plan_dir, "/srv/finger/plans");
+  EXPECT_EQ(s.admission.max_connections, 2000u);
+  EXPECT_EQ(s.admission.max_per_ip, 4u);
+  EXPECT_DOUBLE_EQ(s.accept_rate, 250.5);
+  EXPECT_DOUBLE_EQ(s.lookups.rate, 0.5);
+  EXPECT_DOUBLE_EQ(s.lookups.burst, 8);
+  EXPECT_EQ(s.request_timeout, 120s);
+}
+
+TEST(Settings, FileOverridesOnlyWhatItNames) {
+  Settings base;
+  base.ban.threshold = 9;
+  base.admission.max_per_ip = 3;
+  const Settings s = parse_settings("max_per_ip = 0\n", base);
+  EXPECT_EQ(s.ban.threshold, 9);
+  EXPECT_EQ(s.admission.max_per_ip, 0u);
+  // An empty value is a value: ban_allowlist = clears the list.
+  base.allowlist = {"203.0.113.10"};
+  EXPECT_TRUE(parse_settings("ban_allowlist =", base).allowlist.empty());
+}
+
+TEST(Settings, DurationSuffixes) {
+  Settings s;
+  apply_setting(s, "request_timeout", "45");
+  EXPECT_EQ(s.request_timeout, 45s);
+  apply_setting(s, "request_timeout", "45s");
+  EXPECT_EQ(s.request_timeout, 45s);
+  apply_setting(s, "ban_window", "90m");
+  EXPECT_EQ(s.ban.window, 90min);
+  apply_setting(s, "ban_window", "2d");
+  EXPECT_EQ(s.ban.window, 48h);
+  for (const char *bad : {"0", "", "h", "-5", "5w", "1.5h", "366d"}) {
+    EXPECT_THROW(apply_setting(s, "ban_window", bad), std::invalid_argument)
+        << bad;
+  }
+}
+
+TEST(Settings, RejectsBadValues) {
+  Settings s;
+  EXPECT_THROW(apply_setting(s, "ban_threshold", "three"),
+               std::invalid_argument);
+  EXPECT_THROW(apply_setting(s, "ban_threshold", "-1"), std::invalid_argument);
+  EXPECT_THROW(apply_setting(s, "ban_threshold", "100000"),
+               std::invalid_argument);
+  EXPECT_THROW(apply_setting(s, "plan_dir", "relative/dir"),
+               std::invalid_argument);
+  EXPECT_THROW(apply_setting(s, "lookup_rate", "-1"), std::invalid_argument);
+  EXPECT_THROW(apply_setting(s, "lookup_rate", "nan"), std::invalid_argument);
+  EXPECT_THROW(apply_setting(s, "port", "79"), std::invalid_argument);
+}
+
+TEST(Settings, ErrorsNameTheLineAndApplyNothing) {
+  const Settings base;
+  try {
+    parse_settings("ban_threshold = 1\n\n# fine so far\nban_treshold = 2\n",
+                   base);
+    FAIL() << "expected an error";
+  } catch (const std::invalid_argument &e) {
+    EXPECT_EQ(std::string(e.what()), "line 4: unknown setting 'ban_treshold'");
+  }
+  try {
+    parse_settings("max_connections 10", base);
+    FAIL() << "expected an error";
+  } catch (const std::invalid_argument &e) {
+    EXPECT_EQ(std::string(e.what()), "line 1: expected key = value");
+  }
+}
+
+TEST(Settings, EnvironmentVariablesUseTheUpperCaseName) {
+  ::setenv("FINGER_BAN_THRESHOLD", "7", 1);
+  ::setenv("FINGER_REQUEST_TIMEOUT", "30", 1);
+  const Settings s = settings_from_env();
+  EXPECT_EQ(s.ban.threshold, 7);
+  EXPECT_EQ(s.request_timeout, 30s);
+
+  ::setenv("FINGER_REQUEST_TIMEOUT", "0", 1);
+  try {
+    settings_from_env();
+    FAIL() << "expected an error";
+  } catch (const std::invalid_argument &e) {
+    EXPECT_EQ(std::string(e.what()), "bad FINGER_REQUEST_TIMEOUT '0'");
+  }
+  ::unsetenv("FINGER_BAN_THRESHOLD");
+  ::unsetenv("FINGER_REQUEST_TIMEOUT");
+}
+
+TEST(Settings, LoadsAFile) {
+  const auto path = std::filesystem::temp_directory_path() /
+                    ("finger_config_test_" +
+                     std::to_string(std::chrono::steady_clock::now()
+                                        .time_since_epoch()
+                                        .count()));
+  std::ofstream(path) << "lookup_burst = 40\r\nlookup_rate = x\r\n";
+  try {
+    load_settings(path, Settings{});
+    FAIL() << "expected an error";
+  } catch (const std::invalid_argument &e) {
+    EXPECT_EQ(std::string(e.what()),
+              path.string() + ": line 2: bad lookup_rate 'x'");
+  }
+  std::ofstream(path) << "lookup_burst = 40\r\n";
+  EXPECT_DOUBLE_EQ(load_settings(path, Settings{}).lookups.burst, 40);
+  std::filesystem::remove(path);
+  EXPECT_THROW(load_settings(path, Settings{}), std::system_error);
+}
+
+TEST(LiveSettings, SnapshotsSurviveASwap) {
+  Settings s;
+  s.ban.threshold = 1;
+  LiveSettings live(s);
+  const auto before = live.get();
+  s.ban.threshold = 2;
+  live.set(s);
+  EXPECT_EQ(before->ban.threshold, 1);
+  EXPECT_EQ(live.get()->ban.threshold, 2);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -79,6 +79,32 @@ TEST_F(ProcessMockTest, ProcessLowercasesUsernameForLookup) {
   EXPECT_EQ(result, "Just another hacker.\r\n");
 }
 
+// finger() says what kind of reply it built, so callers need not guess from
+// the body; plan bodies come through read_plan(), which defaults to
+// read_file() for wrappers (like this mock) that only implement that.
+TEST_F(ProcessMockTest, FingerClassifiesReplies) {
+  using ::testing::_;
+  using ::testing::Return;
+
+  EXPECT_CALL(*mock_filesystem, exists(_))
+      .WillOnce(Return(true))
+      .WillOnce(Return(false));
+  EXPECT_CALL(*mock_filesystem, read_file(_))
+      .WillOnce(Return("InvalidInput: not really\r\n"));
+
+  const Reply plan = finger("pete", *mock_filesystem);
+  EXPECT_EQ(plan.kind, Reply::Kind::plan);
+  EXPECT_EQ(plan.body.view(), "InvalidInput: not really\r\n");
+
+  const Reply miss = finger("nobody", *mock_filesystem);
+  EXPECT_EQ(miss.kind, Reply::Kind::miss);
+  EXPECT_EQ(miss.body.view(), "nobody");
+
+  const Reply invalid = finger("../etc/passwd", *mock_filesystem);
+  EXPECT_EQ(invalid.kind, Reply::Kind::invalid);
+  EXPECT_TRUE(invalid.body.view().starts_with("InvalidInput:"));
+}
+
 // Test showing multiple expectations
 TEST_F(ProcessMockTest, MultipleFileOperations) {
   using ::testing::_;
@@ -4,6 +4,7 @@
 #include <fstream>
 #include <gtest/gtest.h>
 #include <string>
+#include <sys/stat.h>
 
 // Test fixture for real filesystem integration tests
 class RealFilesystemTest : public ::testing::Test {
@@ -212,6 +213,57 @@ TEST_F(RealFilesystemTest, ReadFileWithSpecialCharacters) {
   EXPECT_EQ(result, special_content + "\r\n");
 }
 
+// Large plans are read in one go; only the final newline becomes CRLF and
+// everything else, including blank lines and stray CRs, is kept byte for byte.
+TEST_F(RealFilesystemTest, ReadFileLargePlanKeepsInteriorBytes) {
+  std::string art;
+  for (int i = 0; i < 5000; ++i) {
+    art += std::string(i % 80, '#') + (i % 7 == 0 ? "\r\n" : "\n");
+    if (i % 100 == 0) {
+      art += "\n";
+    }
+  }
+  createTestFile("artuser", art + "last line\n");
+  EXPECT_EQ(real_fs.read_file(test_base_path / "artuser"),
+            art + "last line\r\n");
+
+  createTestFile("artuser", art + "no newline");
+  EXPECT_EQ(real_fs.read_file(test_base_path / "artuser"),
+            art + "no newline\r\n");
+}
+
+// Past the cap the plan is cut off, and still ends in CRLF.
+TEST_F(RealFilesystemTest, ReadFileStopsAtTheSizeCap) {
+  createTestFile("longuser", std::string(50000, 'x') + "\n");
+  const RealFilesystemWrapper capped(20000);
+  EXPECT_EQ(capped.read_file(test_base_path / "longuser"),
+            std::string(20000, 'x') + "\r\n");
+  EXPECT_EQ(capped.max_plan_size(), 20000u);
+
+  createTestFile("shortuser", "Short enough\n");
+  EXPECT_EQ(capped.read_file(test_base_path / "shortuser"),
+            "Short enough\r\n");
+}
+
+// Only regular files (directly or through a symlink) are plans. A device or
+// a FIFO reads as no plan, without blocking on the FIFO's missing writer.
+TEST_F(RealFilesystemTest, ReadFileRefusesSpecialFiles) {
+  createTestFile("target", "Linked plan\n");
+  std::filesystem::create_symlink(test_base_path / "target",
+                                  test_base_path / "linkuser");
+  std::filesystem::create_symlink("/dev/zero", test_base_path / "zerouser");
+  ASSERT_EQ(::mkfifo((test_base_path / "fifouser").c_str(), 0600), 0);
+  createTestDirectory("diruser");
+
+  EXPECT_EQ(real_fs.read_file(test_base_path / "linkuser"),
+            "Linked plan\r\n");
+  EXPECT_EQ(real_fs.read_file(test_base_path / "zerouser"), "");
+  EXPECT_EQ(real_fs.read_file(test_base_path / "fifouser"), "");
+  EXPECT_EQ(real_fs.read_file(test_base_path / "diruser"), "");
+  EXPECT_EQ(process("zerouser", real_fs, test_base_path), "zerouser");
+  EXPECT_EQ(process("fifouser", real_fs, test_base_path), "fifouser");
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,145 @@
+#include "handoff.hpp"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// A TCP socket listening on an ephemeral loopback port.
+int listen_tcp() {
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  EXPECT_EQ(::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr), 0);
+  EXPECT_EQ(::listen(fd, 8), 0);
+  return fd;
+}
+
+unsigned short port_of(int fd) {
+  sockaddr_in addr{};
+  socklen_t len = sizeof addr;
+  ::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len);
+  return ntohs(addr.sin_port);
+}
+
+class HandoffTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, ch), 0);
+  }
+  void TearDown() override {
+    ::close(ch[0]);
+    ::close(ch[1]);
+  }
+
+  int ch[2] = {-1, -1}; // old daemon's end, new daemon's end
+};
+
+} // namespace
+
+TEST_F(HandoffTest, PassesListeningSocketsAndState) {
+  const int finger_a = listen_tcp();
+  const int finger_b = listen_tcp();
+  const int metrics = listen_tcp();
+  // Bigger than a socket buffer, so the two ends have to take turns.
+  std::vector<char> state(4 << 20);
+  for (std::size_t i = 0; i < state.size(); ++i) {
+    state[i] = static_cast<char>(i * 31);
+  }
+  const std::vector<HandedSocket> sockets = {{finger_a, SocketRole::finger},
+                                             {finger_b, SocketRole::finger},
+                                             {metrics, SocketRole::metrics}};
+  std::thread old_daemon([&] { send_handoff(ch[0], sockets, state); });
+  const Handoff h = receive_handoff(ch[1]);
+  old_daemon.join();
+
+  ASSERT_EQ(h.sockets.size(), 3u);
+  EXPECT_EQ(h.sockets[0].role, SocketRole::finger);
+  EXPECT_EQ(h.sockets[2].role, SocketRole::metrics);
+  EXPECT_EQ(h.ban_state, state);
+  // The same sockets, under new descriptors that stay open on their own.
+  EXPECT_NE(h.sockets[0].fd, finger_a);
+  EXPECT_EQ(port_of(h.sockets[0].fd), port_of(finger_a));
+  EXPECT_EQ(port_of(h.sockets[1].fd), port_of(finger_b));
+  EXPECT_EQ(port_of(h.sockets[2].fd), port_of(metrics));
+  const unsigned short port = port_of(finger_a);
+  ::close(finger_a);
+  ::close(finger_b);
+  ::close(metrics);
+
+  // A client of the old socket is accepted by the new daemon.
+  const int client = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  ASSERT_EQ(::connect(client, reinterpret_cast<sockaddr *>(&addr), sizeof addr),
+            0);
+  const int conn = ::accept(h.sockets[0].fd, nullptr, nullptr);
+  EXPECT_GE(conn, 0);
+  ::close(conn);
+  ::close(client);
+
+  confirm_handoff(ch[1]);
+  char ok = 0;
+  EXPECT_EQ(::read(ch[0], &ok, 1), 1);
+  for (const auto &s : h.sockets) {
+    ::close(s.fd);
+  }
+}
+
+TEST_F(HandoffTest, RejectsAnythingElse) {
+  const std::string junk = "GET / HTTP/1.0\r\n\r\nnot a handoff";
+  ASSERT_EQ(::write(ch[0], junk.data(), junk.size()),
+            static_cast<ssize_t>(junk.size()));
+  EXPECT_THROW(receive_handoff(ch[1]), std::runtime_error);
+}
+
+TEST_F(HandoffTest, OldDaemonGoingAwayFailsTheHandoff) {
+  ::shutdown(ch[0], SHUT_WR);
+  EXPECT_THROW(receive_handoff(ch[1]), std::runtime_error);
+}
+
+TEST(UpgradeSocket, NobodyListeningMeansAFreshStart) {
+  const auto dir = std::filesystem::temp_directory_path();
+  const auto path =
+      dir / ("finger_upgrade_test_" +
+             std::to_string(
+                 std::chrono::steady_clock::now().time_since_epoch().count()));
+  EXPECT_EQ(connect_upgrade_socket(path), -1);
+
+  // A socket file left behind by a daemon that has exited.
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+  ASSERT_EQ(::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr), 0);
+  ::close(fd);
+  EXPECT_EQ(connect_upgrade_socket(path), -1);
+
+  const int live = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  std::filesystem::remove(path);
+  ASSERT_EQ(::bind(live, reinterpret_cast<sockaddr *>(&addr), sizeof addr), 0);
+  ASSERT_EQ(::listen(live, 1), 0);
+  const int channel = connect_upgrade_socket(path);
+  EXPECT_GE(channel, 0);
+  ::close(channel);
+  ::close(live);
+  std::filesystem::remove(path);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,178 @@
+#include "log.hpp"
+#include <chrono>
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+
+// Captures a Logger's output in an unlinked temp file.
+class LogTest : public ::testing::Test {
+protected:
+  void SetUp() override { file = std::tmpfile(); }
+  void TearDown() override { std::fclose(file); }
+
+  int fd() const { return ::fileno(file); }
+
+  std::string output() const {
+    std::string out;
+    char buf[4096];
+    for (off_t off = 0;;) {
+      const ssize_t n = ::pread(fd(), buf, sizeof buf, off);
+      if (n <= 0) {
+        return out;
+      }
+      out.append(buf, static_cast<std::size_t>(n));
+      off += n;
+    }
+  }
+
+  static Logger::Options sync(Logger::Format format = Logger::Format::text) {
+    Logger::Options opts;
+    opts.format = format;
+    opts.background = false;
+    return opts;
+  }
+
+  std::FILE *file = nullptr;
+};
+
+TEST_F(LogTest, TextRendersEventAndFields) {
+  Logger log(fd(), sync());
+  log.log("finger miss", {{"client", "203.0.113.5"},
+                          {"user", std::string("root")},
+                          {"failures", 2},
+                          {"blocked", false}});
+  log.log("finger drop");
+  EXPECT_EQ(output(), "");
+  log.flush();
+  EXPECT_EQ(output(), "finger miss client=203.0.113.5 user=root failures=2 "
+                      "blocked=false\nfinger drop\n");
+}
+
+TEST_F(LogTest, EscapesClientSuppliedValues) {
+  Logger log(fd(), sync());
+  log.log("finger request", {{"user", "a b\"c\x1b[2J"}, {"empty", ""}});
+  log.flush();
+  EXPECT_EQ(output(),
+            "finger request user=\"a b\\\"c\\x1b[2J\" empty=\"\"\n");
+}
+
+TEST_F(LogTest, LogfmtAndJsonCarryTimestamps) {
+  {
+    Logger log(fd(), sync(Logger::Format::logfmt));
+    log.log("finger miss", {{"client", "203.0.113.5"}, {"failures", 3}});
+  }
+  {
+    Logger log(fd(), sync(Logger::Format::json));
+    log.log("finger miss",
+            {{"user", "x\"y\n"}, {"failures", 3}, {"blocked", true}});
+  }
+  const std::string ts = R"(\d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3}Z)";
+  const std::regex expected(
+      "ts=" + ts + " msg=\"finger miss\" client=203\\.0\\.113\\.5 failures=3\n" +
+      R"(\{"ts":")" + ts +
+      R"(","msg":"finger miss","user":"x\\"y\\u000a","failures":3,"blocked":true\}\n)");
+  EXPECT_TRUE(std::regex_match(output(), expected)) << output();
+}
+
+TEST_F(LogTest, FullRingDropsAndReportsLoss) {
+  Logger::Options opts = sync();
+  opts.capacity = 4;
+  Logger log(fd(), opts);
+  for (int i = 0; i < 10; ++i) {
+    log.log("tick", {{"i", i}});
+  }
+  EXPECT_EQ(log.dropped(), 6u);
+  log.flush();
+  EXPECT_EQ(output(), "tick i=0\ntick i=1\ntick i=2\ntick i=3\n"
+                      "log overflow dropped=6\n");
+  // The loss is reported once; the ring is usable again.
+  log.log("tick", {{"i", 10}});
+  log.flush();
+  EXPECT_EQ(output().substr(output().rfind("tick")), "tick i=10\n");
+  EXPECT_EQ(log.dropped(), 6u);
+}
+
+TEST_F(LogTest, LongValuesAndExtraFieldsAreCut) {
+  Logger log(fd(), sync());
+  const std::string big(1000, 'x');
+  log.log("big", {{"a", big}, {"b", "never fits"}});
+  log.log("many", {{"a", 1}, {"b", 2}, {"c", 3}, {"d", 4}, {"e", 5}, {"f", 6},
+                   {"g", 7}});
+  log.flush();
+  EXPECT_EQ(output(),
+            "big a=" + std::string(Logger::kMaxValueBytes, 'x') +
+                " b=\"\"\nmany a=1 b=2 c=3 d=4 e=5 f=6\n");
+}
+
+TEST_F(LogTest, BackgroundFlusherKeepsEveryEventFromEveryThread) {
+  constexpr int kThreads = 4;
+  constexpr int kEach = 2000;
+  {
+    Logger::Options opts;
+    opts.capacity = kThreads * kEach;
+    opts.flush_interval = 1ms;
+    Logger log(fd(), opts);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&log, t] {
+        for (int i = 0; i < kEach; ++i) {
+          log.log("tick", {{"thread", t}, {"i", i}});
+        }
+      });
+    }
+    for (auto &th : threads) {
+      th.join();
+    }
+    EXPECT_EQ(log.dropped(), 0u);
+  }
+  // Each thread's events arrive complete and in that thread's order.
+  std::istringstream lines(output());
+  std::map<int, int> next;
+  std::string line;
+  int total = 0;
+  while (std::getline(lines, line)) {
+    int t = -1, i = -1;
+    ASSERT_EQ(std::sscanf(line.c_str(), "tick thread=%d i=%d", &t, &i), 2)
+        << line;
+    EXPECT_EQ(i, next[t]++);
+    ++total;
+  }
+  EXPECT_EQ(total, kThreads * kEach);
+}
+
+TEST(LogRateLimit, LetsABurstThroughPerSecondAndCountsTheRest) {
+  LogRateLimit limit(2);
+  const auto t0 = std::chrono::steady_clock::time_point{} + 100s;
+  std::uint64_t suppressed = 99;
+  EXPECT_TRUE(limit.allow(t0, suppressed));
+  EXPECT_EQ(suppressed, 0u);
+  EXPECT_TRUE(limit.allow(t0 + 100ms, suppressed));
+  EXPECT_FALSE(limit.allow(t0 + 200ms, suppressed));
+  EXPECT_FALSE(limit.allow(t0 + 900ms, suppressed));
+  EXPECT_TRUE(limit.allow(t0 + 1s, suppressed));
+  EXPECT_EQ(suppressed, 2u);
+  EXPECT_TRUE(limit.allow(t0 + 1500ms, suppressed));
+  EXPECT_EQ(suppressed, 0u);
+}
+
+TEST(LogFormat, ParsesKnownNames) {
+  EXPECT_EQ(parse_log_format("text"), Logger::Format::text);
+  EXPECT_EQ(parse_log_format("logfmt"), Logger::Format::logfmt);
+  EXPECT_EQ(parse_log_format("json"), Logger::Format::json);
+  EXPECT_THROW(parse_log_format("JSON"), std::invalid_argument);
+  EXPECT_THROW(parse_log_format(""), std::invalid_argument);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
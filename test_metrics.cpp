@@ -0,0 +1,142 @@
+#include "metrics.hpp"
+#include <chrono>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+using namespace std::chrono_literals;
+using ::testing::HasSubstr;
+using ::testing::Not;
+using ::testing::Return;
+
+class MockFilesystemWrapper : public IFilesystemWrapper {
+public:
+  MOCK_METHOD(bool, exists, (const std::filesystem::path &path),
+              (const, override));
+  MOCK_METHOD(std::string, read_file, (const std::filesystem::path &path),
+              (const, override));
+};
+
+TEST(LatencyHistogram, BucketsByPowerOfTwoMicroseconds) {
+  LatencyHistogram h;
+  h.record(0ns);    // bucket 0 (<= 1us)
+  h.record(1us);    // bucket 0
+  h.record(1500ns); // 2us -> bucket 1
+  h.record(3us);    // bucket 2 (<= 4us)
+  h.record(4us);    // bucket 2
+  h.record(1ms);    // 1000us -> bucket 10 (<= 1024us)
+  h.record(1h);     // overflow
+  const auto s = h.snapshot();
+  EXPECT_EQ(s.buckets[0], 2u);
+  EXPECT_EQ(s.buckets[1], 1u);
+  EXPECT_EQ(s.buckets[2], 2u);
+  EXPECT_EQ(s.buckets[10], 1u);
+  EXPECT_EQ(s.buckets[LatencyHistogram::kBuckets], 1u);
+  EXPECT_EQ(s.count, 7u);
+  EXPECT_EQ(s.sum_us, 0u + 1 + 2 + 3 + 4 + 1000 + 3600000000u);
+}
+
+TEST(LatencyHistogram, ConcurrentRecordsAreAllCounted) {
+  LatencyHistogram h;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&h] {
+      for (int i = 0; i < 10000; ++i) {
+        h.record(std::chrono::microseconds(i % 100));
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ(h.snapshot().count, 40000u);
+}
+
+TEST(Metrics, RendersPrometheusText) {
+  Metrics m;
+  m.accepts.inc(3);
+  m.plan_hits.inc();
+  m.timeouts.inc(5);
+  m.rejected[static_cast<std::size_t>(Protocol::tls)].inc(2);
+  m.request_latency.record(3us);
+  m.request_latency.record(2s);
+  m.add_gauge("finger_tracked_ips", "Client IPs in the ban table.",
+              [] { return 42.0; });
+  const std::string out = m.render();
+  EXPECT_THAT(out, HasSubstr("# TYPE finger_accepts_total counter\n"
+                             "finger_accepts_total 3\n"));
+  EXPECT_THAT(out, HasSubstr("finger_plan_hits_total 1\n"));
+  EXPECT_THAT(out, HasSubstr("finger_misses_total 0\n"));
+  EXPECT_THAT(out, HasSubstr("finger_timeouts_total 5\n"));
+  EXPECT_THAT(out, HasSubstr("# TYPE finger_rejected_total counter\n"));
+  EXPECT_THAT(out, HasSubstr("finger_rejected_total{protocol=\"tls\"} 2\n"
+                             "finger_rejected_total{protocol=\"sip\"} 0\n"));
+  EXPECT_THAT(out, Not(HasSubstr("protocol=\"finger\"")));
+  EXPECT_THAT(out, HasSubstr("# TYPE finger_request_duration_seconds histogram\n"));
+  // Buckets are cumulative, in seconds.
+  EXPECT_THAT(out, HasSubstr("finger_request_duration_seconds_bucket{le=\"2e-06\"} 0\n"));
+  EXPECT_THAT(out, HasSubstr("finger_request_duration_seconds_bucket{le=\"4e-06\"} 1\n"));
+  EXPECT_THAT(out, HasSubstr("finger_request_duration_seconds_bucket{le=\"1.048576\"} 1\n"));
+  EXPECT_THAT(out, HasSubstr("finger_request_duration_seconds_bucket{le=\"2.097152\"} 2\n"));
+  EXPECT_THAT(out, HasSubstr("finger_request_duration_seconds_bucket{le=\"+Inf\"} 2\n"));
+  EXPECT_THAT(out, HasSubstr("finger_request_duration_seconds_sum 2.000003\n"));
+  EXPECT_THAT(out, HasSubstr("finger_request_duration_seconds_count 2\n"));
+  EXPECT_THAT(out, HasSubstr("# TYPE finger_tracked_ips gauge\n"
+                             "finger_tracked_ips 42\n"));
+}
+
+TEST(Metrics, TimedFilesystemRecordsReadsOnly) {
+  MockFilesystemWrapper mock;
+  LatencyHistogram reads;
+  TimedFilesystemWrapper timed(mock, reads);
+  EXPECT_CALL(mock, exists(::testing::_)).WillOnce(Return(true));
+  EXPECT_CALL(mock, read_file(::testing::_)).WillOnce(Return("plan\r\n"));
+  EXPECT_TRUE(timed.exists("/var/finger/users/pete"));
+  EXPECT_EQ(reads.snapshot().count, 0u);
+  EXPECT_EQ(timed.read_file("/var/finger/users/pete"), "plan\r\n");
+  EXPECT_EQ(reads.snapshot().count, 1u);
+}
+
+TEST(Metrics, ParsesListenAddresses) {
+  using boost::asio::ip::tcp;
+  using local = boost::asio::local::stream_protocol;
+  const auto v4 = parse_metrics_address("127.0.0.1:9179");
+  ASSERT_TRUE(std::holds_alternative<tcp::endpoint>(v4));
+  EXPECT_EQ(std::get<tcp::endpoint>(v4).port(), 9179);
+  const auto v6 = parse_metrics_address("[::1]:9179");
+  ASSERT_TRUE(std::holds_alternative<tcp::endpoint>(v6));
+  EXPECT_TRUE(std::get<tcp::endpoint>(v6).address().is_v6());
+  const auto unix_sock = parse_metrics_address("unix:/run/finger.sock");
+  ASSERT_TRUE(std::holds_alternative<local::endpoint>(unix_sock));
+  EXPECT_EQ(std::get<local::endpoint>(unix_sock).path(), "/run/finger.sock");
+
+  EXPECT_THROW(parse_metrics_address("localhost:9179"), std::invalid_argument);
+  EXPECT_THROW(parse_metrics_address("127.0.0.1"), std::invalid_argument);
+  EXPECT_THROW(parse_metrics_address("127.0.0.1:0"), std::invalid_argument);
+  EXPECT_THROW(parse_metrics_address("127.0.0.1:99999"), std::invalid_argument);
+  EXPECT_THROW(parse_metrics_address("unix:"), std::invalid_argument);
+}
+
+TEST(Metrics, HttpResponseServesOnlyMetricsPaths) {
+  Metrics m;
+  const std::string ok =
+      metrics_http_response("GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n", m);
+  EXPECT_THAT(ok, HasSubstr("HTTP/1.0 200 OK\r\n"));
+  EXPECT_THAT(ok, HasSubstr("finger_accepts_total 0\n"));
+  const std::string body = m.render();
+  EXPECT_THAT(ok, HasSubstr("Content-Length: " + std::to_string(body.size())));
+
+  const std::string missing =
+      metrics_http_response("GET /secret HTTP/1.1\r\n\r\n", m);
+  EXPECT_THAT(missing, HasSubstr("HTTP/1.0 404 Not Found\r\n"));
+  EXPECT_THAT(missing, Not(HasSubstr("finger_accepts_total")));
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
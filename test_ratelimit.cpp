@@ -0,0 +1,123 @@
+#include "ratelimit.hpp"
+#include <atomic>
+#include <boost/asio/ip/address_v4.hpp>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+IpKey ip(std::uint32_t n) { return boost::asio::ip::address_v4(n); }
+
+int allowed(LookupLimiter &limiter, const IpKey &key,
+            std::chrono::steady_clock::time_point now, int tries) {
+  int n = 0;
+  for (int i = 0; i < tries; ++i) {
+    n += limiter.allow(key, now);
+  }
+  return n;
+}
+
+} // namespace
+
+TEST(LookupLimiter, AllowsTheBurstThenTheRate) {
+  LookupLimiter limiter({.rate = 2, .burst = 5}, 1);
+  const auto t0 = std::chrono::steady_clock::now();
+  const IpKey a = ip(0xcb007107);
+  EXPECT_EQ(allowed(limiter, a, t0, 100), 5);
+  EXPECT_FALSE(limiter.allow(a, t0 + 400ms));
+  EXPECT_TRUE(limiter.allow(a, t0 + 500ms));
+  EXPECT_FALSE(limiter.allow(a, t0 + 500ms));
+  // Ten seconds of hammering gets the rate and nothing more.
+  int n = 0;
+  for (auto t = t0 + 501ms; t <= t0 + 10500ms; t += 1ms) {
+    n += limiter.allow(a, t);
+  }
+  EXPECT_EQ(n, 20);
+  // A rested client has its whole burst back.
+  EXPECT_EQ(allowed(limiter, a, t0 + 1h, 100), 5);
+}
+
+TEST(LookupLimiter, HeavyHittersDoNotThrottleOccasionalClients) {
+  LookupLimiter limiter({.rate = 1, .burst = 10, .width = 1024, .depth = 4},
+                        42);
+  const auto t0 = std::chrono::steady_clock::now();
+  // 200 addresses hammer flat out for a minute...
+  for (int s = 0; s < 60; ++s) {
+    for (std::uint32_t h = 0; h < 200; ++h) {
+      allowed(limiter, ip(0xc6120000 + h), t0 + std::chrono::seconds(s), 50);
+    }
+  }
+  // ...while every one of 5000 other addresses makes a single lookup.
+  int refused = 0;
+  for (std::uint32_t c = 0; c < 5000; ++c) {
+    refused += !limiter.allow(ip(0x0a000000 + c), t0 + 60s);
+  }
+  // Refusals need all four cells shared with a hitter: ~(200/1024)^4.
+  EXPECT_LT(refused, 25);
+  // The hitters themselves still get only the rate.
+  EXPECT_LE(allowed(limiter, ip(0xc6120000), t0 + 60s, 50), 1);
+}
+
+TEST(LookupLimiter, MemoryIsFixed) {
+  LookupLimiter limiter({.rate = 1, .burst = 1, .width = 1000, .depth = 3});
+  EXPECT_EQ(limiter.config().width, 1024u);
+  EXPECT_EQ(limiter.memory_bytes(), 3 * 1024 * 8u);
+  const auto t0 = std::chrono::steady_clock::now();
+  for (std::uint32_t c = 0; c < 100000; ++c) {
+    limiter.allow(ip(c), t0);
+  }
+  EXPECT_EQ(limiter.memory_bytes(), 3 * 1024 * 8u);
+}
+
+TEST(LookupLimiter, ZeroRateDisablesIt) {
+  LookupLimiter limiter({.rate = 0});
+  EXPECT_FALSE(limiter.enabled());
+  EXPECT_EQ(allowed(limiter, ip(1), std::chrono::steady_clock::now(), 1000),
+            1000);
+}
+
+TEST(LookupLimiter, SetRateTakesEffectImmediately) {
+  LookupLimiter limiter({.rate = 0, .burst = 5}, 1);
+  const auto t0 = std::chrono::steady_clock::now();
+  const IpKey a = ip(0xcb007107);
+  EXPECT_EQ(allowed(limiter, a, t0, 100), 100);
+
+  limiter.set_rate(1, 3);
+  EXPECT_TRUE(limiter.enabled());
+  EXPECT_EQ(allowed(limiter, a, t0, 100), 3);
+  EXPECT_TRUE(limiter.allow(a, t0 + 1s));
+
+  // Raising the burst lets a throttled client straight back in.
+  limiter.set_rate(1, 10);
+  EXPECT_EQ(allowed(limiter, a, t0 + 1s, 100), 7);
+
+  limiter.set_rate(0, 10);
+  EXPECT_FALSE(limiter.enabled());
+  EXPECT_EQ(allowed(limiter, a, t0 + 1s, 100), 100);
+}
+
+TEST(LookupLimiter, ConcurrentCallersStayNearTheBurst) {
+  LookupLimiter limiter({.rate = 1, .burst = 100}, 7);
+  const auto t0 = std::chrono::steady_clock::now();
+  std::atomic<int> total{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back(
+        [&] { total += allowed(limiter, ip(0xcb007107), t0, 10000); });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  // Each race can let at most one extra lookup through per thread.
+  EXPECT_GE(total, 100);
+  EXPECT_LE(total, 104);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,286 @@
+#include "reader.hpp"
+#include "metrics.hpp"
+#include "uring.hpp"
+#include <atomic>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+const std::filesystem::path kBase{"/var/finger/users/"};
+
+// A filesystem whose exists() calls wait at a gate until it is opened, and
+// which counts them per path.
+class GatedFilesystem : public IFilesystemWrapper {
+public:
+  bool exists(const std::filesystem::path &path) const override {
+    std::unique_lock lock(mu_);
+    ++calls_[path.filename().string()];
+    cv_.wait(lock, [this] { return open_; });
+    if (path.filename() == "broken") {
+      throw std::filesystem::filesystem_error(
+          "stat", path, std::make_error_code(std::errc::io_error));
+    }
+    return plans_.contains(path.filename().string());
+  }
+  std::string read_file(const std::filesystem::path &path) const override {
+    std::lock_guard lock(mu_);
+    return plans_.at(path.filename().string());
+  }
+
+  void add(const std::string &name, const std::string &content) {
+    std::lock_guard lock(mu_);
+    plans_[name] = content;
+  }
+  void open() {
+    std::lock_guard lock(mu_);
+    open_ = true;
+    cv_.notify_all();
+  }
+  int calls(const std::string &name) const {
+    std::lock_guard lock(mu_);
+    auto it = calls_.find(name);
+    return it == calls_.end() ? 0 : it->second;
+  }
+
+private:
+  mutable std::mutex mu_;
+  mutable std::condition_variable cv_;
+  mutable std::map<std::string, int> calls_;
+  std::map<std::string, std::string> plans_;
+  bool open_ = false;
+};
+
+class PlanReaderTest : public ::testing::Test {
+protected:
+  // Look each name up concurrently; the replies, in order, once all are in.
+  std::vector<Reply> lookup_all(PlanReader &reader,
+                                const std::vector<std::string> &names,
+                                IoUring *ring = nullptr) {
+    std::vector<Reply> replies(names.size());
+    std::size_t done = 0;
+    for (std::size_t i = 0; i < names.size(); ++i) {
+      boost::asio::co_spawn(
+          ctx,
+          [&, i]() -> boost::asio::awaitable<void> {
+            replies[i] = co_await reader.finger(names[i], kBase, ring);
+            ++done;
+          },
+          boost::asio::detached);
+    }
+    run_until([&] { return done == names.size(); });
+    return replies;
+  }
+
+  template <typename Pred> void run_until(Pred done) {
+    const auto deadline = std::chrono::steady_clock::now() + 2s;
+    while (!done() && std::chrono::steady_clock::now() < deadline) {
+      ctx.run_for(5ms);
+      ctx.restart();
+    }
+  }
+
+  boost::asio::io_context ctx;
+  LatencyHistogram reads;
+};
+
+} // namespace
+
+TEST_F(PlanReaderTest, AnswersAsFingerDoes) {
+  GatedFilesystem fs, plain;
+  for (auto *f : {&fs, &plain}) {
+    f->add("pete", "Just another hacker.\r\n");
+    f->add("blank", "");
+    f->open();
+  }
+  CachingFilesystemWrapper cache(fs, kBase);
+  PlanReader reader(cache, fs, reads, 2);
+
+  const std::vector<std::string> names = {"pete", "Pete", "nobody", "blank",
+                                          "../etc/passwd", "a/b"};
+  const auto replies = lookup_all(reader, names);
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    const Reply expected = finger(names[i], plain, kBase);
+    EXPECT_EQ(replies[i].kind, expected.kind) << names[i];
+    EXPECT_EQ(replies[i].body.view(), expected.body.view()) << names[i];
+  }
+  // Answered from the cache the second time round.
+  const auto again = lookup_all(reader, {"pete", "nobody"});
+  EXPECT_EQ(again[0].body.view(), "Just another hacker.\r\n");
+  EXPECT_EQ(again[1].kind, Reply::Kind::miss);
+  EXPECT_EQ(fs.calls("pete"), 1);
+  EXPECT_EQ(fs.calls("nobody"), 1);
+}
+
+TEST_F(PlanReaderTest, TryFingerAnswersOnlyWithoutReading) {
+  GatedFilesystem fs;
+  fs.add("pete", "Just another hacker.\r\n");
+  fs.open();
+  CachingFilesystemWrapper cache(fs, kBase);
+  PlanReader reader(cache, fs, reads, 1);
+
+  const auto invalid = reader.try_finger("../etc/passwd", kBase);
+  ASSERT_TRUE(invalid);
+  EXPECT_EQ(invalid->kind, Reply::Kind::invalid);
+  EXPECT_EQ(reader.try_finger("pete", kBase), std::nullopt);
+  EXPECT_EQ(fs.calls("pete"), 0);
+
+  lookup_all(reader, {"pete"});
+  const auto hit = reader.try_finger("Pete", kBase);
+  ASSERT_TRUE(hit);
+  EXPECT_EQ(hit->kind, Reply::Kind::plan);
+  EXPECT_EQ(hit->body.view(), "Just another hacker.\r\n");
+  EXPECT_EQ(fs.calls("pete"), 1);
+}
+
+TEST_F(PlanReaderTest, ConcurrentMissesShareOneLookup) {
+  GatedFilesystem fs;
+  fs.add("pete", "Just another hacker.\r\n");
+  CachingFilesystemWrapper cache(fs, kBase);
+  PlanReader reader(cache, fs, reads, 4);
+
+  std::vector<Reply> replies;
+  std::thread opener([&] {
+    // Every lookup is queued behind the closed gate by now.
+    std::this_thread::sleep_for(50ms);
+    fs.open();
+  });
+  replies = lookup_all(reader, {"pete", "pete", "Pete", "pete", "nobody",
+                                "nobody"});
+  opener.join();
+  ASSERT_EQ(replies.size(), 6u);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(replies[i].body.view(), "Just another hacker.\r\n");
+  }
+  EXPECT_EQ(replies[4].kind, Reply::Kind::miss);
+  EXPECT_EQ(replies[5].body.view(), "nobody");
+  EXPECT_EQ(fs.calls("pete"), 1);
+  EXPECT_EQ(fs.calls("nobody"), 1);
+  EXPECT_EQ(reader.reads(), 2u);
+  EXPECT_EQ(reader.coalesced(), 4u);
+}
+
+TEST_F(PlanReaderTest, LookupsRunOffTheCallingThread) {
+  GatedFilesystem fs;
+  fs.add("pete", "Just another hacker.\r\n");
+  CachingFilesystemWrapper cache(fs, kBase);
+  PlanReader reader(cache, fs, reads, 1);
+
+  // While the lookup waits at the gate, this thread keeps running handlers.
+  std::atomic<int> ticks = 0;
+  bool done = false;
+  std::thread::id resumed_on;
+  boost::asio::co_spawn(
+      ctx,
+      [&]() -> boost::asio::awaitable<void> {
+        co_await reader.finger("pete", kBase);
+        resumed_on = std::this_thread::get_id();
+        done = true;
+      },
+      boost::asio::detached);
+  for (int i = 0; i < 5; ++i) {
+    boost::asio::post(ctx, [&] { ++ticks; });
+    ctx.run_for(5ms);
+    ctx.restart();
+  }
+  EXPECT_EQ(ticks, 5);
+  EXPECT_FALSE(done);
+  fs.open();
+  run_until([&] { return done; });
+  ASSERT_TRUE(done);
+  EXPECT_EQ(resumed_on, std::this_thread::get_id());
+}
+
+TEST_F(PlanReaderTest, FilesystemErrorsReachEveryWaiter) {
+  GatedFilesystem fs;
+  fs.open();
+  CachingFilesystemWrapper cache(fs, kBase);
+  PlanReader reader(cache, fs, reads, 2);
+
+  int errors = 0;
+  std::size_t done = 0;
+  const auto attempt = [&](int n) {
+    for (int i = 0; i < n; ++i) {
+      boost::asio::co_spawn(
+          ctx,
+          [&]() -> boost::asio::awaitable<void> {
+            try {
+              co_await reader.finger("broken", kBase);
+            } catch (const std::filesystem::filesystem_error &) {
+              ++errors;
+            }
+            ++done;
+          },
+          boost::asio::detached);
+    }
+  };
+  attempt(3);
+  run_until([&] { return done == 3; });
+  EXPECT_EQ(errors, 3);
+  // Nothing was cached, so the next lookup tries again.
+  attempt(1);
+  run_until([&] { return done == 4; });
+  EXPECT_EQ(errors, 4);
+  EXPECT_GE(fs.calls("broken"), 2);
+}
+
+TEST_F(PlanReaderTest, ReadsThroughTheCallersRing) {
+  auto ring = IoUring::open(ctx);
+  if (!ring) {
+    GTEST_SKIP() << "io_uring is unavailable here";
+  }
+  boost::asio::co_spawn(ctx, ring->run(), boost::asio::detached);
+  const auto dir = std::filesystem::temp_directory_path() /
+                   ("finger_reader_test_" +
+                    std::to_string(std::chrono::steady_clock::now()
+                                       .time_since_epoch()
+                                       .count()));
+  std::filesystem::create_directories(dir);
+  std::ofstream(dir / "pete") << "Just another hacker.\n";
+  RealFilesystemWrapper real_fs;
+  CachingFilesystemWrapper cache(real_fs, dir);
+  PlanReader reader(cache, real_fs, reads, 1);
+
+  std::vector<Reply> replies(3);
+  std::size_t done = 0;
+  for (std::size_t i = 0; i < replies.size(); ++i) {
+    boost::asio::co_spawn(
+        ctx,
+        [&, i]() -> boost::asio::awaitable<void> {
+          replies[i] = co_await reader.finger(i == 2 ? "nobody" : "pete", dir,
+                                              ring.get());
+          ++done;
+        },
+        boost::asio::detached);
+  }
+  run_until([&] { return done == replies.size(); });
+  ASSERT_EQ(done, replies.size());
+  EXPECT_EQ(replies[0].body.view(), "Just another hacker.\r\n");
+  EXPECT_EQ(replies[1].body.view(), "Just another hacker.\r\n");
+  EXPECT_EQ(replies[2].kind, Reply::Kind::miss);
+  EXPECT_EQ(reader.reads(), 2u);
+  EXPECT_EQ(reader.coalesced(), 1u);
+  EXPECT_EQ(reads.snapshot().count, 2u);
+  ring.reset();
+  std::filesystem::remove_all(dir);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
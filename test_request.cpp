@@ -0,0 +1,193 @@
+#include "request.hpp"
+#include "reaper.hpp"
+#include <algorithm>
+#include <boost/asio/as_tuple.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <string>
+#include <string_view>
+
+using namespace std::chrono_literals;
+using boost::asio::ip::tcp;
+
+namespace {
+
+// Feed s to the framer in pieces of at most step bytes.
+RequestFramer::Status feed(RequestFramer &framer, std::string_view s,
+                           std::size_t step) {
+  auto status = RequestFramer::Status::need_more;
+  while (!s.empty() && status == RequestFramer::Status::need_more) {
+    const auto space = framer.space();
+    const std::size_t n = std::min({step, s.size(), space.size()});
+    std::copy_n(s.data(), n, space.data());
+    s.remove_prefix(n);
+    status = framer.commit(n);
+  }
+  return status;
+}
+
+} // namespace
+
+TEST(RequestFramer, JoinsALineSplitAcrossReads) {
+  for (std::size_t step = 1; step <= 7; ++step) {
+    RequestFramer framer;
+    EXPECT_EQ(feed(framer, "/W pete\r", step),
+              RequestFramer::Status::need_more);
+    EXPECT_EQ(feed(framer, "\n", step), RequestFramer::Status::complete);
+    EXPECT_EQ(framer.line(), "/W pete");
+  }
+}
+
+TEST(RequestFramer, AcceptsBareLineFeedAndHalfClose) {
+  RequestFramer lf;
+  EXPECT_EQ(feed(lf, "pete\ntrailing junk", 64),
+            RequestFramer::Status::complete);
+  EXPECT_EQ(lf.line(), "pete");
+
+  RequestFramer closed;
+  EXPECT_EQ(feed(closed, "pete", 64), RequestFramer::Status::need_more);
+  EXPECT_EQ(closed.finish(), RequestFramer::Status::complete);
+  EXPECT_EQ(closed.line(), "pete");
+
+  RequestFramer nothing;
+  EXPECT_EQ(nothing.finish(), RequestFramer::Status::need_more);
+}
+
+TEST(RequestFramer, StopsAtTheLongestRequest) {
+  RequestFramer fits;
+  EXPECT_EQ(feed(fits, std::string(kMaxRequestBytes, 'a') + "\r\n", 100),
+            RequestFramer::Status::complete);
+  EXPECT_EQ(fits.line().size(), kMaxRequestBytes);
+
+  RequestFramer too_long;
+  EXPECT_EQ(feed(too_long, std::string(kMaxRequestBytes + 2, 'a'), 100),
+            RequestFramer::Status::overlong);
+  EXPECT_TRUE(too_long.space().empty());
+}
+
+TEST(ParseQuery, SplitsRfc1288Queries) {
+  FingerQuery q = parse_query("pete");
+  EXPECT_FALSE(q.verbose);
+  EXPECT_EQ(q.user, "pete");
+  EXPECT_EQ(q.host, "");
+
+  q = parse_query("/W pete");
+  EXPECT_TRUE(q.verbose);
+  EXPECT_EQ(q.user, "pete");
+
+  q = parse_query("/w   pete ");
+  EXPECT_TRUE(q.verbose);
+  EXPECT_EQ(q.user, "pete");
+
+  q = parse_query("");
+  EXPECT_FALSE(q.verbose);
+  EXPECT_EQ(q.user, "");
+
+  q = parse_query("/W");
+  EXPECT_TRUE(q.verbose);
+  EXPECT_EQ(q.user, "");
+
+  q = parse_query("/W pete@example.org@example.net");
+  EXPECT_TRUE(q.verbose);
+  EXPECT_EQ(q.user, "pete");
+  EXPECT_EQ(q.host, "example.org@example.net");
+
+  q = parse_query("@example.org");
+  EXPECT_EQ(q.user, "");
+  EXPECT_EQ(q.host, "example.org");
+
+  // Not the /W token: a name with a slash, left for validation to refuse.
+  q = parse_query("/Wpete");
+  EXPECT_FALSE(q.verbose);
+  EXPECT_EQ(q.user, "/Wpete");
+}
+
+TEST(IdleReaper, ClosesOnlyConnectionsPastTheirDeadline) {
+  boost::asio::io_context ctx;
+  tcp::socket a(ctx), b(ctx), c(ctx);
+  a.open(tcp::v4());
+  b.open(tcp::v4());
+  c.open(tcp::v4());
+  IdleReaper reaper(10s);
+  const auto t0 = std::chrono::steady_clock::now();
+  auto ra = reaper.add(a, t0);
+  auto rb = reaper.add(b, t0 + 5s);
+  {
+    auto rc = reaper.add(c, t0 + 6s);
+  }
+  EXPECT_EQ(reaper.pending(), 2u);
+
+  EXPECT_EQ(reaper.reap(t0 + 9s), 0u);
+  EXPECT_EQ(reaper.reap(t0 + 10s), 1u);
+  EXPECT_TRUE(ra.timed_out());
+  EXPECT_FALSE(a.is_open());
+  EXPECT_FALSE(rb.timed_out());
+  EXPECT_TRUE(b.is_open());
+  // A connection that finished in time was never touched.
+  EXPECT_TRUE(c.is_open());
+  EXPECT_EQ(reaper.pending(), 1u);
+}
+
+TEST(IdleReaper, SetTimeoutMovesPendingDeadlines) {
+  boost::asio::io_context ctx;
+  tcp::socket a(ctx), b(ctx);
+  a.open(tcp::v4());
+  b.open(tcp::v4());
+  IdleReaper reaper(10s);
+  const auto t0 = std::chrono::steady_clock::now();
+  auto ra = reaper.add(a, t0);
+
+  reaper.set_timeout(2s);
+  EXPECT_EQ(reaper.timeout(), 2s);
+  auto rb = reaper.add(b, t0 + 1s);
+  EXPECT_EQ(reaper.reap(t0 + 2s), 1u);
+  EXPECT_TRUE(ra.timed_out());
+  EXPECT_EQ(reaper.reap(t0 + 3s), 1u);
+  EXPECT_TRUE(rb.timed_out());
+}
+
+TEST(IdleReaper, AbortsAStalledRead) {
+  boost::asio::io_context ctx;
+  tcp::acceptor acceptor(ctx, tcp::endpoint(tcp::v4(), 0));
+  tcp::socket client(ctx);
+  client.connect(acceptor.local_endpoint());
+  tcp::socket server = acceptor.accept();
+
+  IdleReaper reaper(50ms);
+  boost::system::error_code read_ec;
+  bool timed_out = false;
+  boost::asio::co_spawn(
+      ctx,
+      [&]() -> boost::asio::awaitable<void> {
+        const auto idle = reaper.add(server, std::chrono::steady_clock::now());
+        char buf[16];
+        auto [ec, n] = co_await server.async_read_some(
+            boost::asio::buffer(buf),
+            boost::asio::as_tuple(boost::asio::deferred));
+        read_ec = ec;
+        timed_out = idle.timed_out();
+      },
+      boost::asio::detached);
+  boost::asio::co_spawn(ctx, reaper.run(10ms), boost::asio::detached);
+  ctx.run_for(500ms);
+
+  EXPECT_TRUE(timed_out);
+  EXPECT_EQ(read_ec, boost::asio::error::operation_aborted);
+  EXPECT_EQ(reaper.pending(), 0u);
+  // The client sees the connection closed.
+  char byte;
+  boost::system::error_code ec;
+  boost::asio::read(client, boost::asio::buffer(&byte, 1), ec);
+  EXPECT_EQ(ec, boost::asio::error::eof);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,163 @@
+#include "validate.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <string_view>
+
+namespace {
+
+// process()'s checks as they were before the single-pass validator: a chain
+// of find() calls, then std::tolower over a copy. The validator must agree
+// with it on every input; the only new distinction is junk, which this
+// treated as an ordinary (never-found) name.
+RequestClass reference(const std::string &username, std::string &key) {
+  if (username.find("../") != std::string::npos ||
+      username.find("..\\") != std::string::npos ||
+      username.find("%2e%2e%2f") != std::string::npos ||
+      username.find("%2e%2e%5c") != std::string::npos ||
+      username.find("%2E%2E%2F") != std::string::npos ||
+      username.find("%2E%2E%5C") != std::string::npos ||
+      username.find("..%2f") != std::string::npos ||
+      username.find("..%5c") != std::string::npos ||
+      username.find("..%2F") != std::string::npos ||
+      username.find("..%5C") != std::string::npos) {
+    return RequestClass::traversal;
+  }
+  key = username;
+  std::transform(key.begin(), key.end(), key.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  if (username.find("/") != std::string::npos) {
+    return RequestClass::path;
+  }
+  const bool junk =
+      username.size() > kMaxNameBytes ||
+      std::any_of(username.begin(), username.end(), [](unsigned char c) {
+        return c < 0x20 || c == 0x7f;
+      });
+  return junk ? RequestClass::junk : RequestClass::valid;
+}
+
+void expect_agrees(const std::string &name) {
+  std::string want_key, key, scalar_key;
+  const RequestClass want = reference(name, want_key);
+  const RequestClass got = classify_username(name, key);
+  const RequestClass scalar = classify_username_scalar(name, scalar_key);
+  ASSERT_EQ(got, want) << "input: " << testing::PrintToString(name);
+  ASSERT_EQ(scalar, want) << "input: " << testing::PrintToString(name);
+  if (want != RequestClass::traversal) {
+    ASSERT_EQ(key, want_key) << "input: " << testing::PrintToString(name);
+    ASSERT_EQ(scalar_key, want_key);
+  }
+}
+
+} // namespace
+
+TEST(Validate, ClassifiesAndLowerCases) {
+  std::string key;
+  EXPECT_EQ(classify_username("Pete", key), RequestClass::valid);
+  EXPECT_EQ(key, "pete");
+  EXPECT_EQ(classify_username("", key), RequestClass::valid);
+  EXPECT_EQ(classify_username("a/b", key), RequestClass::path);
+  EXPECT_EQ(classify_username("x/../etc", key), RequestClass::traversal);
+  EXPECT_EQ(classify_username("GET / HTTP/1.1\r\nHost: x", key),
+            RequestClass::path);
+  EXPECT_EQ(classify_username("\x16\x03\x01\x02", key), RequestClass::junk);
+  EXPECT_EQ(classify_username(std::string(kMaxNameBytes, 'a'), key),
+            RequestClass::valid);
+  EXPECT_EQ(classify_username(std::string(kMaxNameBytes + 1, 'a'), key),
+            RequestClass::junk);
+  // Mixed-case hex was never a traversal pattern; high bytes pass through.
+  EXPECT_EQ(classify_username("%2e%2E%2f", key), RequestClass::valid);
+  EXPECT_EQ(classify_username("P\xc3\xa9TE", key), RequestClass::valid);
+  EXPECT_EQ(key, "p\xc3\xa9te");
+}
+
+// Every pattern at every offset across the 16- and 32-byte block edges,
+// including straddling them and running off the end of the input.
+TEST(Validate, PatternsAreFoundAtEveryOffset) {
+  const char *patterns[] = {"../",       "..\\",      "%2e%2e%2f",
+                            "%2e%2e%5c", "%2E%2E%2F", "%2E%2E%5C",
+                            "..%2f",     "..%5c",     "..%2F",
+                            "..%5C"};
+  for (const std::string p : patterns) {
+    for (std::size_t len = p.size(); len < 80; ++len) {
+      for (std::size_t at = 0; at + p.size() <= len; ++at) {
+        std::string name(len, 'A');
+        name.replace(at, p.size(), p);
+        expect_agrees(name);
+        // Cut short, it must not match.
+        expect_agrees(name.substr(0, at + p.size() - 1));
+      }
+    }
+  }
+}
+
+TEST(Validate, FuzzAgainstFindChain) {
+  // Mostly bytes that appear in the patterns, so near-misses are common.
+  const std::string alphabet = "..%%%22eEfF5cC//\\aZz \r\n\t\x7f\x80\xff";
+  std::mt19937_64 rng(20241017);
+  for (int iter = 0; iter < 200000; ++iter) {
+    const std::size_t len = rng() % (iter % 100 == 0 ? 600 : 70);
+    std::string name(len, '\0');
+    for (auto &c : name) {
+      c = rng() % 8 == 0 ? static_cast<char>(rng())
+                         : alphabet[rng() % alphabet.size()];
+    }
+    expect_agrees(name);
+    if (::testing::Test::HasFatalFailure()) {
+      return;
+    }
+  }
+}
+
+TEST(Protocol, RecognisesOtherProtocolsProbes) {
+  using namespace std::string_view_literals;
+  EXPECT_EQ(classify_protocol("GET / HTTP/1.1\r\nHost: x\r\n\r\n"),
+            Protocol::http);
+  EXPECT_EQ(classify_protocol("OPTIONS * HTTP/1.1\r\n"), Protocol::http);
+  EXPECT_EQ(classify_protocol("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"),
+            Protocol::http);
+  EXPECT_EQ(
+      classify_protocol("\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03"sv),
+      Protocol::tls);
+  EXPECT_EQ(classify_protocol("OPTIONS sip:nm SIP/2.0\r\nVia: x\r\n"),
+            Protocol::sip);
+  EXPECT_EQ(classify_protocol("REGISTER sips:example.org SIP/2.0\r\n"),
+            Protocol::sip);
+  EXPECT_EQ(classify_protocol("SIP/2.0 200 OK\r\n"), Protocol::sip);
+  // A read that stops before the request URI says nothing yet.
+  for (const std::string_view partial :
+       {"OPTIONS "sv, "OPTIONS s"sv, "OPTIONS sip"sv, "OPTIONS sips"sv}) {
+    EXPECT_EQ(classify_protocol(partial), Protocol::finger) << partial;
+  }
+  EXPECT_EQ(classify_protocol("OPTIONS sip:"), Protocol::sip);
+  EXPECT_EQ(classify_protocol("OPTIONS /"), Protocol::http);
+  EXPECT_EQ(classify_protocol("SSH-2.0-OpenSSH_9.6\r\n"), Protocol::ssh);
+  EXPECT_EQ(classify_protocol("\x00\x00\x00\x2a\xff\x53\x4d\x42"sv),
+            Protocol::binary);
+  EXPECT_EQ(classify_protocol("pete\x1b[2J\r\n"), Protocol::binary);
+  EXPECT_EQ(classify_protocol(std::string(kMaxRequestBytes + 1, 'a')),
+            Protocol::overlong);
+}
+
+TEST(Protocol, LeavesFingerRequestsAlone) {
+  EXPECT_EQ(classify_protocol("pete\r\n"), Protocol::finger);
+  EXPECT_EQ(classify_protocol("/W pete\r\n"), Protocol::finger);
+  EXPECT_EQ(classify_protocol("\r\n"), Protocol::finger);
+  EXPECT_EQ(classify_protocol(""), Protocol::finger);
+  EXPECT_EQ(classify_protocol("get\r\n"), Protocol::finger);
+  EXPECT_EQ(classify_protocol("GET\r\n"), Protocol::finger);
+  EXPECT_EQ(classify_protocol("p\xc3\xa9te\tx\r\n"), Protocol::finger);
+  EXPECT_EQ(classify_protocol("../../etc/passwd\r\n"), Protocol::finger);
+  // The limit is on the request, not its line ending.
+  EXPECT_EQ(classify_protocol(std::string(kMaxRequestBytes, 'a') + "\r\n"),
+            Protocol::finger);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -8,4 +8,10 @@ bastille cmd finger sh -c '
   meson install -C builddir
 '
 
-bastille cmd finger service fingerd restart
+# Hands the listening socket and ban table to the new binary (see FREEBSD.md);
+# falls back to a restart if the daemon has no upgrade socket set.
+if bastille cmd finger sysrc -n fingerd_env | grep -q FINGER_UPGRADE_SOCKET; then
+  bastille cmd finger service fingerd upgrade
+else
+  bastille cmd finger service fingerd restart
+fi
@@ -0,0 +1,518 @@
+#include "uring.hpp"
+
+#include <boost/asio/as_tuple.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/deferred.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#ifdef IORING_ACCEPT_MULTISHOT
+#include <atomic>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+int ring_setup(unsigned entries, io_uring_params *p) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+int ring_enter(int fd, unsigned to_submit, unsigned min_complete,
+               unsigned flags) {
+  return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+int ring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return static_cast<int>(
+      ::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+// The ring's indices are shared with the kernel.
+unsigned load_acquire(unsigned *p) {
+  return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+}
+
+void store_release(unsigned *p, unsigned v) {
+  std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release);
+}
+
+// Everything the daemon submits. IORING_OP_SOCKET is not used, but arrived
+// in the same release as multishot accept (5.19), which has no probe bit of
+// its own.
+constexpr std::uint8_t kOpsUsed[] = {
+    IORING_OP_OPENAT, IORING_OP_STATX,        IORING_OP_READ,  IORING_OP_CLOSE,
+    IORING_OP_ACCEPT, IORING_OP_ASYNC_CANCEL, IORING_OP_SOCKET};
+
+bool supports_ops(int ring_fd) {
+  constexpr unsigned kProbeOps = 256;
+  std::vector<std::uint64_t> buf(
+      (sizeof(io_uring_probe) + kProbeOps * sizeof(io_uring_probe_op)) / 8 +
+      1);
+  auto *probe = reinterpret_cast<io_uring_probe *>(buf.data());
+  if (ring_register(ring_fd, IORING_REGISTER_PROBE, probe, kProbeOps) < 0) {
+    return false;
+  }
+  for (const std::uint8_t op : kOpsUsed) {
+    if (op > probe->last_op ||
+        !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Plans are small: one read usually takes the whole file.
+constexpr unsigned kReadChunk = 16384;
+
+} // namespace
+
+struct IoUring::Op {
+  virtual ~Op() = default;
+  // One completion: its result and CQE flags.
+  virtual void complete(int res, std::uint32_t flags) = 0;
+};
+
+// One-shot operation completing an Asio handler, on its own executor.
+template <typename Handler> struct IoUring::HandlerOp : Op {
+  HandlerOp(Handler h, boost::asio::io_context::executor_type fallback)
+      : handler(std::move(h)), fallback(fallback) {}
+
+  void complete(int res, std::uint32_t) override {
+    auto ex = boost::asio::get_associated_executor(handler, fallback);
+    boost::asio::post(ex, [h = std::move(handler), res]() mutable {
+      std::move(h)(res);
+    });
+  }
+
+  Handler handler;
+  boost::asio::io_context::executor_type fallback;
+};
+
+struct IoUring::AcceptOp : Op {
+  explicit AcceptOp(AcceptHandler h) : handler(std::move(h)) {}
+
+  void complete(int res, std::uint32_t flags) override {
+    handler(res, (flags & IORING_CQE_F_MORE) != 0);
+  }
+
+  AcceptHandler handler;
+};
+
+std::unique_ptr<IoUring> IoUring::open(boost::asio::io_context &ctx,
+                                       unsigned entries) {
+  io_uring_params p{};
+  const int fd = ring_setup(entries, &p);
+  if (fd < 0) {
+    return nullptr;
+  }
+  // NODROP: completions that do not fit are held back rather than lost.
+  // SUBMIT_STABLE: what an entry points at (a path) is only needed until it
+  // is submitted.
+  constexpr std::uint32_t kFeatures =
+      IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE;
+  if ((p.features & kFeatures) != kFeatures || !supports_ops(fd)) {
+    ::close(fd);
+    return nullptr;
+  }
+  const int event_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (event_fd < 0) {
+    ::close(fd);
+    return nullptr;
+  }
+  std::unique_ptr<IoUring> ring(new IoUring(ctx, fd, event_fd));
+  int registered = event_fd;
+  if (!ring->map(&p) ||
+      ring_register(fd, IORING_REGISTER_EVENTFD, &registered, 1) < 0) {
+    return nullptr;
+  }
+  return ring;
+}
+
+IoUring::IoUring(boost::asio::io_context &ctx, int ring_fd, int event_fd)
+    : ctx_(ctx), ring_fd_(ring_fd), event_(ctx, event_fd) {}
+
+bool IoUring::map(const void *params) {
+  const auto &p = *static_cast<const io_uring_params *>(params);
+  rings_size_ = std::max<std::size_t>(
+      p.sq_off.array + p.sq_entries * sizeof(unsigned),
+      p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+  void *rings = ::mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (rings == MAP_FAILED) {
+    return false;
+  }
+  rings_ = rings;
+  sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return false;
+  }
+  sqes_ = sqes;
+
+  auto *base = static_cast<char *>(rings);
+  const auto at = [base](std::uint32_t offset) {
+    return reinterpret_cast<unsigned *>(base + offset);
+  };
+  sq_head_ = at(p.sq_off.head);
+  sq_tail_ = at(p.sq_off.tail);
+  sq_flags_ = at(p.sq_off.flags);
+  sq_array_ = at(p.sq_off.array);
+  sq_mask_ = *at(p.sq_off.ring_mask);
+  sq_entries_ = p.sq_entries;
+  cq_head_ = at(p.cq_off.head);
+  cq_tail_ = at(p.cq_off.tail);
+  cq_mask_ = *at(p.cq_off.ring_mask);
+  cqes_ = base + p.cq_off.cqes;
+  sq_local_tail_ = *sq_tail_;
+  return true;
+}
+
+IoUring::~IoUring() {
+  if (sqes_ && !ops_.empty()) {
+    // Reads in flight write into buffers their handlers own, so the kernel
+    // has to be done with every operation before they are destroyed.
+    auto *sqe = static_cast<io_uring_sqe *>(queue(nullptr));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+    store_release(sq_tail_, sq_local_tail_);
+    while (!ops_.empty()) {
+      const int n = ring_enter(ring_fd_, unsubmitted_, 1,
+                               IORING_ENTER_GETEVENTS);
+      if (n < 0 && errno != EINTR) {
+        break;
+      }
+      unsubmitted_ -= static_cast<unsigned>(std::max(n, 0));
+      unsigned head = *cq_head_;
+      while (head != load_acquire(cq_tail_)) {
+        const auto &cqe = static_cast<io_uring_cqe *>(cqes_)[head & cq_mask_];
+        auto *op = reinterpret_cast<Op *>(cqe.user_data);
+        if (op && !(cqe.flags & IORING_CQE_F_MORE)) {
+          ops_.erase(op);
+          delete op;
+        }
+        store_release(cq_head_, ++head);
+      }
+    }
+  }
+  for (Op *op : ops_) {
+    delete op;
+  }
+  if (sqes_) {
+    ::munmap(sqes_, sqes_size_);
+  }
+  if (rings_) {
+    ::munmap(rings_, rings_size_);
+  }
+  ::close(ring_fd_);
+}
+
+void *IoUring::queue(Op *op) {
+  // A full queue goes to the kernel straight away.
+  if (sq_local_tail_ - load_acquire(sq_head_) >= sq_entries_) {
+    flush();
+  }
+  const unsigned index = sq_local_tail_ & sq_mask_;
+  auto *sqe = static_cast<io_uring_sqe *>(sqes_) + index;
+  *sqe = io_uring_sqe{};
+  sqe->user_data = reinterpret_cast<std::uintptr_t>(op);
+  sq_array_[index] = index;
+  ++sq_local_tail_;
+  ++unsubmitted_;
+  return sqe;
+}
+
+void *IoUring::next_sqe(Op *op) {
+  void *sqe = queue(op);
+  if (!flush_posted_) {
+    flush_posted_ = true;
+    boost::asio::post(ctx_, [this] { flush(); });
+  }
+  return sqe;
+}
+
+void IoUring::flush() {
+  flush_posted_ = false;
+  store_release(sq_tail_, sq_local_tail_);
+  while (unsubmitted_ > 0) {
+    const int n = ring_enter(ring_fd_, unsubmitted_, 0, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0 && (n == 0 || errno == EAGAIN || errno == EBUSY)) {
+      // Short of memory, or completions backed up: try again once run() has
+      // taken some.
+      flush_posted_ = true;
+      boost::asio::post(ctx_, [this] { flush(); });
+      return;
+    }
+    if (n < 0) {
+      throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+    }
+    ++enter_calls_;
+    submitted_ += static_cast<unsigned>(n);
+    unsubmitted_ -= static_cast<unsigned>(n);
+  }
+}
+
+void IoUring::reap() {
+  unsigned head = *cq_head_;
+  for (;;) {
+    if (head == load_acquire(cq_tail_)) {
+      // Completions held back while the queue was full are only posted by
+      // another io_uring_enter().
+      if (!(load_acquire(sq_flags_) & IORING_SQ_CQ_OVERFLOW) ||
+          ring_enter(ring_fd_, 0, 0, IORING_ENTER_GETEVENTS) < 0) {
+        return;
+      }
+      continue;
+    }
+    const auto &cqe = static_cast<io_uring_cqe *>(cqes_)[head & cq_mask_];
+    auto *op = reinterpret_cast<Op *>(cqe.user_data);
+    const int res = cqe.res;
+    const std::uint32_t flags = cqe.flags;
+    // Free the slot first: the handler may queue more work.
+    store_release(cq_head_, ++head);
+    if (!op) {
+      continue;
+    }
+    op->complete(res, flags);
+    if (!(flags & IORING_CQE_F_MORE)) {
+      ops_.erase(op);
+      delete op;
+    }
+  }
+}
+
+boost::asio::awaitable<void> IoUring::run() {
+  std::uint64_t count;
+  for (;;) {
+    auto [ec, n] = co_await event_.async_read_some(
+        boost::asio::buffer(&count, sizeof count),
+        boost::asio::as_tuple(boost::asio::deferred));
+    if (ec) {
+      co_return;
+    }
+    reap();
+  }
+}
+
+template <typename Prep>
+boost::asio::awaitable<int> IoUring::perform(Prep prep) {
+  co_return co_await boost::asio::async_initiate<
+      decltype(boost::asio::deferred), void(int)>(
+      [this, &prep](auto handler) {
+        auto op = std::make_unique<HandlerOp<decltype(handler)>>(
+            std::move(handler), ctx_.get_executor());
+        ops_.insert(op.get());
+        prep(*static_cast<io_uring_sqe *>(next_sqe(op.release())));
+      },
+      boost::asio::deferred);
+}
+
+boost::asio::awaitable<std::optional<std::string>>
+IoUring::read_file(std::filesystem::path path, std::size_t limit) {
+  // Opened without blocking, and checked before reading, so that a FIFO or
+  // device where a plan should be is never waited on or read from.
+  const int fd = co_await perform([&path](io_uring_sqe &sqe) {
+    sqe.opcode = IORING_OP_OPENAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<std::uintptr_t>(path.c_str());
+    sqe.open_flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+  });
+  if (fd < 0) {
+    co_return std::nullopt;
+  }
+  struct statx stx {};
+  const int stat_res = co_await perform([&](io_uring_sqe &sqe) {
+    sqe.opcode = IORING_OP_STATX;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uintptr_t>("");
+    sqe.statx_flags = AT_EMPTY_PATH;
+    sqe.len = STATX_TYPE;
+    sqe.addr2 = reinterpret_cast<std::uintptr_t>(&stx);
+  });
+  std::optional<std::string> content;
+  if (stat_res == 0 && S_ISREG(stx.stx_mode)) {
+    // A short read from a regular file is its end, so a plan smaller than
+    // the chunk takes a single read.
+    content.emplace();
+    std::size_t size = 0;
+    while (size < limit) {
+      const auto want = static_cast<unsigned>(
+          std::min<std::size_t>(kReadChunk, limit - size));
+      content->resize(size + want);
+      const int n = co_await perform([&](io_uring_sqe &sqe) {
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<std::uintptr_t>(content->data() + size);
+        sqe.len = want;
+        sqe.off = size;
+      });
+      if (n > 0) {
+        size += static_cast<std::size_t>(n);
+      }
+      if (n < static_cast<int>(want)) {
+        break;
+      }
+    }
+    content->resize(size);
+  }
+  co_await perform([fd](io_uring_sqe &sqe) {
+    sqe.opcode = IORING_OP_CLOSE;
+    sqe.fd = fd;
+  });
+  co_return content;
+}
+
+std::uint64_t IoUring::accept(int fd, AcceptHandler handler) {
+  auto op = std::make_unique<AcceptOp>(std::move(handler));
+  ops_.insert(op.get());
+  const auto id = reinterpret_cast<std::uintptr_t>(op.get());
+  auto *sqe = static_cast<io_uring_sqe *>(next_sqe(op.release()));
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  return id;
+}
+
+void IoUring::cancel(std::uint64_t id) {
+  if (!ops_.contains(reinterpret_cast<Op *>(id))) {
+    return;
+  }
+  auto *sqe = static_cast<io_uring_sqe *>(next_sqe(nullptr));
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = id;
+}
+
+#else
+
+// No io_uring here; open() is all that is ever called.
+
+std::unique_ptr<IoUring> IoUring::open(boost::asio::io_context &, unsigned) {
+  return nullptr;
+}
+
+IoUring::~IoUring() = default;
+
+boost::asio::awaitable<void> IoUring::run() { co_return; }
+
+boost::asio::awaitable<std::optional<std::string>>
+IoUring::read_file(std::filesystem::path, std::size_t) {
+  co_return std::nullopt;
+}
+
+std::uint64_t IoUring::accept(int, AcceptHandler handler) {
+  handler(-ENOSYS, false);
+  return 0;
+}
+
+void IoUring::cancel(std::uint64_t) {}
+
+#endif
+
+struct MultishotAcceptor::State {
+  explicit State(boost::asio::io_context::executor_type ex) : wake(ex) {}
+  ~State() {
+    for (const int fd : ready) {
+      ::close(fd);
+    }
+  }
+
+  // Cancelled whenever there is something for accept() to look at.
+  boost::asio::steady_timer wake;
+  std::deque<int> ready;
+  int error = 0;
+  std::uint64_t id = 0;   // the armed accept, or 0
+  std::uint64_t arms = 0; // times armed, to tell a stale accept's end
+  std::size_t live = 0;   // accepts armed and not yet ended
+  bool stopped = false;
+};
+
+MultishotAcceptor::MultishotAcceptor(IoUring &ring, int fd)
+    : ring_(ring), fd_(fd),
+      state_(std::make_shared<State>(ring.get_executor())) {}
+
+MultishotAcceptor::~MultishotAcceptor() { pause(); }
+
+void MultishotAcceptor::arm() {
+  const std::uint64_t arms = ++state_->arms;
+  std::weak_ptr<State> weak = state_;
+  ++state_->live;
+  state_->id = ring_.accept(fd_, [weak, arms](int res, bool more) {
+    const auto state = weak.lock();
+    if (!state) {
+      if (res >= 0) {
+        ::close(res);
+      }
+      return;
+    }
+    if (res >= 0) {
+      state->ready.push_back(res);
+    } else if (res != -ECANCELED) {
+      state->error = -res;
+    }
+    if (!more) {
+      --state->live;
+      if (state->arms == arms) {
+        state->id = 0;
+      }
+    }
+    state->wake.cancel();
+  });
+}
+
+boost::asio::awaitable<int> MultishotAcceptor::accept() {
+  const auto state = state_;
+  for (;;) {
+    if (!state->ready.empty()) {
+      const int fd = state->ready.front();
+      state->ready.pop_front();
+      co_return fd;
+    }
+    if (state->error) {
+      co_return -std::exchange(state->error, 0);
+    }
+    if (state->stopped) {
+      // Connections accepted before the cancel took effect are still on
+      // their way.
+      if (state->live == 0) {
+        co_return -ECANCELED;
+      }
+    } else if (!state->id) {
+      arm();
+    }
+    state->wake.expires_at(std::chrono::steady_clock::time_point::max());
+    co_await state->wake.async_wait(
+        boost::asio::as_tuple(boost::asio::deferred));
+  }
+}
+
+void MultishotAcceptor::pause() {
+  if (state_->id) {
+    ring_.cancel(std::exchange(state_->id, 0));
+  }
+}
+
+void MultishotAcceptor::stop() {
+  state_->stopped = true;
+  pause();
+  state_->wake.cancel();
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+
+// IoUring runs Linux io_uring operations for one io_context (FINGER_IO_URING):
+// the plan file reads, so that opening and reading a plan never blocks the
+// thread serving connections, and multishot accept, where one submission
+// keeps accepting connections until it is cancelled.
+//
+// Operations queued during one turn of the io_context go to the kernel in a
+// single io_uring_enter() at the end of it. Completions are signalled on an
+// eventfd that the io_context waits on like any other descriptor, and each
+// completion handler runs on the io_context. Client sockets are still read
+// and written through Asio's reactor.
+//
+// The ring is used directly through its system calls (no liburing), and is
+// only built on Linux with io_uring headers new enough for multishot accept.
+// Everywhere else, and on kernels without it (older than 5.19, or with
+// io_uring blocked by a seccomp filter or sysctl), open() returns nullptr and
+// the daemon serves as before.
+//
+// Not thread-safe: everything is called on the io_context's thread.
+class IoUring {
+public:
+  // Called for each connection a multishot accept takes: the new
+  // descriptor or -errno, and whether more calls follow. The last call has
+  // more == false; after cancel() it is -ECANCELED.
+  using AcceptHandler = std::function<void(int result, bool more)>;
+
+  // A ring of the given size for ctx, or nullptr where io_uring is
+  // unavailable.
+  static std::unique_ptr<IoUring> open(boost::asio::io_context &ctx,
+                                       unsigned entries = 256);
+  // Cancels whatever is still in flight and waits for the kernel to let go
+  // of it. Handlers not yet called are destroyed without being called.
+  ~IoUring();
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  // Deliver completions. Spawn once on the io_context; runs until the ring
+  // is destroyed.
+  boost::asio::awaitable<void> run();
+
+  // The contents of the file at path, up to limit bytes, or nullopt if it
+  // cannot be opened or is not a regular file (a FIFO or device is never
+  // read). Opening, checking, reading and closing all go through the ring.
+  // A read error ends the contents early, as with
+  // RealFilesystemWrapper::read_file().
+  boost::asio::awaitable<std::optional<std::string>>
+  read_file(std::filesystem::path path, std::size_t limit);
+
+  // Start a multishot accept on listening socket fd. Returns an id for
+  // cancel().
+  std::uint64_t accept(int fd, AcceptHandler handler);
+
+  // Cancel the operation with that id, if it is still in flight.
+  void cancel(std::uint64_t id);
+
+  boost::asio::io_context::executor_type get_executor() const {
+    return ctx_.get_executor();
+  }
+
+  // io_uring_enter() calls made to submit, and operations submitted, so far.
+  std::uint64_t enter_calls() const { return enter_calls_; }
+  std::uint64_t submitted() const { return submitted_; }
+
+private:
+  struct Op;
+  template <typename Handler> struct HandlerOp;
+  struct AcceptOp;
+
+  IoUring(boost::asio::io_context &ctx, int ring_fd, int event_fd);
+
+  // Map the rings set up by io_uring_setup(); params is the kernel's
+  // io_uring_params, passed opaquely to keep its header out of this one.
+  bool map(const void *params);
+  // A zeroed submission queue entry for op (null for one with no
+  // completion handler), sent with the next flush().
+  void *queue(Op *op);
+  // queue(), with a flush() at the end of this turn of the io_context.
+  void *next_sqe(Op *op);
+  // Submit everything queued.
+  void flush();
+  // Hand every posted completion to its operation.
+  void reap();
+  template <typename Prep> boost::asio::awaitable<int> perform(Prep prep);
+
+  boost::asio::io_context &ctx_;
+  int ring_fd_;
+  boost::asio::posix::stream_descriptor event_;
+
+  void *rings_ = nullptr;
+  std::size_t rings_size_ = 0;
+  void *sqes_ = nullptr;
+  std::size_t sqes_size_ = 0;
+  unsigned *sq_head_ = nullptr;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_flags_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  void *cqes_ = nullptr;
+  unsigned cq_mask_ = 0;
+
+  unsigned sq_local_tail_ = 0; // includes entries not yet flushed
+  unsigned unsubmitted_ = 0;
+  bool flush_posted_ = false;
+  std::unordered_set<Op *> ops_; // in flight, owned here
+  std::uint64_t enter_calls_ = 0;
+  std::uint64_t submitted_ = 0;
+};
+
+// A listening socket accepted from with a multishot accept on ring. The
+// accept is only armed while the caller is asking for connections: pause()
+// cancels it, so that while the caller holds off (backpressure) new
+// connections wait in the kernel's listen backlog, as they do for a plain
+// acceptor. Connections the kernel had already accepted are still handed
+// out.
+class MultishotAcceptor {
+public:
+  // fd stays owned by the caller; it must outlive the acceptor, or stop()
+  // must have been called first.
+  MultishotAcceptor(IoUring &ring, int fd);
+  ~MultishotAcceptor();
+
+  MultishotAcceptor(const MultishotAcceptor &) = delete;
+  MultishotAcceptor &operator=(const MultishotAcceptor &) = delete;
+
+  // The next accepted connection's descriptor (owned by the caller), or
+  // -errno. After stop(), -ECANCELED once every accepted one is handed out.
+  boost::asio::awaitable<int> accept();
+
+  // Cancel the multishot accept until the next accept().
+  void pause();
+  // Cancel it for good, and wake a pending accept().
+  void stop();
+
+private:
+  struct State;
+
+  void arm();
+
+  IoUring &ring_;
+  int fd_;
+  std::shared_ptr<State> state_;
+};
@@ -0,0 +1,276 @@
+#include "validate.hpp"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Whether one of the traversal patterns starts at name[i]:
+//   "../"  "..\"  "..%2f"  "..%5c"  "..%2F"  "..%5C"
+//   "%2e%2e%2f"  "%2e%2e%5c"  "%2E%2E%2F"  "%2E%2E%5C"
+// Every pattern starts with '.' or '%', so only those bytes are passed in;
+// most are rejected by the second byte.
+bool traversal_at(std::string_view name, std::size_t i) {
+  const std::string_view rest = name.substr(i);
+  if (rest.size() < 3) {
+    return false;
+  }
+  if (rest[0] == '.') {
+    if (rest[1] != '.') {
+      return false;
+    }
+    const std::string_view sep = rest.substr(2);
+    return sep[0] == '/' || sep[0] == '\\' || sep.starts_with("%2f") ||
+           sep.starts_with("%5c") || sep.starts_with("%2F") ||
+           sep.starts_with("%5C");
+  }
+  if (rest[1] != '2' || rest.size() < 9) {
+    return false;
+  }
+  return rest.starts_with("%2e%2e%2f") || rest.starts_with("%2e%2e%5c") ||
+         rest.starts_with("%2E%2E%2F") || rest.starts_with("%2E%2E%5C");
+}
+
+struct Scan {
+  bool slash = false;
+  bool junk = false;
+};
+
+// Look at one byte that may matter ('.', '%', '/' or a control byte).
+// Returns true if a traversal pattern starts there.
+inline bool visit(std::string_view name, std::size_t i, Scan &scan) {
+  const auto c = static_cast<unsigned char>(name[i]);
+  switch (c) {
+  case '.':
+  case '%':
+    return traversal_at(name, i);
+  case '/':
+    scan.slash = true;
+    return false;
+  default:
+    if (c < 0x20 || c == 0x7f) {
+      scan.junk = true;
+    }
+    return false;
+  }
+}
+
+inline char lower(char c) {
+  return c >= 'A' && c <= 'Z' ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+RequestClass finish(std::string_view name, const Scan &scan) {
+  if (scan.slash) {
+    return RequestClass::path;
+  }
+  if (scan.junk || name.size() > kMaxNameBytes) {
+    return RequestClass::junk;
+  }
+  return RequestClass::valid;
+}
+
+} // namespace
+
+RequestClass classify_username_scalar(std::string_view name,
+                                      std::string &key) {
+  key.resize(name.size());
+  Scan scan;
+  for (std::size_t i = 0; i < name.size(); ++i) {
+    key[i] = lower(name[i]);
+    if (visit(name, i, scan)) {
+      return RequestClass::traversal;
+    }
+  }
+  return finish(name, scan);
+}
+
+RequestClass classify_username(std::string_view name, std::string &key) {
+  key.resize(name.size());
+  const char *in = name.data();
+  char *out = key.data();
+  const std::size_t n = name.size();
+  std::size_t i = 0;
+  Scan scan;
+
+  // Each vector step lower-cases a block, notes any '/' or control byte in
+  // it, and only visits bytes that begin like a traversal pattern, so plain
+  // names, junk and runs of dots cost no per-byte branches.
+#if defined(__AVX2__)
+  {
+    const __m256i dot = _mm256_set1_epi8('.');
+    const __m256i pct = _mm256_set1_epi8('%');
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i ctl_max = _mm256_set1_epi8(0x1f);
+    const __m256i upper_a = _mm256_set1_epi8('A');
+    const __m256i upper_z = _mm256_set1_epi8('Z');
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i two = _mm256_set1_epi8('2');
+    const __m256i e_bits = _mm256_set1_epi8('e');
+    // Loads reach two bytes past the block, for the prefix test below.
+    for (; i + 34 <= n; i += 32) {
+      const __m256i v =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+      const __m256i v1 =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i + 1));
+      const __m256i v2 =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i + 2));
+      // Unsigned range tests: v <= hi iff min(v, hi) == v.
+      const __m256i ctl = _mm256_or_si256(
+          _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl_max), v),
+          _mm256_cmpeq_epi8(v, del));
+      const __m256i upper = _mm256_and_si256(
+          _mm256_cmpeq_epi8(_mm256_max_epu8(v, upper_a), v),
+          _mm256_cmpeq_epi8(_mm256_min_epu8(v, upper_z), v));
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i *>(out + i),
+          _mm256_add_epi8(v, _mm256_and_si256(upper, case_bit)));
+      scan.slash |= _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, slash)) != 0;
+      scan.junk |= _mm256_movemask_epi8(ctl) != 0;
+      // Candidates share a pattern's first three bytes: "../", "..\\",
+      // "..%" or "%2e"/"%2E". Anything else is rejected without a visit.
+      const __m256i dots = _mm256_and_si256(
+          _mm256_and_si256(_mm256_cmpeq_epi8(v, dot),
+                           _mm256_cmpeq_epi8(v1, dot)),
+          _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v2, slash),
+                                          _mm256_cmpeq_epi8(v2, bslash)),
+                          _mm256_cmpeq_epi8(v2, pct)));
+      const __m256i pcts = _mm256_and_si256(
+          _mm256_and_si256(_mm256_cmpeq_epi8(v, pct),
+                           _mm256_cmpeq_epi8(v1, two)),
+          _mm256_cmpeq_epi8(_mm256_or_si256(v2, case_bit), e_bits));
+      const __m256i starts = _mm256_or_si256(dots, pcts);
+      for (auto mask = static_cast<unsigned>(_mm256_movemask_epi8(starts));
+           mask; mask &= mask - 1) {
+        if (traversal_at(name, i + __builtin_ctz(mask))) {
+          return RequestClass::traversal;
+        }
+      }
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  {
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i pct = _mm_set1_epi8('%');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i ctl_max = _mm_set1_epi8(0x1f);
+    const __m128i upper_a = _mm_set1_epi8('A');
+    const __m128i upper_z = _mm_set1_epi8('Z');
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i two = _mm_set1_epi8('2');
+    const __m128i e_bits = _mm_set1_epi8('e');
+    for (; i + 18 <= n; i += 16) {
+      const __m128i v =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+      const __m128i v1 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i + 1));
+      const __m128i v2 =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i + 2));
+      const __m128i ctl =
+          _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl_max), v),
+                       _mm_cmpeq_epi8(v, del));
+      const __m128i upper =
+          _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, upper_a), v),
+                        _mm_cmpeq_epi8(_mm_min_epu8(v, upper_z), v));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                       _mm_add_epi8(v, _mm_and_si128(upper, case_bit)));
+      scan.slash |= _mm_movemask_epi8(_mm_cmpeq_epi8(v, slash)) != 0;
+      scan.junk |= _mm_movemask_epi8(ctl) != 0;
+      const __m128i dots = _mm_and_si128(
+          _mm_and_si128(_mm_cmpeq_epi8(v, dot), _mm_cmpeq_epi8(v1, dot)),
+          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v2, slash),
+                                    _mm_cmpeq_epi8(v2, bslash)),
+                       _mm_cmpeq_epi8(v2, pct)));
+      const __m128i pcts = _mm_and_si128(
+          _mm_and_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v1, two)),
+          _mm_cmpeq_epi8(_mm_or_si128(v2, case_bit), e_bits));
+      const __m128i starts = _mm_or_si128(dots, pcts);
+      for (auto mask = static_cast<unsigned>(_mm_movemask_epi8(starts)); mask;
+           mask &= mask - 1) {
+        if (traversal_at(name, i + __builtin_ctz(mask))) {
+          return RequestClass::traversal;
+        }
+      }
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    out[i] = lower(in[i]);
+    if (visit(name, i, scan)) {
+      return RequestClass::traversal;
+    }
+  }
+  return finish(name, scan);
+}
+
+namespace {
+
+// "METHOD " at the start of the request, from the given list.
+template <std::size_t N>
+bool starts_with_method(std::string_view request,
+                        const std::string_view (&methods)[N],
+                        std::string_view &rest) {
+  for (const auto m : methods) {
+    if (request.size() > m.size() && request.starts_with(m) &&
+        request[m.size()] == ' ') {
+      rest = request.substr(m.size() + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+Protocol classify_protocol(std::string_view request) {
+  // TLS record header: handshake (0x16), major version 3.
+  if (request.size() >= 2 && request[0] == '\x16' && request[1] == '\x03') {
+    return Protocol::tls;
+  }
+  if (request.starts_with("SSH-")) {
+    return Protocol::ssh;
+  }
+  if (request.starts_with("SIP/2.0 ")) {
+    return Protocol::sip;
+  }
+  // SIP shares OPTIONS with HTTP; its request URI tells them apart.
+  static constexpr std::string_view kSipMethods[] = {
+      "INVITE",    "REGISTER", "OPTIONS", "ACK",     "BYE",
+      "CANCEL",    "SUBSCRIBE", "NOTIFY", "MESSAGE", "INFO",
+      "REFER",     "PRACK",    "UPDATE",  "PUBLISH"};
+  std::string_view rest;
+  if (starts_with_method(request, kSipMethods, rest)) {
+    if (rest.starts_with("sip:") || rest.starts_with("sips:")) {
+      return Protocol::sip;
+    }
+    // The URI has not arrived yet: wait for it rather than call this HTTP.
+    if (std::string_view("sips:").starts_with(rest)) {
+      return Protocol::finger;
+    }
+  }
+  static constexpr std::string_view kHttpMethods[] = {
+      "GET",     "POST",  "HEAD",  "PUT", "DELETE", "OPTIONS",
+      "CONNECT", "TRACE", "PATCH", "PRI"};
+  if (starts_with_method(request, kHttpMethods, rest)) {
+    return Protocol::http;
+  }
+  for (const char ch : request) {
+    const auto c = static_cast<unsigned char>(ch);
+    if ((c < 0x20 && c != '\t' && c != '\r' && c != '\n') || c == 0x7f) {
+      return Protocol::binary;
+    }
+  }
+  std::size_t len = request.size();
+  while (len > 0 && (request[len - 1] == '\r' || request[len - 1] == '\n')) {
+    --len;
+  }
+  if (len > kMaxRequestBytes) {
+    return Protocol::overlong;
+  }
+  return Protocol::finger;
+}
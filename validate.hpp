@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Request validation for finger lookups, in a single pass over the name.
+//
+// The name is classified as one of
+//
+//   traversal  contains a directory-traversal pattern: "../", "..\", or one
+//              of their percent-encoded spellings ("%2e%2e%2f", "..%2F", ...;
+//              only the all-lower and all-upper hex forms, as matched before)
+//   path       otherwise contains a '/'
+//   junk       otherwise cannot name a plan file: it contains a control byte
+//              (scanners' HTTP requests, binary probes) or is longer than
+//              any filename
+//   valid      anything else
+//
+// in that order of precedence, and the lower-cased lookup key (ASCII A-Z
+// only, as std::tolower in the C locale) is written in the same pass.
+//
+// Where the compiler targets SSE2 (every x86-64) or AVX2 (-mavx2), 16 or 32
+// bytes are examined per step: bytes that are none of '.', '%', '/' or a
+// control byte are lower-cased and skipped without a branch, so long junk is
+// scanned at close to memory speed. Other targets use the scalar loop.
+
+enum class RequestClass { valid, traversal, path, junk };
+
+// Longest name that can be a plan file (NAME_MAX on Linux and FreeBSD).
+inline constexpr std::size_t kMaxNameBytes = 255;
+
+// Classify name and set key to its lower-cased form. key is only complete
+// when the result is not traversal (the scan stops at the first pattern).
+RequestClass classify_username(std::string_view name, std::string &key);
+
+// The same without vector instructions; exposed for tests and benchmarks.
+RequestClass classify_username_scalar(std::string_view name, std::string &key);
+
+// What the first bytes of a connection look like. Port 79 mostly sees other
+// protocols' probes; recognising them up front lets the daemon close those
+// connections and count the offense without building a lookup at all.
+enum class Protocol {
+  finger,   // anything not recognised below
+  http,     // an HTTP request line (including the HTTP/2 preface)
+  tls,      // a TLS handshake record (ClientHello)
+  sip,      // a SIP request or response line
+  ssh,      // an SSH version banner
+  binary,   // control bytes other than tab, CR and LF
+  overlong, // longer than any finger request could be
+};
+inline constexpr std::size_t kProtocolCount = 7;
+
+// Longest finger request accepted: a plan name, with room for RFC 1288's
+// "/W " prefix and an "@host" suffix.
+inline constexpr std::size_t kMaxRequestBytes = 2 * kMaxNameBytes;
+
+// Classify the first read from a connection. Only looks at the prefix
+// needed to decide, except for the binary test, which scans all of it.
+// Returns finger while too little has arrived to decide, so call it again
+// as more is read.
+Protocol classify_protocol(std::string_view first_bytes);
+
+inline constexpr const char *protocol_name(Protocol p) {
+  constexpr const char *kNames[kProtocolCount] = {
+      "finger", "http", "tls", "sip", "ssh", "binary", "overlong"};
+  return kNames[static_cast<std::size_t>(p)];
+}